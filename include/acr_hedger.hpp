@@ -0,0 +1,146 @@
+/**
+ * @file acr_hedger.hpp Decides when to hedge ACRs to a backup CCF.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef ACR_HEDGER_HPP_
+#define ACR_HEDGER_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <unordered_map>
+
+#include "counter.h"
+
+class PeerMessageSender;
+
+// Supports hedged sending of ACRs.  If a CCF hasn't answered an ACR within a
+// threshold, the same ACR is also sent to the next CCF, and the first answer
+// wins.  The hedge is the encoded ACR sent to the first CCF, with only its
+// Destination-Host changed and the T flag set, so it carries the same
+// Session-Id and End-to-End identifier and the CDFs can spot the duplicate.
+// ACRs that couldn't be encoded aren't hedged.
+//
+// The threshold is the configured percentile of recent ACR latencies, so only
+// the slowest ACRs are hedged.  Hedges are also limited to a budget, as a
+// percentage of ACRs sent, so that hedging can't double the load on the CCFs.
+//
+// The hedger runs a thread that tells PeerMessageSenders when it's time to
+// hedge.  It is shared by all PeerMessageSenders, and is thread-safe.
+class AcrHedger
+{
+public:
+  // @param percentile       - The percentile of ACR latency after which to
+  //                           hedge.
+  // @param budget_percent   - The maximum percentage of ACRs to hedge.
+  // @param stats_aggregator - Statistics aggregator.  May be NULL.
+  AcrHedger(int percentile,
+            int budget_percent,
+            LastValueCache* stats_aggregator = NULL);
+  virtual ~AcrHedger();
+
+  bool start();
+  void stop();
+
+  // Record the latency of an answered ACR.
+  void record_latency(uint64_t latency_ms);
+
+  // Called when an ACR is first sent.  Returns how long to wait before
+  // hedging it, or 0 if it shouldn't be hedged (because we don't have enough
+  // latency samples yet).
+  uint64_t acr_sent();
+
+  // Called when it's time to hedge an ACR.  Returns whether there is budget
+  // to do so.
+  bool take_budget();
+
+  // Record that a hedged ACR was answered first.
+  void hedge_won();
+
+  // Call sender->hedge() after delay_ms.
+  void schedule(PeerMessageSender* sender, uint64_t delay_ms);
+
+  // Cancel a scheduled call.  Returns false if there wasn't one scheduled
+  // (including if it's already been made or is about to be).
+  bool cancel(PeerMessageSender* sender);
+
+  // The minimum number of latency samples needed before we hedge.
+  static const uint64_t MIN_SAMPLES = 100;
+
+  // The width of the latency histogram buckets, and the number of buckets.
+  static const uint64_t BUCKET_MS = 5;
+  static const int NUM_BUCKETS = 400;
+
+  // The number of samples after which the histogram is aged, so that it
+  // tracks recent latency.
+  static const uint64_t DECAY_SAMPLES = 10000;
+
+  // The current time in milliseconds.  Virtual so that UT can control time.
+  virtual uint64_t now_ms();
+
+private:
+  static void* timer_thread_fn(void* hedger);
+  void timer_thread();
+
+  // Recalculate the hedge threshold.  Must be called with the lock held.
+  void update_threshold();
+
+  const int _percentile;
+  const int _budget_percent;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  pthread_t _timer_thread;
+  bool _running;
+
+  // Histogram of recent ACR latencies.
+  uint64_t _latency_buckets[NUM_BUCKETS];
+  uint64_t _samples;
+  uint64_t _samples_since_update;
+  uint64_t _threshold_ms;
+
+  // Hedges we can make, in hundredths of a hedge.  Earned by sending ACRs and
+  // spent by hedging them.
+  int _credits;
+
+  std::multimap<uint64_t, PeerMessageSender*> _timers;
+  std::unordered_map<PeerMessageSender*, std::multimap<uint64_t, PeerMessageSender*>::iterator> _timer_index;
+
+  StatisticCounter* _hedged_stat;
+  StatisticCounter* _hedge_won_stat;
+  StatisticCounter* _over_budget_stat;
+};
+
+#endif
@@ -0,0 +1,280 @@
+/**
+ * @file acr_spool.hpp On-disk spool of ACRs that couldn't be delivered to any CCF.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef ACR_SPOOL_HPP_
+#define ACR_SPOOL_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "accumulator.h"
+#include "counter.h"
+#include "rf.h"
+
+// An append-only spool of records on disk, which are replayed in order.
+//
+// The spool is a directory of fixed-size segment files, each of which is
+// memory-mapped.  Records are appended to the newest segment, and a flush
+// thread syncs them to disk in batches (group commit), so appending never
+// waits for the disk.  A replay thread passes records to deliver() in order,
+// at no more than the configured rate, with up to MAX_IN_FLIGHT records being
+// delivered at once.  Only one record with a given key (see record_key()) is
+// delivered at a time, so records with the same key are delivered in the
+// order they were appended.  Records that can't be delivered are retried
+// later, before any new ones.  Segments that have been completely delivered
+// are reused for new records.
+//
+// Each segment records how far it has been delivered (up to the first record
+// that hasn't been), so after a restart replay continues from where it left
+// off.  Records that were delivered out of order, or just before a crash,
+// may be delivered again.
+//
+// The spool reports the following statistics:
+// - ralf_acr_spool_depth    - Records waiting to be delivered, on each change.
+// - ralf_acr_spool_writes   - Records written.
+// - ralf_acr_spool_commits  - Batches of records synced to disk.
+// - ralf_acr_spool_replayed - Records delivered.
+// - ralf_acr_spool_dropped  - Records that couldn't be written because the
+//                             spool was full.
+class AcrSpool
+{
+public:
+  // @param dir              - Directory to keep the segments in.  Created if
+  //                           it doesn't exist.
+  // @param max_bytes        - Maximum size of the spool on disk.
+  // @param replay_rate      - Maximum records to replay per second.
+  // @param stats_aggregator - Statistics aggregator.  May be NULL.
+  // @param segment_size     - Size of each segment.
+  AcrSpool(const std::string& dir,
+           uint64_t max_bytes,
+           int replay_rate,
+           LastValueCache* stats_aggregator = NULL,
+           size_t segment_size = DEFAULT_SEGMENT_SIZE);
+  virtual ~AcrSpool();
+
+  // Loads any records left in the spool from a previous run, and starts the
+  // flush and replay threads.
+  bool start();
+  void stop();
+
+  // Appends a record.  Returns false if the spool is full.
+  bool append(const std::string& record);
+
+  // The number of records waiting to be delivered.
+  uint64_t depth();
+
+  // Loads records left in the spool from a previous run.  Called by start().
+  bool recover();
+
+  // Syncs appended records to disk.  Called on the flush thread.
+  void flush();
+
+  // Starts delivering the oldest record that needs delivering, unless
+  // MAX_IN_FLIGHT records are already being delivered.  Returns false if
+  // there wasn't one, or a delivery has failed since.  Called on the replay
+  // thread.
+  bool replay_one();
+
+  // Called once a record has been delivered, or with false if it should be
+  // retried later.
+  typedef std::function<void(bool delivered)> DeliveryCallback;
+
+  static const size_t DEFAULT_SEGMENT_SIZE = 16 * 1024 * 1024;
+
+  // How long the flush thread waits for more records before syncing.
+  static const int COMMIT_INTERVAL_MS = 5;
+
+  // How long to wait before retrying a record that couldn't be delivered.
+  static const int RETRY_INTERVAL_MS = 1000;
+
+  // The most records to deliver at once.
+  static const size_t MAX_IN_FLIGHT = 32;
+
+protected:
+  // Starts delivering a record, and calls done when it has finished, which
+  // may be on another thread or before returning.  Called on the replay
+  // thread.
+  virtual void deliver(const std::string& record, const DeliveryCallback& done) = 0;
+
+  // Returns the key that orders a record with respect to the other records.
+  // A record isn't delivered while an earlier record with the same key is
+  // still being delivered or waiting to be retried.  Records with an empty
+  // key (the default) can be delivered in any order.  Called with the
+  // spool's lock held.
+  virtual std::string record_key(const std::string& record) const;
+
+private:
+  struct Segment
+  {
+    std::string path;
+    int fd;
+    char* base;
+    uint64_t seq;
+
+    // The end of the records in the segment, the next record to deliver, and
+    // how much of the segment has been synced to disk.
+    size_t write_offset;
+    size_t read_offset;
+    size_t synced_offset;
+    bool header_dirty;
+  };
+
+  // A record that has been passed to deliver().
+  struct Delivery
+  {
+    enum State { SENDING, DELIVERED, FAILED };
+
+    Segment* segment;
+    size_t offset;
+    size_t size;
+    std::string key;
+    State state;
+  };
+
+  static void* flush_thread_fn(void* spool);
+  static void* replay_thread_fn(void* spool);
+  void flush_thread();
+  void replay_thread();
+
+  // Waits on a condition for timeout_ms, or until the spool is stopped.  Must
+  // be called with the lock held.
+  void wait_ms(pthread_cond_t* cond, int timeout_ms);
+
+  // Opens a segment left by a previous run, or creates a new one.
+  Segment* open_segment(const std::string& path);
+  Segment* new_segment();
+
+  // Finds the end of the records in a segment, and counts them.
+  uint64_t scan_segment(Segment* segment);
+
+  // Returns a delivery for the oldest record that hasn't been sent yet, or
+  // NULL if they all have or it has to wait for an earlier record with the
+  // same key.  Must be called with the lock held.
+  Delivery* next_delivery();
+
+  // Records the result of a delivery, and moves the read offset past the
+  // records that have been delivered in order.
+  void delivery_done(Delivery* delivery, bool delivered);
+
+  // Moves delivered segments to the free list, or deletes them.  Must be
+  // called without the lock held.
+  void retire_segments(const std::vector<Segment*>& segments);
+  void close_segment(Segment* segment, bool remove);
+
+  std::string segment_path(uint64_t seq) const;
+
+  const std::string _dir;
+  const size_t _segment_size;
+  const size_t _max_segments;
+  const int _replay_rate;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _flush_cond;
+  pthread_cond_t _replay_cond;
+  pthread_t _flush_thread;
+  pthread_t _replay_thread;
+  bool _running;
+
+  // Held while syncing, so that segments aren't unmapped under the flush.
+  pthread_mutex_t _sync_lock;
+
+  // Segments with records in, oldest first, and segments that can be reused.
+  std::deque<Segment*> _segments;
+  std::vector<Segment*> _free;
+  uint64_t _next_seq;
+  uint64_t _depth;
+  bool _dirty;
+
+  // Records being delivered, or delivered ahead of an earlier record, oldest
+  // first.  The next record to send is at _send_offset in _send_segment.
+  std::deque<Delivery*> _deliveries;
+  Segment* _send_segment;
+  size_t _send_offset;
+  int _sending;
+  int _failed;
+
+  // Set if the next record to send is waiting for an earlier record with the
+  // same key.  Cleared when any delivery finishes.
+  bool _blocked;
+  uint64_t _failures;
+  bool _backoff;
+
+  StatisticAccumulator* _depth_stat;
+  StatisticCounter* _writes_stat;
+  StatisticCounter* _commits_stat;
+  StatisticCounter* _replayed_stat;
+  StatisticCounter* _dropped_stat;
+};
+
+// A spool of ACRs that couldn't be delivered to any CCF.  Each record holds
+// an encoded ACR and the CCFs to send it to, and is replayed by resending the
+// ACR to each CCF in turn until one answers.  ACRs with the same Session-Id
+// are replayed one at a time, in the order they were spooled.
+class RfAcrSpool : public AcrSpool
+{
+public:
+  RfAcrSpool(Rf::Dictionary* dict,
+             Diameter::Stack* diameter_stack,
+             const std::string& dir,
+             uint64_t max_bytes,
+             int replay_rate,
+             LastValueCache* stats_aggregator = NULL);
+  virtual ~RfAcrSpool();
+
+  // Spools an encoded ACR.  Returns false if the spool is full.
+  bool spool(const std::vector<std::string>& ccfs, const std::string& acr);
+
+  // Build and parse spool records.
+  static std::string make_record(const std::vector<std::string>& ccfs,
+                                 const std::string& acr);
+  static bool parse_record(const std::string& record,
+                           std::vector<std::string>& ccfs,
+                           std::string& acr);
+
+protected:
+  void deliver(const std::string& record, const DeliveryCallback& done);
+  std::string record_key(const std::string& record) const;
+
+private:
+  Rf::Dictionary* _dict;
+  Diameter::Stack* _diameter_stack;
+};
+
+#endif
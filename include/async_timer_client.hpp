@@ -0,0 +1,150 @@
+/**
+ * @file async_timer_client.hpp Asynchronous client for Chronos timers
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef ASYNC_TIMER_CLIENT_HPP_
+#define ASYNC_TIMER_CLIENT_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+#include "worker_pool.hpp"
+#include "chronosconnection.h"
+#include "counter.h"
+#include "sas.h"
+
+// A request to create, update or delete a Chronos timer.
+struct TimerRequest
+{
+  enum Method { POST, PUT, DELETE };
+
+  // Called once Chronos has answered, with the HTTP result and the timer ID
+  // (which Chronos may have changed).
+  typedef std::function<void(HTTPCode rc, const std::string& timer_id)> Completion;
+
+  Method method;
+  std::string timer_id;
+  uint32_t interval;
+  uint32_t repeat_for;
+  std::string callback_uri;
+  std::string opaque_data;
+  std::map<std::string, uint32_t> tags;
+  SAS::TrailId trail;
+  Completion completion;
+};
+
+// Sends timer requests to Chronos from a pool of threads, so that callers
+// don't wait for the round trip.  Each thread reuses its own keep-alive
+// connection to Chronos, so requests are pipelined across the threads.
+//
+// Requests for the same timer are queued to the same thread, so they reach
+// Chronos in order.  Chronos has no batch API, but a queued PUT is dropped
+// (without calling its completion) if a DELETE for the same timer is queued
+// behind it - ralf_timer_requests_coalesced.
+//
+// If the queue is full, a request for a timer with nothing queued (including
+// any POST) is sent on the caller's thread instead
+// (ralf_timer_requests_inline).  A request for a timer that does have
+// requests queued mustn't overtake them, so the caller waits for room in the
+// timer's queue.
+class AsyncTimerClient : public WorkerPool<TimerRequest*>
+{
+public:
+  AsyncTimerClient(ChronosConnection* conn,
+                   unsigned int num_threads,
+                   size_t max_queue,
+                   ExceptionHandler* exception_handler,
+                   LastValueCache* stats_aggregator);
+  virtual ~AsyncTimerClient();
+
+  // Creates a timer.  The completion is passed the new timer's ID.
+  void send_post(uint32_t interval,
+                 uint32_t repeat_for,
+                 const std::string& callback_uri,
+                 const std::string& opaque_data,
+                 SAS::TrailId trail,
+                 const std::map<std::string, uint32_t>& tags,
+                 TimerRequest::Completion completion);
+
+  // Updates a timer.
+  void send_put(const std::string& timer_id,
+                uint32_t interval,
+                uint32_t repeat_for,
+                const std::string& callback_uri,
+                const std::string& opaque_data,
+                SAS::TrailId trail,
+                const std::map<std::string, uint32_t>& tags,
+                TimerRequest::Completion completion);
+
+  // Deletes a timer.  There is no completion.
+  void send_delete(const std::string& timer_id, SAS::TrailId trail);
+
+protected:
+  void process_work(TimerRequest*& req);
+
+  // Sends the request to Chronos and calls its completion.
+  virtual void send(TimerRequest* req);
+
+private:
+  // Queues a request, or sends it if the queue is full.
+  void queue(TimerRequest* req);
+
+  static void discard(TimerRequest* req);
+
+  ChronosConnection* _conn;
+  std::hash<std::string> _hash;
+
+  // The requests, and DELETEs, queued for each timer.
+  struct QueuedRequests
+  {
+    int requests;
+    int deletes;
+  };
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _space_cond;
+  std::atomic<int> _space_waiters;
+  std::unordered_map<std::string, QueuedRequests> _queued;
+
+  StatisticCounter* _coalesced_stat;
+  StatisticCounter* _inline_stat;
+};
+
+#endif
@@ -0,0 +1,108 @@
+/**
+ * @file billing_worker_pool.hpp Pool of threads that run the session manager.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef BILLING_WORKER_POOL_HPP_
+#define BILLING_WORKER_POOL_HPP_
+
+#include <atomic>
+#include <string>
+
+#include "worker_pool.hpp"
+#include "counter.h"
+#include "message.hpp"
+#include "session_manager.hpp"
+
+// Pool of threads that pass billing requests to the SessionManager.  This
+// keeps memcached and Chronos round trips off the HTTP threads - they only
+// parse the request and queue it here.
+//
+// In ordered mode, requests are assigned to a lane using the session's store
+// key (call ID, role and function), so updates to one session are never
+// processed concurrently on this node and can't hit CAS contention with each
+// other.  The pool counts the requests that were queued behind another
+// request for the same session, i.e. the contention that has been avoided
+// (ralf_billing_contention_avoided).  Requests are counted in a fixed table
+// of atomic counters indexed by the session's hash, so counting doesn't take
+// a lock; sessions that share a counter may occasionally be over-counted.
+class BillingWorkerPool : public WorkerPool<Message*>
+{
+public:
+  BillingWorkerPool(SessionManager* sess_mgr,
+                    unsigned int num_threads,
+                    size_t max_queue,
+                    ExceptionHandler* exception_handler,
+                    LastValueCache* stats_aggregator,
+                    bool ordered = false);
+  virtual ~BillingWorkerPool();
+
+  // Queues a message.  Returns false (and leaves the message with the caller)
+  // if the queue is full.
+  bool add_message(Message* msg);
+
+  // The number of requests that have been queued behind another request for
+  // the same session.
+  uint64_t contention_avoided() const { return _contention_avoided; }
+
+  static const size_t PENDING_SLOTS = 16384;
+
+protected:
+  void process_work(Message*& msg);
+  void process_work_failed(Message*& msg);
+
+  // Mark a request as in progress on this thread, and as finished, so that
+  // later requests for its session aren't counted as queued behind it.
+  // end_request does nothing if there's no request in progress.
+  void begin_request(Message* msg);
+  void end_request();
+
+private:
+  SessionManager* _sess_mgr;
+  bool _ordered;
+  std::hash<std::string> _hash;
+
+  // The number of requests queued or in progress for the sessions that hash
+  // to each slot.
+  std::atomic<int>* _pending;
+
+  // The slot of the request in progress on this thread, so it can be
+  // released if the request hits an exception.  -1 if there isn't one.
+  static thread_local int _current_slot;
+
+  std::atomic<uint64_t> _contention_avoided;
+  StatisticCounter* _contention_avoided_stat;
+};
+
+#endif
@@ -0,0 +1,192 @@
+/**
+ * @file bounded_queue.hpp Bounded lock-free multi-producer multi-consumer queue.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef BOUNDED_QUEUE_HPP_
+#define BOUNDED_QUEUE_HPP_
+
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+// A fixed capacity queue that any number of threads can push to and pop from
+// without taking a lock.  Each slot carries a sequence number that tells
+// producers and consumers whether the slot is free for the current lap of the
+// ring, so a push or pop is a single compare-and-swap on the tail or head in
+// the common case.
+//
+// The queue never blocks - push fails if the queue is full and pop fails if
+// it is empty.  Callers that need to wait for work should pair it with a
+// semaphore (see WorkerPool).
+template<class T>
+class BoundedQueue
+{
+public:
+  // The capacity is rounded up to a power of two.
+  BoundedQueue(size_t capacity) :
+    _mask(round_up_pow2(capacity) - 1),
+    _cells(_mask + 1),
+    _enqueue_pos(0),
+    _dequeue_pos(0)
+  {
+    for (size_t ii = 0; ii <= _mask; ii++)
+    {
+      _cells[ii].sequence.store(ii, std::memory_order_relaxed);
+    }
+  }
+
+  // Adds an item to the tail of the queue.  Returns false if the queue is
+  // full, in which case the item is unchanged.
+  bool push(T& item)
+  {
+    Cell* cell;
+    size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+      cell = &_cells[pos & _mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+      if (diff == 0)
+      {
+        // The slot is free for this lap - try to claim it.
+        if (_enqueue_pos.compare_exchange_weak(pos,
+                                               pos + 1,
+                                               std::memory_order_relaxed))
+        {
+          break;
+        }
+      }
+      else if (diff < 0)
+      {
+        // The slot still holds an item from the previous lap, so we're full.
+        return false;
+      }
+      else
+      {
+        // Another producer got here first.
+        pos = _enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->data = std::move(item);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Removes the item at the head of the queue.  Returns false if there isn't
+  // one.
+  bool pop(T& item)
+  {
+    Cell* cell;
+    size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+
+    while (true)
+    {
+      cell = &_cells[pos & _mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+      if (diff == 0)
+      {
+        if (_dequeue_pos.compare_exchange_weak(pos,
+                                               pos + 1,
+                                               std::memory_order_relaxed))
+        {
+          break;
+        }
+      }
+      else if (diff < 0)
+      {
+        // Nothing has been published to this slot yet.
+        return false;
+      }
+      else
+      {
+        pos = _dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+
+    item = std::move(cell->data);
+    cell->sequence.store(pos + _mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Approximate number of items in the queue.  This is only exact when no
+  // other thread is pushing or popping.
+  size_t size() const
+  {
+    size_t tail = _enqueue_pos.load(std::memory_order_relaxed);
+    size_t head = _dequeue_pos.load(std::memory_order_relaxed);
+    return (tail > head) ? (tail - head) : 0;
+  }
+
+  size_t capacity() const
+  {
+    return _mask + 1;
+  }
+
+private:
+  struct Cell
+  {
+    Cell() : sequence(0), data() {}
+    Cell(const Cell& other) : sequence(other.sequence.load()), data(other.data) {}
+
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  static size_t round_up_pow2(size_t value)
+  {
+    size_t result = 2;
+    while (result < value)
+    {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  const size_t _mask;
+  std::vector<Cell> _cells;
+
+  // Keep the producer and consumer positions on separate cache lines so that
+  // pushes and pops don't contend.
+  alignas(64) std::atomic<size_t> _enqueue_pos;
+  alignas(64) std::atomic<size_t> _dequeue_pos;
+};
+
+#endif
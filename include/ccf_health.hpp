@@ -0,0 +1,120 @@
+/**
+ * @file ccf_health.hpp Tracks which CCFs are reachable.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef CCF_HEALTH_HPP_
+#define CCF_HEALTH_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "counter.h"
+
+// Tracks which CCFs are reachable, so that ACRs aren't sent to a CCF that is
+// known to be failing (and so don't wait for a timeout before failing over).
+//
+// Each CCF has a circuit breaker:
+// -  CLOSED: the CCF is healthy and is used as normal.
+// -  OPEN: the CCF has failed failure_threshold times in a row.  It is
+//    skipped until probe_interval_ms has passed.
+// -  HALF_OPEN: the next ACR for the CCF is a probe.  If it succeeds the
+//    circuit closes, and if it fails it opens again.  Other ACRs skip the CCF
+//    while the probe is outstanding.
+//
+// The tracker is shared by all PeerMessageSenders, and is thread-safe.
+class CcfHealthTracker
+{
+public:
+  // @param failure_threshold - The number of consecutive failures that open
+  //                            the circuit for a CCF.
+  // @param probe_interval_ms - How long the circuit stays open before a CCF
+  //                            is probed.
+  // @param stats_aggregator  - Statistics aggregator.  May be NULL.
+  CcfHealthTracker(int failure_threshold,
+                   int probe_interval_ms,
+                   LastValueCache* stats_aggregator = NULL);
+  virtual ~CcfHealthTracker();
+
+  enum State
+  {
+    CLOSED,
+    OPEN,
+    HALF_OPEN
+  };
+
+  // Order a list of CCFs for sending an ACR.  CCFs that can be used keep
+  // their relative order, and come before those that are being skipped (which
+  // are still tried as a last resort).
+  std::vector<std::string> order(const std::vector<std::string>& ccfs);
+
+  // Report the outcome of sending an ACR to a CCF.
+  void success(const std::string& ccf);
+  void failure(const std::string& ccf);
+
+  State state(const std::string& ccf);
+
+protected:
+  // The current time in milliseconds.  Virtual so that UT can control time.
+  virtual uint64_t now_ms();
+
+private:
+  struct Health
+  {
+    Health() : state(CLOSED), failures(0), retry_at_ms(0) {}
+
+    State state;
+    int failures;
+
+    // When OPEN, when to move to HALF_OPEN.  When HALF_OPEN, when to give up
+    // waiting for the outcome of the probe and send another.
+    uint64_t retry_at_ms;
+  };
+
+  bool allow(Health& health, uint64_t now);
+
+  pthread_mutex_t _lock;
+  std::map<std::string, Health> _ccfs;
+
+  const int _failure_threshold;
+  const uint64_t _probe_interval_ms;
+
+  StatisticCounter* _opened_stat;
+  StatisticCounter* _skipped_stat;
+};
+
+#endif
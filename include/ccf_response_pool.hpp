@@ -0,0 +1,96 @@
+/**
+ * @file ccf_response_pool.hpp Pool of threads that process CCF answers
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef CCF_RESPONSE_POOL_HPP_
+#define CCF_RESPONSE_POOL_HPP_
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <string>
+
+#include "worker_pool.hpp"
+#include "counter.h"
+#include "message.hpp"
+#include "session_manager.hpp"
+
+// A CCF's answer to an ACR, waiting to be processed by the SessionManager.
+struct CcfResponse
+{
+  bool accepted;
+  uint32_t interim_interval;
+  std::string session_id;
+  int rc;
+  Message* msg;
+};
+
+// Pool of threads that pass CCF answers to the SessionManager.  This keeps
+// Chronos and memcached round trips off the Diameter stack's threads - they
+// only decode the answer and queue it here.
+//
+// Answers are assigned to a lane using the session's store key, so answers
+// for one session are processed in the order they arrived.  How long answers
+// wait in the queue is reported as ralf_ccf_response_queue_wait_us.  If the
+// queue is full the answer is processed on the Diameter thread instead
+// (ralf_ccf_response_overflows).
+class CcfResponsePool : public WorkerPool<CcfResponse>
+{
+public:
+  CcfResponsePool(SessionManager* sess_mgr,
+                  unsigned int num_threads,
+                  size_t max_queue,
+                  ExceptionHandler* exception_handler,
+                  LastValueCache* stats_aggregator);
+  virtual ~CcfResponsePool();
+
+  // Queues an answer.  Returns false if the queue is full, in which case the
+  // caller must process the answer itself.
+  bool add_response(CcfResponse& response);
+
+  // The number of answers that couldn't be queued.
+  uint64_t overflows() const { return _overflows; }
+
+protected:
+  void process_work(CcfResponse& response);
+
+private:
+  SessionManager* _sess_mgr;
+  std::hash<std::string> _hash;
+  std::atomic<uint64_t> _overflows;
+  StatisticCounter* _overflows_stat;
+};
+
+#endif
@@ -0,0 +1,155 @@
+/**
+ * @file ccf_window.hpp Limits the number of ACRs outstanding to each CCF.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef CCF_WINDOW_HPP_
+#define CCF_WINDOW_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+#include "accumulator.h"
+#include "counter.h"
+
+class PeerMessageSender;
+
+// Limits the number of ACRs that can be outstanding to each CCF at once.  ACRs
+// beyond the window are queued, and sent as earlier ACRs are answered.  This
+// stops a slow CCF building up an unbounded number of transactions.
+//
+// If a CCF's queue is full, the overflow policy decides what happens:
+// - FAILOVER - the new ACR is sent to the next CCF instead (or fails if there
+//              isn't one).
+// - DROP     - the new ACR fails.
+// - SHED     - the oldest queued ACR fails, and the new ACR is queued.
+//
+// The window is shared by all PeerMessageSenders, and is thread-safe.  It
+// reports the following statistics:
+// - ralf_ccf_window_occupancy - ACRs outstanding to the CCF, on each send.
+// - ralf_ccf_queue_depth      - ACRs queued for the CCF, on each queue.
+// - ralf_ccf_queue_wait_us    - How long each ACR was queued for.
+// - ralf_ccf_queue_overflows  - ACRs that found the queue full.
+class CcfWindow
+{
+public:
+  enum OverflowPolicy
+  {
+    FAILOVER,
+    DROP,
+    SHED
+  };
+
+  enum Result
+  {
+    // The ACR can be sent now.
+    SEND,
+
+    // The ACR has been queued.  The sender will be told when it can be sent
+    // (or that it has been shed).
+    QUEUED,
+
+    // The queue is full, and the ACR should be handled according to the
+    // overflow policy.
+    FULL
+  };
+
+  // @param window_size      - The maximum number of ACRs outstanding to each
+  //                           CCF.
+  // @param max_queue        - The maximum number of ACRs queued for each CCF.
+  // @param policy           - What to do when the queue is full.
+  // @param stats_aggregator - Statistics aggregator.  May be NULL.
+  CcfWindow(int window_size,
+            int max_queue,
+            OverflowPolicy policy,
+            LastValueCache* stats_aggregator = NULL);
+  virtual ~CcfWindow();
+
+  // Asks to send an ACR to a CCF.  If this returns SEND, the caller must call
+  // release() when the ACR has been answered.  If it returns QUEUED, the
+  // sender's window_open() is called later, with the attempt number.
+  Result acquire(const std::string& ccf,
+                 PeerMessageSender* sender,
+                 unsigned int attempt);
+
+  // Frees up a space in the CCF's window.  If any ACRs are queued, the space
+  // is handed on to the oldest.
+  void release(const std::string& ccf);
+
+  OverflowPolicy policy() const { return _policy; }
+
+  // The number of ACRs outstanding to, and queued for, a CCF.
+  int in_flight(const std::string& ccf);
+  size_t queue_depth(const std::string& ccf);
+
+  // Parses an overflow policy name.  Returns false if it isn't valid.
+  static bool parse_policy(const std::string& name, OverflowPolicy& policy);
+
+protected:
+  // The current time in microseconds.  Virtual so that UT can control time.
+  virtual uint64_t now_us();
+
+private:
+  struct Waiter
+  {
+    PeerMessageSender* sender;
+    unsigned int attempt;
+    uint64_t queued_us;
+  };
+
+  struct CcfState
+  {
+    CcfState() : in_flight(0) {}
+
+    int in_flight;
+    std::deque<Waiter> queue;
+  };
+
+  const int _window_size;
+  const size_t _max_queue;
+  const OverflowPolicy _policy;
+
+  pthread_mutex_t _lock;
+  std::unordered_map<std::string, CcfState> _ccfs;
+
+  StatisticAccumulator* _occupancy_stat;
+  StatisticAccumulator* _queue_depth_stat;
+  StatisticAccumulator* _queue_wait_stat;
+  StatisticCounter* _overflow_stat;
+};
+
+#endif
@@ -43,6 +43,8 @@
 #include "httpstack_utils.h"
 #include "message.hpp"
 #include "session_manager.hpp"
+#include "billing_worker_pool.hpp"
+#include "interim_pacer.hpp"
 #include "sas.h"
 #include "ralfsasevent.h"
 
@@ -51,6 +53,14 @@ const std::string TIMER_INTERIM_PARAM = "timer-interim";
 struct BillingHandlerConfig
 {
   SessionManager* mgr;
+
+  // If set, requests are queued to this pool rather than being passed to the
+  // session manager on the HTTP thread.
+  BillingWorkerPool* pool;
+
+  // If set, timer-interim requests are paced by this before being queued or
+  // handled.
+  InterimPacer* pacer;
 };
 
 class BillingTask : public HttpStackUtils::Task
@@ -59,17 +69,48 @@ public:
   BillingTask(HttpStack::Request& req,
                      const BillingHandlerConfig* cfg,
                      SAS::TrailId trail) :
-    HttpStackUtils::Task(req, trail), _sess_mgr(cfg->mgr)
+    HttpStackUtils::Task(req, trail),
+    _sess_mgr(cfg->mgr),
+    _pool(cfg->pool),
+    _pacer(cfg->pacer)
   {};
   void run();
+
+  // Parses the request body into a Message.  The body is parsed in-situ, so
+  // its contents are taken by the Message and reqbody is left empty.
   static HTTPCode parse_body(std::string call_id,
                              bool timer_interim,
-                             std::string reqbody,
+                             std::string& reqbody,
                              Message** msg,
                              SAS::TrailId trail);
+
+  // Builds the Message for a timer-interim request directly, if its body is
+  // the one the session manager gives Chronos (see
+  // SessionManager::create_opaque_data).  Returns false, leaving msg unset,
+  // if the body is anything else, in which case it should be passed to
+  // parse_body().
+  static bool parse_timer_interim(const std::string& call_id,
+                                  const std::string& reqbody,
+                                  Message** msg,
+                                  SAS::TrailId trail);
+
+  // Passes a message to the billing pool or, if there isn't one, to the
+  // session manager.  Returns false, without taking ownership of the message,
+  // if the billing queue is full.  Used for paced messages and timer pops.
+  static bool handle_message(const BillingHandlerConfig* cfg, Message* msg);
+
+  // Handles an interim timer popping in the in-process timer wheel, in the
+  // same way as a timer-interim request from Chronos.  Returns false if the
+  // pacing or billing queue is full, so the wheel should offer the pop again
+  // later.
+  static bool timer_popped(const BillingHandlerConfig* cfg,
+                           const std::string& callback_uri,
+                           const std::string& opaque_data);
 private:
   inline std::string call_id() {return _req.file();};
   SessionManager* _sess_mgr;
+  BillingWorkerPool* _pool;
+  InterimPacer* _pacer;
 };
 
 class BillingHandler:
@@ -0,0 +1,153 @@
+/**
+ * @file interim_pacer.hpp Paces the processing of timer-interim requests
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef INTERIM_PACER_HPP_
+#define INTERIM_PACER_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <functional>
+
+#include "accumulator.h"
+#include "counter.h"
+#include "message.hpp"
+
+// Smooths bursts of timer-interim requests (for example, when many sessions
+// were created at the same moment and their timers pop together) so that
+// INTERIM ACRs reach the CDF at no more than a target rate.
+//
+// Requests are queued, and the pacer's thread releases them from a token
+// bucket that fills at the target rate and holds up to a tenth of a second's
+// worth of tokens.  If the queue is full, the request is refused, so that the
+// caller can push back on whoever sent it.  If the release callback refuses a
+// request, it stays at the front of the queue and is offered again shortly.
+//
+// The pacer reports the following statistics:
+// - ralf_interim_pacer_depth       - Requests queued, on each change.
+// - ralf_interim_pacer_overflows   - Requests refused because the queue was
+//                                    full.
+// - ralf_interim_pacer_arrivals    - Requests that arrived in each second.
+// - ralf_interim_pacer_releases    - Requests released in each second.
+// Comparing the distributions of the last two shows how much the pacer has
+// flattened the load.
+class InterimPacer
+{
+public:
+  // Called with each message that is released, on the pacer's thread.  Takes
+  // ownership of the message and returns true, or returns false if it can't
+  // take the message yet (for example because the billing queue is full).
+  typedef std::function<bool(Message* msg)> ReleaseCallback;
+
+  // @param release          - Called with each released message.
+  // @param rate             - Maximum messages to release per second.
+  // @param max_queue        - Maximum messages to queue.
+  // @param stats_aggregator - Statistics aggregator.  May be NULL.
+  InterimPacer(ReleaseCallback release,
+               int rate,
+               size_t max_queue,
+               LastValueCache* stats_aggregator = NULL);
+  virtual ~InterimPacer();
+
+  bool start();
+
+  // Stops the pacer's thread.  Any queued messages are released, and any
+  // that are refused are dropped.
+  void stop();
+
+  // Queues a message to be released.  Returns false, without taking ownership
+  // of the message, if the queue is full.
+  bool add(Message* msg);
+
+  // The number of queued messages.
+  size_t depth();
+
+  // Releases as many queued messages as there are tokens for at the given
+  // time, and returns how many ms until there will be another token (or until
+  // a refused message should be offered again).  Called on the pacer's
+  // thread.
+  uint64_t release(uint64_t now_ms);
+
+  // How long to wait before offering a refused message again.
+  static const uint64_t RETRY_MS = 10;
+
+protected:
+  // The monotonic time in milliseconds.  Virtual so the UTs can control time.
+  virtual uint64_t now_ms();
+
+private:
+  static void* thread_fn(void* pacer);
+  void thread();
+
+  // How long until there's a token, or a refused message should be offered
+  // again.  Must be called with the lock held.
+  uint64_t next_wait_ms(uint64_t now_ms);
+
+  // Adds the tokens that have accrued since the last refill, and reports the
+  // arrival and release counts for each second that has finished.  Must be
+  // called with the lock held.
+  void refill(uint64_t now_ms);
+
+  ReleaseCallback _release;
+  const int _rate;
+  const size_t _max_queue;
+  const double _max_tokens;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  pthread_t _thread;
+  bool _running;
+
+  std::deque<Message*> _queue;
+  double _tokens;
+  uint64_t _last_refill_ms;
+
+  // If the release callback has refused a message, when to offer it again.
+  uint64_t _retry_ms;
+
+  // The start of the current second, and the messages that have arrived and
+  // been released in it.
+  uint64_t _second_start_ms;
+  uint64_t _arrivals;
+  uint64_t _releases;
+
+  StatisticAccumulator* _depth_stat;
+  StatisticCounter* _overflows_stat;
+  StatisticAccumulator* _arrivals_stat;
+  StatisticAccumulator* _releases_stat;
+};
+
+#endif
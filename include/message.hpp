@@ -40,6 +40,7 @@
 #include "rapidjson/document.h"
 #include "rf.h"
 #include "sas.h"
+#include "object_pool.hpp"
 
 enum role_of_node_t
 {
@@ -67,6 +68,30 @@ enum node_functionality_t
   ATCF = 15
 };
 
+/* Storage for a request body that has been parsed in-situ.  The document's
+   strings point into `buffer`, and its other values are allocated from a
+   memory pool whose first chunk is held inline, so a typical ACR body is
+   parsed without any further heap allocation.  The body has to live as long
+   as the Message (it's used to build ACRs on the Diameter threads), so the
+   pool can't be a per-thread arena. */
+struct ReceivedBody
+{
+  static const size_t INLINE_CHUNK_SIZE = 4096;
+
+  /* Takes the contents of `body` (which is left empty) and parses it. */
+  ReceivedBody(std::string& body);
+
+  /* Creates an empty document, to be built using `allocator`. */
+  ReceivedBody();
+
+  POOLED_ALLOCATION(ReceivedBody)
+
+  std::string buffer;
+  alignas(8) char chunk[INLINE_CHUNK_SIZE];
+  rapidjson::MemoryPoolAllocator<> allocator;
+  rapidjson::Document doc;
+};
+
 struct Message
 {
   Message(const std::string& call_id,
@@ -77,8 +102,20 @@ struct Message
           uint32_t session_refresh_time,
           SAS::TrailId trail,
           bool timer_interim=false);
+  /* The body comes first so that passing NULL for the body to the other
+     constructor isn't ambiguous. */
+  Message(ReceivedBody* body,
+          const std::string& call_id,
+          role_of_node_t role,
+          node_functionality_t function,
+          Rf::AccountingRecordType record_type,
+          uint32_t session_refresh_time,
+          SAS::TrailId trail,
+          bool timer_interim=false);
   ~Message();
 
+  POOLED_ALLOCATION(Message)
+
   /* The identifiers (Call-Id, role and function) and the JSON
      document are known by the controller when this message is
      constructed, so are set in the constructor and shouldn't
@@ -103,7 +140,18 @@ struct Message
 
   uint32_t interim_interval;
   uint32_t session_refresh_time;
+
+  /* The session's timer schedule and expiry, from the database store, if
+     timer updates are lazy. */
+  uint32_t timer_interval;
+  uint32_t timer_expiry;
+  uint32_t session_expiry;
+
   SAS::TrailId trail;
+
+private:
+  /* Set if received_json was parsed in-situ, in which case this owns it. */
+  ReceivedBody* _received_body;
 };
 
 #endif
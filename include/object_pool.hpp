@@ -0,0 +1,361 @@
+/**
+ * @file object_pool.hpp Pooled allocation for objects created for every ACR.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef OBJECT_POOL_HPP_
+#define OBJECT_POOL_HPP_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <new>
+#include <string>
+
+#include "accumulator.h"
+#include "counter.h"
+
+// A pool of memory for objects of type T.  Classes that are allocated for
+// every ACR use it for their operator new and delete (see
+// POOLED_ALLOCATION), so their memory is reused rather than going back to the
+// heap.
+//
+// Each thread keeps a small cache of free blocks, so most allocations and
+// frees don't take a lock.  These objects are often freed on a different
+// thread from the one that allocated them (e.g. a Diameter thread frees what
+// an HTTP thread allocated), so when a thread's cache gets too big, a batch of
+// blocks is moved to a shared list, where other threads can pick them up.
+//
+// Subclasses of T that are bigger than T bypass the pool.
+//
+// If init_stats is called, the pool reports the following statistics (where
+// <prefix> is the prefix passed to init_stats):
+// -  <prefix>_hits: allocations served from the pool.
+// -  <prefix>_misses: allocations that needed memory from the heap.
+// -  <prefix>_live: the number of objects allocated, sampled whenever a
+//    thread's cache runs dry.  That only happens when the thread is
+//    allocating more objects than it frees, so its high-water mark is close
+//    to the most objects that have been alive at once.
+//
+// Each thread counts the objects it allocates and frees, so that the pool
+// doesn't have a counter that every thread writes to.  The counts are summed
+// when the number of live objects is needed.
+template<class T>
+class ObjectPool
+{
+public:
+  static void* allocate(size_t size)
+  {
+    if (size != sizeof(T))
+    {
+      return ::operator new(size);
+    }
+
+    _cache.add_live(1);
+    FreeBlock* block = _cache.take();
+
+    if (block == NULL)
+    {
+      // Refill this thread's cache from the shared list.
+      pthread_mutex_lock(&_shared_lock);
+      while ((_shared != NULL) && (_cache.count < BATCH_SIZE))
+      {
+        FreeBlock* shared = _shared;
+        _shared = shared->next;
+        _shared_count--;
+        _cache.put(shared);
+      }
+      uint64_t live = total_live();
+      pthread_mutex_unlock(&_shared_lock);
+
+      if (_live_stat != NULL)
+      {
+        _live_stat->accumulate(live);
+      }
+
+      block = _cache.take();
+    }
+
+    if (block != NULL)
+    {
+      if (_hits_stat != NULL)
+      {
+        _hits_stat->increment();
+      }
+    }
+    else
+    {
+      if (_misses_stat != NULL)
+      {
+        _misses_stat->increment();
+      }
+
+      block = (FreeBlock*)::operator new(BLOCK_SIZE);
+    }
+
+    return block;
+  }
+
+  static void deallocate(void* ptr, size_t size)
+  {
+    if (ptr == NULL)
+    {
+      return;
+    }
+
+    if (size != sizeof(T))
+    {
+      ::operator delete(ptr);
+      return;
+    }
+
+    _cache.add_live(-1);
+    _cache.put((FreeBlock*)ptr);
+
+    if (_cache.count > MAX_CACHED)
+    {
+      release_batch(_cache);
+    }
+  }
+
+  // Report statistics for this pool.  The statistics live for the life of
+  // the process, as objects may be freed at any point until it exits.
+  static void init_stats(const std::string& prefix,
+                         LastValueCache* stats_aggregator)
+  {
+    _hits_stat = new StatisticCounter(prefix + "_hits", stats_aggregator);
+    _misses_stat = new StatisticCounter(prefix + "_misses", stats_aggregator);
+    _live_stat = new StatisticAccumulator(prefix + "_live", stats_aggregator);
+  }
+
+  // The number of objects currently allocated, and free blocks held in the
+  // calling thread's cache.
+  static uint64_t live()
+  {
+    pthread_mutex_lock(&_shared_lock);
+    uint64_t live = total_live();
+    pthread_mutex_unlock(&_shared_lock);
+    return live;
+  }
+  static size_t cached() { return _cache.count; }
+
+  // The most free blocks a thread caches, and how many it moves to or from
+  // the shared list at once.
+  static const size_t MAX_CACHED = 64;
+  static const size_t BATCH_SIZE = 32;
+
+  // The most free blocks held on the shared list.  Beyond this, blocks go
+  // back to the heap.
+  static const size_t MAX_SHARED = 4096;
+
+private:
+  struct FreeBlock
+  {
+    FreeBlock* next;
+  };
+
+  static const size_t BLOCK_SIZE = (sizeof(T) > sizeof(FreeBlock)) ?
+                                     sizeof(T) : sizeof(FreeBlock);
+
+  struct ThreadCache
+  {
+    ThreadCache() : head(NULL), count(0), live(0), prev_cache(NULL)
+    {
+      pthread_mutex_lock(&_shared_lock);
+      next_cache = _caches;
+      if (next_cache != NULL)
+      {
+        next_cache->prev_cache = this;
+      }
+      _caches = this;
+      pthread_mutex_unlock(&_shared_lock);
+    }
+
+    // Give the blocks back when the thread exits, and hand over the count of
+    // live objects.
+    ~ThreadCache()
+    {
+      while (count > 0)
+      {
+        release_batch(*this);
+      }
+
+      pthread_mutex_lock(&_shared_lock);
+      _exited_live += live.load(std::memory_order_relaxed);
+      if (prev_cache != NULL)
+      {
+        prev_cache->next_cache = next_cache;
+      }
+      else
+      {
+        _caches = next_cache;
+      }
+      if (next_cache != NULL)
+      {
+        next_cache->prev_cache = prev_cache;
+      }
+      pthread_mutex_unlock(&_shared_lock);
+    }
+
+    // Only this thread writes its count, so it doesn't need an atomic
+    // increment - it's only atomic so that other threads can read it.
+    void add_live(int64_t delta)
+    {
+      live.store(live.load(std::memory_order_relaxed) + delta,
+                 std::memory_order_relaxed);
+    }
+
+    FreeBlock* take()
+    {
+      FreeBlock* block = head;
+      if (block != NULL)
+      {
+        head = block->next;
+        count--;
+      }
+      return block;
+    }
+
+    void put(FreeBlock* block)
+    {
+      block->next = head;
+      head = block;
+      count++;
+    }
+
+    FreeBlock* head;
+    size_t count;
+
+    // Objects allocated less objects freed on this thread.  This goes
+    // negative on threads that free objects allocated elsewhere.
+    std::atomic<int64_t> live;
+
+    // All the threads' caches are kept on a list, so their counts can be
+    // summed.
+    ThreadCache* prev_cache;
+    ThreadCache* next_cache;
+  };
+
+  // The number of objects currently allocated.  Must be called with
+  // _shared_lock held.
+  static uint64_t total_live()
+  {
+    int64_t live = _exited_live;
+
+    for (ThreadCache* cache = _caches; cache != NULL; cache = cache->next_cache)
+    {
+      live += cache->live.load(std::memory_order_relaxed);
+    }
+
+    return (uint64_t)live;
+  }
+
+  // Move a batch of blocks from a thread's cache to the shared list.
+  static void release_batch(ThreadCache& cache)
+  {
+    pthread_mutex_lock(&_shared_lock);
+
+    for (size_t ii = 0; (ii < BATCH_SIZE) && (cache.count > 0); ii++)
+    {
+      FreeBlock* block = cache.take();
+
+      if (_shared_count < MAX_SHARED)
+      {
+        block->next = _shared;
+        _shared = block;
+        _shared_count++;
+      }
+      else
+      {
+        ::operator delete(block);
+      }
+    }
+
+    pthread_mutex_unlock(&_shared_lock);
+  }
+
+  static thread_local ThreadCache _cache;
+
+  static pthread_mutex_t _shared_lock;
+  static FreeBlock* _shared;
+  static size_t _shared_count;
+
+  // The threads' caches, and the count of live objects handed over by
+  // threads that have exited.  Protected by _shared_lock.
+  static ThreadCache* _caches;
+  static int64_t _exited_live;
+
+  static StatisticCounter* _hits_stat;
+  static StatisticCounter* _misses_stat;
+  static StatisticAccumulator* _live_stat;
+};
+
+template<class T>
+const size_t ObjectPool<T>::MAX_CACHED;
+template<class T>
+const size_t ObjectPool<T>::BATCH_SIZE;
+template<class T>
+const size_t ObjectPool<T>::MAX_SHARED;
+template<class T>
+thread_local typename ObjectPool<T>::ThreadCache ObjectPool<T>::_cache;
+template<class T>
+pthread_mutex_t ObjectPool<T>::_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+template<class T>
+typename ObjectPool<T>::FreeBlock* ObjectPool<T>::_shared = NULL;
+template<class T>
+size_t ObjectPool<T>::_shared_count = 0;
+template<class T>
+typename ObjectPool<T>::ThreadCache* ObjectPool<T>::_caches = NULL;
+template<class T>
+int64_t ObjectPool<T>::_exited_live = 0;
+template<class T>
+StatisticCounter* ObjectPool<T>::_hits_stat = NULL;
+template<class T>
+StatisticCounter* ObjectPool<T>::_misses_stat = NULL;
+template<class T>
+StatisticAccumulator* ObjectPool<T>::_live_stat = NULL;
+
+// Declares operator new and delete for a class, using an ObjectPool.
+#define POOLED_ALLOCATION(CLASS)                                              \
+  static void* operator new(size_t size)                                      \
+  {                                                                           \
+    return ObjectPool<CLASS>::allocate(size);                                 \
+  }                                                                           \
+  static void operator delete(void* ptr, size_t size)                         \
+  {                                                                           \
+    ObjectPool<CLASS>::deallocate(ptr, size);                                 \
+  }
+
+#endif
@@ -42,33 +42,142 @@
 #include "rf.h"
 #include "message.hpp"
 #include "session_manager.hpp"
+#include "counter.h"
+#include "ccf_health.hpp"
+#include "acr_hedger.hpp"
+#include "ccf_window.hpp"
+#include "rtt_estimator.hpp"
+#include "acr_spool.hpp"
+#include "object_pool.hpp"
+
+class RalfTransaction;
 
 // A PeerMessageSender is responsible for ensuring that a connection is open
 // to either the primary or backup CCF, and once a connection has been opened,
 // sending the message to it.
+//
+// If hedging is enabled, an ACR that hasn't been answered within the hedge
+// threshold is also sent to the next CCF, and the first answer wins.  The
+// sender is then deleted once every transaction (and any hedge timer) has
+// finished with it.
 class PeerMessageSender
 {
 public:
-  PeerMessageSender(SAS::TrailId trail, const std::string& dest_realm);
+  PeerMessageSender(SAS::TrailId trail,
+                    const std::string& dest_realm,
+                    StatisticCounter* encodes_saved_stat = NULL,
+                    CcfHealthTracker* ccf_health = NULL,
+                    AcrHedger* hedger = NULL,
+                    CcfWindow* window = NULL,
+                    RttEstimator* rtt_estimator = NULL,
+                    RfAcrSpool* spool = NULL);
   virtual ~PeerMessageSender();
+
+  POOLED_ALLOCATION(PeerMessageSender)
+
   virtual void send(Message* msg,
                     SessionManager* sm,
                     Rf::Dictionary* dict,
                     Diameter::Stack* diameter_stack);
 
-  void send_cb(int result_cdoe, int interim_interval, std::string session_id);
+  // Called by a RalfTransaction when the CCF answers (or the send fails).
+  // @param attempt - Which send the transaction was for.
+  void send_cb(unsigned int attempt,
+               int result_code,
+               int interim_interval,
+               std::string session_id);
+
+  // Called by the AcrHedger when it's time to hedge.
+  void hedge();
+
+  // Called by the CcfWindow when a queued ACR can be sent (admitted is true)
+  // or has been shed (admitted is false).  Returns whether the space in the
+  // window was used.
+  virtual bool window_open(unsigned int attempt, bool admitted);
 
 private:
-  void int_send_msg();
+  // Starts sending the message to the next CCF, subject to the CCF window.
+  // Returns false if there are no more CCFs to try.
+  bool int_send_msg(bool hedge);
+
+  // Sends the message to a CCF, once there's space in its window.
+  void send_to_ccf(unsigned int which);
+
+  // Handles the CCF window refusing an ACR.
+  void not_sent(unsigned int attempt);
+
+  // Handles a failed attempt, failing over if allowed.
+  void attempt_failed(int result_code, bool failover);
+
+  // Whether the ACR can be spooled if no CCF answers.  STARTs aren't, as the
+  // SessionManager doesn't keep a session whose START failed, so a replayed
+  // START would open a session at the CDF that nothing ever closes.  Only
+  // valid while the message is.
+  bool spoolable();
+
+  // Drops a reference to this object, deleting it if it was the last one.
+  // Must be the last thing a caller does with this object.
+  void release();
 
   Message* _msg;
-  unsigned int _which;
+  uint32_t _accounting_record_number;
   std::vector<std::string> _ccfs;
   SessionManager* _sm;
   Rf::Dictionary* _dict;
   Diameter::Stack* _diameter_stack;
   SAS::TrailId _trail;
   const std::string _dest_realm;
+
+  // The ACR exactly as sent to the first CCF, if there are backup CCFs to try
+  // or it might be spooled.  Failovers and hedges resend it with a new
+  // Destination-Host rather than rebuilding it from the JSON.
+  std::string _encoded_acr;
+
+  // Counts ACRs sent on failover or hedge without being rebuilt.  Owned by
+  // the PeerMessageSenderFactory.  May be NULL.
+  StatisticCounter* _encodes_saved_stat;
+
+  // Tracks which CCFs are failing.  Owned by the PeerMessageSenderFactory.
+  // May be NULL.
+  CcfHealthTracker* _ccf_health;
+
+  // Hedges slow ACRs.  Owned by the PeerMessageSenderFactory.  May be NULL.
+  AcrHedger* _hedger;
+
+  // Limits the ACRs outstanding to each CCF.  Owned by the
+  // PeerMessageSenderFactory.  May be NULL.
+  CcfWindow* _window;
+
+  // Sets ACR timeouts from each CCF's round trip time.  Owned by the
+  // PeerMessageSenderFactory.  May be NULL.
+  RttEstimator* _rtt_estimator;
+
+  // Keeps ACRs that couldn't be delivered to any CCF.  Owned by the
+  // PeerMessageSenderFactory.  May be NULL.
+  RfAcrSpool* _spool;
+
+  // Protects the state below, which can be accessed by several transactions
+  // and the hedger's thread at once.
+  pthread_mutex_t _lock;
+
+  // The number of transactions and hedge timers that refer to this object.
+  int _refs;
+
+  // The number of transactions still waiting for an answer.
+  int _in_flight;
+
+  // Whether the SessionManager has been told the outcome.  Once it has, _msg
+  // is no longer valid.
+  bool _finished;
+
+  // The index of the next CCF to try.
+  unsigned int _next;
+
+  // Per send: the transaction (NULL once it has finished), when it was sent,
+  // and whether it was a hedge.
+  std::vector<RalfTransaction*> _tsxs;
+  std::vector<uint64_t> _sent_ms;
+  std::vector<bool> _hedges;
 };
 
 #endif /* PEER_MESSAGE_SENDER_HPP_ */
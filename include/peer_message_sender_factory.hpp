@@ -41,15 +41,69 @@
 class PeerMessageSenderFactory
 {
 public:
-  PeerMessageSenderFactory(const std::string& dest_realm) : _dest_realm(dest_realm) {};
+  // @param ccf_health - Tracks which CCFs are failing.  May be NULL.  The
+  //                      factory takes ownership of it.
+  // @param hedger     - Hedges slow ACRs.  May be NULL.  The factory takes
+  //                      ownership of it.
+  // @param window     - Limits the ACRs outstanding to each CCF.  May be
+  //                      NULL.  The factory takes ownership of it.
+  // @param rtt_estimator
+  //                    - Sets ACR timeouts from each CCF's round trip time.
+  //                      May be NULL.  The factory takes ownership of it.
+  // @param spool      - Keeps ACRs that couldn't be delivered to any CCF.
+  //                      May be NULL.  The factory takes ownership of it.
+  PeerMessageSenderFactory(const std::string& dest_realm,
+                           LastValueCache* stats_aggregator = NULL,
+                           CcfHealthTracker* ccf_health = NULL,
+                           AcrHedger* hedger = NULL,
+                           CcfWindow* window = NULL,
+                           RttEstimator* rtt_estimator = NULL,
+                           RfAcrSpool* spool = NULL) :
+    _dest_realm(dest_realm),
+    _encodes_saved_stat(NULL),
+    _ccf_health(ccf_health),
+    _hedger(hedger),
+    _window(window),
+    _rtt_estimator(rtt_estimator),
+    _spool(spool)
+  {
+    if (stats_aggregator != NULL)
+    {
+      _encodes_saved_stat = new StatisticCounter("ralf_acr_encodes_saved",
+                                                 stats_aggregator);
+    }
+  };
+
+  virtual ~PeerMessageSenderFactory()
+  {
+    delete _encodes_saved_stat; _encodes_saved_stat = NULL;
+    delete _ccf_health; _ccf_health = NULL;
+    delete _hedger; _hedger = NULL;
+    delete _window; _window = NULL;
+    delete _rtt_estimator; _rtt_estimator = NULL;
+    delete _spool; _spool = NULL;
+  }
 
   virtual PeerMessageSender* newSender(SAS::TrailId trail)
   {
-    return new PeerMessageSender(trail, _dest_realm);
+    return new PeerMessageSender(trail,
+                                 _dest_realm,
+                                 _encodes_saved_stat,
+                                 _ccf_health,
+                                 _hedger,
+                                 _window,
+                                 _rtt_estimator,
+                                 _spool);
   }
 
 private:
   const std::string _dest_realm;
+  StatisticCounter* _encodes_saved_stat;
+  CcfHealthTracker* _ccf_health;
+  AcrHedger* _hedger;
+  CcfWindow* _window;
+  RttEstimator* _rtt_estimator;
+  RfAcrSpool* _spool;
 };
 
 
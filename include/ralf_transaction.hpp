@@ -36,9 +36,13 @@
 #ifndef RALF_TRANSACTION_HPP_
 #define RALF_TRANSACTION_HPP_
 
+#include <atomic>
+
 #include "diameterstack.h"
 #include "message.hpp"
 #include "peer_message_sender.hpp"
+#include "rtt_estimator.hpp"
+#include "object_pool.hpp"
 #include "sas.h"
 
 class RalfTransaction: public Diameter::Transaction
@@ -49,16 +53,40 @@ public:
   RalfTransaction(Diameter::Dictionary* dict,
                   PeerMessageSender* peer_sender,
                   Message* msg,
-                  SAS::TrailId trail) :
+                  SAS::TrailId trail,
+                  unsigned int attempt = 0,
+                  RttEstimator* rtt_estimator = NULL,
+                  const std::string& ccf = "") :
     Diameter::Transaction(dict, trail),
     _peer_sender(peer_sender),
-    _msg(msg)
+    _msg(msg),
+    _attempt(attempt),
+    _cancelled(false),
+    _rtt_estimator(rtt_estimator),
+    _ccf(ccf),
+    _start_us((rtt_estimator != NULL) ? rtt_estimator->now_us() : 0)
   {
   };
 
+  POOLED_ALLOCATION(RalfTransaction)
+
+  // Called when another transaction for the same ACR has been answered
+  // first.  The CCF may still answer this one, but the answer is ignored.
+  void cancel() { _cancelled = true; }
+
 private:
   PeerMessageSender* _peer_sender;
   Message* _msg;
+
+  // Which send of the ACR this is for.
+  unsigned int _attempt;
+  std::atomic<bool> _cancelled;
+
+  // Estimates the CCF's round trip time, from the time this transaction was
+  // created until the answer.  May be NULL.
+  RttEstimator* _rtt_estimator;
+  const std::string _ccf;
+  const uint64_t _start_us;
 };
 
 
@@ -40,9 +40,13 @@
 #include <freeDiameter/freeDiameter-host.h>
 #include <freeDiameter/libfdcore.h>
 #include <rapidjson/document.h>
+#include <pthread.h>
+#include <atomic>
 #include <string>
+#include <unordered_map>
 
 #include "diameterstack.h"
+#include "statistic.h"
 #include "log.h"
 
 namespace Rf {
@@ -66,11 +70,67 @@ private:
 class Dictionary : public Diameter::Dictionary
 {
 public:
-  Dictionary();
+  // @param max_unknown_avps - The most names that aren't in the dictionary to
+  //                            cache.
+  Dictionary(LastValueCache* stats_aggregator = NULL,
+             size_t max_unknown_avps = DEFAULT_MAX_UNKNOWN_AVPS);
+  ~Dictionary();
   const Diameter::Dictionary::Application RF;
   const Diameter::Dictionary::Vendor TGPP;
   const Diameter::Dictionary::Message ACCOUNTING_REQUEST;
   const Diameter::Dictionary::Message ACCOUNTING_RESPONSE;
+  const Diameter::Dictionary::AVP DESTINATION_HOST_AVP;
+  const Diameter::Dictionary::AVP DESTINATION_REALM_AVP;
+  const Diameter::Dictionary::AVP ACCOUNTING_RECORD_NUMBER_AVP;
+
+  // Find the dictionary entry for an AVP in the Rf vendors, or NULL if there
+  // isn't one.  The result is cached, so only the first lookup of each name
+  // searches the dictionary.  The names come from request bodies, so only
+  // the first max_unknown_avps names that aren't in the dictionary are
+  // cached.  Safe to call from multiple threads.
+  const Diameter::Dictionary::AVP* lookup_avp(const std::string& name) const;
+
+  // As lookup_avp, but throws Diameter::Stack::Exception if the AVP isn't in
+  // the dictionary.
+  const Diameter::Dictionary::AVP& find_avp(const std::string& name) const;
+
+  // As lookup_avp, but if the AVP isn't in the dictionary, counts it as left
+  // out of a message.
+  const Diameter::Dictionary::AVP* lookup_avp_or_ignore(const std::string& name) const;
+
+  // Reports how many times each AVP has been left out of a message in the
+  // ralf_ignored_avps statistic, if that's changed since it was last
+  // reported.  AVPs whose names aren't cached are reported together as
+  // "(other)".
+  void report_ignored() const;
+
+  // The number of times an AVP has been ignored.  AVPs whose names aren't
+  // cached share one count.
+  uint64_t ignored_count(const std::string& name) const;
+
+  static const size_t DEFAULT_MAX_UNKNOWN_AVPS = 1000;
+
+private:
+  struct CachedAVP
+  {
+    // NULL if the AVP isn't in the dictionary.
+    Diameter::Dictionary::AVP* avp;
+    std::atomic<uint64_t> ignored;
+  };
+
+  CachedAVP* lookup(const std::string& name) const;
+
+  mutable pthread_rwlock_t _avps_lock;
+  mutable std::unordered_map<std::string, CachedAVP*> _avps;
+
+  // The number of names in the cache that aren't in the dictionary, and the
+  // entry shared by names that couldn't be cached.
+  const size_t _max_unknown_avps;
+  mutable size_t _unknown_avps;
+  mutable CachedAVP _uncached_avp;
+
+  Statistic* _ignored_stat;
+  mutable std::atomic<bool> _ignored_changed;
 };
 
 class AccountingRequest : public Diameter::Message
@@ -85,6 +145,31 @@ public:
                     const rapidjson::Value& contents);
   inline AccountingRequest(Diameter::Message& msg) : Diameter::Message(msg) {};
   ~AccountingRequest();
+
+  // Encode this request so that it can be sent again (e.g. to a backup CCF)
+  // without being rebuilt.  Returns false if it can't be encoded.
+  bool encode(std::string& encoded) const;
+
+  // Rebuild an encoded request for sending to a different Destination-Host.
+  // The request is marked as a potential retransmission.  Returns NULL if the
+  // request can't be rebuilt.  The caller owns the returned message.
+  static Diameter::Message* retarget(const Dictionary* dict,
+                                     Diameter::Stack* diameter_stack,
+                                     const std::string& encoded,
+                                     const std::string& dest_host);
+
+  // Patch a copy of an encoded request for sending to a different
+  // Destination-Host, without parsing its AVPs.  Everything else, including
+  // the Session-Id and End-to-End identifier, is unchanged.  Returns false if
+  // the encoding has no Destination-Host AVP.
+  static bool retarget_encoded(const std::string& encoded,
+                               const std::string& dest_host,
+                               std::string& retargeted);
+
+  // Get the Session-Id of an encoded request, without parsing its other
+  // AVPs.  Returns false if the encoding has no Session-Id AVP.
+  static bool encoded_session_id(const std::string& encoded,
+                                 std::string& session_id);
 };
 
 class AccountingResponse : public Diameter::Message
@@ -0,0 +1,114 @@
+/**
+ * @file rtt_estimator.hpp Estimates each CCF's round trip time, to set ACR timeouts.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef RTT_ESTIMATOR_HPP_
+#define RTT_ESTIMATOR_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+
+#include "statistic.h"
+
+// Estimates the round trip time to each CCF, in the same way as TCP estimates
+// its retransmission timeout (RFC 6298), and uses it to set the timeout on
+// ACRs.  This means we fail over from a CCF that has stopped answering in a
+// small multiple of its normal latency, rather than after the Diameter
+// stack's static timeout.
+//
+// The timeout is the smoothed RTT plus four times its variance, bounded by
+// the configured minimum and maximum.  Each timeout doubles the CCF's timeout
+// (up to the maximum) until it answers again.
+//
+// The estimates are reported per CCF in the ralf_ccf_rtt statistic, as rows
+// of CCF, smoothed RTT (us), RTT variance (us) and timeout (ms).
+//
+// The estimator is shared by all PeerMessageSenders, and is thread-safe.
+class RttEstimator
+{
+public:
+  RttEstimator(int min_timeout_ms,
+               int max_timeout_ms,
+               LastValueCache* stats_aggregator = NULL);
+  virtual ~RttEstimator();
+
+  // Record that a CCF answered an ACR in rtt_us.
+  void sample(const std::string& ccf, uint64_t rtt_us);
+
+  // Record that an ACR to a CCF timed out.
+  void timed_out(const std::string& ccf);
+
+  // The timeout to use for an ACR to a CCF.  This is the maximum until the
+  // CCF has answered.
+  unsigned int timeout_ms(const std::string& ccf);
+
+  uint64_t srtt_us(const std::string& ccf);
+  uint64_t rttvar_us(const std::string& ccf);
+
+  // The current time in microseconds.  Virtual so that UT can control time.
+  virtual uint64_t now_us();
+
+private:
+  struct Estimate
+  {
+    Estimate() : srtt_us(0), rttvar_us(0), timeout_ms(0) {}
+
+    uint64_t srtt_us;
+    uint64_t rttvar_us;
+    unsigned int timeout_ms;
+  };
+
+  // Recalculate a CCF's timeout after a sample.  Must be called with the
+  // lock held.
+  void update_timeout(Estimate& estimate);
+
+  // Report the estimates, at most once a second.
+  void report();
+
+  const unsigned int _min_timeout_ms;
+  const unsigned int _max_timeout_ms;
+
+  pthread_mutex_t _lock;
+  std::unordered_map<std::string, Estimate> _estimates;
+
+  Statistic* _rtt_stat;
+  std::atomic<time_t> _reported;
+};
+
+#endif
@@ -0,0 +1,129 @@
+/**
+ * @file session_cache.hpp In-process cache of deserialized sessions.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SESSION_CACHE_HPP_
+#define SESSION_CACHE_HPP_
+
+#include <pthread.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "session_store.h"
+#include "counter.h"
+
+// A bounded, sharded, least-recently-used cache of deserialized sessions,
+// keyed on the session's store key.  Each entry holds the CAS of the stored
+// record it corresponds to, or 0 if that isn't known (which is the case after
+// we've written the record ourselves - the store doesn't tell us the new CAS).
+//
+// The cache is thread-safe.  Each shard has its own lock and LRU list, and
+// its own share of the memory cap.
+//
+// If a statistics aggregator is supplied, the cache reports
+// ralf_session_cache_hits, ralf_session_cache_misses and
+// ralf_session_cache_evictions.
+class SessionCache
+{
+public:
+  // @param max_bytes        - The (approximate) maximum memory to use for
+  //                           cached sessions.
+  // @param num_shards       - The number of shards.
+  // @param stats_aggregator - Statistics aggregator.  May be NULL.
+  SessionCache(size_t max_bytes,
+               unsigned int num_shards = DEFAULT_NUM_SHARDS,
+               LastValueCache* stats_aggregator = NULL);
+  ~SessionCache();
+
+  // Looks up a session.  Returns a copy of the session (which the caller must
+  // delete) and fills in its CAS, or NULL if the session isn't cached.
+  //
+  // @param require_cas - If set, an entry whose CAS isn't known is treated as
+  //                      a miss.
+  SessionStore::Session* get(const std::string& key,
+                             uint64_t& cas,
+                             bool require_cas = true);
+
+  // Adds or replaces a session in the cache.
+  void put(const std::string& key,
+           const SessionStore::Session& session,
+           uint64_t cas);
+
+  // Removes a session from the cache.
+  void invalidate(const std::string& key);
+
+  // The approximate memory currently used for cached sessions.
+  size_t size_bytes();
+
+  static const unsigned int DEFAULT_NUM_SHARDS = 16;
+
+private:
+  struct Entry
+  {
+    std::string key;
+    SessionStore::Session session;
+    uint64_t cas;
+    size_t size;
+  };
+
+  struct Shard
+  {
+    Shard() : bytes(0) { pthread_mutex_init(&lock, NULL); }
+    ~Shard() { pthread_mutex_destroy(&lock); }
+
+    pthread_mutex_t lock;
+
+    // Most recently used entries are at the front.
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t bytes;
+  };
+
+  Shard* shard_for(const std::string& key);
+  static size_t entry_size(const std::string& key,
+                           const SessionStore::Session& session);
+
+  std::vector<Shard*> _shards;
+  size_t _max_shard_bytes;
+  std::hash<std::string> _hash;
+
+  StatisticCounter* _hit_stat;
+  StatisticCounter* _miss_stat;
+  StatisticCounter* _eviction_stat;
+};
+
+#endif
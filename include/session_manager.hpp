@@ -41,8 +41,13 @@
 #include "chronosconnection.h"
 #include "rf.h"
 #include "health_checker.h"
+#include "counter.h"
 
 class PeerMessageSenderFactory;
+class CcfResponsePool;
+class TaskPool;
+class AsyncTimerClient;
+class SessionReplicator;
 
 class SessionManager
 {
@@ -53,37 +58,122 @@ public:
                  PeerMessageSenderFactory* factory,
                  ChronosConnection* timer_conn,
                  Diameter::Stack* diameter_stack,
-                 HealthChecker* hc): _local_store(local_store),
-                                     _remote_stores(remote_stores),
-                                     _timer_conn(timer_conn),
-                                     _dict(dict),
-                                     _factory(factory),
-                                     _diameter_stack(diameter_stack),
-                                     _health_checker(hc) {};
-  ~SessionManager() {};
+                 HealthChecker* hc,
+                 LastValueCache* stats_aggregator = NULL);
+  ~SessionManager();
   void handle(Message* msg);
   void on_ccf_response (bool accepted, uint32_t interim_interval, std::string session_id, int rc, Message* msg);
 
+  // Processes a CCF's answer.  Called from on_ccf_response, or from the
+  // CcfResponsePool's threads if the answer was queued.
+  void process_ccf_response(bool accepted, uint32_t interim_interval, std::string session_id, int rc, Message* msg);
+
+  // Sets the pool that CCF answers are queued to, so that they aren't
+  // processed on the Diameter stack's threads.  May be NULL.
+  void set_response_pool(CcfResponsePool* response_pool) { _response_pool = response_pool; }
+
+  // Sets the pool used to create a new session's timer while the session is
+  // written to the stores, and to look a session up in the remote stores in
+  // parallel.  May be NULL.
+  void set_task_pool(TaskPool* task_pool) { _task_pool = task_pool; }
+
+  // Sets the client used to send timer requests to Chronos without waiting
+  // for the answer.  If NULL, the ChronosConnection is used directly.
+  void set_timer_client(AsyncTimerClient* timer_client) { _timer_client = timer_client; }
+
+  // Sets whether Chronos timers are only updated when their schedule changes
+  // or they are about to stop popping.
+  void set_lazy_timer_updates(bool lazy) { _lazy_timer_updates = lazy; }
+
+  // Sets the maximum jitter applied to timer intervals, as a percentage of
+  // the interval.  Each session's timer pops a fixed amount early, derived
+  // from the session's identifiers, so sessions that start together don't
+  // keep generating INTERIMs together.
+  void set_timer_jitter(unsigned int percent) { _timer_jitter = percent; }
+
+  // Sets the replicators for the remote sites.  If there are any, sessions
+  // are written to the remote sites by the replicators, in the background,
+  // rather than while processing each request.  Sessions are still read
+  // from the remote stores directly if they aren't in the local store.
+  void set_replicators(std::vector<SessionReplicator*> replicators) { _replicators = replicators; }
+
+  // Sets how long to wait for the remote stores when looking up a session
+  // that isn't in the local store.  Only applies if there's a task pool.
+  void set_remote_lookup_timeout(unsigned int timeout_ms) { _remote_lookup_timeout_ms = timeout_ms; }
+
+  static const unsigned int DEFAULT_REMOTE_LOOKUP_TIMEOUT_MS = 500;
+
 private:
   std::string create_opaque_data(Message* msg);
   void update_timer_id(Message* msg, std::string timer_id);
-  void send_chronos_update(std::string& timer_id,
-                           uint32_t interim_interval,
-                           uint32_t session_refresh_time,
-                           const std::string& callback_uri,
-                           const std::string& opaque_data,
-                           SAS::TrailId trail);
+  void update_timer_id(const std::string& call_id,
+                       role_of_node_t role,
+                       node_functionality_t function,
+                       SAS::TrailId trail,
+                       const std::string& old_timer_id,
+                       const std::string& timer_id,
+                       uint32_t timer_interval = 0,
+                       uint32_t timer_expiry = 0);
+  void set_start_timer_id(const std::string& call_id,
+                          role_of_node_t role,
+                          node_functionality_t function,
+                          SAS::TrailId trail,
+                          const std::string& timer_id);
+  uint32_t jittered_interval(Message* msg, uint32_t interim_interval);
+  void update_timer(Message* msg, uint32_t interim_interval);
+  bool timer_update_needed(Message* msg, uint32_t interim_interval, uint32_t now);
+  HTTPCode send_chronos_update(std::string& timer_id,
+                               uint32_t interim_interval,
+                               uint32_t session_refresh_time,
+                               const std::string& callback_uri,
+                               const std::string& opaque_data,
+                               SAS::TrailId trail);
   void sas_log_ccf_response(bool accepted,
                             const std::string& session_id,
                             Message* msg);
+  SessionStore::Session* find_remote_session(Message* msg);
+  void replicate(const std::string& call_id,
+                 role_of_node_t role,
+                 node_functionality_t function,
+                 SessionStore::Session* sess,
+                 bool new_session,
+                 SAS::TrailId trail);
+  void replicate_delete(const std::string& call_id,
+                        role_of_node_t role,
+                        node_functionality_t function,
+                        SAS::TrailId trail);
+  void contention_hit(const std::string& call_id);
 
   SessionStore* _local_store;
   std::vector<SessionStore*> _remote_stores;
+  std::vector<SessionReplicator*> _replicators;
   ChronosConnection* _timer_conn;
   Rf::Dictionary* _dict;
   PeerMessageSenderFactory* _factory;
   Diameter::Stack* _diameter_stack;
   HealthChecker* _health_checker;
+  CcfResponsePool* _response_pool;
+  TaskPool* _task_pool;
+  AsyncTimerClient* _timer_client;
+  bool _lazy_timer_updates;
+  unsigned int _timer_jitter;
+  unsigned int _remote_lookup_timeout_ms;
+
+  // Counts CAS contention when writing sessions to the local store.
+  StatisticCounter* _contention_hit_stat;
+
+  // Count the timer updates sent to Chronos, and those skipped because the
+  // timer was up to date.
+  StatisticCounter* _timer_updates_sent_stat;
+  StatisticCounter* _timer_updates_skipped_stat;
+
+  // Count where sessions for INTERIMs and STOPs are found: in the local store,
+  // in a remote store (so the session has failed over from another site), or
+  // nowhere.  Lookups in the remote stores that time out count as misses too.
+  StatisticCounter* _local_hits_stat;
+  StatisticCounter* _remote_hits_stat;
+  StatisticCounter* _misses_stat;
+  StatisticCounter* _remote_timeouts_stat;
 };
 
 #endif /* SESSION_MANAGER_HPP_ */
@@ -0,0 +1,207 @@
+/**
+ * @file session_replicator.hpp Asynchronous replication of sessions to a remote site
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef SESSION_REPLICATOR_HPP_
+#define SESSION_REPLICATOR_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "session_store.h"
+#include "accumulator.h"
+#include "counter.h"
+#include "sas.h"
+
+// Replicates session changes to a remote site's store on its own thread, so
+// that requests don't wait for cross-site round trips.
+//
+// Changes are queued as a copy of the session as it was written locally (or
+// a deletion).  A change to a session that is already queued replaces the
+// queued change, so a busy session is only written to the remote site once
+// per batch.  The replicator's thread takes up to MAX_BATCH changes at a time
+// and shares them out between its writer threads, so that the round trips to
+// the remote site overlap.  The changes in a batch are all to different
+// sessions, and the next batch isn't taken until they've all been written,
+// so changes to a session are still written in order.
+//
+// A change that created the session is written without reading the remote
+// site's copy first, falling back to reading and merging if the session
+// already exists there.  Sessions that the remote site has also updated keep
+// the higher of the two accounting record numbers.
+//
+// Lag is bounded in two ways: no more than max_queue sessions can have
+// changes queued, and a change that has been queued for longer than
+// max_lag_ms is dropped rather than written.  Either way the remote site
+// misses the change, as it would have done if it was uncontactable.
+//
+// The replicators for all sites share one set of statistics:
+// - ralf_replication_queue_depth - Sessions with changes queued, on each
+//                                  change.
+// - ralf_replication_lag_ms      - How long each change was queued for.
+// - ralf_replication_coalesced   - Changes that replaced a queued change.
+// - ralf_replication_dropped     - Changes dropped because the queue was full
+//                                  or they were too old.
+// - ralf_replication_failed      - Changes that couldn't be written.
+class SessionReplicator
+{
+public:
+  // The statistics, shared by the replicators for all sites.
+  class Stats
+  {
+  public:
+    Stats(LastValueCache* stats_aggregator);
+    ~Stats();
+
+    StatisticAccumulator* depth;
+    StatisticAccumulator* lag_ms;
+    StatisticCounter* coalesced;
+    StatisticCounter* dropped;
+    StatisticCounter* failed;
+  };
+
+  // @param store            - The remote site's store.
+  // @param site             - The remote site's name, for logs.
+  // @param max_queue        - Maximum sessions to queue changes for.
+  // @param max_lag_ms       - Maximum time to queue a change for.
+  // @param stats            - Statistics.  May be NULL.
+  // @param num_writers      - The number of threads writing changes to the
+  //                           remote site, including the replicator's own.
+  SessionReplicator(SessionStore* store,
+                    const std::string& site,
+                    size_t max_queue,
+                    uint64_t max_lag_ms,
+                    Stats* stats = NULL,
+                    unsigned int num_writers = 1);
+  virtual ~SessionReplicator();
+
+  bool start();
+
+  // Stops the replicator's thread, once the queued changes have been written.
+  void stop();
+
+  // Queue a session to be written to the remote site, or deleted from it.
+  // new_session is set if the session has just been created locally.
+  void replicate(const std::string& call_id,
+                 role_of_node_t role,
+                 node_functionality_t function,
+                 const SessionStore::Session* session,
+                 bool new_session,
+                 SAS::TrailId trail);
+  void replicate_delete(const std::string& call_id,
+                        role_of_node_t role,
+                        node_functionality_t function,
+                        SAS::TrailId trail);
+
+  // The number of sessions with changes queued.
+  size_t depth();
+
+  // Writes the next batch of queued changes.  Returns the number of changes
+  // written or dropped.  Called on the replicator's thread.
+  size_t write_batch();
+
+  const std::string& site() const { return _site; }
+
+  static const size_t MAX_BATCH = 100;
+
+protected:
+  // The monotonic time in milliseconds.  Virtual so the UTs can control time.
+  virtual uint64_t now_ms();
+
+private:
+  struct Change
+  {
+    std::string call_id;
+    role_of_node_t role;
+    node_functionality_t function;
+
+    // If false, the session is deleted.
+    bool write;
+    bool new_session;
+    SessionStore::Session session;
+    SAS::TrailId trail;
+    uint64_t queued_ms;
+  };
+
+  static void* thread_fn(void* replicator);
+  void thread();
+  static void* writer_thread_fn(void* replicator);
+  void writer_thread();
+
+  // Queues a change, replacing any queued change for the same session.
+  void queue(Change& change);
+
+  // Writes a batch of changes, with the help of the writer threads.
+  void write_changes(std::vector<Change>& batch);
+
+  // Writes a change to the remote store (or drops it if it's too old).
+  void write_one(const Change& change);
+  Store::Status write_change(const Change& change);
+
+  SessionStore* _store;
+  const std::string _site;
+  const size_t _max_queue;
+  const uint64_t _max_lag_ms;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  pthread_t _thread;
+  bool _running;
+
+  // The sessions with changes queued, in the order they were first queued,
+  // and their changes.
+  std::deque<std::string> _order;
+  std::unordered_map<std::string, Change> _changes;
+
+  Stats* _stats;
+
+  // The batch being written, the next change in it for a writer to take, and
+  // how many of its changes haven't been written yet.
+  const unsigned int _num_writers;
+  pthread_mutex_t _batch_lock;
+  pthread_cond_t _batch_cond;
+  pthread_cond_t _batch_done_cond;
+  std::vector<pthread_t> _writers;
+  bool _writers_running;
+  std::vector<Change>* _batch;
+  size_t _batch_next;
+  size_t _batch_unfinished;
+};
+
+#endif
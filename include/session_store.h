@@ -39,9 +39,13 @@
 
 #include <string>
 #include <vector>
+#include <time.h>
 
 #include "store.h"
 #include "message.hpp"
+#include "counter.h"
+
+class SessionCache;
 
 class SessionStore
 {
@@ -72,16 +76,53 @@ public:
     // The interim interval time for this session as specified in the Diameter Acct-Interim-Interval AVP.
     uint32_t interim_interval;
 
+    // The schedule last set on the Chronos timer: its interval, and when (in
+    // seconds since the epoch) it stops popping.  Only kept if timer updates
+    // are lazy, otherwise 0.
+    uint32_t timer_interval = 0;
+    uint32_t timer_expiry = 0;
+
+    // When (in seconds since the epoch) the session expires unless it is
+    // refreshed.  Only kept if timer updates are lazy, otherwise 0.
+    uint32_t session_expiry = 0;
+
+    // While the START that created the session is waiting for Chronos to
+    // return its timer ID, timer_id is NO_TIMER and this is when (in seconds
+    // since the epoch) to stop waiting for it.  Otherwise 0.
+    uint32_t timer_pending_until = 0;
+
   private:
     // CAS value for this Session.  Used to guarantee consistency
     // between memcached instances.
     uint64_t _cas;
 
+    // When the accounting record number is stored separately from the rest
+    // of the session, _cas is the CAS of the record number, and these hold
+    // the CAS of the rest of the session (0 if unknown), its serialized form
+    // when it was read, and when it expires.
+    uint64_t _body_cas;
+    std::string _body_data;
+    time_t _body_expiry;
+
+    // Whether the session was read from the split layout, in which case it
+    // must be written back in that layout.
+    bool _split_layout = false;
+
     // The SessionStore will set/read the _cas value but no-one else
     // should.
     friend class SessionStore;
   };
 
+  /// The formats that sessions can be stored in.  The format of a record is
+  /// identified from its first byte.
+  enum Format
+  {
+    FORMAT_BINARY = 0,
+    FORMAT_JSON,
+    FORMAT_COMPACT,
+    NUM_FORMATS
+  };
+
   /// Interface used by the SessionStore to serialize sessions from C++ objects
   /// to the format used in the store, and deserialize them.
   ///
@@ -109,6 +150,9 @@ public:
 
     /// @return the name of this (de)serializer.
     virtual std::string name() = 0;
+
+    /// @return the format this (de)serializer reads and writes.
+    virtual Format format() = 0;
   };
 
   /// A (de)serializer for the (deprecated) custom binary format.
@@ -120,6 +164,7 @@ public:
     std::string serialize_session(Session *data);
     Session* deserialize_session(const std::string& data);
     std::string name();
+    Format format() { return FORMAT_BINARY; }
   };
 
   /// A (de)serializer for the JSON format.
@@ -131,23 +176,67 @@ public:
     std::string serialize_session(Session *data);
     Session* deserialize_session(const std::string& data);
     std::string name();
+    Format format() { return FORMAT_JSON; }
   };
 
+  /// A (de)serializer for the compact binary format.
+  ///
+  /// Records start with a magic byte and a version byte.  Integers are
+  /// encoded as little-endian base-128 varints, and strings as a varint length
+  /// followed by the string's bytes, so records are independent of the
+  /// host's endianness and word size.
+  class CompactSerializerDeserializer : public SerializerDeserializer
+  {
+  public:
+    ~CompactSerializerDeserializer() {};
+
+    std::string serialize_session(Session *data);
+    Session* deserialize_session(const std::string& data);
+    std::string name();
+    Format format() { return FORMAT_COMPACT; }
+
+    static const uint8_t MAGIC = 0xC5;
+    static const uint8_t VERSION = 3;
+  };
+
+  /// The accounting record number written in the body of a session stored
+  /// in the split layout.  Real record numbers start at 1, so a body holding
+  /// this marks the layout, and tells every node (whether or not it splits
+  /// record numbers itself) to look for the record number separately.
+  static const uint32_t SPLIT_LAYOUT_RECORD_NUMBER = 0;
+
   /// Constructor that allows the user to specify which serializer and
   /// deserializers to use.
   ///
   /// @param store              - Pointer to the underlying data store.
   /// @param serializer         - The serializer to use when writing records.
   ///                             The SessionStore takes ownership of it.
-  /// @param deserializer       - A vector of deserializers to try when reading
-  ///                             records. The order of this vector is
-  ///                             important - each deserializer is
-  ///                             tried in turn until one successfully parses
-  ///                             the record. The SessionStore takes ownership
-  ///                             of the entries in the vector.
+  /// @param deserializer       - A vector of deserializers to use when
+  ///                             reading records. Each record is passed to
+  ///                             the deserializer for the format identified
+  ///                             by its first byte; if there's more than one
+  ///                             for a format, the first in the vector is
+  ///                             used. The SessionStore takes ownership of
+  ///                             the entries in the vector.
+  /// @param cache              - In-process cache of session bodies to
+  ///                             consult before the store.  May be NULL.
+  ///                             Only used with split_record_number - the
+  ///                             store doesn't tell us the CAS of a record
+  ///                             we've written, so a cached whole session
+  ///                             could never be written back.  The
+  ///                             SessionStore does not take ownership of it.
+  /// @param stats_aggregator   - Statistics aggregator, used to count the
+  ///                             records read in each format.  May be NULL.
+  /// @param split_record_number - Whether to store the accounting record
+  ///                             number separately from the rest of the
+  ///                             session, so that INTERIMs only need to write
+  ///                             the record number.
   SessionStore(Store *store,
                SerializerDeserializer*& serializer,
-               std::vector<SerializerDeserializer*>& deserializers);
+               std::vector<SerializerDeserializer*>& deserializers,
+               SessionCache* cache = NULL,
+               LastValueCache* stats_aggregator = NULL,
+               bool split_record_number = false);
 
   /// Alternative constructor that creates a SessionStore with just the default
   /// (de)serializer.
@@ -188,19 +277,72 @@ public:
                                     const node_functionality_t function,
                                     SAS::TrailId trail);
 
+  // The key that the session for this call ID, role and function is stored
+  // under.
+  static std::string create_key(const std::string& call_id,
+                                const role_of_node_t role,
+                                const node_functionality_t function);
+
+  // FNV-1a hash of a string.  Unlike std::hash, this is the same on every
+  // build, so nodes can compare the values they work out.
+  static uint64_t hash_body(const std::string& body);
+
 private:
   // Serialise a session to a string, ready to store in the DB.
   std::string serialize_session(Session *session);
   Session* deserialize_session(const std::string& s);
 
-  std::string create_key(const std::string& call_id,
-                         const role_of_node_t role,
-                         const node_functionality_t function);
+  Session* read_session(const std::string& call_id,
+                        const std::string& key,
+                        uint64_t& cas,
+                        SAS::TrailId trail);
+
+  // Read and write sessions whose accounting record number is stored
+  // separately.
+  Session* get_split_session_data(const std::string& call_id,
+                                  const std::string& key,
+                                  SAS::TrailId trail);
+  Store::Status set_split_session_data(const std::string& key,
+                                       Session* session,
+                                       bool new_session,
+                                       SAS::TrailId trail);
+  std::string serialize_body(Session* session);
+
+  // The contents of a record number record in the split layout.
+  struct RecordNumber
+  {
+    uint32_t acct_record_number;
+    time_t body_expiry;
+    uint64_t body_hash; // 0 if not known.
+    bool has_session_expiry;
+    uint32_t session_expiry;
+    uint64_t cas;
+  };
+
+  Store::Status read_record_number(const std::string& key,
+                                   RecordNumber& arn,
+                                   SAS::TrailId trail);
+  Session* apply_record_number(Session* session,
+                               uint64_t body_cas,
+                               const RecordNumber* arn);
+
+  // Identify the format of a record from its first byte.
+  static Format detect_format(const std::string& s);
+
+  void init_deserializers(LastValueCache* stats_aggregator);
 
   Store* _store;
 
   SerializerDeserializer* _serializer;
   std::vector<SerializerDeserializer*> _deserializers;
+
+  // The deserializer to use for each format (or NULL if there isn't one),
+  // and the number of records read in each format.
+  SerializerDeserializer* _format_deserializers[NUM_FORMATS];
+  StatisticCounter* _format_read_stats[NUM_FORMATS];
+
+  SessionCache* _cache;
+  bool _split_record_number;
 };
 
 #endif
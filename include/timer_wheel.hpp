@@ -0,0 +1,281 @@
+/**
+ * @file timer_wheel.hpp In-process timer service for interim timers
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef TIMER_WHEEL_HPP_
+#define TIMER_WHEEL_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "chronosconnection.h"
+#include "store.h"
+#include "accumulator.h"
+#include "counter.h"
+#include "sas.h"
+
+// Runs interim timers in-process, rather than in Chronos.  It has the same
+// interface as ChronosConnection, so the session manager can use either, but
+// when a timer pops its callback is called directly rather than Chronos
+// sending an HTTP request back to Ralf.  Timers are not replicated to other
+// Ralfs, so this is only suitable for single-site deployments.
+//
+// Timers are kept in a hierarchical timing wheel: four levels of 256 slots,
+// where each slot on the lowest level covers one tick, and each slot on the
+// levels above covers a whole turn of the level below.  Arming, updating and
+// cancelling a timer are O(1), and timers move down a level at most three
+// times before they pop.  The wheel's thread advances it every tick.
+//
+// If a store is given, each timer is written to it (in the "timer" table,
+// keyed by timer ID), along with an index of this node's timers sharded over
+// NUM_INDEX_SHARDS records.  Each shard's timer IDs are written to a new
+// record (in the "timer_index_ids" table) and then the shard's own record (in
+// the "timer_index" table, keyed by node ID and shard) is pointed at it, so
+// that updating a shard only reads the small pointer record for its CAS.
+// Changes are written in batches every FLUSH_INTERVAL_MS on a separate
+// thread, so neither arming nor popping a timer waits for the store, but the
+// last batch may be lost if Ralf crashes.  On start-up the timers in the index
+// are re-armed, and pop at the next point in their schedule.  Pops that were
+// due while Ralf was down are not caught up.
+//
+// The wheel reports the following statistics:
+// - ralf_timer_wheel_timers - Armed timers, on each tick that pops any.
+// - ralf_timer_wheel_pops   - Timers popped.
+class TimerWheel : public ChronosConnection
+{
+public:
+  // Called on the wheel's thread when a timer pops, with the callback URI and
+  // body it was armed with.  It should pass the pop on to another thread
+  // rather than process it, and return false if it can't, in which case the
+  // pop is offered again on the next tick.
+  typedef std::function<bool(const std::string& callback_uri,
+                             const std::string& opaque_data)> PopCallback;
+
+  // @param pop_callback     - Called when a timer pops.
+  // @param store            - Store to keep the timers in, so that they survive
+  //                           restarts.  May be NULL.
+  // @param node_id          - Identifies this node's timers in the store.
+  // @param stats_aggregator - Statistics aggregator.  May be NULL.
+  TimerWheel(PopCallback pop_callback,
+             Store* store,
+             const std::string& node_id,
+             LastValueCache* stats_aggregator = NULL);
+  virtual ~TimerWheel();
+
+  // Re-arms any timers left in the store by a previous run, and starts the
+  // wheel's thread and the thread that writes timers to the store.
+  bool start();
+  void stop();
+
+  using ChronosConnection::send_post;
+  using ChronosConnection::send_put;
+
+  // Arms a timer that pops every timer_interval seconds until repeat_for
+  // seconds have passed.  post_identity is set to the new timer's ID.  Tags
+  // are ignored.
+  virtual HTTPCode send_post(std::string& post_identity,
+                             uint32_t timer_interval,
+                             uint32_t repeat_for,
+                             const std::string& callback_uri,
+                             const std::string& opaque_data,
+                             SAS::TrailId trail,
+                             const std::map<std::string, uint32_t>& tags);
+
+  // Re-arms a timer from now, creating it if it doesn't exist.
+  virtual HTTPCode send_put(std::string& put_identity,
+                            uint32_t timer_interval,
+                            uint32_t repeat_for,
+                            const std::string& callback_uri,
+                            const std::string& opaque_data,
+                            SAS::TrailId trail,
+                            const std::map<std::string, uint32_t>& tags);
+
+  // Cancels a timer.  Returns HTTP_NOT_FOUND if it doesn't exist.
+  virtual HTTPCode send_delete(const std::string& delete_identity,
+                               SAS::TrailId trail);
+
+  // The number of armed timers.
+  size_t size();
+
+  // Pops the timers that are due at the given time.  Called on the wheel's
+  // thread.
+  void advance(uint64_t now_ms);
+
+  // Writes changed timers to the store.  Called on the flush thread.
+  void flush();
+
+  // Re-arms the timers in the store.  Called by start().
+  void recover();
+
+  // Build and parse timer records in the store.  Times are wall clock times
+  // in milliseconds.
+  static std::string make_record(uint64_t interval_ms,
+                                 uint64_t first_pop_ms,
+                                 uint64_t end_ms,
+                                 const std::string& callback_uri,
+                                 const std::string& opaque_data);
+  static bool parse_record(const std::string& record,
+                           uint64_t& interval_ms,
+                           uint64_t& first_pop_ms,
+                           uint64_t& end_ms,
+                           std::string& callback_uri,
+                           std::string& opaque_data);
+
+  static const uint64_t TICK_MS = 10;
+  static const int LEVELS = 4;
+  static const int SLOT_BITS = 8;
+  static const int SLOTS = 1 << SLOT_BITS;
+
+  static const int NUM_INDEX_SHARDS = 1024;
+  static const int FLUSH_INTERVAL_MS = 100;
+
+protected:
+  // The monotonic and wall clock times in milliseconds.  Virtual so the UTs
+  // can control time.
+  virtual uint64_t now_ms();
+  virtual uint64_t wall_ms();
+
+private:
+  struct Timer
+  {
+    std::string id;
+    std::string callback_uri;
+    std::string opaque_data;
+    uint64_t interval_ms;
+    uint64_t first_pop_ms;
+    uint64_t next_pop_ms;
+    uint64_t end_ms;
+
+    // The timer's slot in the wheel, and its neighbours in the slot.
+    int level;
+    int slot;
+    Timer* prev;
+    Timer* next;
+  };
+
+  static void* thread_fn(void* wheel);
+  void thread();
+
+  static void* flush_thread_fn(void* wheel);
+  void flush_thread();
+
+  // Arms a new timer, or re-arms an existing one, to pop first at
+  // first_pop_ms and then every interval_ms until end_ms.  Must be called with
+  // the lock held.
+  void arm(const std::string& id,
+           uint64_t interval_ms,
+           uint64_t first_pop_ms,
+           uint64_t end_ms,
+           const std::string& callback_uri,
+           const std::string& opaque_data);
+
+  // Add and remove timers from the wheel.  Must be called with the lock held.
+  void insert(Timer* timer);
+  void unlink(Timer* timer);
+
+  // Moves the timers in a slot down to the levels below.
+  void cascade(int level, int slot);
+
+  // Marks a timer as needing writing to the store.
+  void mark_dirty(const std::string& id);
+
+  // Writes a record to the store, overwriting any existing record.  If
+  // old_data is given, it's set to the record that was overwritten (empty if
+  // there wasn't one).
+  bool write(const std::string& table,
+             const std::string& key,
+             const std::string& data,
+             int expiry,
+             std::string* old_data = NULL);
+
+  // Writes an index shard's timer IDs to a new record with the given key, and
+  // points the shard at it.  If there are no IDs, the shard is deleted.
+  bool write_index(int shard,
+                   const std::string& ids_key,
+                   const std::string& ids,
+                   int expiry);
+
+  // Sets the tick from the clock, if it hasn't been set yet.  Must be called
+  // with the lock held.
+  void init_tick();
+
+  std::string new_id();
+  int shard(const std::string& id) const;
+  std::string index_key(int shard) const;
+
+  PopCallback _pop_callback;
+  Store* _store;
+  const std::string _node_id;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  pthread_cond_t _flush_cond;
+  pthread_t _thread;
+  pthread_t _flush_thread;
+  bool _running;
+
+  Timer* _slots[LEVELS][SLOTS];
+  std::unordered_map<std::string, Timer*> _timers;
+
+  // The next tick to process.
+  uint64_t _tick;
+
+  // Pops that the callback couldn't take, to offer again on the next tick.
+  // Only used by advance().
+  std::vector<std::pair<std::string, std::string>> _refused;
+
+  // Timer IDs are made up of the node ID, the time the first ID was
+  // allocated, and a count.
+  uint64_t _id_base;
+  uint64_t _next_id;
+
+  // The IDs of this node's timers in each index shard, and the timers and
+  // shards that have changed since the last flush.
+  std::vector<std::unordered_set<std::string>> _index;
+  std::unordered_set<std::string> _dirty_timers;
+  std::unordered_set<int> _dirty_shards;
+  std::hash<std::string> _hash;
+
+  StatisticAccumulator* _timers_stat;
+  StatisticCounter* _pops_stat;
+};
+
+#endif
@@ -0,0 +1,359 @@
+/**
+ * @file worker_pool.hpp Pool of worker threads fed by a bounded lock-free queue.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#ifndef WORKER_POOL_HPP_
+#define WORKER_POOL_HPP_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "bounded_queue.hpp"
+#include "exception_handler.h"
+#include "accumulator.h"
+#include "log.h"
+
+// A pool of threads that process work items of type T.  Work is added with
+// add_work, which never blocks - if the queue is full the work is rejected and
+// the caller must deal with it.  Subclasses implement process_work.
+//
+// The pool can run in one of two modes.
+// -  Unordered: all the threads take work from a single shared queue.
+// -  Ordered: each thread has its own queue (a "lane"), and work is assigned
+//    to a lane by hashing a key supplied by the caller.  Work with the same
+//    key is therefore processed serially, in the order it was added.
+//
+// If a statistics aggregator is supplied the pool reports the following
+// statistics (where <prefix> is the stat_prefix passed on construction):
+// -  <prefix>_queue_depth: the queue depth, sampled as work is added.
+// -  <prefix>_queue_wait_us: the time work spent queued before a worker
+//    picked it up.
+// -  <prefix>_busy_workers: the number of busy workers, sampled as each worker
+//    picks up work.  Dividing by the number of workers gives the pool's
+//    utilisation.
+template<class T>
+class WorkerPool
+{
+public:
+  // @param num_threads       - The number of worker threads.
+  // @param max_queue         - The maximum number of work items that can be
+  //                            queued.  In ordered mode this is split
+  //                            between the lanes.
+  // @param exception_handler - Handler for exceptions hit while processing
+  //                            work.  May be NULL.
+  // @param callback          - Called on work that hit an exception, so it
+  //                            can be tidied up.  May be NULL.
+  // @param stats_aggregator  - Statistics aggregator.  May be NULL.
+  // @param stat_prefix       - Prefix for this pool's statistic names.
+  WorkerPool(unsigned int num_threads,
+             size_t max_queue,
+             ExceptionHandler* exception_handler,
+             void (*callback)(T),
+             LastValueCache* stats_aggregator,
+             const std::string& stat_prefix,
+             bool ordered = false) :
+    _num_threads(num_threads),
+    _exception_handler(exception_handler),
+    _callback(callback),
+    _terminated(false),
+    _busy_workers(0),
+    _queue_depth_stat(NULL),
+    _queue_wait_stat(NULL),
+    _busy_workers_stat(NULL)
+  {
+    size_t num_lanes = (ordered && (num_threads > 0)) ? num_threads : 1;
+    size_t lane_queue = (max_queue / num_lanes > 0) ? max_queue / num_lanes : 1;
+
+    for (size_t ii = 0; ii < num_lanes; ii++)
+    {
+      _lanes.push_back(new Lane(lane_queue));
+    }
+
+    if (stats_aggregator != NULL)
+    {
+      _queue_depth_stat = new StatisticAccumulator(stat_prefix + "_queue_depth",
+                                                   stats_aggregator);
+      _queue_wait_stat = new StatisticAccumulator(stat_prefix + "_queue_wait_us",
+                                                  stats_aggregator);
+      _busy_workers_stat = new StatisticAccumulator(stat_prefix + "_busy_workers",
+                                                    stats_aggregator);
+    }
+  }
+
+  virtual ~WorkerPool()
+  {
+    for (typename std::vector<Lane*>::iterator it = _lanes.begin();
+         it != _lanes.end();
+         ++it)
+    {
+      delete *it;
+    }
+    _lanes.clear();
+
+    delete _queue_depth_stat; _queue_depth_stat = NULL;
+    delete _queue_wait_stat; _queue_wait_stat = NULL;
+    delete _busy_workers_stat; _busy_workers_stat = NULL;
+  }
+
+  // Starts the worker threads.  Returns false if any of them could not be
+  // created.
+  bool start()
+  {
+    for (unsigned int ii = 0; ii < _num_threads; ii++)
+    {
+      // In ordered mode there is a lane per thread.  Otherwise every thread
+      // shares the single lane.
+      WorkerThreadParams* params = new WorkerThreadParams();
+      params->pool = this;
+      params->lane = _lanes[ii % _lanes.size()];
+
+      pthread_t thread;
+      int rc = pthread_create(&thread, NULL, worker_thread_entry_point, params);
+
+      if (rc != 0)
+      {
+        TRC_ERROR("Failed to create worker thread: %d", rc);
+        delete params;
+        return false;
+      }
+
+      _threads.push_back(thread);
+    }
+
+    return true;
+  }
+
+  // Tells the worker threads to exit once the queue has drained.
+  void stop()
+  {
+    _terminated = true;
+
+    for (unsigned int ii = 0; ii < _threads.size(); ii++)
+    {
+      sem_post(&_lanes[ii % _lanes.size()]->work_sem);
+    }
+  }
+
+  // Waits for the worker threads to exit.
+  void join()
+  {
+    for (std::vector<pthread_t>::iterator it = _threads.begin();
+         it != _threads.end();
+         ++it)
+    {
+      pthread_join(*it, NULL);
+    }
+
+    _threads.clear();
+  }
+
+  // Queues some work.  Returns false (leaving the work untouched) if the queue
+  // is full.
+  bool add_work(T& work)
+  {
+    return add_work(work, 0);
+  }
+
+  // Queues some work with an ordering key.  In ordered mode, all work with the
+  // same key hash is processed on the same lane.
+  bool add_work(T& work, size_t key_hash)
+  {
+    Lane* lane = _lanes[lane_index(key_hash)];
+
+    QueuedWork queued;
+    queued.work = work;
+    queued.enqueue_time_us = now_us();
+
+    if (!lane->queue.push(queued))
+    {
+      return false;
+    }
+
+    sem_post(&lane->work_sem);
+
+    if (_queue_depth_stat != NULL)
+    {
+      _queue_depth_stat->accumulate(lane->queue.size());
+    }
+
+    return true;
+  }
+
+  size_t queue_depth() const
+  {
+    size_t depth = 0;
+
+    for (typename std::vector<Lane*>::const_iterator it = _lanes.begin();
+         it != _lanes.end();
+         ++it)
+    {
+      depth += (*it)->queue.size();
+    }
+
+    return depth;
+  }
+
+  size_t num_lanes() const
+  {
+    return _lanes.size();
+  }
+
+  // The lane that work with this key hash is assigned to.
+  size_t lane_index(size_t key_hash) const
+  {
+    return key_hash % _lanes.size();
+  }
+
+protected:
+  // Processes an item of work.  Called on one of the worker threads.
+  virtual void process_work(T& work) = 0;
+
+  // Called on the worker thread when process_work hits an exception.  The
+  // exception handler recovers with a longjmp, so destructors in
+  // process_work haven't run - anything it must release is released here.
+  // By default the callback passed on construction is called.
+  virtual void process_work_failed(T& work)
+  {
+    if (_callback != NULL)
+    {
+      _callback(work);
+    }
+  }
+
+  static uint64_t now_us()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+  }
+
+private:
+  struct QueuedWork
+  {
+    T work;
+    uint64_t enqueue_time_us;
+  };
+
+  struct Lane
+  {
+    Lane(size_t max_queue) : queue(max_queue) { sem_init(&work_sem, 0, 0); }
+    ~Lane() { sem_destroy(&work_sem); }
+
+    BoundedQueue<QueuedWork> queue;
+    sem_t work_sem;
+  };
+
+  struct WorkerThreadParams
+  {
+    WorkerPool<T>* pool;
+    Lane* lane;
+  };
+
+  static void* worker_thread_entry_point(void* params_param)
+  {
+    WorkerThreadParams* params = (WorkerThreadParams*)params_param;
+    params->pool->worker_thread_func(params->lane);
+    delete params;
+    return NULL;
+  }
+
+  void worker_thread_func(Lane* lane)
+  {
+    while (true)
+    {
+      sem_wait(&lane->work_sem);
+
+      QueuedWork queued;
+
+      // Every post of the semaphore corresponds to a pushed item, but that
+      // item may not be at the head of the queue yet if a slower producer
+      // claimed an earlier slot.  Spin until it becomes visible.
+      while (!lane->queue.pop(queued))
+      {
+        if (_terminated && (lane->queue.size() == 0))
+        {
+          return;
+        }
+
+        sched_yield();
+      }
+
+      int busy = ++_busy_workers;
+
+      if (_queue_wait_stat != NULL)
+      {
+        _queue_wait_stat->accumulate(now_us() - queued.enqueue_time_us);
+        _busy_workers_stat->accumulate(busy);
+      }
+
+      if (_exception_handler != NULL)
+      {
+        CW_TRY
+        {
+          process_work(queued.work);
+        }
+        CW_EXCEPT(_exception_handler)
+        {
+          process_work_failed(queued.work);
+        }
+        CW_END
+      }
+      else
+      {
+        process_work(queued.work);
+      }
+
+      --_busy_workers;
+    }
+  }
+
+  unsigned int _num_threads;
+  std::vector<pthread_t> _threads;
+  std::vector<Lane*> _lanes;
+  ExceptionHandler* _exception_handler;
+  void (*_callback)(T);
+  volatile bool _terminated;
+  std::atomic<int> _busy_workers;
+
+  StatisticAccumulator* _queue_depth_stat;
+  StatisticAccumulator* _queue_wait_stat;
+  StatisticAccumulator* _busy_workers_stat;
+};
+
+#endif
@@ -0,0 +1,318 @@
+/**
+ * @file acr_hedger.cpp Decides when to hedge ACRs to a backup CCF.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+#include <string.h>
+
+#include "acr_hedger.hpp"
+#include "peer_message_sender.hpp"
+#include "log.h"
+
+// The cost of a hedge, and the most hedges we can save up.  The limit stops a
+// long quiet period building up enough budget for a burst of hedges.
+static const int HEDGE_COST = 100;
+static const int MAX_CREDITS = 10 * HEDGE_COST;
+
+AcrHedger::AcrHedger(int percentile,
+                     int budget_percent,
+                     LastValueCache* stats_aggregator) :
+  _percentile(percentile),
+  _budget_percent(budget_percent),
+  _running(false),
+  _samples(0),
+  _samples_since_update(0),
+  _threshold_ms(0),
+  _credits(0),
+  _hedged_stat(NULL),
+  _hedge_won_stat(NULL),
+  _over_budget_stat(NULL)
+{
+  memset(_latency_buckets, 0, sizeof(_latency_buckets));
+
+  pthread_mutex_init(&_lock, NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  if (stats_aggregator != NULL)
+  {
+    _hedged_stat = new StatisticCounter("ralf_acr_hedges", stats_aggregator);
+    _hedge_won_stat = new StatisticCounter("ralf_acr_hedge_wins", stats_aggregator);
+    _over_budget_stat = new StatisticCounter("ralf_acr_hedge_over_budget", stats_aggregator);
+  }
+}
+
+AcrHedger::~AcrHedger()
+{
+  stop();
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+
+  delete _hedged_stat; _hedged_stat = NULL;
+  delete _hedge_won_stat; _hedge_won_stat = NULL;
+  delete _over_budget_stat; _over_budget_stat = NULL;
+}
+
+bool AcrHedger::start()
+{
+  _running = true;
+  int rc = pthread_create(&_timer_thread, NULL, timer_thread_fn, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start ACR hedging thread: %d", rc);
+    _running = false;
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  return true;
+}
+
+void AcrHedger::stop()
+{
+  pthread_mutex_lock(&_lock);
+  bool running = _running;
+  _running = false;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  if (running)
+  {
+    pthread_join(_timer_thread, NULL);
+  }
+
+  // Any senders that were waiting to hedge are left to complete without
+  // hedging.
+  _timers.clear();
+  _timer_index.clear();
+}
+
+void AcrHedger::record_latency(uint64_t latency_ms)
+{
+  uint64_t bucket = latency_ms / BUCKET_MS;
+
+  if (bucket >= (uint64_t)NUM_BUCKETS)
+  {
+    bucket = NUM_BUCKETS - 1;
+  }
+
+  pthread_mutex_lock(&_lock);
+
+  _latency_buckets[bucket]++;
+  _samples++;
+
+  if (_samples >= DECAY_SAMPLES)
+  {
+    // Age the histogram.
+    _samples = 0;
+
+    for (int ii = 0; ii < NUM_BUCKETS; ii++)
+    {
+      _latency_buckets[ii] /= 2;
+      _samples += _latency_buckets[ii];
+    }
+  }
+
+  if (++_samples_since_update >= MIN_SAMPLES)
+  {
+    update_threshold();
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void AcrHedger::update_threshold()
+{
+  uint64_t target = (_samples * _percentile + 99) / 100;
+  uint64_t count = 0;
+  int bucket = 0;
+
+  while ((bucket < NUM_BUCKETS - 1) &&
+         (count + _latency_buckets[bucket] < target))
+  {
+    count += _latency_buckets[bucket];
+    bucket++;
+  }
+
+  _threshold_ms = (bucket + 1) * BUCKET_MS;
+  _samples_since_update = 0;
+
+  TRC_DEBUG("ACR hedge threshold is now %ld ms", _threshold_ms);
+}
+
+uint64_t AcrHedger::acr_sent()
+{
+  pthread_mutex_lock(&_lock);
+
+  _credits += _budget_percent;
+  if (_credits > MAX_CREDITS)
+  {
+    _credits = MAX_CREDITS;
+  }
+
+  uint64_t delay_ms = (_samples >= MIN_SAMPLES) ? _threshold_ms : 0;
+
+  pthread_mutex_unlock(&_lock);
+
+  return delay_ms;
+}
+
+bool AcrHedger::take_budget()
+{
+  pthread_mutex_lock(&_lock);
+
+  bool allowed = (_credits >= HEDGE_COST);
+  if (allowed)
+  {
+    _credits -= HEDGE_COST;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  StatisticCounter* stat = allowed ? _hedged_stat : _over_budget_stat;
+  if (stat != NULL)
+  {
+    stat->increment();
+  }
+
+  return allowed;
+}
+
+void AcrHedger::hedge_won()
+{
+  if (_hedge_won_stat != NULL)
+  {
+    _hedge_won_stat->increment();
+  }
+}
+
+void AcrHedger::schedule(PeerMessageSender* sender, uint64_t delay_ms)
+{
+  uint64_t deadline = now_ms() + delay_ms;
+
+  pthread_mutex_lock(&_lock);
+
+  std::multimap<uint64_t, PeerMessageSender*>::iterator it =
+    _timers.insert(std::make_pair(deadline, sender));
+  _timer_index[sender] = it;
+
+  if (it == _timers.begin())
+  {
+    // This is now the earliest timer, so wake the thread up.
+    pthread_cond_signal(&_cond);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+bool AcrHedger::cancel(PeerMessageSender* sender)
+{
+  bool cancelled = false;
+
+  pthread_mutex_lock(&_lock);
+
+  std::unordered_map<PeerMessageSender*, std::multimap<uint64_t, PeerMessageSender*>::iterator>::iterator it =
+    _timer_index.find(sender);
+
+  if (it != _timer_index.end())
+  {
+    _timers.erase(it->second);
+    _timer_index.erase(it);
+    cancelled = true;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return cancelled;
+}
+
+void* AcrHedger::timer_thread_fn(void* hedger)
+{
+  ((AcrHedger*)hedger)->timer_thread();
+  return NULL;
+}
+
+void AcrHedger::timer_thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (_running)
+  {
+    if (_timers.empty())
+    {
+      pthread_cond_wait(&_cond, &_lock);
+      continue;
+    }
+
+    uint64_t deadline = _timers.begin()->first;
+    uint64_t now = now_ms();
+
+    if (deadline > now)
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      uint64_t wait_ns = (deadline - now) * 1000000;
+      ts.tv_sec += (ts.tv_nsec + wait_ns) / 1000000000;
+      ts.tv_nsec = (ts.tv_nsec + wait_ns) % 1000000000;
+      pthread_cond_timedwait(&_cond, &_lock, &ts);
+      continue;
+    }
+
+    PeerMessageSender* sender = _timers.begin()->second;
+    _timers.erase(_timers.begin());
+    _timer_index.erase(sender);
+
+    // Don't hold the lock while the sender hedges, as it might call back
+    // into us.
+    pthread_mutex_unlock(&_lock);
+    sender->hedge();
+    pthread_mutex_lock(&_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+uint64_t AcrHedger::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,1132 @@
+/**
+ * @file acr_spool.cpp On-disk spool of ACRs that couldn't be delivered to any CCF.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "acr_spool.hpp"
+#include "log.h"
+
+// Each segment starts with a header, followed by records.  Each record is a
+// length and a checksum, followed by the data, padded to 8 bytes.  The end of
+// the records is the first record that doesn't have a valid checksum.  The
+// checksum includes the segment's sequence number, so records left over from
+// a previous use of the file aren't mistaken for new ones.
+struct SegmentHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t seq;
+
+  // The offset of the first record that hasn't been delivered.
+  uint64_t read_offset;
+};
+
+static const uint32_t SEGMENT_MAGIC = 0x52535043;
+static const uint32_t SEGMENT_VERSION = 1;
+static const size_t HEADER_SIZE = 64;
+static const size_t RECORD_HEADER_SIZE = 8;
+static const char* SEGMENT_PREFIX = "acr-spool-";
+static const char* SEGMENT_SUFFIX = ".seg";
+
+// The most delivered segments to keep for reuse.
+static const size_t MAX_FREE_SEGMENTS = 2;
+
+const size_t AcrSpool::MAX_IN_FLIGHT;
+
+static size_t record_size(size_t len)
+{
+  return RECORD_HEADER_SIZE + ((len + 7) & ~(size_t)7);
+}
+
+// FNV-1a, seeded with the segment's sequence number.
+static uint32_t record_checksum(uint64_t seq, const char* data, uint32_t len)
+{
+  uint32_t hash = 2166136261u;
+  const unsigned char* bytes = (const unsigned char*)&seq;
+
+  for (size_t ii = 0; ii < sizeof(seq); ii++)
+  {
+    hash = (hash ^ bytes[ii]) * 16777619u;
+  }
+
+  for (uint32_t ii = 0; ii < len; ii++)
+  {
+    hash = (hash ^ (unsigned char)data[ii]) * 16777619u;
+  }
+
+  // Never zero, so that zeroed space is never a valid record.
+  return (hash == 0) ? 1 : hash;
+}
+
+AcrSpool::AcrSpool(const std::string& dir,
+                   uint64_t max_bytes,
+                   int replay_rate,
+                   LastValueCache* stats_aggregator,
+                   size_t segment_size) :
+  _dir(dir),
+  _segment_size(segment_size),
+  _max_segments(std::max((uint64_t)2, max_bytes / segment_size)),
+  _replay_rate(replay_rate),
+  _running(false),
+  _next_seq(1),
+  _depth(0),
+  _dirty(false),
+  _send_segment(NULL),
+  _send_offset(0),
+  _sending(0),
+  _failed(0),
+  _blocked(false),
+  _failures(0),
+  _backoff(false),
+  _depth_stat(NULL),
+  _writes_stat(NULL),
+  _commits_stat(NULL),
+  _replayed_stat(NULL),
+  _dropped_stat(NULL)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_mutex_init(&_sync_lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_flush_cond, &cond_attr);
+  pthread_cond_init(&_replay_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  if (stats_aggregator != NULL)
+  {
+    _depth_stat = new StatisticAccumulator("ralf_acr_spool_depth", stats_aggregator);
+    _writes_stat = new StatisticCounter("ralf_acr_spool_writes", stats_aggregator);
+    _commits_stat = new StatisticCounter("ralf_acr_spool_commits", stats_aggregator);
+    _replayed_stat = new StatisticCounter("ralf_acr_spool_replayed", stats_aggregator);
+    _dropped_stat = new StatisticCounter("ralf_acr_spool_dropped", stats_aggregator);
+  }
+}
+
+AcrSpool::~AcrSpool()
+{
+  stop();
+  flush();
+
+  for (size_t ii = 0; ii < _deliveries.size(); ii++)
+  {
+    delete _deliveries[ii];
+  }
+  _deliveries.clear();
+
+  for (size_t ii = 0; ii < _segments.size(); ii++)
+  {
+    close_segment(_segments[ii], false);
+  }
+  _segments.clear();
+
+  for (size_t ii = 0; ii < _free.size(); ii++)
+  {
+    close_segment(_free[ii], true);
+  }
+  _free.clear();
+
+  pthread_cond_destroy(&_flush_cond);
+  pthread_cond_destroy(&_replay_cond);
+  pthread_mutex_destroy(&_sync_lock);
+  pthread_mutex_destroy(&_lock);
+
+  delete _depth_stat; _depth_stat = NULL;
+  delete _writes_stat; _writes_stat = NULL;
+  delete _commits_stat; _commits_stat = NULL;
+  delete _replayed_stat; _replayed_stat = NULL;
+  delete _dropped_stat; _dropped_stat = NULL;
+}
+
+bool AcrSpool::start()
+{
+  if (!recover())
+  {
+    return false;
+  }
+
+  _running = true;
+
+  int rc = pthread_create(&_flush_thread, NULL, flush_thread_fn, this);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start ACR spool flush thread: %d", rc);
+    _running = false;
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  rc = pthread_create(&_replay_thread, NULL, replay_thread_fn, this);
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start ACR spool replay thread: %d", rc);
+    stop();
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  return true;
+}
+
+void AcrSpool::stop()
+{
+  pthread_mutex_lock(&_lock);
+  bool running = _running;
+  _running = false;
+  pthread_cond_broadcast(&_flush_cond);
+  pthread_cond_broadcast(&_replay_cond);
+  pthread_mutex_unlock(&_lock);
+
+  if (running)
+  {
+    pthread_join(_flush_thread, NULL);
+    pthread_join(_replay_thread, NULL);
+  }
+}
+
+bool AcrSpool::recover()
+{
+  if ((mkdir(_dir.c_str(), 0700) != 0) && (errno != EEXIST))
+  {
+    TRC_ERROR("Failed to create ACR spool directory %s: %d", _dir.c_str(), errno);
+    return false;
+  }
+
+  DIR* dir = opendir(_dir.c_str());
+  if (dir == NULL)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to open ACR spool directory %s: %d", _dir.c_str(), errno);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  std::vector<Segment*> segments;
+  struct dirent* entry;
+
+  while ((entry = readdir(dir)) != NULL)
+  {
+    std::string name = entry->d_name;
+
+    if ((name.compare(0, strlen(SEGMENT_PREFIX), SEGMENT_PREFIX) == 0) &&
+        (name.size() > strlen(SEGMENT_SUFFIX)) &&
+        (name.compare(name.size() - strlen(SEGMENT_SUFFIX),
+                      std::string::npos,
+                      SEGMENT_SUFFIX) == 0))
+    {
+      Segment* segment = open_segment(_dir + "/" + name);
+
+      if (segment != NULL)
+      {
+        segments.push_back(segment);
+      }
+    }
+  }
+
+  closedir(dir);
+
+  std::sort(segments.begin(),
+            segments.end(),
+            [](const Segment* a, const Segment* b) { return a->seq < b->seq; });
+
+  std::vector<Segment*> retired;
+  pthread_mutex_lock(&_lock);
+
+  for (size_t ii = 0; ii < segments.size(); ii++)
+  {
+    Segment* segment = segments[ii];
+    uint64_t records = scan_segment(segment);
+    _next_seq = std::max(_next_seq, segment->seq + 1);
+
+    if ((records == 0) && (ii + 1 < segments.size()))
+    {
+      // Already delivered.
+      retired.push_back(segment);
+    }
+    else
+    {
+      _segments.push_back(segment);
+      _depth += records;
+    }
+  }
+
+  uint64_t depth = _depth;
+  pthread_mutex_unlock(&_lock);
+
+  retire_segments(retired);
+
+  if (depth > 0)
+  {
+    TRC_STATUS("Found %" PRIu64 " undelivered ACRs in spool %s", depth, _dir.c_str());
+  }
+
+  if (_depth_stat != NULL)
+  {
+    _depth_stat->accumulate(depth);
+  }
+
+  return true;
+}
+
+AcrSpool::Segment* AcrSpool::open_segment(const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDWR);
+  struct stat st;
+
+  if ((fd < 0) || (fstat(fd, &st) != 0) || ((size_t)st.st_size != _segment_size))
+  {
+    TRC_WARNING("Ignoring ACR spool segment %s", path.c_str());
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return NULL;
+  }
+
+  char* base = (char*)mmap(NULL, _segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (base == MAP_FAILED)
+  {
+    // LCOV_EXCL_START
+    TRC_WARNING("Failed to map ACR spool segment %s: %d", path.c_str(), errno);
+    close(fd);
+    return NULL;
+    // LCOV_EXCL_STOP
+  }
+
+  SegmentHeader* header = (SegmentHeader*)base;
+
+  if ((header->magic != SEGMENT_MAGIC) ||
+      (header->version != SEGMENT_VERSION) ||
+      (header->read_offset < HEADER_SIZE) ||
+      (header->read_offset > _segment_size))
+  {
+    TRC_WARNING("Ignoring invalid ACR spool segment %s", path.c_str());
+    munmap(base, _segment_size);
+    close(fd);
+    return NULL;
+  }
+
+  Segment* segment = new Segment();
+  segment->path = path;
+  segment->fd = fd;
+  segment->base = base;
+  segment->seq = header->seq;
+  segment->read_offset = header->read_offset;
+  segment->write_offset = header->read_offset;
+  segment->synced_offset = header->read_offset;
+  segment->header_dirty = false;
+  return segment;
+}
+
+uint64_t AcrSpool::scan_segment(Segment* segment)
+{
+  uint64_t records = 0;
+  size_t offset = segment->read_offset;
+
+  while (offset + RECORD_HEADER_SIZE <= _segment_size)
+  {
+    uint32_t len;
+    uint32_t checksum;
+    memcpy(&len, segment->base + offset, sizeof(len));
+    memcpy(&checksum, segment->base + offset + sizeof(len), sizeof(checksum));
+
+    if ((len == 0) ||
+        (offset + record_size(len) > _segment_size) ||
+        (checksum != record_checksum(segment->seq,
+                                     segment->base + offset + RECORD_HEADER_SIZE,
+                                     len)))
+    {
+      break;
+    }
+
+    offset += record_size(len);
+    records++;
+  }
+
+  segment->write_offset = offset;
+  segment->synced_offset = offset;
+  return records;
+}
+
+std::string AcrSpool::segment_path(uint64_t seq) const
+{
+  char name[64];
+  snprintf(name, sizeof(name), "%s%016" PRIx64 "%s", SEGMENT_PREFIX, seq, SEGMENT_SUFFIX);
+  return _dir + "/" + name;
+}
+
+AcrSpool::Segment* AcrSpool::new_segment()
+{
+  uint64_t seq = _next_seq++;
+  std::string path = segment_path(seq);
+  Segment* segment = NULL;
+
+  if (!_free.empty())
+  {
+    // Reuse a delivered segment.  This saves allocating disk space.
+    segment = _free.back();
+    _free.pop_back();
+
+    if (rename(segment->path.c_str(), path.c_str()) != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_WARNING("Failed to rename ACR spool segment %s: %d",
+                  segment->path.c_str(), errno);
+      close_segment(segment, true);
+      segment = NULL;
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  if ((segment == NULL) && (_segments.size() + _free.size() < _max_segments))
+  {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+    if ((fd < 0) || (ftruncate(fd, _segment_size) != 0))
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to create ACR spool segment %s: %d", path.c_str(), errno);
+      if (fd >= 0)
+      {
+        close(fd);
+        unlink(path.c_str());
+      }
+      return NULL;
+      // LCOV_EXCL_STOP
+    }
+
+    char* base = (char*)mmap(NULL, _segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (base == MAP_FAILED)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to map ACR spool segment %s: %d", path.c_str(), errno);
+      close(fd);
+      unlink(path.c_str());
+      return NULL;
+      // LCOV_EXCL_STOP
+    }
+
+    segment = new Segment();
+    segment->fd = fd;
+    segment->base = base;
+  }
+
+  if (segment == NULL)
+  {
+    return NULL;
+  }
+
+  segment->path = path;
+  segment->seq = seq;
+  segment->read_offset = HEADER_SIZE;
+  segment->write_offset = HEADER_SIZE;
+  segment->synced_offset = HEADER_SIZE;
+  segment->header_dirty = true;
+
+  SegmentHeader* header = (SegmentHeader*)segment->base;
+  header->magic = SEGMENT_MAGIC;
+  header->version = SEGMENT_VERSION;
+  header->seq = seq;
+  header->read_offset = HEADER_SIZE;
+
+  return segment;
+}
+
+void AcrSpool::retire_segments(const std::vector<Segment*>& segments)
+{
+  std::vector<Segment*> to_close;
+
+  // Take the sync lock first, so that segments aren't closed under a flush.
+  pthread_mutex_lock(&_sync_lock);
+  pthread_mutex_lock(&_lock);
+
+  for (size_t ii = 0; ii < segments.size(); ii++)
+  {
+    if (_free.size() < MAX_FREE_SEGMENTS)
+    {
+      _free.push_back(segments[ii]);
+    }
+    else
+    {
+      to_close.push_back(segments[ii]);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  for (size_t ii = 0; ii < to_close.size(); ii++)
+  {
+    close_segment(to_close[ii], true);
+  }
+
+  pthread_mutex_unlock(&_sync_lock);
+}
+
+void AcrSpool::close_segment(Segment* segment, bool remove)
+{
+  munmap(segment->base, _segment_size);
+  close(segment->fd);
+
+  if (remove)
+  {
+    unlink(segment->path.c_str());
+  }
+
+  delete segment; segment = NULL;
+}
+
+bool AcrSpool::append(const std::string& record)
+{
+  size_t size = record_size(record.size());
+
+  if ((record.empty()) || (HEADER_SIZE + size > _segment_size))
+  {
+    TRC_ERROR("Can't spool record of %zu bytes", record.size());
+    return false;
+  }
+
+  pthread_mutex_lock(&_lock);
+
+  Segment* segment = _segments.empty() ? NULL : _segments.back();
+
+  if ((segment == NULL) || (segment->write_offset + size > _segment_size))
+  {
+    segment = new_segment();
+
+    if (segment == NULL)
+    {
+      pthread_mutex_unlock(&_lock);
+      TRC_WARNING("ACR spool is full, dropping record");
+
+      if (_dropped_stat != NULL)
+      {
+        _dropped_stat->increment();
+      }
+
+      return false;
+    }
+
+    _segments.push_back(segment);
+  }
+
+  char* dest = segment->base + segment->write_offset;
+  uint32_t len = record.size();
+  uint32_t checksum = record_checksum(segment->seq, record.data(), len);
+  memcpy(dest + RECORD_HEADER_SIZE, record.data(), len);
+  memcpy(dest + sizeof(len), &checksum, sizeof(checksum));
+  memcpy(dest, &len, sizeof(len));
+  segment->write_offset += size;
+
+  uint64_t depth = ++_depth;
+  _dirty = true;
+  pthread_cond_signal(&_flush_cond);
+  pthread_cond_signal(&_replay_cond);
+
+  pthread_mutex_unlock(&_lock);
+
+  if (_writes_stat != NULL)
+  {
+    _writes_stat->increment();
+  }
+
+  if (_depth_stat != NULL)
+  {
+    _depth_stat->accumulate(depth);
+  }
+
+  return true;
+}
+
+uint64_t AcrSpool::depth()
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t depth = _depth;
+  pthread_mutex_unlock(&_lock);
+  return depth;
+}
+
+void AcrSpool::flush()
+{
+  // Work out what needs syncing.  The records themselves are synced without
+  // the lock, so appends can carry on meanwhile.
+  std::vector<std::pair<Segment*, size_t> > to_sync;
+
+  pthread_mutex_lock(&_sync_lock);
+  pthread_mutex_lock(&_lock);
+
+  for (size_t ii = 0; ii < _segments.size(); ii++)
+  {
+    Segment* segment = _segments[ii];
+
+    if ((segment->header_dirty) ||
+        (segment->synced_offset < segment->write_offset))
+    {
+      to_sync.push_back(std::make_pair(segment, segment->write_offset));
+      segment->header_dirty = false;
+    }
+  }
+
+  _dirty = false;
+  pthread_mutex_unlock(&_lock);
+
+  for (size_t ii = 0; ii < to_sync.size(); ii++)
+  {
+    Segment* segment = to_sync[ii].first;
+
+    if (msync(segment->base, to_sync[ii].second, MS_SYNC) != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to sync ACR spool segment %s: %d", segment->path.c_str(), errno);
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  pthread_mutex_lock(&_lock);
+  for (size_t ii = 0; ii < to_sync.size(); ii++)
+  {
+    to_sync[ii].first->synced_offset = std::max(to_sync[ii].first->synced_offset,
+                                                to_sync[ii].second);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  pthread_mutex_unlock(&_sync_lock);
+
+  if ((!to_sync.empty()) && (_commits_stat != NULL))
+  {
+    _commits_stat->increment();
+  }
+}
+
+bool AcrSpool::replay_one()
+{
+  std::vector<Segment*> retired;
+  pthread_mutex_lock(&_lock);
+
+  // Skip past segments that have been completely delivered.
+  while ((_segments.size() > 1) &&
+         (_segments.front()->read_offset == _segments.front()->write_offset))
+  {
+    if (_send_segment == _segments.front())
+    {
+      _send_segment = _segments[1];
+      _send_offset = _send_segment->read_offset;
+    }
+
+    retired.push_back(_segments.front());
+    _segments.pop_front();
+  }
+
+  // Records that couldn't be delivered are retried before any new ones.
+  Delivery* delivery = NULL;
+
+  for (size_t ii = 0; (_failed > 0) && (ii < _deliveries.size()); ii++)
+  {
+    if (_deliveries[ii]->state == Delivery::FAILED)
+    {
+      delivery = _deliveries[ii];
+      _failed--;
+      break;
+    }
+  }
+
+  if ((delivery == NULL) && (_deliveries.size() < MAX_IN_FLIGHT))
+  {
+    delivery = next_delivery();
+  }
+
+  if (delivery != NULL)
+  {
+    delivery->state = Delivery::SENDING;
+    _sending++;
+  }
+
+  uint64_t failures = _failures;
+  pthread_mutex_unlock(&_lock);
+
+  if (!retired.empty())
+  {
+    retire_segments(retired);
+  }
+
+  if (delivery == NULL)
+  {
+    return false;
+  }
+
+  // Only this thread retires segments, and the record's segment can't be
+  // retired until it's been delivered, so the record is safe to read without
+  // the lock.
+  uint32_t len;
+  memcpy(&len, delivery->segment->base + delivery->offset, sizeof(len));
+  std::string record(delivery->segment->base + delivery->offset + RECORD_HEADER_SIZE, len);
+
+  deliver(record,
+          [this, delivery](bool delivered) { delivery_done(delivery, delivered); });
+
+  pthread_mutex_lock(&_lock);
+  bool failed = (_failures != failures);
+  pthread_mutex_unlock(&_lock);
+
+  return !failed;
+}
+
+AcrSpool::Delivery* AcrSpool::next_delivery()
+{
+  if (_segments.empty())
+  {
+    return NULL;
+  }
+
+  if (_send_segment == NULL)
+  {
+    _send_segment = _segments.front();
+    _send_offset = _send_segment->read_offset;
+  }
+
+  while (_send_offset >= _send_segment->write_offset)
+  {
+    // Move on to the next segment, if there is one.
+    std::deque<Segment*>::iterator next = std::find(_segments.begin(),
+                                                    _segments.end(),
+                                                    _send_segment) + 1;
+
+    if (next == _segments.end())
+    {
+      return NULL;
+    }
+
+    _send_segment = *next;
+    _send_offset = _send_segment->read_offset;
+  }
+
+  uint32_t len;
+  memcpy(&len, _send_segment->base + _send_offset, sizeof(len));
+  std::string key = record_key(std::string(_send_segment->base + _send_offset + RECORD_HEADER_SIZE,
+                                           len));
+
+  // Wait for any earlier record with the same key.
+  for (size_t ii = 0; (!key.empty()) && (ii < _deliveries.size()); ii++)
+  {
+    if ((_deliveries[ii]->state != Delivery::DELIVERED) &&
+        (_deliveries[ii]->key == key))
+    {
+      _blocked = true;
+      return NULL;
+    }
+  }
+
+  Delivery* delivery = new Delivery();
+  delivery->segment = _send_segment;
+  delivery->offset = _send_offset;
+  delivery->size = record_size(len);
+  delivery->key = key;
+  delivery->state = Delivery::SENDING;
+  _deliveries.push_back(delivery);
+
+  _send_offset += delivery->size;
+  return delivery;
+}
+
+void AcrSpool::delivery_done(Delivery* delivery, bool delivered)
+{
+  pthread_mutex_lock(&_lock);
+
+  if (delivered)
+  {
+    delivery->state = Delivery::DELIVERED;
+  }
+  else
+  {
+    delivery->state = Delivery::FAILED;
+    _failed++;
+    _failures++;
+    _backoff = true;
+  }
+
+  // Move the read offset past the records that have now been delivered in
+  // order.
+  uint64_t replayed = 0;
+
+  while ((!_deliveries.empty()) &&
+         (_deliveries.front()->state == Delivery::DELIVERED))
+  {
+    Delivery* front = _deliveries.front();
+    _deliveries.pop_front();
+
+    Segment* segment = front->segment;
+    segment->read_offset = front->offset + front->size;
+    ((SegmentHeader*)segment->base)->read_offset = segment->read_offset;
+    segment->header_dirty = true;
+    _dirty = true;
+    _depth--;
+    replayed++;
+
+    delete front; front = NULL;
+  }
+
+  for (uint64_t ii = 0; (ii < replayed) && (_replayed_stat != NULL); ii++)
+  {
+    _replayed_stat->increment();
+  }
+
+  if ((replayed > 0) && (_depth_stat != NULL))
+  {
+    _depth_stat->accumulate(_depth);
+  }
+
+  // Once this delivery is no longer counted, the spool may be destroyed, so
+  // this must be the last thing done with the lock held.
+  _blocked = false;
+  _sending--;
+  pthread_cond_broadcast(&_replay_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+std::string AcrSpool::record_key(const std::string& record) const
+{
+  return "";
+}
+
+void* AcrSpool::flush_thread_fn(void* spool)
+{
+  ((AcrSpool*)spool)->flush_thread();
+  return NULL;
+}
+
+void* AcrSpool::replay_thread_fn(void* spool)
+{
+  ((AcrSpool*)spool)->replay_thread();
+  return NULL;
+}
+
+void AcrSpool::wait_ms(pthread_cond_t* cond, int timeout_ms)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  uint64_t nsec = deadline.tv_nsec + (uint64_t)timeout_ms * 1000000;
+  deadline.tv_sec += nsec / 1000000000;
+  deadline.tv_nsec = nsec % 1000000000;
+
+  // Keep waiting if we're woken early by new records.
+  while ((_running) &&
+         (pthread_cond_timedwait(cond, &_lock, &deadline) != ETIMEDOUT))
+  {
+  }
+}
+
+void AcrSpool::flush_thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (_running)
+  {
+    if (!_dirty)
+    {
+      pthread_cond_wait(&_flush_cond, &_lock);
+      continue;
+    }
+
+    // Give other records a chance to join this batch.
+    wait_ms(&_flush_cond, COMMIT_INTERVAL_MS);
+
+    pthread_mutex_unlock(&_lock);
+    flush();
+    pthread_mutex_lock(&_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void AcrSpool::replay_thread()
+{
+  int interval_ms = (_replay_rate > 0) ? std::max(1000 / _replay_rate, 1) : 1;
+
+  pthread_mutex_lock(&_lock);
+
+  while (_running)
+  {
+    if (_backoff)
+    {
+      // A record couldn't be delivered, so wait before retrying.
+      _backoff = false;
+      wait_ms(&_replay_cond, RETRY_INTERVAL_MS);
+      continue;
+    }
+
+    // Wait for a record to need sending, and for room to send it.  Records
+    // that have been sent but not yet delivered in order are still counted
+    // in the depth.
+    if ((_failed == 0) &&
+        ((_blocked) ||
+         (_deliveries.size() >= MAX_IN_FLIGHT) ||
+         (_depth <= _deliveries.size())))
+    {
+      pthread_cond_wait(&_replay_cond, &_lock);
+      continue;
+    }
+
+    pthread_mutex_unlock(&_lock);
+    replay_one();
+    pthread_mutex_lock(&_lock);
+
+    // Pace the replay.
+    if (_running)
+    {
+      wait_ms(&_replay_cond, interval_ms);
+    }
+  }
+
+  // Deliveries call back into the spool, so wait for them to finish.
+  while (_sending > 0)
+  {
+    pthread_cond_wait(&_replay_cond, &_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+namespace
+{
+// Sends a replayed ACR to each of its CCFs in turn, until one answers.
+class SpoolTransaction : public Diameter::Transaction
+{
+public:
+  SpoolTransaction(Rf::Dictionary* dict,
+                   Diameter::Stack* diameter_stack,
+                   const std::vector<std::string>& ccfs,
+                   size_t ccf,
+                   const std::string& acr,
+                   const AcrSpool::DeliveryCallback& done) :
+    Diameter::Transaction(dict, 0),
+    _dict(dict),
+    _diameter_stack(diameter_stack),
+    _ccfs(ccfs),
+    _ccf(ccf),
+    _acr(acr),
+    _done(done)
+  {
+  }
+
+  // Sends the ACR to the given CCF, or fails the delivery if there are no
+  // CCFs left.
+  static void send(Rf::Dictionary* dict,
+                   Diameter::Stack* diameter_stack,
+                   const std::vector<std::string>& ccfs,
+                   size_t ccf,
+                   const std::string& acr,
+                   const AcrSpool::DeliveryCallback& done)
+  {
+    if (ccf >= ccfs.size())
+    {
+      done(false);
+      return;
+    }
+
+    Diameter::Message* msg = Rf::AccountingRequest::retarget(dict,
+                                                             diameter_stack,
+                                                             acr,
+                                                             ccfs[ccf]);
+
+    if (msg == NULL)
+    {
+      // Retrying won't help, so move on.
+      TRC_ERROR("Discarding spooled ACR that can't be decoded");
+      done(true);
+      return;
+    }
+
+    // The stack deletes the transaction once it has called back.
+    msg->send(new SpoolTransaction(dict, diameter_stack, ccfs, ccf, acr, done));
+    delete msg; msg = NULL;
+  }
+
+  void on_response(Diameter::Message& rsp)
+  {
+    int result_code = 0;
+    rsp.result_code(result_code);
+
+    if (result_code == ER_DIAMETER_UNABLE_TO_DELIVER)
+    {
+      send(_dict, _diameter_stack, _ccfs, _ccf + 1, _acr, _done);
+      return;
+    }
+
+    TRC_DEBUG("Spooled ACR delivered to %s, result %d",
+              _ccfs[_ccf].c_str(), result_code);
+    _done(true);
+  }
+
+  void on_timeout()
+  {
+    send(_dict, _diameter_stack, _ccfs, _ccf + 1, _acr, _done);
+  }
+
+private:
+  Rf::Dictionary* _dict;
+  Diameter::Stack* _diameter_stack;
+  std::vector<std::string> _ccfs;
+  size_t _ccf;
+  std::string _acr;
+  AcrSpool::DeliveryCallback _done;
+};
+}
+
+RfAcrSpool::~RfAcrSpool()
+{
+  // Stop replaying before this object goes away.
+  stop();
+}
+
+RfAcrSpool::RfAcrSpool(Rf::Dictionary* dict,
+                       Diameter::Stack* diameter_stack,
+                       const std::string& dir,
+                       uint64_t max_bytes,
+                       int replay_rate,
+                       LastValueCache* stats_aggregator) :
+  AcrSpool(dir, max_bytes, replay_rate, stats_aggregator),
+  _dict(dict),
+  _diameter_stack(diameter_stack)
+{
+}
+
+bool RfAcrSpool::spool(const std::vector<std::string>& ccfs,
+                       const std::string& acr)
+{
+  return append(make_record(ccfs, acr));
+}
+
+// A record is the number of CCFs, then each CCF (as a 2 byte length and the
+// name), then the encoded ACR.
+std::string RfAcrSpool::make_record(const std::vector<std::string>& ccfs,
+                                    const std::string& acr)
+{
+  std::string record;
+  record.push_back((char)ccfs.size());
+
+  for (size_t ii = 0; ii < ccfs.size(); ii++)
+  {
+    uint16_t len = ccfs[ii].size();
+    record.append((const char*)&len, sizeof(len));
+    record.append(ccfs[ii]);
+  }
+
+  record.append(acr);
+  return record;
+}
+
+bool RfAcrSpool::parse_record(const std::string& record,
+                              std::vector<std::string>& ccfs,
+                              std::string& acr)
+{
+  if (record.empty())
+  {
+    return false;
+  }
+
+  size_t num_ccfs = (unsigned char)record[0];
+  size_t offset = 1;
+
+  for (size_t ii = 0; ii < num_ccfs; ii++)
+  {
+    uint16_t len;
+
+    if (offset + sizeof(len) > record.size())
+    {
+      return false;
+    }
+
+    memcpy(&len, record.data() + offset, sizeof(len));
+    offset += sizeof(len);
+
+    if (offset + len > record.size())
+    {
+      return false;
+    }
+
+    ccfs.push_back(record.substr(offset, len));
+    offset += len;
+  }
+
+  acr = record.substr(offset);
+  return !acr.empty();
+}
+
+void RfAcrSpool::deliver(const std::string& record, const DeliveryCallback& done)
+{
+  std::vector<std::string> ccfs;
+  std::string acr;
+
+  if (!parse_record(record, ccfs, acr))
+  {
+    // Retrying won't help, so move on.
+    TRC_ERROR("Discarding invalid spooled ACR");
+    done(true);
+    return;
+  }
+
+  SpoolTransaction::send(_dict, _diameter_stack, ccfs, 0, acr, done);
+}
+
+std::string RfAcrSpool::record_key(const std::string& record) const
+{
+  std::vector<std::string> ccfs;
+  std::string acr;
+  std::string session_id;
+
+  if ((parse_record(record, ccfs, acr)) &&
+      (Rf::AccountingRequest::encoded_session_id(acr, session_id)))
+  {
+    return session_id;
+  }
+
+  return "";
+}
@@ -0,0 +1,309 @@
+/**
+ * @file async_timer_client.cpp Asynchronous client for Chronos timers
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "async_timer_client.hpp"
+#include "log.h"
+
+AsyncTimerClient::AsyncTimerClient(ChronosConnection* conn,
+                                   unsigned int num_threads,
+                                   size_t max_queue,
+                                   ExceptionHandler* exception_handler,
+                                   LastValueCache* stats_aggregator) :
+  WorkerPool<TimerRequest*>(num_threads,
+                            max_queue,
+                            exception_handler,
+                            &AsyncTimerClient::discard,
+                            stats_aggregator,
+                            "ralf_timer",
+                            true),
+  _conn(conn),
+  _space_waiters(0),
+  _coalesced_stat(NULL),
+  _inline_stat(NULL)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_space_cond, NULL);
+
+  if (stats_aggregator != NULL)
+  {
+    _coalesced_stat = new StatisticCounter("ralf_timer_requests_coalesced",
+                                           stats_aggregator);
+    _inline_stat = new StatisticCounter("ralf_timer_requests_inline",
+                                        stats_aggregator);
+  }
+}
+
+AsyncTimerClient::~AsyncTimerClient()
+{
+  pthread_cond_destroy(&_space_cond);
+  pthread_mutex_destroy(&_lock);
+
+  delete _coalesced_stat; _coalesced_stat = NULL;
+  delete _inline_stat; _inline_stat = NULL;
+}
+
+void AsyncTimerClient::send_post(uint32_t interval,
+                                 uint32_t repeat_for,
+                                 const std::string& callback_uri,
+                                 const std::string& opaque_data,
+                                 SAS::TrailId trail,
+                                 const std::map<std::string, uint32_t>& tags,
+                                 TimerRequest::Completion completion)
+{
+  TimerRequest* req = new TimerRequest();
+  req->method = TimerRequest::POST;
+  req->interval = interval;
+  req->repeat_for = repeat_for;
+  req->callback_uri = callback_uri;
+  req->opaque_data = opaque_data;
+  req->trail = trail;
+  req->tags = tags;
+  req->completion = completion;
+  queue(req);
+}
+
+void AsyncTimerClient::send_put(const std::string& timer_id,
+                                uint32_t interval,
+                                uint32_t repeat_for,
+                                const std::string& callback_uri,
+                                const std::string& opaque_data,
+                                SAS::TrailId trail,
+                                const std::map<std::string, uint32_t>& tags,
+                                TimerRequest::Completion completion)
+{
+  TimerRequest* req = new TimerRequest();
+  req->method = TimerRequest::PUT;
+  req->timer_id = timer_id;
+  req->interval = interval;
+  req->repeat_for = repeat_for;
+  req->callback_uri = callback_uri;
+  req->opaque_data = opaque_data;
+  req->trail = trail;
+  req->tags = tags;
+  req->completion = completion;
+  queue(req);
+}
+
+void AsyncTimerClient::send_delete(const std::string& timer_id,
+                                   SAS::TrailId trail)
+{
+  TimerRequest* req = new TimerRequest();
+  req->method = TimerRequest::DELETE;
+  req->timer_id = timer_id;
+  req->interval = 0;
+  req->repeat_for = 0;
+  req->trail = trail;
+  queue(req);
+}
+
+void AsyncTimerClient::queue(TimerRequest* req)
+{
+  bool queued;
+
+  if (req->method == TimerRequest::POST)
+  {
+    // New timers don't have an ID yet, so nothing else can be queued for
+    // them.  Spread them by callback URI.
+    queued = add_work(req, _hash(req->callback_uri));
+  }
+  else
+  {
+    // Count the request before it's queued, so that a PUT ahead of a DELETE
+    // can't miss it.
+    size_t key_hash = _hash(req->timer_id);
+
+    pthread_mutex_lock(&_lock);
+    QueuedRequests& timer = _queued[req->timer_id];
+    timer.requests++;
+
+    if (req->method == TimerRequest::DELETE)
+    {
+      timer.deletes++;
+    }
+
+    queued = add_work(req, key_hash);
+
+    // If there are other requests for this timer queued, wait for room behind
+    // them.  The workers signal as they take each request.
+    while ((!queued) && (timer.requests > 1))
+    {
+      _space_waiters++;
+      queued = add_work(req, key_hash);
+
+      if (!queued)
+      {
+        pthread_cond_wait(&_space_cond, &_lock);
+      }
+
+      _space_waiters--;
+    }
+
+    if (!queued)
+    {
+      timer.requests--;
+
+      if (req->method == TimerRequest::DELETE)
+      {
+        timer.deletes--;
+      }
+
+      if (timer.requests == 0)
+      {
+        _queued.erase(req->timer_id);
+      }
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  if (!queued)
+  {
+    TRC_DEBUG("Timer request queue full, sending request inline");
+
+    if (_inline_stat != NULL)
+    {
+      _inline_stat->increment();
+    }
+
+    send(req);
+    delete req; req = NULL;
+  }
+}
+
+void AsyncTimerClient::process_work(TimerRequest*& req)
+{
+  bool superseded = false;
+
+  if (req->method != TimerRequest::POST)
+  {
+    pthread_mutex_lock(&_lock);
+    std::unordered_map<std::string, QueuedRequests>::iterator it =
+                                                   _queued.find(req->timer_id);
+
+    if (req->method == TimerRequest::PUT)
+    {
+      superseded = (it->second.deletes > 0);
+    }
+    else
+    {
+      it->second.deletes--;
+    }
+
+    if (--it->second.requests == 0)
+    {
+      _queued.erase(it);
+    }
+
+    pthread_mutex_unlock(&_lock);
+  }
+
+  // We've taken a request off the queue, so there's room for a caller that's
+  // waiting.
+  if (_space_waiters > 0)
+  {
+    pthread_mutex_lock(&_lock);
+    pthread_cond_broadcast(&_space_cond);
+    pthread_mutex_unlock(&_lock);
+  }
+
+  if (superseded)
+  {
+    TRC_DEBUG("Drop PUT for timer %s, which is about to be deleted",
+              req->timer_id.c_str());
+
+    if (_coalesced_stat != NULL)
+    {
+      _coalesced_stat->increment();
+    }
+  }
+  else
+  {
+    send(req);
+  }
+
+  delete req; req = NULL;
+}
+
+void AsyncTimerClient::send(TimerRequest* req)
+{
+  std::string timer_id = req->timer_id;
+  HTTPCode rc;
+
+  switch (req->method)
+  {
+  case TimerRequest::POST:
+    rc = _conn->send_post(timer_id,
+                          req->interval,
+                          req->repeat_for,
+                          req->callback_uri,
+                          req->opaque_data,
+                          req->trail,
+                          req->tags);
+    break;
+
+  case TimerRequest::PUT:
+    rc = _conn->send_put(timer_id,
+                         req->interval,
+                         req->repeat_for,
+                         req->callback_uri,
+                         req->opaque_data,
+                         req->trail,
+                         req->tags);
+    break;
+
+  case TimerRequest::DELETE:
+  default:
+    rc = _conn->send_delete(timer_id, req->trail);
+    break;
+  }
+
+  if (rc != HTTP_OK)
+  {
+    TRC_ERROR("Chronos request for timer %s failed: %ld", timer_id.c_str(), rc);
+  }
+
+  if (req->completion)
+  {
+    req->completion(rc, timer_id);
+  }
+}
+
+// LCOV_EXCL_START - only called on exceptions
+void AsyncTimerClient::discard(TimerRequest* req)
+{
+  delete req;
+}
+// LCOV_EXCL_STOP
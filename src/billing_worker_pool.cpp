@@ -0,0 +1,165 @@
+/**
+ * @file billing_worker_pool.cpp Pool of threads that run the session manager.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "billing_worker_pool.hpp"
+#include "session_store.h"
+#include "log.h"
+
+const size_t BillingWorkerPool::PENDING_SLOTS;
+thread_local int BillingWorkerPool::_current_slot = -1;
+
+BillingWorkerPool::BillingWorkerPool(SessionManager* sess_mgr,
+                                     unsigned int num_threads,
+                                     size_t max_queue,
+                                     ExceptionHandler* exception_handler,
+                                     LastValueCache* stats_aggregator,
+                                     bool ordered) :
+  WorkerPool<Message*>(num_threads,
+                       max_queue,
+                       exception_handler,
+                       NULL,
+                       stats_aggregator,
+                       "ralf_billing",
+                       ordered),
+  _sess_mgr(sess_mgr),
+  _ordered(ordered),
+  _pending(NULL),
+  _contention_avoided(0),
+  _contention_avoided_stat(NULL)
+{
+  if (_ordered)
+  {
+    _pending = new std::atomic<int>[PENDING_SLOTS];
+
+    for (size_t ii = 0; ii < PENDING_SLOTS; ii++)
+    {
+      _pending[ii] = 0;
+    }
+
+    if (stats_aggregator != NULL)
+    {
+      _contention_avoided_stat =
+        new StatisticCounter("ralf_billing_contention_avoided", stats_aggregator);
+    }
+  }
+}
+
+BillingWorkerPool::~BillingWorkerPool()
+{
+  delete[] _pending; _pending = NULL;
+
+  delete _contention_avoided_stat; _contention_avoided_stat = NULL;
+}
+
+bool BillingWorkerPool::add_message(Message* msg)
+{
+  if (!_ordered)
+  {
+    return add_work(msg);
+  }
+
+  std::string key = SessionStore::create_key(msg->call_id,
+                                             msg->role,
+                                             msg->function);
+  size_t key_hash = _hash(key);
+  std::atomic<int>& pending = _pending[key_hash % PENDING_SLOTS];
+
+  // Count the message before queuing it, so that the worker can't finish with
+  // it before it's been counted.
+  int count = pending++;
+
+  if (!add_work(msg, key_hash))
+  {
+    pending--;
+    return false;
+  }
+
+  if (count > 0)
+  {
+    // Without the lane this request would have raced with the earlier one.
+    TRC_DEBUG("Request for %s queued behind %d other(s)", key.c_str(), count);
+    _contention_avoided++;
+
+    if (_contention_avoided_stat != NULL)
+    {
+      _contention_avoided_stat->increment();
+    }
+  }
+
+  return true;
+}
+
+void BillingWorkerPool::process_work(Message*& msg)
+{
+  TRC_DEBUG("Handle the queued message");
+  begin_request(msg);
+
+  // The session manager takes ownership of the message object and is
+  // responsible for deleting it.
+  _sess_mgr->handle(msg);
+  msg = NULL;
+
+  end_request();
+}
+
+// The message may already have been deleted, so it's only used to say which
+// request failed.  Release its session so later requests for the session
+// aren't counted as queued behind it.
+void BillingWorkerPool::process_work_failed(Message*& msg)
+{
+  TRC_DEBUG("Billing request %p hit an exception", msg);
+  end_request();
+}
+
+void BillingWorkerPool::begin_request(Message* msg)
+{
+  if (_ordered)
+  {
+    std::string key = SessionStore::create_key(msg->call_id,
+                                               msg->role,
+                                               msg->function);
+    _current_slot = _hash(key) % PENDING_SLOTS;
+  }
+}
+
+void BillingWorkerPool::end_request()
+{
+  if (_current_slot >= 0)
+  {
+    _pending[_current_slot]--;
+    _current_slot = -1;
+  }
+}
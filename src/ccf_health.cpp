@@ -0,0 +1,203 @@
+/**
+ * @file ccf_health.cpp Tracks which CCFs are reachable.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include "ccf_health.hpp"
+#include "log.h"
+
+CcfHealthTracker::CcfHealthTracker(int failure_threshold,
+                                   int probe_interval_ms,
+                                   LastValueCache* stats_aggregator) :
+  _failure_threshold(failure_threshold),
+  _probe_interval_ms(probe_interval_ms),
+  _opened_stat(NULL),
+  _skipped_stat(NULL)
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  if (stats_aggregator != NULL)
+  {
+    _opened_stat = new StatisticCounter("ralf_ccf_circuit_opened", stats_aggregator);
+    _skipped_stat = new StatisticCounter("ralf_ccf_skipped", stats_aggregator);
+  }
+}
+
+CcfHealthTracker::~CcfHealthTracker()
+{
+  pthread_mutex_destroy(&_lock);
+  delete _opened_stat; _opened_stat = NULL;
+  delete _skipped_stat; _skipped_stat = NULL;
+}
+
+std::vector<std::string> CcfHealthTracker::order(const std::vector<std::string>& ccfs)
+{
+  std::vector<std::string> ordered;
+  std::vector<std::string> skipped;
+  uint64_t now = now_ms();
+
+  pthread_mutex_lock(&_lock);
+
+  for (std::vector<std::string>::const_iterator it = ccfs.begin();
+       it != ccfs.end();
+       ++it)
+  {
+    if (allow(_ccfs[*it], now))
+    {
+      ordered.push_back(*it);
+    }
+    else
+    {
+      skipped.push_back(*it);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (!skipped.empty())
+  {
+    TRC_DEBUG("Skipping %d failing CCFs", (int)skipped.size());
+
+    if (_skipped_stat != NULL)
+    {
+      _skipped_stat->increment();
+    }
+
+    ordered.insert(ordered.end(), skipped.begin(), skipped.end());
+  }
+
+  return ordered;
+}
+
+// Whether an ACR can be sent to a CCF.  Must be called with the lock held.
+bool CcfHealthTracker::allow(Health& health, uint64_t now)
+{
+  switch (health.state)
+  {
+  case CLOSED:
+    return true;
+
+  case OPEN:
+    if (now < health.retry_at_ms)
+    {
+      return false;
+    }
+
+    // Time to probe the CCF.  This ACR is the probe.
+    health.state = HALF_OPEN;
+    health.retry_at_ms = now + _probe_interval_ms;
+    return true;
+
+  case HALF_OPEN:
+    if (now < health.retry_at_ms)
+    {
+      // Still waiting for the outcome of the probe.
+      return false;
+    }
+
+    // We never heard how the probe went, for example because it was to a
+    // backup CCF and the primary answered first.  Probe again.
+    health.retry_at_ms = now + _probe_interval_ms;
+    return true;
+  }
+
+  return true; // LCOV_EXCL_LINE
+}
+
+void CcfHealthTracker::success(const std::string& ccf)
+{
+  pthread_mutex_lock(&_lock);
+
+  Health& health = _ccfs[ccf];
+
+  if (health.state != CLOSED)
+  {
+    TRC_STATUS("CCF %s is reachable again", ccf.c_str());
+  }
+
+  health.state = CLOSED;
+  health.failures = 0;
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void CcfHealthTracker::failure(const std::string& ccf)
+{
+  bool opened = false;
+  uint64_t now = now_ms();
+
+  pthread_mutex_lock(&_lock);
+
+  Health& health = _ccfs[ccf];
+  health.failures++;
+
+  if ((health.state == HALF_OPEN) ||
+      ((health.state == CLOSED) && (health.failures >= _failure_threshold)))
+  {
+    health.state = OPEN;
+    health.retry_at_ms = now + _probe_interval_ms;
+    opened = true;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  if (opened)
+  {
+    TRC_WARNING("CCF %s is failing, skipping it for %d ms",
+                ccf.c_str(), (int)_probe_interval_ms);
+
+    if (_opened_stat != NULL)
+    {
+      _opened_stat->increment();
+    }
+  }
+}
+
+CcfHealthTracker::State CcfHealthTracker::state(const std::string& ccf)
+{
+  pthread_mutex_lock(&_lock);
+  State state = _ccfs[ccf].state;
+  pthread_mutex_unlock(&_lock);
+
+  return state;
+}
+
+uint64_t CcfHealthTracker::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
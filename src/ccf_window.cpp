@@ -0,0 +1,220 @@
+/**
+ * @file ccf_window.cpp Limits the number of ACRs outstanding to each CCF.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+
+#include "ccf_window.hpp"
+#include "peer_message_sender.hpp"
+#include "log.h"
+
+CcfWindow::CcfWindow(int window_size,
+                     int max_queue,
+                     OverflowPolicy policy,
+                     LastValueCache* stats_aggregator) :
+  _window_size(window_size),
+  _max_queue(max_queue),
+  _policy(policy),
+  _occupancy_stat(NULL),
+  _queue_depth_stat(NULL),
+  _queue_wait_stat(NULL),
+  _overflow_stat(NULL)
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  if (stats_aggregator != NULL)
+  {
+    _occupancy_stat = new StatisticAccumulator("ralf_ccf_window_occupancy",
+                                               stats_aggregator);
+    _queue_depth_stat = new StatisticAccumulator("ralf_ccf_queue_depth",
+                                                 stats_aggregator);
+    _queue_wait_stat = new StatisticAccumulator("ralf_ccf_queue_wait_us",
+                                                stats_aggregator);
+    _overflow_stat = new StatisticCounter("ralf_ccf_queue_overflows",
+                                          stats_aggregator);
+  }
+}
+
+CcfWindow::~CcfWindow()
+{
+  pthread_mutex_destroy(&_lock);
+
+  delete _occupancy_stat; _occupancy_stat = NULL;
+  delete _queue_depth_stat; _queue_depth_stat = NULL;
+  delete _queue_wait_stat; _queue_wait_stat = NULL;
+  delete _overflow_stat; _overflow_stat = NULL;
+}
+
+CcfWindow::Result CcfWindow::acquire(const std::string& ccf,
+                                     PeerMessageSender* sender,
+                                     unsigned int attempt)
+{
+  pthread_mutex_lock(&_lock);
+  CcfState& state = _ccfs[ccf];
+
+  if (state.in_flight < _window_size)
+  {
+    int occupancy = ++state.in_flight;
+    pthread_mutex_unlock(&_lock);
+
+    if (_occupancy_stat != NULL)
+    {
+      _occupancy_stat->accumulate(occupancy);
+    }
+
+    return SEND;
+  }
+
+  Waiter waiter;
+  waiter.sender = sender;
+  waiter.attempt = attempt;
+  waiter.queued_us = now_us();
+
+  if (state.queue.size() < _max_queue)
+  {
+    state.queue.push_back(waiter);
+    size_t depth = state.queue.size();
+    pthread_mutex_unlock(&_lock);
+
+    if (_queue_depth_stat != NULL)
+    {
+      _queue_depth_stat->accumulate(depth);
+    }
+
+    return QUEUED;
+  }
+
+  if (_overflow_stat != NULL)
+  {
+    _overflow_stat->increment();
+  }
+
+  if ((_policy == SHED) && (!state.queue.empty()))
+  {
+    // Make room by shedding the oldest queued ACR, which is the one most
+    // likely to have been retried or timed out by now anyway.
+    Waiter shed = state.queue.front();
+    state.queue.pop_front();
+    state.queue.push_back(waiter);
+    pthread_mutex_unlock(&_lock);
+
+    TRC_DEBUG("Queue for %s is full, shedding oldest ACR", ccf.c_str());
+    shed.sender->window_open(shed.attempt, false);
+    return QUEUED;
+  }
+
+  pthread_mutex_unlock(&_lock);
+  TRC_DEBUG("Queue for %s is full", ccf.c_str());
+  return FULL;
+}
+
+void CcfWindow::release(const std::string& ccf)
+{
+  while (true)
+  {
+    pthread_mutex_lock(&_lock);
+    CcfState& state = _ccfs[ccf];
+
+    if (state.queue.empty())
+    {
+      state.in_flight--;
+      pthread_mutex_unlock(&_lock);
+      return;
+    }
+
+    // Hand the space on to the oldest queued ACR.
+    Waiter waiter = state.queue.front();
+    state.queue.pop_front();
+    pthread_mutex_unlock(&_lock);
+
+    if (_queue_wait_stat != NULL)
+    {
+      _queue_wait_stat->accumulate(now_us() - waiter.queued_us);
+    }
+
+    if (waiter.sender->window_open(waiter.attempt, true))
+    {
+      return;
+    }
+
+    // The sender no longer needed to send (another CCF has answered), so
+    // try the next one.
+  }
+}
+
+int CcfWindow::in_flight(const std::string& ccf)
+{
+  pthread_mutex_lock(&_lock);
+  int in_flight = _ccfs[ccf].in_flight;
+  pthread_mutex_unlock(&_lock);
+  return in_flight;
+}
+
+size_t CcfWindow::queue_depth(const std::string& ccf)
+{
+  pthread_mutex_lock(&_lock);
+  size_t depth = _ccfs[ccf].queue.size();
+  pthread_mutex_unlock(&_lock);
+  return depth;
+}
+
+bool CcfWindow::parse_policy(const std::string& name, OverflowPolicy& policy)
+{
+  if (name == "failover")
+  {
+    policy = FAILOVER;
+  }
+  else if (name == "drop")
+  {
+    policy = DROP;
+  }
+  else if (name == "shed")
+  {
+    policy = SHED;
+  }
+  else
+  {
+    return false;
+  }
+
+  return true;
+}
+
+uint64_t CcfWindow::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
@@ -37,6 +37,7 @@
 #include "handlers.hpp"
 #include "message.hpp"
 #include "log.h"
+#include "utils.h"
 
 #include "rapidjson/rapidjson.h"
 #include "rapidjson/writer.h"
@@ -67,7 +68,14 @@ void BillingTask::run()
   }
 
   Message* msg = NULL;
-  HTTPCode rc = parse_body(call_id(), timer_interim, _req.get_rx_body(), &msg, trail());
+  std::string body = _req.get_rx_body();
+  HTTPCode rc = HTTP_OK;
+
+  if ((!timer_interim) ||
+      (!parse_timer_interim(call_id(), body, &msg, trail())))
+  {
+    rc = parse_body(call_id(), timer_interim, body, &msg, trail());
+  }
 
   if (rc != HTTP_OK)
   {
@@ -75,6 +83,38 @@ void BillingTask::run()
     SAS::report_event(rejected);
     send_http_reply(rc);
   }
+  else if ((msg != NULL) && (timer_interim) && (_pacer != NULL))
+  {
+    // The pacer passes the message on once it's its turn.  If its queue is
+    // full we're overloaded, so reject the request.
+    if (_pacer->add(msg))
+    {
+      msg = NULL;
+      send_http_reply(rc);
+    }
+    else
+    {
+      TRC_WARNING("Interim pacing queue is full, rejecting request");
+      delete msg; msg = NULL;
+      send_http_reply(HTTP_SERVER_UNAVAILABLE);
+    }
+  }
+  else if ((msg != NULL) && (_pool != NULL))
+  {
+    // Queue the message for a billing worker.  If the queue is full we're
+    // overloaded, so reject the request.
+    if (_pool->add_message(msg))
+    {
+      msg = NULL;
+      send_http_reply(rc);
+    }
+    else
+    {
+      TRC_WARNING("Billing queue is full, rejecting request");
+      delete msg; msg = NULL;
+      send_http_reply(HTTP_SERVER_UNAVAILABLE);
+    }
+  }
   else
   {
     send_http_reply(rc);
@@ -92,17 +132,184 @@ void BillingTask::run()
 
   delete this;
 }
+
+bool BillingTask::timer_popped(const BillingHandlerConfig* cfg,
+                               const std::string& callback_uri,
+                               const std::string& opaque_data)
+{
+  // The callback URI is /call-id/<call ID>?timer-interim=true.
+  std::string path = callback_uri.substr(0, callback_uri.find('?'));
+  std::string call_id = Utils::url_unescape(path.substr(path.rfind('/') + 1));
+
+  SAS::TrailId trail = SAS::new_trail(0);
+  SAS::Marker cid_assoc(trail, MARKER_ID_SIP_CALL_ID, 0);
+  cid_assoc.add_var_param(call_id);
+  SAS::report_marker(cid_assoc);
+
+  SAS::Event timer_pop(trail, SASEvent::INTERIM_TIMER_POPPED, 0);
+  SAS::report_event(timer_pop);
+
+  Message* msg = NULL;
+  HTTPCode rc = HTTP_OK;
+
+  if (!parse_timer_interim(call_id, opaque_data, &msg, trail))
+  {
+    std::string body = opaque_data;
+    rc = parse_body(call_id, true, body, &msg, trail);
+  }
+
+  if (rc != HTTP_OK)
+  {
+    SAS::Event rejected(trail, SASEvent::REQUEST_REJECTED_INVALID_JSON, 0);
+    SAS::report_event(rejected);
+  }
+  else if (msg != NULL)
+  {
+    // If the pacing or billing queue is full, the wheel offers the pop again
+    // later, rather than it being handled on the wheel's thread.
+    bool queued = (cfg->pacer != NULL) ?
+                    cfg->pacer->add(msg) : handle_message(cfg, msg);
+
+    if (!queued)
+    {
+      delete msg; msg = NULL;
+      return false;
+    }
+
+    msg = NULL;
+  }
+
+  return true;
+}
 //LCOV_EXCL_STOP
 
+bool BillingTask::handle_message(const BillingHandlerConfig* cfg, Message* msg)
+{
+  if (cfg->pool != NULL)
+  {
+    return cfg->pool->add_message(msg);
+  }
+
+  // The session manager takes ownership of the message object and is
+  // responsible for deleting it.
+  cfg->mgr->handle(msg);
+  return true;
+}
+
+// The body the session manager gives Chronos for interim timers is always
+// this, with the role and function filled in.
+static const char TIMER_INTERIM_PREFIX[] =
+  "{\"event\":{\"Service-Information\":{\"IMS-Information\":{\"Role-Of-Node\":";
+static const char TIMER_INTERIM_INFIX[] = ",\"Node-Functionality\":";
+static const char TIMER_INTERIM_SUFFIX[] = "}},\"Accounting-Record-Type\":3}}";
+
+// Matches the literal at pos in body, and moves pos past it.
+template <size_t N>
+static bool match_literal(const std::string& body, size_t& pos, const char (&literal)[N])
+{
+  if (body.compare(pos, N - 1, literal) != 0)
+  {
+    return false;
+  }
+
+  pos += N - 1;
+  return true;
+}
+
+// Matches a small non-negative integer at pos in body, and moves pos past it.
+static bool match_int(const std::string& body, size_t& pos, int& value)
+{
+  size_t start = pos;
+  value = 0;
+
+  while ((pos < body.size()) &&
+         (pos - start < 4) &&
+         (body[pos] >= '0') &&
+         (body[pos] <= '9'))
+  {
+    value = value * 10 + (body[pos] - '0');
+    pos++;
+  }
+
+  return (pos > start);
+}
+
+bool BillingTask::parse_timer_interim(const std::string& call_id,
+                                      const std::string& reqbody,
+                                      Message** msg,
+                                      SAS::TrailId trail)
+{
+  size_t pos = 0;
+  int role_of_node;
+  int node_functionality;
+
+  if ((!match_literal(reqbody, pos, TIMER_INTERIM_PREFIX)) ||
+      (!match_int(reqbody, pos, role_of_node)) ||
+      (!match_literal(reqbody, pos, TIMER_INTERIM_INFIX)) ||
+      (!match_int(reqbody, pos, node_functionality)) ||
+      (!match_literal(reqbody, pos, TIMER_INTERIM_SUFFIX)) ||
+      (pos != reqbody.size()))
+  {
+    TRC_DEBUG("Timer-interim body doesn't match the template, parse it");
+    return false;
+  }
+
+  TRC_DEBUG("Handling timer-interim request, body:\n%s", reqbody.c_str());
+
+  Rf::AccountingRecordType record_type(3);
+  SAS::Event incoming(trail, SASEvent::INCOMING_REQUEST, 0);
+  incoming.add_static_param(record_type.code());
+  incoming.add_static_param(node_functionality);
+  SAS::report_event(incoming);
+
+  // Build the same document that parsing the body would have.  The member
+  // names are constants, so aren't copied, and the values are allocated from
+  // the inline chunk.
+  ReceivedBody* received = new ReceivedBody();
+  rapidjson::Document& body = received->doc;
+  rapidjson::MemoryPoolAllocator<>& allocator = received->allocator;
+
+  rapidjson::Value ims_info(rapidjson::kObjectType);
+  ims_info.AddMember("Role-Of-Node", role_of_node, allocator);
+  ims_info.AddMember("Node-Functionality", node_functionality, allocator);
+
+  rapidjson::Value service_info(rapidjson::kObjectType);
+  service_info.AddMember("IMS-Information", ims_info, allocator);
+
+  rapidjson::Value event(rapidjson::kObjectType);
+  event.AddMember("Service-Information", service_info, allocator);
+  event.AddMember("Accounting-Record-Type", 3, allocator);
+
+  body.SetObject();
+  body.AddMember("event", event, allocator);
+
+  *msg = new Message(received,
+                     call_id,
+                     (role_of_node_t)role_of_node,
+                     (node_functionality_t)node_functionality,
+                     record_type,
+                     0,
+                     trail,
+                     true);
+  return true;
+}
+
 HTTPCode BillingTask::parse_body(std::string call_id,
                                  bool timer_interim,
-                                 std::string reqbody,
+                                 std::string& reqbody,
                                  Message** msg,
                                  SAS::TrailId trail)
 {
-  rapidjson::Document* body = new rapidjson::Document();
-  std::string bodys = reqbody;
-  body->Parse<0>(bodys.c_str());
+  // Parsing in-situ destroys the source text, so keep a copy if we might need
+  // to log an unparseable body.
+  std::string raw_body;
+  if (Log::enabled(Log::DEBUG_LEVEL))
+  {
+    raw_body = reqbody;
+  }
+
+  ReceivedBody* received = new ReceivedBody(reqbody);
+  rapidjson::Document* body = &received->doc;
   std::vector<std::string> ccfs;
   uint32_t session_refresh_time = 0;
   role_of_node_t role_of_node;
@@ -115,7 +322,7 @@ HTTPCode BillingTask::parse_body(std::string call_id,
     {
       // Print the body from the source string.  We can't pretty print an
       // invalid document.
-      TRC_DEBUG("Handling request, Body:\n%s", reqbody.c_str());
+      TRC_DEBUG("Handling request, Body:\n%s", raw_body.c_str());
     }
     else
     {
@@ -133,7 +340,7 @@ HTTPCode BillingTask::parse_body(std::string call_id,
       !(*body)["event"].IsObject())
   {
     TRC_WARNING("JSON document was either not valid or did not have an 'event' key");
-    delete body;
+    delete received;
     return HTTP_BAD_REQUEST;
   }
 
@@ -145,7 +352,7 @@ HTTPCode BillingTask::parse_body(std::string call_id,
       (!(*body)["event"]["Service-Information"]["IMS-Information"].IsObject()))
   {
     TRC_ERROR("IMS-Information not included in the event description");
-    delete body;
+    delete received;
     return HTTP_BAD_REQUEST;
   }
   else
@@ -155,7 +362,7 @@ HTTPCode BillingTask::parse_body(std::string call_id,
     if ((role_of_node_json == ims_information_json.MemberEnd()) || !(role_of_node_json->value.IsInt()))
     {
       TRC_ERROR("No Role-Of-Node in IMS-Information");
-      delete body;
+      delete received;
       return HTTP_BAD_REQUEST;
     }
 
@@ -165,7 +372,7 @@ HTTPCode BillingTask::parse_body(std::string call_id,
     if ((node_function_json == ims_information_json.MemberEnd()) || !(node_function_json->value.IsInt()))
     {
       TRC_ERROR("No Node-Functionality in IMS-Information");
-      delete body;
+      delete received;
       return HTTP_BAD_REQUEST;
     }
 
@@ -178,7 +385,7 @@ HTTPCode BillingTask::parse_body(std::string call_id,
         ((*body)["event"]["Accounting-Record-Type"].IsInt())))
   {
     TRC_WARNING("Accounting-Record-Type not available in JSON");
-    delete body;
+    delete received;
     return HTTP_BAD_REQUEST;
   }
 
@@ -186,7 +393,7 @@ HTTPCode BillingTask::parse_body(std::string call_id,
   if (!record_type.isValid())
   {
     TRC_ERROR("Accounting-Record-Type was not one of START/INTERIM/STOP/EVENT");
-    delete body;
+    delete received;
     return HTTP_BAD_REQUEST;
   }
 
@@ -217,7 +424,7 @@ HTTPCode BillingTask::parse_body(std::string call_id,
       missing_peers.add_static_param(record_type.code());
       SAS::report_event(missing_peers);
 
-      delete body;
+      delete received;
       return HTTP_OK;
     }
 
@@ -226,7 +433,7 @@ HTTPCode BillingTask::parse_body(std::string call_id,
         ((*body)["peers"]["ccf"].Size() == 0))
     {
       TRC_ERROR("JSON lacked a 'ccf' array, or the array was empty (mandatory for START/EVENT)");
-      delete body;
+      delete received;
       return HTTP_BAD_REQUEST;
     }
 
@@ -235,7 +442,7 @@ HTTPCode BillingTask::parse_body(std::string call_id,
       if (!(*body)["peers"]["ccf"][i].IsString())
       {
         TRC_ERROR("JSON contains a 'ccf' array but not all the elements are strings");
-        delete body;
+        delete received;
         return HTTP_BAD_REQUEST;
       }
       TRC_DEBUG("Adding CCF %s", (*body)["peers"]["ccf"][i].GetString());
@@ -243,10 +450,10 @@ HTTPCode BillingTask::parse_body(std::string call_id,
     }
   }
 
-  *msg = new Message(call_id,
+  *msg = new Message(received,
+                     call_id,
                      role_of_node,
                      node_functionality,
-                     body,
                      record_type,
                      session_refresh_time,
                      trail,
@@ -0,0 +1,341 @@
+/**
+ * @file interim_pacer.cpp Paces the processing of timer-interim requests
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#include "interim_pacer.hpp"
+#include "log.h"
+
+const uint64_t InterimPacer::RETRY_MS;
+
+InterimPacer::InterimPacer(ReleaseCallback release,
+                           int rate,
+                           size_t max_queue,
+                           LastValueCache* stats_aggregator) :
+  _release(release),
+  _rate(rate),
+  _max_queue(max_queue),
+  _max_tokens(std::max(rate / 10.0, 1.0)),
+  _running(false),
+  _tokens(_max_tokens),
+  _last_refill_ms(0),
+  _retry_ms(0),
+  _second_start_ms(0),
+  _arrivals(0),
+  _releases(0),
+  _depth_stat(NULL),
+  _overflows_stat(NULL),
+  _arrivals_stat(NULL),
+  _releases_stat(NULL)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  if (stats_aggregator != NULL)
+  {
+    _depth_stat = new StatisticAccumulator("ralf_interim_pacer_depth",
+                                           stats_aggregator);
+    _overflows_stat = new StatisticCounter("ralf_interim_pacer_overflows",
+                                           stats_aggregator);
+    _arrivals_stat = new StatisticAccumulator("ralf_interim_pacer_arrivals",
+                                              stats_aggregator);
+    _releases_stat = new StatisticAccumulator("ralf_interim_pacer_releases",
+                                              stats_aggregator);
+  }
+}
+
+InterimPacer::~InterimPacer()
+{
+  stop();
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+
+  delete _depth_stat; _depth_stat = NULL;
+  delete _overflows_stat; _overflows_stat = NULL;
+  delete _arrivals_stat; _arrivals_stat = NULL;
+  delete _releases_stat; _releases_stat = NULL;
+}
+
+bool InterimPacer::start()
+{
+  _running = true;
+  int rc = pthread_create(&_thread, NULL, thread_fn, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start interim pacing thread: %d", rc);
+    _running = false;
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  return true;
+}
+
+void InterimPacer::stop()
+{
+  pthread_mutex_lock(&_lock);
+  bool running = _running;
+  _running = false;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  if (running)
+  {
+    pthread_join(_thread, NULL);
+  }
+
+  // Release anything still queued, without pacing it.
+  pthread_mutex_lock(&_lock);
+  std::deque<Message*> queue;
+  queue.swap(_queue);
+  pthread_mutex_unlock(&_lock);
+
+  for (std::deque<Message*>::iterator msg = queue.begin();
+       msg != queue.end();
+       ++msg)
+  {
+    if (!_release(*msg))
+    {
+      TRC_WARNING("Dropping paced timer-interim request on shutdown");
+      delete *msg;
+    }
+  }
+}
+
+bool InterimPacer::add(Message* msg)
+{
+  uint64_t now = now_ms();
+
+  pthread_mutex_lock(&_lock);
+  refill(now);
+  _arrivals++;
+
+  if (_queue.size() >= _max_queue)
+  {
+    pthread_mutex_unlock(&_lock);
+
+    TRC_DEBUG("Interim pacing queue is full, refusing request");
+
+    if (_overflows_stat != NULL)
+    {
+      _overflows_stat->increment();
+    }
+
+    return false;
+  }
+
+  _queue.push_back(msg);
+  size_t depth = _queue.size();
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  if (_depth_stat != NULL)
+  {
+    _depth_stat->accumulate(depth);
+  }
+
+  return true;
+}
+
+size_t InterimPacer::depth()
+{
+  pthread_mutex_lock(&_lock);
+  size_t depth = _queue.size();
+  pthread_mutex_unlock(&_lock);
+  return depth;
+}
+
+uint64_t InterimPacer::release(uint64_t now_ms)
+{
+  std::vector<Message*> released;
+
+  pthread_mutex_lock(&_lock);
+  refill(now_ms);
+
+  // If the last message we offered was refused, wait before offering it
+  // again.
+  while ((now_ms >= _retry_ms) && (!_queue.empty()) && (_tokens >= 1.0))
+  {
+    released.push_back(_queue.front());
+    _queue.pop_front();
+    _tokens -= 1.0;
+  }
+
+  if (released.empty())
+  {
+    uint64_t wait_ms = next_wait_ms(now_ms);
+    pthread_mutex_unlock(&_lock);
+    return wait_ms;
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  size_t accepted = 0;
+
+  while ((accepted < released.size()) && (_release(released[accepted])))
+  {
+    accepted++;
+  }
+
+  pthread_mutex_lock(&_lock);
+  _releases += accepted;
+
+  if (accepted < released.size())
+  {
+    // Put the refused message and the ones after it back, in order, and give
+    // back their tokens.
+    TRC_DEBUG("Paced request refused, offering it again shortly");
+    _queue.insert(_queue.begin(), released.begin() + accepted, released.end());
+    _tokens = std::min(_tokens + (released.size() - accepted), _max_tokens);
+    _retry_ms = now_ms + RETRY_MS;
+  }
+
+  size_t depth = _queue.size();
+  uint64_t wait_ms = next_wait_ms(now_ms);
+  pthread_mutex_unlock(&_lock);
+
+  if (_depth_stat != NULL)
+  {
+    _depth_stat->accumulate(depth);
+  }
+
+  return wait_ms;
+}
+
+uint64_t InterimPacer::next_wait_ms(uint64_t now_ms)
+{
+  if (now_ms < _retry_ms)
+  {
+    return _retry_ms - now_ms;
+  }
+
+  return (_tokens >= 1.0) ? 0 : (uint64_t)((1.0 - _tokens) * 1000 / _rate) + 1;
+}
+
+uint64_t InterimPacer::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void* InterimPacer::thread_fn(void* pacer)
+{
+  ((InterimPacer*)pacer)->thread();
+  return NULL;
+}
+
+void InterimPacer::thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (_running)
+  {
+    pthread_mutex_unlock(&_lock);
+    uint64_t wait_ms = release(now_ms());
+    pthread_mutex_lock(&_lock);
+
+    if (!_running)
+    {
+      break;
+    }
+
+    // If there's nothing to release, wake up anyway at least once a second
+    // so the per-second statistics are reported.
+    if (_queue.empty())
+    {
+      wait_ms = 1000;
+    }
+    else if (wait_ms == 0)
+    {
+      continue;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t wait_ns = wait_ms * 1000000;
+    ts.tv_sec += (ts.tv_nsec + wait_ns) / 1000000000;
+    ts.tv_nsec = (ts.tv_nsec + wait_ns) % 1000000000;
+    pthread_cond_timedwait(&_cond, &_lock, &ts);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void InterimPacer::refill(uint64_t now_ms)
+{
+  if (_last_refill_ms == 0)
+  {
+    _last_refill_ms = now_ms;
+    _second_start_ms = now_ms;
+  }
+
+  if (now_ms > _last_refill_ms)
+  {
+    _tokens = std::min(_tokens + (now_ms - _last_refill_ms) * _rate / 1000.0,
+                       _max_tokens);
+    _last_refill_ms = now_ms;
+  }
+
+  // Report each second that has finished.  Seconds with nothing in are
+  // reported too, but only the last minute of them if we've been idle.
+  if (now_ms >= _second_start_ms + 60000)
+  {
+    _second_start_ms = now_ms - 60000;
+  }
+
+  while (now_ms >= _second_start_ms + 1000)
+  {
+    if (_arrivals_stat != NULL)
+    {
+      _arrivals_stat->accumulate(_arrivals);
+      _releases_stat->accumulate(_releases);
+    }
+
+    _arrivals = 0;
+    _releases = 0;
+    _second_start_ms += 1000;
+  }
+}
@@ -55,6 +55,7 @@
 #include "saslogger.h"
 #include "rf.h"
 #include "peer_message_sender_factory.hpp"
+#include "ralf_transaction.hpp"
 #include "sas.h"
 #include "load_monitor.h"
 #include "diameterresolver.h"
@@ -63,6 +64,15 @@
 #include "exception_handler.h"
 #include "ralf_alarmdefinition.h"
 #include "namespace_hop.h"
+#include "zmq_lvc.h"
+#include "billing_worker_pool.hpp"
+#include "ccf_response_pool.hpp"
+#include "task_pool.hpp"
+#include "async_timer_client.hpp"
+#include "timer_wheel.hpp"
+#include "interim_pacer.hpp"
+#include "session_replicator.hpp"
+#include "session_cache.hpp"
 
 enum OptionTypes
 {
@@ -79,11 +89,40 @@ enum OptionTypes
   SAS_USE_SIGNALING_IF,
   PIDFILE,
   DAEMON,
+  BILLING_THREADS,
+  BILLING_QUEUE_SIZE,
+  BILLING_ORDERED,
+  SESSION_CACHE_SIZE,
+  SPLIT_RECORD_NUMBER,
+  CCF_FAILURE_THRESHOLD,
+  CCF_PROBE_INTERVAL_MS,
+  ACR_HEDGE_PERCENTILE,
+  ACR_HEDGE_BUDGET,
+  CCF_WINDOW,
+  CCF_QUEUE_SIZE,
+  CCF_OVERFLOW_POLICY,
+  CCF_TIMEOUT_MIN_MS,
+  CCF_TIMEOUT_MAX_MS,
+  ACR_SPOOL_DIR,
+  ACR_SPOOL_SIZE,
+  ACR_SPOOL_REPLAY_RATE,
+  CCF_RESPONSE_THREADS,
+  CCF_RESPONSE_QUEUE_SIZE,
+  TASK_THREADS,
+  TIMER_THREADS,
+  LAZY_TIMER_UPDATES,
+  TIMER_WHEEL,
+  TIMER_JITTER,
+  INTERIM_RATE,
+  REMOTE_STORE,
+  REPLICATION_MAX_LAG,
+  REPLICATION_THREADS,
+  REMOTE_LOOKUP_TIMEOUT,
 };
 
 enum struct MemcachedWriteFormat
 {
-  BINARY, JSON
+  BINARY, JSON, COMPACT
 };
 
 struct options
@@ -115,6 +154,35 @@ struct options
   std::string pidfile;
   bool daemon;
   bool sas_signaling_if;
+  int billing_threads;
+  int billing_queue_size;
+  bool billing_ordered;
+  int session_cache_size;
+  bool split_record_number;
+  int ccf_failure_threshold;
+  int ccf_probe_interval_ms;
+  int acr_hedge_percentile;
+  int acr_hedge_budget;
+  int ccf_window;
+  int ccf_queue_size;
+  CcfWindow::OverflowPolicy ccf_overflow_policy;
+  int ccf_timeout_min_ms;
+  int ccf_timeout_max_ms;
+  std::string acr_spool_dir;
+  int acr_spool_size;
+  int acr_spool_replay_rate;
+  int ccf_response_threads;
+  int ccf_response_queue_size;
+  int task_threads;
+  int timer_threads;
+  bool lazy_timer_updates;
+  bool timer_wheel;
+  int timer_jitter;
+  int interim_rate;
+  std::map<std::string, std::string> remote_stores;
+  int replication_max_lag_ms;
+  int replication_threads;
+  int remote_lookup_timeout_ms;
 };
 
 const static struct option long_opt[] =
@@ -143,6 +211,35 @@ const static struct option long_opt[] =
   {"pidfile",                     required_argument, NULL, PIDFILE},
   {"daemon",                      no_argument,       NULL, DAEMON},
   {"sas-use-signaling-interface", no_argument,       NULL, SAS_USE_SIGNALING_IF},
+  {"billing-threads",             required_argument, NULL, BILLING_THREADS},
+  {"billing-queue-size",          required_argument, NULL, BILLING_QUEUE_SIZE},
+  {"billing-ordered",             no_argument,       NULL, BILLING_ORDERED},
+  {"session-cache-size",          required_argument, NULL, SESSION_CACHE_SIZE},
+  {"split-record-number",         no_argument,       NULL, SPLIT_RECORD_NUMBER},
+  {"ccf-failure-threshold",       required_argument, NULL, CCF_FAILURE_THRESHOLD},
+  {"ccf-probe-interval-ms",       required_argument, NULL, CCF_PROBE_INTERVAL_MS},
+  {"acr-hedge-percentile",        required_argument, NULL, ACR_HEDGE_PERCENTILE},
+  {"acr-hedge-budget",            required_argument, NULL, ACR_HEDGE_BUDGET},
+  {"ccf-window",                  required_argument, NULL, CCF_WINDOW},
+  {"ccf-queue-size",              required_argument, NULL, CCF_QUEUE_SIZE},
+  {"ccf-overflow-policy",         required_argument, NULL, CCF_OVERFLOW_POLICY},
+  {"ccf-timeout-min-ms",          required_argument, NULL, CCF_TIMEOUT_MIN_MS},
+  {"ccf-timeout-max-ms",          required_argument, NULL, CCF_TIMEOUT_MAX_MS},
+  {"acr-spool-dir",               required_argument, NULL, ACR_SPOOL_DIR},
+  {"acr-spool-size",              required_argument, NULL, ACR_SPOOL_SIZE},
+  {"acr-spool-replay-rate",       required_argument, NULL, ACR_SPOOL_REPLAY_RATE},
+  {"ccf-response-threads",        required_argument, NULL, CCF_RESPONSE_THREADS},
+  {"ccf-response-queue-size",     required_argument, NULL, CCF_RESPONSE_QUEUE_SIZE},
+  {"task-threads",                required_argument, NULL, TASK_THREADS},
+  {"timer-threads",               required_argument, NULL, TIMER_THREADS},
+  {"lazy-timer-updates",          no_argument,       NULL, LAZY_TIMER_UPDATES},
+  {"timer-wheel",                 no_argument,       NULL, TIMER_WHEEL},
+  {"timer-jitter",                required_argument, NULL, TIMER_JITTER},
+  {"interim-rate",                required_argument, NULL, INTERIM_RATE},
+  {"remote-store",                required_argument, NULL, REMOTE_STORE},
+  {"replication-max-lag",         required_argument, NULL, REPLICATION_MAX_LAG},
+  {"replication-threads",         required_argument, NULL, REPLICATION_THREADS},
+  {"remote-lookup-timeout",       required_argument, NULL, REMOTE_LOOKUP_TIMEOUT},
   {NULL,                          0,                 NULL, 0},
 };
 
@@ -173,7 +270,8 @@ void usage(void)
        "                            specified, SAS is disabled\n"
        "     --memcached-write-format\n"
        "                            The data format to use when writing sessions\n"
-       "                            to memcached. Values are 'binary' and 'json'\n"
+       "                            to memcached. Values are 'binary', 'json' and\n"
+       "                            'compact'\n"
        "                            (defaults to 'json')\n"
        "     --target-latency-us <usecs>\n"
        "                            Target latency above which throttling applies (default: 100000)\n"
@@ -193,6 +291,97 @@ void usage(void)
        "     --sas-use-signaling-interface\n"
        "                            Whether SAS traffic is to be dispatched over the signaling network\n"
        "                            interface rather than the default management interface\n"
+       "     --billing-threads N    Number of threads that process billing requests. If 0,\n"
+       "                            requests are processed on the HTTP threads (default: 0)\n"
+       "     --billing-queue-size N Maximum number of billing requests queued for the billing\n"
+       "                            threads. Requests are rejected when it is full (default: 10000)\n"
+       "     --billing-ordered      Give each billing thread its own queue, and queue all requests\n"
+       "                            for a session to the same thread, so that they are processed\n"
+       "                            in order and don't contend with each other\n"
+       "     --session-cache-size N Maximum size, in MB, of the in-process cache of session bodies\n"
+       "                            read from memcached. Only used with --split-record-number.\n"
+       "                            If 0, sessions are not cached (default: 0)\n"
+       "     --split-record-number  Store each session's accounting record number separately\n"
+       "                            from the rest of the session, so that INTERIMs only need to\n"
+       "                            update the record number. All nodes must use the same setting\n"
+       "     --ccf-failure-threshold N\n"
+       "                            Number of consecutive failures to reach a CCF after which it is\n"
+       "                            skipped (tried last) until it has been probed successfully.\n"
+       "                            If 0, failing CCFs are not skipped (default: 0)\n"
+       "     --ccf-probe-interval-ms <msecs>\n"
+       "                            How long to skip a failing CCF before probing it (default: 5000)\n"
+       "     --acr-hedge-percentile N\n"
+       "                            If a CCF takes longer than this percentile of recent ACR\n"
+       "                            latencies to answer, also send the ACR to the next CCF and use\n"
+       "                            whichever answers first. If 0, ACRs are not hedged (default: 0)\n"
+       "     --acr-hedge-budget N   Maximum percentage of ACRs to hedge (default: 5)\n"
+       "     --ccf-window N         Maximum number of ACRs outstanding to each CCF. Further ACRs\n"
+       "                            are queued. If 0, there is no limit (default: 0)\n"
+       "     --ccf-queue-size N     Maximum number of ACRs queued for each CCF when its window is\n"
+       "                            full (default: 1000)\n"
+       "     --ccf-overflow-policy <failover|drop|shed>\n"
+       "                            What to do with an ACR when its CCF's queue is full: send it\n"
+       "                            to the next CCF, fail it, or fail the oldest queued ACR\n"
+       "                            instead (default: failover)\n"
+       "     --ccf-timeout-min-ms <msecs>\n"
+       "                            Minimum timeout for ACRs when timeouts are based on each CCF's\n"
+       "                            round trip time (default: 50)\n"
+       "     --ccf-timeout-max-ms <msecs>\n"
+       "                            Maximum timeout for ACRs. If set, each ACR times out after a\n"
+       "                            multiple of its CCF's smoothed round trip time, within this\n"
+       "                            maximum and the minimum above. If 0, the Diameter stack's\n"
+       "                            default timeout is used (default: 0)\n"
+       "     --acr-spool-dir <directory>\n"
+       "                            Directory to keep INTERIM, STOP and EVENT ACRs in when no CCF\n"
+       "                            can be reached, until one can. If not set, such ACRs are\n"
+       "                            discarded\n"
+       "     --acr-spool-size N     Maximum size, in MB, of the ACR spool (default: 1024)\n"
+       "     --acr-spool-replay-rate N\n"
+       "                            Maximum number of spooled ACRs to send per second once a CCF\n"
+       "                            can be reached (default: 100)\n"
+       "     --ccf-response-threads N\n"
+       "                            Number of threads that process CCF answers. If 0, answers are\n"
+       "                            processed on the Diameter stack's threads (default: 0)\n"
+       "     --ccf-response-queue-size N\n"
+       "                            Maximum number of CCF answers queued for the CCF response\n"
+       "                            threads. When it is full, answers are processed on the\n"
+       "                            Diameter stack's threads (default: 10000)\n"
+       "     --task-threads N       Number of threads used to run a request's Chronos and session\n"
+       "                            store operations concurrently. If 0, they are run one after\n"
+       "                            another (default: 0)\n"
+       "     --timer-threads N      Number of threads that send timer requests to Chronos, so that\n"
+       "                            billing requests don't wait for them. If 0, timer requests are\n"
+       "                            sent on the thread processing the billing request (default: 0)\n"
+       "     --lazy-timer-updates   Only update a session's Chronos timer when its interval changes\n"
+       "                            or it is about to stop popping, rather than on every INTERIM.\n"
+       "                            Only set this once every node supports it\n"
+       "     --timer-wheel          Run interim timers in-process rather than in Chronos. Timers are\n"
+       "                            kept in the session store, but not replicated to other sites,\n"
+       "                            so only use this for single-site deployments. Timer pops are\n"
+       "                            processed on the billing threads (10 if --billing-threads is 0)\n"
+       "     --timer-jitter=<percent>\n"
+       "                            Pop each session's interim timer up to this percentage of its\n"
+       "                            interval early, so sessions created together don't send\n"
+       "                            INTERIMs together (0-50, default: 0)\n"
+       "     --interim-rate N       Maximum timer-interim requests to process per second. Bursts\n"
+       "                            above this are queued and smoothed out, and processed on the\n"
+       "                            billing threads (10 if --billing-threads is 0). If 0, they are\n"
+       "                            not paced (default: 0)\n"
+       "     --remote-store=<site>,<file>\n"
+       "                            Replicate sessions to another site's memcached cluster,\n"
+       "                            whose settings are in the given file. May be repeated, once\n"
+       "                            for each remote site\n"
+       "     --replication-max-lag=<ms>\n"
+       "                            Maximum time to queue a session change for a remote site\n"
+       "                            before dropping it (default: 1000)\n"
+       "     --replication-threads N\n"
+       "                            Number of threads writing session changes to each remote site\n"
+       "                            (default: 10)\n"
+       "     --remote-lookup-timeout=<ms>\n"
+       "                            Maximum time to wait for the remote sites when looking up a\n"
+       "                            session that isn't stored locally. Only applies with\n"
+       "                            --task-threads, which query the sites in parallel\n"
+       "                            (default: 500)\n"
        "     --pidfile=<filename>   Write pidfile\n"
        "     --daemon               Run as a daemon\n"
        " -h, --help                 Show this help screen\n"
@@ -325,12 +514,18 @@ int init_options(int argc, char**argv, struct options& options)
         TRC_INFO("Memcached write format set to 'json'");
         options.memcached_write_format = MemcachedWriteFormat::JSON;
       }
+      else if (strcmp(optarg, "compact") == 0)
+      {
+        TRC_INFO("Memcached write format set to 'compact'");
+        options.memcached_write_format = MemcachedWriteFormat::COMPACT;
+      }
       else
       {
         TRC_WARNING("Invalid value for memcached-write-format, using '%s'."
-                    "Got '%s', valid values are 'json' and 'binary'",
-                    ((options.memcached_write_format == MemcachedWriteFormat::JSON) ?
-                     "json" : "binary"),
+                    "Got '%s', valid values are 'json', 'binary' and 'compact'",
+                    ((options.memcached_write_format == MemcachedWriteFormat::JSON) ? "json" :
+                     (options.memcached_write_format == MemcachedWriteFormat::COMPACT) ? "compact" :
+                     "binary"),
                     optarg);
       }
       break;
@@ -397,6 +592,271 @@ int init_options(int argc, char**argv, struct options& options)
       options.sas_signaling_if = true;
       break;
 
+    case BILLING_THREADS:
+      options.billing_threads = atoi(optarg);
+      if (options.billing_threads < 0)
+      {
+        TRC_ERROR("Invalid --billing-threads option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Billing threads: %d", options.billing_threads);
+      break;
+
+    case BILLING_QUEUE_SIZE:
+      options.billing_queue_size = atoi(optarg);
+      if (options.billing_queue_size <= 0)
+      {
+        TRC_ERROR("Invalid --billing-queue-size option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Billing queue size: %d", options.billing_queue_size);
+      break;
+
+    case BILLING_ORDERED:
+      TRC_INFO("Billing requests are processed in per-session order");
+      options.billing_ordered = true;
+      break;
+
+    case SESSION_CACHE_SIZE:
+      options.session_cache_size = atoi(optarg);
+      if (options.session_cache_size < 0)
+      {
+        TRC_ERROR("Invalid --session-cache-size option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Session cache size: %d MB", options.session_cache_size);
+      break;
+
+    case SPLIT_RECORD_NUMBER:
+      TRC_INFO("Accounting record numbers are stored separately from sessions");
+      options.split_record_number = true;
+      break;
+
+    case CCF_FAILURE_THRESHOLD:
+      options.ccf_failure_threshold = atoi(optarg);
+      if (options.ccf_failure_threshold < 0)
+      {
+        TRC_ERROR("Invalid --ccf-failure-threshold option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("CCF failure threshold: %d", options.ccf_failure_threshold);
+      break;
+
+    case CCF_PROBE_INTERVAL_MS:
+      options.ccf_probe_interval_ms = atoi(optarg);
+      TRC_INFO("CCF probe interval: %d ms", options.ccf_probe_interval_ms);
+      break;
+
+    case ACR_HEDGE_PERCENTILE:
+      options.acr_hedge_percentile = atoi(optarg);
+      if ((options.acr_hedge_percentile < 0) || (options.acr_hedge_percentile > 99))
+      {
+        TRC_ERROR("Invalid --acr-hedge-percentile option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("ACR hedge percentile: %d", options.acr_hedge_percentile);
+      break;
+
+    case ACR_HEDGE_BUDGET:
+      options.acr_hedge_budget = atoi(optarg);
+      if ((options.acr_hedge_budget < 0) || (options.acr_hedge_budget > 100))
+      {
+        TRC_ERROR("Invalid --acr-hedge-budget option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("ACR hedge budget: %d%%", options.acr_hedge_budget);
+      break;
+
+    case CCF_WINDOW:
+      options.ccf_window = atoi(optarg);
+      if (options.ccf_window < 0)
+      {
+        TRC_ERROR("Invalid --ccf-window option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("CCF window: %d", options.ccf_window);
+      break;
+
+    case CCF_QUEUE_SIZE:
+      options.ccf_queue_size = atoi(optarg);
+      if (options.ccf_queue_size < 0)
+      {
+        TRC_ERROR("Invalid --ccf-queue-size option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("CCF queue size: %d", options.ccf_queue_size);
+      break;
+
+    case CCF_OVERFLOW_POLICY:
+      if (!CcfWindow::parse_policy(optarg, options.ccf_overflow_policy))
+      {
+        TRC_ERROR("Invalid --ccf-overflow-policy option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("CCF overflow policy: %s", optarg);
+      break;
+
+    case CCF_TIMEOUT_MIN_MS:
+      options.ccf_timeout_min_ms = atoi(optarg);
+      if (options.ccf_timeout_min_ms <= 0)
+      {
+        TRC_ERROR("Invalid --ccf-timeout-min-ms option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Minimum CCF timeout: %d ms", options.ccf_timeout_min_ms);
+      break;
+
+    case CCF_TIMEOUT_MAX_MS:
+      options.ccf_timeout_max_ms = atoi(optarg);
+      if (options.ccf_timeout_max_ms < 0)
+      {
+        TRC_ERROR("Invalid --ccf-timeout-max-ms option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Maximum CCF timeout: %d ms", options.ccf_timeout_max_ms);
+      break;
+
+    case ACR_SPOOL_DIR:
+      options.acr_spool_dir = std::string(optarg);
+      TRC_INFO("ACR spool directory: %s", optarg);
+      break;
+
+    case ACR_SPOOL_SIZE:
+      options.acr_spool_size = atoi(optarg);
+      if (options.acr_spool_size <= 0)
+      {
+        TRC_ERROR("Invalid --acr-spool-size option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("ACR spool size: %d MB", options.acr_spool_size);
+      break;
+
+    case ACR_SPOOL_REPLAY_RATE:
+      options.acr_spool_replay_rate = atoi(optarg);
+      if (options.acr_spool_replay_rate <= 0)
+      {
+        TRC_ERROR("Invalid --acr-spool-replay-rate option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("ACR spool replay rate: %d/s", options.acr_spool_replay_rate);
+      break;
+
+    case CCF_RESPONSE_THREADS:
+      options.ccf_response_threads = atoi(optarg);
+      if (options.ccf_response_threads < 0)
+      {
+        TRC_ERROR("Invalid --ccf-response-threads option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("CCF response threads: %d", options.ccf_response_threads);
+      break;
+
+    case CCF_RESPONSE_QUEUE_SIZE:
+      options.ccf_response_queue_size = atoi(optarg);
+      if (options.ccf_response_queue_size <= 0)
+      {
+        TRC_ERROR("Invalid --ccf-response-queue-size option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("CCF response queue size: %d", options.ccf_response_queue_size);
+      break;
+
+    case TASK_THREADS:
+      options.task_threads = atoi(optarg);
+      if (options.task_threads < 0)
+      {
+        TRC_ERROR("Invalid --task-threads option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Task threads: %d", options.task_threads);
+      break;
+
+    case TIMER_THREADS:
+      options.timer_threads = atoi(optarg);
+      if (options.timer_threads < 0)
+      {
+        TRC_ERROR("Invalid --timer-threads option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Timer threads: %d", options.timer_threads);
+      break;
+
+    case LAZY_TIMER_UPDATES:
+      TRC_INFO("Chronos timers are updated lazily");
+      options.lazy_timer_updates = true;
+      break;
+
+    case TIMER_WHEEL:
+      TRC_INFO("Interim timers are run in-process");
+      options.timer_wheel = true;
+      break;
+
+    case TIMER_JITTER:
+      options.timer_jitter = atoi(optarg);
+      if ((options.timer_jitter < 0) || (options.timer_jitter > 50))
+      {
+        TRC_ERROR("Invalid --timer-jitter option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Timer jitter: %d%%", options.timer_jitter);
+      break;
+
+    case INTERIM_RATE:
+      options.interim_rate = atoi(optarg);
+      if (options.interim_rate < 0)
+      {
+        TRC_ERROR("Invalid --interim-rate option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Timer-interim rate: %d", options.interim_rate);
+      break;
+
+    case REMOTE_STORE:
+      {
+        std::string site_store = optarg;
+        size_t comma = site_store.find(',');
+        if ((comma == std::string::npos) || (comma == 0) || (comma == site_store.size() - 1))
+        {
+          TRC_ERROR("Invalid --remote-store option %s", optarg);
+          return -1;
+        }
+        std::string site = site_store.substr(0, comma);
+        std::string file = site_store.substr(comma + 1);
+        TRC_INFO("Remote store for site %s: %s", site.c_str(), file.c_str());
+        options.remote_stores[site] = file;
+      }
+      break;
+
+    case REPLICATION_MAX_LAG:
+      options.replication_max_lag_ms = atoi(optarg);
+      if (options.replication_max_lag_ms <= 0)
+      {
+        TRC_ERROR("Invalid --replication-max-lag option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Replication max lag: %dms", options.replication_max_lag_ms);
+      break;
+
+    case REPLICATION_THREADS:
+      options.replication_threads = atoi(optarg);
+      if (options.replication_threads <= 0)
+      {
+        TRC_ERROR("Invalid --replication-threads option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Replication threads: %d", options.replication_threads);
+      break;
+
+    case REMOTE_LOOKUP_TIMEOUT:
+      options.remote_lookup_timeout_ms = atoi(optarg);
+      if (options.remote_lookup_timeout_ms <= 0)
+      {
+        TRC_ERROR("Invalid --remote-lookup-timeout option %s", optarg);
+        return -1;
+      }
+      TRC_INFO("Remote lookup timeout: %dms", options.remote_lookup_timeout_ms);
+      break;
+
     default:
       CL_RALF_INVALID_OPTION_C.log();
       TRC_ERROR("Unknown option: %d.  Run with --help for options.\n", opt);
@@ -407,6 +867,127 @@ int init_options(int argc, char**argv, struct options& options)
   return 0;
 }
 
+// Statistics published by Ralf.
+const static std::string known_stats[] = {
+  "ralf_billing_queue_depth",
+  "ralf_billing_queue_wait_us",
+  "ralf_billing_busy_workers",
+  "ralf_billing_contention_avoided",
+  "ralf_ccf_response_queue_depth",
+  "ralf_ccf_response_queue_wait_us",
+  "ralf_ccf_response_busy_workers",
+  "ralf_ccf_response_overflows",
+  "ralf_task_queue_depth",
+  "ralf_task_queue_wait_us",
+  "ralf_task_busy_workers",
+  "ralf_timer_queue_depth",
+  "ralf_timer_queue_wait_us",
+  "ralf_timer_busy_workers",
+  "ralf_timer_requests_coalesced",
+  "ralf_timer_requests_inline",
+  "ralf_session_contention_hit",
+  "ralf_timer_updates_sent",
+  "ralf_timer_updates_skipped",
+  "ralf_timer_wheel_timers",
+  "ralf_timer_wheel_pops",
+  "ralf_interim_pacer_depth",
+  "ralf_interim_pacer_overflows",
+  "ralf_interim_pacer_arrivals",
+  "ralf_interim_pacer_releases",
+  "ralf_replication_queue_depth",
+  "ralf_replication_lag_ms",
+  "ralf_replication_coalesced",
+  "ralf_replication_dropped",
+  "ralf_replication_failed",
+  "ralf_session_local_hits",
+  "ralf_session_remote_hits",
+  "ralf_session_misses",
+  "ralf_session_remote_timeouts",
+  "ralf_session_cache_hits",
+  "ralf_session_cache_misses",
+  "ralf_session_cache_evictions",
+  "ralf_session_reads_binary",
+  "ralf_session_reads_json",
+  "ralf_session_reads_compact",
+  "ralf_ignored_avps",
+  "ralf_acr_encodes_saved",
+  "ralf_ccf_circuit_opened",
+  "ralf_ccf_skipped",
+  "ralf_acr_hedges",
+  "ralf_acr_hedge_wins",
+  "ralf_acr_hedge_over_budget",
+  "ralf_ccf_window_occupancy",
+  "ralf_ccf_queue_depth",
+  "ralf_ccf_queue_wait_us",
+  "ralf_ccf_queue_overflows",
+  "ralf_ccf_rtt",
+  "ralf_acr_spool_depth",
+  "ralf_acr_spool_writes",
+  "ralf_acr_spool_commits",
+  "ralf_acr_spool_replayed",
+  "ralf_acr_spool_dropped",
+  "ralf_pool_message_hits",
+  "ralf_pool_message_misses",
+  "ralf_pool_message_live",
+  "ralf_pool_received_body_hits",
+  "ralf_pool_received_body_misses",
+  "ralf_pool_received_body_live",
+  "ralf_pool_peer_message_sender_hits",
+  "ralf_pool_peer_message_sender_misses",
+  "ralf_pool_peer_message_sender_live",
+  "ralf_pool_ralf_transaction_hits",
+  "ralf_pool_ralf_transaction_misses",
+  "ralf_pool_ralf_transaction_live",
+};
+const static int num_known_stats = sizeof(known_stats) / sizeof(std::string);
+
+// Maximum number of tasks queued for the task threads.  When it is full, tasks
+// are run on the thread that asked for them.
+const static size_t TASK_QUEUE_SIZE = 10000;
+
+// Maximum number of requests queued for Chronos.  When it is full, requests
+// are sent on the thread that made them.
+const static size_t TIMER_QUEUE_SIZE = 10000;
+
+// Maximum number of timer-interim requests queued for pacing.  When it is
+// full, requests are rejected (or timer pops are offered again later).
+const static size_t INTERIM_QUEUE_SIZE = 10000;
+
+// Number of billing threads used with --timer-wheel or --interim-rate if
+// --billing-threads is 0.
+const static int DEFAULT_BILLING_THREADS = 10;
+
+// Maximum number of sessions with changes queued for each remote site.  When
+// it is full, changes to other sessions aren't replicated.
+const static size_t REPLICATION_QUEUE_SIZE = 10000;
+
+// Creates the serializer for writing sessions in the configured format.
+static SessionStore::SerializerDeserializer* create_serializer(MemcachedWriteFormat format)
+{
+  if (format == MemcachedWriteFormat::JSON)
+  {
+    return new SessionStore::JsonSerializerDeserializer();
+  }
+  else if (format == MemcachedWriteFormat::COMPACT)
+  {
+    return new SessionStore::CompactSerializerDeserializer();
+  }
+  else
+  {
+    return new SessionStore::BinarySerializerDeserializer();
+  }
+}
+
+// Creates the deserializers for reading sessions in any format.
+static std::vector<SessionStore::SerializerDeserializer*> create_deserializers()
+{
+  std::vector<SessionStore::SerializerDeserializer*> deserializers;
+  deserializers.push_back(new SessionStore::CompactSerializerDeserializer());
+  deserializers.push_back(new SessionStore::JsonSerializerDeserializer());
+  deserializers.push_back(new SessionStore::BinarySerializerDeserializer());
+  return deserializers;
+}
+
 static sem_t term_sem;
 ExceptionHandler* exception_handler;
 
@@ -474,6 +1055,35 @@ int main(int argc, char**argv)
   options.pidfile = "";
   options.daemon = false;
   options.sas_signaling_if = false;
+  options.billing_threads = 0;
+  options.billing_queue_size = 10000;
+  options.billing_ordered = false;
+  options.session_cache_size = 0;
+  options.split_record_number = false;
+  options.ccf_failure_threshold = 0;
+  options.ccf_probe_interval_ms = 5000;
+  options.acr_hedge_percentile = 0;
+  options.acr_hedge_budget = 5;
+  options.ccf_window = 0;
+  options.ccf_queue_size = 1000;
+  options.ccf_overflow_policy = CcfWindow::FAILOVER;
+  options.ccf_timeout_min_ms = 50;
+  options.ccf_timeout_max_ms = 0;
+  options.acr_spool_dir = "";
+  options.acr_spool_size = 1024;
+  options.acr_spool_replay_rate = 100;
+  options.ccf_response_threads = 0;
+  options.ccf_response_queue_size = 10000;
+  options.task_threads = 0;
+  options.timer_threads = 0;
+  options.lazy_timer_updates = false;
+  options.timer_wheel = false;
+  options.timer_jitter = 0;
+  options.interim_rate = 0;
+  options.remote_stores.clear();
+  options.replication_max_lag_ms = 1000;
+  options.replication_threads = 10;
+  options.remote_lookup_timeout_ms = SessionManager::DEFAULT_REMOTE_LOOKUP_TIMEOUT_MS;
 
   // Initialise ENT logging before making "Started" log
   PDLogStatic::init(argv[0]);
@@ -586,6 +1196,15 @@ int main(int argc, char**argv)
                                               options.init_token_rate,
                                               options.min_token_rate);
 
+  LastValueCache* stats_aggregator = new LastValueCache(num_known_stats,
+                                                       known_stats,
+                                                       "ralf");
+
+  ObjectPool<Message>::init_stats("ralf_pool_message", stats_aggregator);
+  ObjectPool<ReceivedBody>::init_stats("ralf_pool_received_body", stats_aggregator);
+  ObjectPool<PeerMessageSender>::init_stats("ralf_pool_peer_message_sender", stats_aggregator);
+  ObjectPool<RalfTransaction>::init_stats("ralf_pool_ralf_transaction", stats_aggregator);
+
   HealthChecker* hc = new HealthChecker();
   hc->start_thread();
 
@@ -604,7 +1223,7 @@ int main(int argc, char**argv)
     diameter_stack->configure(options.diameter_conf,
                               exception_handler,
                               cdf_comm_monitor);
-    dict = new Rf::Dictionary();
+    dict = new Rf::Dictionary(stats_aggregator);
     diameter_stack->advertize_application(Diameter::Dictionary::Application::ACCT,
                                           dict->RF);
     diameter_stack->start();
@@ -616,24 +1235,131 @@ int main(int argc, char**argv)
     exit(2);
   }
 
-  SessionStore::SerializerDeserializer* serializer;
-  std::vector<SessionStore::SerializerDeserializer*> deserializers;
+  SessionStore::SerializerDeserializer* serializer =
+                             create_serializer(options.memcached_write_format);
+  std::vector<SessionStore::SerializerDeserializer*> deserializers =
+                                                        create_deserializers();
 
-  if (options.memcached_write_format == MemcachedWriteFormat::JSON)
+  SessionCache* session_cache = NULL;
+  if ((options.session_cache_size > 0) && (!options.split_record_number))
   {
-    serializer = new SessionStore::JsonSerializerDeserializer();
+    TRC_WARNING("--session-cache-size has no effect without --split-record-number");
   }
-  else
+  else if (options.session_cache_size > 0)
   {
-    serializer = new SessionStore::BinarySerializerDeserializer();
+    session_cache = new SessionCache((size_t)options.session_cache_size * 1024 * 1024,
+                                     SessionCache::DEFAULT_NUM_SHARDS,
+                                     stats_aggregator);
   }
 
-  deserializers.push_back(new SessionStore::JsonSerializerDeserializer());
-  deserializers.push_back(new SessionStore::BinarySerializerDeserializer());
+  SessionStore* store = new SessionStore(mstore,
+                                         serializer,
+                                         deserializers,
+                                         session_cache,
+                                         stats_aggregator,
+                                         options.split_record_number);
+
+  // The stores for the remote sites.  They aren't cached, as other sites
+  // write to them.
+  std::vector<SessionStore*> remote_stores;
+  std::vector<std::string> remote_sites;
+  for (std::map<std::string, std::string>::iterator remote = options.remote_stores.begin();
+       remote != options.remote_stores.end();
+       ++remote)
+  {
+    MemcachedStore* remote_mstore = new MemcachedStore(true,
+                                                       remote->second,
+                                                       NULL,
+                                                       NULL);
+
+    if (!(remote_mstore->has_servers()))
+    {
+      TRC_ERROR("%s file does not contain a valid set of servers for site %s",
+                remote->second.c_str(), remote->first.c_str());
+      return 1;
+    }
+
+    TRC_STATUS("Replicating sessions to site %s", remote->first.c_str());
+    SessionStore::SerializerDeserializer* remote_serializer =
+                             create_serializer(options.memcached_write_format);
+    std::vector<SessionStore::SerializerDeserializer*> remote_deserializers =
+                                                        create_deserializers();
+    remote_stores.push_back(new SessionStore(remote_mstore,
+                                             remote_serializer,
+                                             remote_deserializers,
+                                             NULL,
+                                             NULL,
+                                             options.split_record_number));
+    remote_sites.push_back(remote->first);
+  }
 
-  SessionStore* store = new SessionStore(mstore, serializer, deserializers);
   BillingHandlerConfig* cfg = new BillingHandlerConfig();
-  PeerMessageSenderFactory* factory = new PeerMessageSenderFactory(options.billing_realm);
+  CcfHealthTracker* ccf_health = NULL;
+  if (options.ccf_failure_threshold > 0)
+  {
+    ccf_health = new CcfHealthTracker(options.ccf_failure_threshold,
+                                      options.ccf_probe_interval_ms,
+                                      stats_aggregator);
+  }
+
+  AcrHedger* hedger = NULL;
+  if (options.acr_hedge_percentile > 0)
+  {
+    hedger = new AcrHedger(options.acr_hedge_percentile,
+                           options.acr_hedge_budget,
+                           stats_aggregator);
+    if (!hedger->start())
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start ACR hedging, ACRs will not be hedged");
+      delete hedger; hedger = NULL;
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  CcfWindow* ccf_window = NULL;
+  if (options.ccf_window > 0)
+  {
+    ccf_window = new CcfWindow(options.ccf_window,
+                               options.ccf_queue_size,
+                               options.ccf_overflow_policy,
+                               stats_aggregator);
+  }
+
+  RttEstimator* rtt_estimator = NULL;
+  if (options.ccf_timeout_max_ms > 0)
+  {
+    if (options.ccf_timeout_min_ms > options.ccf_timeout_max_ms)
+    {
+      TRC_WARNING("Minimum CCF timeout is above the maximum, using %d ms",
+                  options.ccf_timeout_max_ms);
+      options.ccf_timeout_min_ms = options.ccf_timeout_max_ms;
+    }
+
+    rtt_estimator = new RttEstimator(options.ccf_timeout_min_ms,
+                                     options.ccf_timeout_max_ms,
+                                     stats_aggregator);
+  }
+
+  // The spool is started once the Diameter stack is up.
+  RfAcrSpool* acr_spool = NULL;
+  if (!options.acr_spool_dir.empty())
+  {
+    acr_spool = new RfAcrSpool(dict,
+                               diameter_stack,
+                               options.acr_spool_dir,
+                               (uint64_t)options.acr_spool_size * 1024 * 1024,
+                               options.acr_spool_replay_rate,
+                               stats_aggregator);
+  }
+
+  PeerMessageSenderFactory* factory = new PeerMessageSenderFactory(options.billing_realm,
+                                                                   stats_aggregator,
+                                                                   ccf_health,
+                                                                   hedger,
+                                                                   ccf_window,
+                                                                   rtt_estimator,
+                                                                   acr_spool);
 
   // Create a DNS resolver.  We'll use this both for HTTP and for Diameter.
   DnsCachedResolver* dns_resolver = new DnsCachedResolver(options.dns_server);
@@ -652,14 +1378,174 @@ int main(int argc, char**argv)
     local_chronos = "[::1]:7253";
   }
 
-  // Create a connection to Chronos.  This requires an HttpResolver.
-  TRC_STATUS("Creating connection to Chronos at %s using %s as the callback URI", local_chronos.c_str(), chronos_callback_addr.c_str());
   HttpResolver* http_resolver = new HttpResolver(dns_resolver,
                                                  http_af,
                                                  options.http_blacklist_duration);
-  ChronosConnection* timer_conn = new ChronosConnection(local_chronos, chronos_callback_addr, http_resolver, chronos_comm_monitor);
 
-  cfg->mgr = new SessionManager(store, {}, dict, factory, timer_conn, diameter_stack, hc);
+  // Either run interim timers in-process, popping them straight into the
+  // billing handler, or create a connection to Chronos.  The latter requires
+  // an HttpResolver.
+  ChronosConnection* timer_conn = NULL;
+  TimerWheel* timer_wheel = NULL;
+  if (options.timer_wheel)
+  {
+    TRC_STATUS("Running interim timers in-process");
+    timer_wheel = new TimerWheel([cfg](const std::string& callback_uri,
+                                       const std::string& opaque_data)
+                                 {
+                                   return BillingTask::timer_popped(cfg,
+                                                                    callback_uri,
+                                                                    opaque_data);
+                                 },
+                                 mstore,
+                                 options.local_host,
+                                 stats_aggregator);
+    timer_conn = timer_wheel;
+  }
+  else
+  {
+    TRC_STATUS("Creating connection to Chronos at %s using %s as the callback URI", local_chronos.c_str(), chronos_callback_addr.c_str());
+    timer_conn = new ChronosConnection(local_chronos, chronos_callback_addr, http_resolver, chronos_comm_monitor);
+  }
+
+  cfg->mgr = new SessionManager(store,
+                                remote_stores,
+                                dict,
+                                factory,
+                                timer_conn,
+                                diameter_stack,
+                                hc,
+                                stats_aggregator);
+
+  // Timer pops from the timer wheel and paced requests are always handed to
+  // the billing pool, so that they aren't processed on the wheel's or the
+  // pacer's thread.
+  int billing_threads = options.billing_threads;
+  if (((options.timer_wheel) || (options.interim_rate > 0)) &&
+      (billing_threads == 0))
+  {
+    billing_threads = DEFAULT_BILLING_THREADS;
+    TRC_STATUS("Using %d billing threads for timer pops", billing_threads);
+  }
+
+  BillingWorkerPool* billing_pool = NULL;
+  if (billing_threads > 0)
+  {
+    billing_pool = new BillingWorkerPool(cfg->mgr,
+                                         billing_threads,
+                                         options.billing_queue_size,
+                                         exception_handler,
+                                         stats_aggregator,
+                                         options.billing_ordered);
+    if (!billing_pool->start())
+    {
+      TRC_ERROR("Failed to start billing worker threads");
+      return 2;
+    }
+    cfg->pool = billing_pool;
+  }
+
+  cfg->mgr->set_lazy_timer_updates(options.lazy_timer_updates);
+  cfg->mgr->set_timer_jitter(options.timer_jitter);
+  cfg->mgr->set_remote_lookup_timeout(options.remote_lookup_timeout_ms);
+
+  SessionReplicator::Stats* replication_stats = NULL;
+  std::vector<SessionReplicator*> replicators;
+  if (!remote_stores.empty())
+  {
+    replication_stats = new SessionReplicator::Stats(stats_aggregator);
+
+    for (size_t ii = 0; ii < remote_stores.size(); ii++)
+    {
+      SessionReplicator* replicator = new SessionReplicator(remote_stores[ii],
+                                                            remote_sites[ii],
+                                                            REPLICATION_QUEUE_SIZE,
+                                                            options.replication_max_lag_ms,
+                                                            replication_stats,
+                                                            options.replication_threads);
+      if (!replicator->start())
+      {
+        TRC_ERROR("Failed to start replication thread for site %s",
+                  remote_sites[ii].c_str());
+        return 2;
+      }
+      replicators.push_back(replicator);
+    }
+
+    cfg->mgr->set_replicators(replicators);
+  }
+
+  InterimPacer* interim_pacer = NULL;
+  if (options.interim_rate > 0)
+  {
+    interim_pacer = new InterimPacer([cfg](Message* msg)
+                                     {
+                                       return BillingTask::handle_message(cfg, msg);
+                                     },
+                                     options.interim_rate,
+                                     INTERIM_QUEUE_SIZE,
+                                     stats_aggregator);
+    if (!interim_pacer->start())
+    {
+      TRC_ERROR("Failed to start interim pacing thread");
+      return 2;
+    }
+    cfg->pacer = interim_pacer;
+  }
+
+  AsyncTimerClient* timer_client = NULL;
+  if (options.timer_threads > 0)
+  {
+    timer_client = new AsyncTimerClient(timer_conn,
+                                        options.timer_threads,
+                                        TIMER_QUEUE_SIZE,
+                                        exception_handler,
+                                        stats_aggregator);
+    if (!timer_client->start())
+    {
+      TRC_ERROR("Failed to start timer threads");
+      return 2;
+    }
+    cfg->mgr->set_timer_client(timer_client);
+  }
+
+  TaskPool* task_pool = NULL;
+  if (options.task_threads > 0)
+  {
+    task_pool = new TaskPool(options.task_threads,
+                             TASK_QUEUE_SIZE,
+                             exception_handler,
+                             stats_aggregator);
+    if (!task_pool->start())
+    {
+      TRC_ERROR("Failed to start task threads");
+      return 2;
+    }
+    cfg->mgr->set_task_pool(task_pool);
+  }
+
+  CcfResponsePool* response_pool = NULL;
+  if (options.ccf_response_threads > 0)
+  {
+    response_pool = new CcfResponsePool(cfg->mgr,
+                                        options.ccf_response_threads,
+                                        options.ccf_response_queue_size,
+                                        exception_handler,
+                                        stats_aggregator);
+    if (!response_pool->start())
+    {
+      TRC_ERROR("Failed to start CCF response threads");
+      return 2;
+    }
+    cfg->mgr->set_response_pool(response_pool);
+  }
+
+  // Start popping timers once everything they need is in place.
+  if ((timer_wheel != NULL) && (!timer_wheel->start()))
+  {
+    TRC_ERROR("Failed to start timer wheel");
+    return 2;
+  }
 
   HttpStack* http_stack = HttpStack::get_instance();
   HttpStackUtils::PingHandler ping_handler;
@@ -702,6 +1588,11 @@ int main(int argc, char**argv)
                                                  diameter_resolver);
   realm_manager->start();
 
+  if ((acr_spool != NULL) && (!acr_spool->start()))
+  {
+    TRC_ERROR("Failed to start ACR spool, undeliverable ACRs will be discarded");
+  }
+
   sem_wait(&term_sem);
 
   CL_RALF_ENDED.log();
@@ -716,6 +1607,34 @@ int main(int argc, char**argv)
     fprintf(stderr, "Caught HttpStack::Exception - %s - %d\n", e._func, e._rc);
   }
 
+  // Stop popping timers, and write the last changes to them to the store.
+  if (timer_wheel != NULL)
+  {
+    timer_wheel->stop();
+  }
+
+  // Pass on the timer-interim requests still waiting to be paced.
+  if (interim_pacer != NULL)
+  {
+    interim_pacer->stop();
+    cfg->pacer = NULL;
+    delete interim_pacer; interim_pacer = NULL;
+  }
+
+  if (billing_pool != NULL)
+  {
+    billing_pool->stop();
+    billing_pool->join();
+    cfg->pool = NULL;
+    delete billing_pool; billing_pool = NULL;
+  }
+
+  // Stop replaying spooled ACRs before the Diameter stack goes away.
+  if (acr_spool != NULL)
+  {
+    acr_spool->stop();
+  }
+
   try
   {
     diameter_stack->stop();
@@ -729,7 +1648,57 @@ int main(int argc, char**argv)
 
   realm_manager->stop();
 
+  if (hedger != NULL)
+  {
+    hedger->stop();
+  }
+
+  // No more answers can arrive, so let the response threads finish the ones
+  // that are queued.
+  if (response_pool != NULL)
+  {
+    response_pool->stop();
+    response_pool->join();
+    cfg->mgr->set_response_pool(NULL);
+    delete response_pool; response_pool = NULL;
+  }
+
+  if (task_pool != NULL)
+  {
+    task_pool->stop();
+    task_pool->join();
+    cfg->mgr->set_task_pool(NULL);
+    delete task_pool; task_pool = NULL;
+  }
+
+  // Send any timer requests that are still queued.
+  if (timer_client != NULL)
+  {
+    timer_client->stop();
+    timer_client->join();
+    cfg->mgr->set_timer_client(NULL);
+    delete timer_client; timer_client = NULL;
+  }
+
+  // Nothing sends ACRs or sets timers now.  The factory deletes the CCF
+  // health tracker, hedger, CCF window, RTT estimator and ACR spool.
+  delete factory; factory = NULL;
+  delete timer_wheel; timer_wheel = NULL;
+
+  // Nothing else writes sessions now, so write the last changes to the remote
+  // sites.
+  cfg->mgr->set_replicators({});
+  for (std::vector<SessionReplicator*>::iterator replicator = replicators.begin();
+       replicator != replicators.end();
+       ++replicator)
+  {
+    (*replicator)->stop();
+    delete *replicator; *replicator = NULL;
+  }
+  delete replication_stats; replication_stats = NULL;
+
   delete realm_manager; realm_manager = NULL;
+  delete session_cache; session_cache = NULL;
   delete diameter_resolver; diameter_resolver = NULL;
   delete http_resolver; http_resolver = NULL;
   delete dns_resolver; dns_resolver = NULL;
@@ -738,6 +1707,7 @@ int main(int argc, char**argv)
   hc->stop_thread();
   delete exception_handler; exception_handler = NULL;
   delete hc; hc = NULL;
+  delete stats_aggregator; stats_aggregator = NULL;
 
   // Delete Ralf's alarm objects
   delete cdf_comm_monitor;
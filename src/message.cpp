@@ -54,11 +54,61 @@ Message::Message(const std::string& call_id,
   timer_interim(timer_interim),
   interim_interval(0),
   session_refresh_time(session_refresh_time),
-  trail(trail)
+  timer_interval(0),
+  timer_expiry(0),
+  session_expiry(0),
+  trail(trail),
+  _received_body(NULL)
+{};
+
+/* Constructor of Message for a body parsed in-situ. Takes ownership of the
+   passed-in ReceivedBody. */
+Message::Message(ReceivedBody* body,
+                 const std::string& call_id,
+                 role_of_node_t role,
+                 node_functionality_t function,
+                 Rf::AccountingRecordType record_type,
+                 uint32_t session_refresh_time,
+                 SAS::TrailId trail,
+                 bool timer_interim):
+  call_id(call_id),
+  role(role),
+  function(function),
+  received_json(&body->doc),
+  record_type(record_type),
+  timer_interim(timer_interim),
+  interim_interval(0),
+  session_refresh_time(session_refresh_time),
+  timer_interval(0),
+  timer_expiry(0),
+  session_expiry(0),
+  trail(trail),
+  _received_body(body)
 {};
 
 /* Deletes the enclosed rapidjson::Document. */
 Message::~Message()
 {
+  if (_received_body != NULL)
+  {
+    delete _received_body;
+  }
+  else
+  {
     delete this->received_json;
+  }
+}
+
+ReceivedBody::ReceivedBody(std::string& body) :
+  allocator(chunk, sizeof(chunk)),
+  doc(&allocator)
+{
+  buffer.swap(body);
+  doc.ParseInsitu<0>(&buffer[0]);
+}
+
+ReceivedBody::ReceivedBody() :
+  allocator(chunk, sizeof(chunk)),
+  doc(&allocator)
+{
 }
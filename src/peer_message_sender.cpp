@@ -48,47 +48,266 @@
  *   - we fail to send the ACR to any of the available CCFs
  *
  *   No action should be taken after any of the above happens, as the this pointer becomes invalid.
+ *
+ *   If the ACR was hedged, the object isn't deleted until the other
+ *   transaction has also finished (or timed out), but the SessionManager is
+ *   only called once.  Likewise, it isn't deleted while an ACR is queued
+ *   behind the CCF window.
  */
-PeerMessageSender::PeerMessageSender(SAS::TrailId trail, const std::string& dest_realm) :
-  _which(0),
+PeerMessageSender::PeerMessageSender(SAS::TrailId trail,
+                                     const std::string& dest_realm,
+                                     StatisticCounter* encodes_saved_stat,
+                                     CcfHealthTracker* ccf_health,
+                                     AcrHedger* hedger,
+                                     CcfWindow* window,
+                                     RttEstimator* rtt_estimator,
+                                     RfAcrSpool* spool) :
+  _msg(NULL),
+  _accounting_record_number(0),
   _trail(trail),
-  _dest_realm(dest_realm)
+  _dest_realm(dest_realm),
+  _encodes_saved_stat(encodes_saved_stat),
+  _ccf_health(ccf_health),
+  _hedger(hedger),
+  _window(window),
+  _rtt_estimator(rtt_estimator),
+  _spool(spool),
+  _refs(0),
+  _in_flight(0),
+  _finished(false),
+  _next(0)
 {
+  pthread_mutex_init(&_lock, NULL);
 }
 
 PeerMessageSender::~PeerMessageSender()
 {
+  pthread_mutex_destroy(&_lock);
 }
 
-/* Sends the message to the sequence of given CCFs.
+/* Sends the message to the sequence of given CCFs.  CCFs that are known to be
+ * failing are tried last.
  *
  * Does not retry on errors - only on failed sends (DIAMETER_UNABLE_TO_SEND).
  */
 void PeerMessageSender::send(Message* msg, SessionManager* sm, Rf::Dictionary* dict, Diameter::Stack* diameter_stack)
 {
   _msg = msg;
-  _ccfs = msg->ccfs;
+  _accounting_record_number = msg->accounting_record_number;
+  _ccfs = (_ccf_health != NULL) ? _ccf_health->order(msg->ccfs) : msg->ccfs;
   _sm = sm;
   _dict = dict;
   _diameter_stack = diameter_stack;
-  int_send_msg();
+  _tsxs.assign(_ccfs.size(), NULL);
+  _sent_ms.assign(_ccfs.size(), 0);
+  _hedges.assign(_ccfs.size(), false);
+
+  // Hold a reference while sending, so that a callback can't delete this
+  // object under us.
+  _refs++;
+
+  if (!int_send_msg(false))
+  {
+    // We couldn't even send to the first CCF.
+    // LCOV_EXCL_START
+    pthread_mutex_lock(&_lock);
+    bool notify = (!_finished) && (_in_flight == 0);
+    _finished = true;
+    pthread_mutex_unlock(&_lock);
+
+    if (notify)
+    {
+      _sm->on_ccf_response(false, 0, "", ER_DIAMETER_UNABLE_TO_DELIVER, _msg);
+    }
+    // LCOV_EXCL_STOP
+  }
+
+  release();
+}
+
+/* Starts sending the message to the next CCF.  If the CCF has too many ACRs
+ * outstanding, the ACR is queued until it has space.
+ *
+ * Takes a reference to this object for the attempt, which is dropped when
+ * the transaction calls back into send_cb (or the ACR is refused).
+ */
+bool PeerMessageSender::int_send_msg(bool hedge)
+{
+  pthread_mutex_lock(&_lock);
+
+  if ((_finished) || (_next >= _ccfs.size()))
+  {
+    pthread_mutex_unlock(&_lock);
+    return false;
+  }
+
+  unsigned int which = _next++;
+  _hedges[which] = hedge;
+  _refs++;
+  _in_flight++;
+
+  pthread_mutex_unlock(&_lock);
+
+  if (_window == NULL)
+  {
+    send_to_ccf(which);
+    return true;
+  }
+
+  switch (_window->acquire(_ccfs[which], this, which))
+  {
+  case CcfWindow::SEND:
+    send_to_ccf(which);
+    break;
+
+  case CcfWindow::QUEUED:
+    // window_open() is called when there's space.
+    TRC_DEBUG("Queued ACR for %s", _ccfs[which].c_str());
+    break;
+
+  case CcfWindow::FULL:
+    not_sent(which);
+    break;
+  }
+
+  return true;
 }
 
-/* Actually sends the message to the current active CCF.
+/* Called by the CCF window when there is space to send a queued ACR, or when
+ * the ACR has been shed.
  *
- * After sending the message, deletes this PeerMessageSender.
+ * Returns false if the space wasn't used, so that the window can pass it on.
  */
-void PeerMessageSender::int_send_msg()
+bool PeerMessageSender::window_open(unsigned int attempt, bool admitted)
 {
-  std::string ccf = _ccfs[_which];
-  TRC_DEBUG("Sending message to %s (number %d)", ccf.c_str(), _which);
+  if (!admitted)
+  {
+    not_sent(attempt);
+    return false;
+  }
+
+  pthread_mutex_lock(&_lock);
+  bool finished = _finished;
+  if (finished)
+  {
+    _in_flight--;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  if (finished)
+  {
+    // Another CCF answered while this ACR was queued.
+    release();
+    return false;
+  }
 
-  SAS::Event msg_sent(_msg->trail, SASEvent::BILLING_REQUEST_SENT, 0);
+  send_to_ccf(attempt);
+  return true;
+}
+
+/* Called when an ACR couldn't be sent to a CCF because its queue was full.
+ * Depending on the overflow policy, either fails over to the next CCF or
+ * gives up on the ACR.
+ */
+void PeerMessageSender::not_sent(unsigned int attempt)
+{
+  TRC_WARNING("Too many ACRs outstanding to %s (number %d)", _ccfs[attempt].c_str(), attempt);
+
+  SAS::Event cdf_failed(_trail, SASEvent::BILLING_REQUEST_NOT_SENT, 0);
+  cdf_failed.add_var_param(_ccfs[attempt]);
+  SAS::report_event(cdf_failed);
+
+  pthread_mutex_lock(&_lock);
+  _in_flight--;
+  pthread_mutex_unlock(&_lock);
+
+  attempt_failed(ER_DIAMETER_TOO_BUSY,
+                 (_window->policy() == CcfWindow::FAILOVER));
+
+  // Drop the reference taken for this attempt.
+  release();
+}
+
+/* Actually sends the message to a CCF.
+ *
+ * The attempt's reference is dropped when the transaction calls back into
+ * send_cb.
+ */
+void PeerMessageSender::send_to_ccf(unsigned int which)
+{
+  pthread_mutex_lock(&_lock);
+
+  std::string ccf = _ccfs[which];
+  RalfTransaction* tsx = new RalfTransaction(_dict,
+                                             this,
+                                             _msg,
+                                             _trail,
+                                             which,
+                                             _rtt_estimator,
+                                             ccf);
+  _tsxs[which] = tsx;
+  _sent_ms[which] = (_hedger != NULL) ? _hedger->now_ms() : 0;
+
+  pthread_mutex_unlock(&_lock);
+
+  // If we're estimating the CCF's round trip time, time the ACR out based on
+  // that rather than the Diameter stack's default timeout.
+  unsigned int timeout_ms = (_rtt_estimator != NULL) ?
+                              _rtt_estimator->timeout_ms(ccf) : 0;
+
+  TRC_DEBUG("Sending message to %s (number %d)", ccf.c_str(), which);
+
+  SAS::Event msg_sent(_trail, SASEvent::BILLING_REQUEST_SENT, 0);
   msg_sent.add_var_param(ccf);
-  msg_sent.add_static_param(_msg->accounting_record_number);
+  msg_sent.add_static_param(_accounting_record_number);
   SAS::report_event(msg_sent);
 
-  RalfTransaction* tsx = new RalfTransaction(_dict, this, _msg, _trail);
+  if ((which > 0) && (!_encoded_acr.empty()))
+  {
+    // This is a failover or a hedge - resend the ACR we sent to the first
+    // CCF, just changing its Destination-Host.  It keeps the same Session-Id
+    // and End-to-End identifier, so the CDF can spot a duplicate.
+    Diameter::Message* acr = Rf::AccountingRequest::retarget(_dict,
+                                                             _diameter_stack,
+                                                             _encoded_acr,
+                                                             ccf);
+
+    if (acr != NULL)
+    {
+      if (_encodes_saved_stat != NULL)
+      {
+        _encodes_saved_stat->increment();
+      }
+
+      // As below, this object is not safe to reference after sending.
+      if (timeout_ms > 0)
+      {
+        acr->send(tsx, timeout_ms);
+      }
+      else
+      {
+        acr->send(tsx);
+      }
+      delete acr; acr = NULL;
+      return;
+    }
+    else if (_hedger != NULL)
+    {
+      // Another send might already have been answered, in which case _msg
+      // has been deleted, so we can't rebuild the ACR.  Treat this CCF as
+      // failed, which moves on to the next one.
+      // LCOV_EXCL_START
+      send_cb(which, ER_DIAMETER_UNABLE_TO_DELIVER, 0, "");
+      delete tsx; tsx = NULL;
+      return;
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  // Build the ACR from the message.  On a failover, this is because the ACR
+  // never reached the first CCF (its window was full).  No hedge is scheduled
+  // without an encoded ACR, so no other send can have been answered and the
+  // message is still valid.
   Rf::AccountingRequest acr(_dict,
                             _diameter_stack,
                             _msg->session_id,
@@ -97,10 +316,70 @@ void PeerMessageSender::int_send_msg()
                             _msg->accounting_record_number,
                             _msg->received_json->FindMember("event")->value);
 
+  if ((_encoded_acr.empty()) &&
+      ((which + 1 < _ccfs.size()) || (spoolable())))
+  {
+    // Save the ACR exactly as sent, in case we need to fail over, hedge or
+    // spool it.  This must happen before the hedge is scheduled, as the hedge
+    // reads it.
+    acr.encode(_encoded_acr);
+  }
+
+  if (which == 0)
+  {
+    if (_ccfs.size() > 1)
+    {
+      uint64_t hedge_delay_ms = (_hedger != NULL) ? _hedger->acr_sent() : 0;
+
+      // Only hedge if we can send the CCFs the same ACR, with the same
+      // Session-Id, so that they can tell it's a duplicate.  A rebuilt START
+      // or EVENT would get a new Session-Id and be billed twice.
+      if ((hedge_delay_ms > 0) && (!_encoded_acr.empty()))
+      {
+        pthread_mutex_lock(&_lock);
+        _refs++;
+        pthread_mutex_unlock(&_lock);
+
+        _hedger->schedule(this, hedge_delay_ms);
+      }
+    }
+    else if (_hedger != NULL)
+    {
+      // Still counts towards the hedge budget.
+      _hedger->acr_sent();
+    }
+  }
+
   // Send the message to freeDiameter.  This object could get modified by a
   // callback (including being deleted) so is not safe to reference after this
   // point.
-  acr.send(tsx); return;
+  if (timeout_ms > 0)
+  {
+    acr.send(tsx, timeout_ms);
+  }
+  else
+  {
+    acr.send(tsx);
+  }
+}
+
+/* Called by the hedger when the first CCF has been slow to answer.  Sends the
+ * ACR to the next CCF too, if there is one and we're within budget.
+ */
+void PeerMessageSender::hedge()
+{
+  pthread_mutex_lock(&_lock);
+  bool can_hedge = (!_finished) && (_next < _ccfs.size());
+  pthread_mutex_unlock(&_lock);
+
+  if ((can_hedge) && (_hedger->take_budget()))
+  {
+    TRC_DEBUG("No answer to ACR yet, hedging to the next CCF");
+    int_send_msg(true);
+  }
+
+  // Drop the hedge timer's reference.
+  release();
 }
 
 /* Called when a message has been sent and a response has been received.
@@ -108,43 +387,165 @@ void PeerMessageSender::int_send_msg()
  * If the send succeeded (as in, the message reached it's target), call back into SessionManager and self-destruct.
  *
  * If the send failed due to routing issues, either try the backup CCF or (if there isn't one), calls back into SessionManager and self-destruct.
+ *
+ * If the ACR was hedged, only the first answer is passed to the
+ * SessionManager.  The other transaction is cancelled, and its answer is
+ * ignored when it arrives.
  */
-void PeerMessageSender::send_cb(int result_code,
+void PeerMessageSender::send_cb(unsigned int attempt,
+                                int result_code,
                                 int interim_interval,
                                 std::string session_id)
 {
+  if (_window != NULL)
+  {
+    _window->release(_ccfs[attempt]);
+  }
+
+  pthread_mutex_lock(&_lock);
+
+  _tsxs[attempt] = NULL;
+  _in_flight--;
+
+  if (_finished)
+  {
+    // Another send has already been answered, so ignore this one.
+    pthread_mutex_unlock(&_lock);
+    TRC_DEBUG("Ignoring late answer from %s", _ccfs[attempt].c_str());
+    release(); return;
+  }
+
   if (result_code != ER_DIAMETER_UNABLE_TO_DELIVER)
   {
+    // This answer wins.  Cancel any other sends.
+    _finished = true;
+
+    for (size_t ii = 0; ii < _tsxs.size(); ii++)
+    {
+      if (_tsxs[ii] != NULL)
+      {
+        _tsxs[ii]->cancel();
+      }
+    }
+
+    pthread_mutex_unlock(&_lock);
+
+    if (_ccf_health != NULL)
+    {
+      _ccf_health->success(_ccfs[attempt]);
+    }
+
+    if (_hedger != NULL)
+    {
+      _hedger->record_latency(_hedger->now_ms() - _sent_ms[attempt]);
+
+      if (_hedges[attempt])
+      {
+        _hedger->hedge_won();
+      }
+
+      if (_hedger->cancel(this))
+      {
+        // The hedge timer hadn't fired, so drop its reference.
+        release();
+      }
+    }
+
     // Send succeeded, notify the SessionManager.
     _sm->on_ccf_response(result_code == ER_DIAMETER_SUCCESS, interim_interval, session_id, result_code, _msg);
-    delete this; return;
+    release(); return;
   }
   else
   {
+    pthread_mutex_unlock(&_lock);
+
     // Send failed
-    TRC_WARNING("Failed to send ACR to %s (number %d)", _ccfs[_which].c_str(), _which);
-    SAS::Event cdf_failed(_msg->trail, SASEvent::BILLING_REQUEST_NOT_SENT, 0);
-    cdf_failed.add_var_param(_ccfs[_which]);
+    TRC_WARNING("Failed to send ACR to %s (number %d)", _ccfs[attempt].c_str(), attempt);
+
+    if (_ccf_health != NULL)
+    {
+      _ccf_health->failure(_ccfs[attempt]);
+    }
+
+    SAS::Event cdf_failed(_trail, SASEvent::BILLING_REQUEST_NOT_SENT, 0);
+    cdf_failed.add_var_param(_ccfs[attempt]);
     SAS::report_event(cdf_failed);
 
     // Do we have a backup CCF?
-    _which++;
-    if (_which < _ccfs.size())
+    if (attempt + 1 < _ccfs.size())
     {
-      SAS::Event cdf_failover(_msg->trail, SASEvent::CDF_FAILOVER, 0);
-      cdf_failover.add_var_param(_ccfs[_which]);
+      SAS::Event cdf_failover(_trail, SASEvent::CDF_FAILOVER, 0);
+      cdf_failover.add_var_param(_ccfs[attempt + 1]);
       SAS::report_event(cdf_failover);
+    }
+
+    attempt_failed(result_code, true);
+    release(); return;
+  }
+}
+
+/* Called when an attempt to send the ACR has failed.  Tries the next CCF if
+ * failover is allowed, otherwise (or if we've run out of CCFs) tells the
+ * SessionManager the ACR has failed - unless another attempt is still
+ * waiting for an answer.
+ */
+void PeerMessageSender::attempt_failed(int result_code, bool failover)
+{
+  // Yes we do try again (unless a hedge has already sent to it).
+  if ((failover) && (int_send_msg(false)))
+  {
+    return;
+  }
 
-      // Yes we do try again.  Must be the last thing we do (as this object
-      // could be modified/freed in a callback after this point).
-      int_send_msg(); return;
+  // No, we've run out.  Only fail if no other send is still waiting for an
+  // answer.
+  pthread_mutex_lock(&_lock);
+  bool notify = (!_finished) && (_in_flight == 0);
+  bool spool = (notify) &&
+               (spoolable()) &&
+               (result_code == ER_DIAMETER_UNABLE_TO_DELIVER) &&
+               (!_encoded_acr.empty());
+  if (notify)
+  {
+    _finished = true;
+  }
+  pthread_mutex_unlock(&_lock);
+
+  if (notify)
+  {
+    TRC_ERROR("Failed to connect to all CCFs, message not sent");
+
+    if (spool)
+    {
+      // Keep the ACR on disk, to be sent once a CCF is reachable again.
+      if (_spool->spool(_ccfs, _encoded_acr))
+      {
+        TRC_INFO("Spooled ACR for later delivery");
+      }
     }
-    else
+
+    if ((_hedger != NULL) && (_hedger->cancel(this)))
     {
-      // No, we've run out, fail
-      TRC_ERROR("Failed to connect to all CCFs, message not sent");
-      _sm->on_ccf_response(false, 0, "", result_code, _msg);
-      delete this; return;
+      release();
     }
+
+    _sm->on_ccf_response(false, 0, "", result_code, _msg);
+  }
+}
+
+bool PeerMessageSender::spoolable()
+{
+  return (_spool != NULL) && (!_msg->record_type.isStart());
+}
+
+void PeerMessageSender::release()
+{
+  pthread_mutex_lock(&_lock);
+  bool last = (--_refs == 0);
+  pthread_mutex_unlock(&_lock);
+
+  if (last)
+  {
+    delete this;
   }
 }
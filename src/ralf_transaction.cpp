@@ -36,10 +36,16 @@
 
 #include "ralf_transaction.hpp"
 #include "ralfsasevent.h"
+#include "log.h"
 
 void RalfTransaction::on_timeout()
 {
-  _peer_sender->send_cb(ER_DIAMETER_UNABLE_TO_DELIVER, 0, "");
+  if (_rtt_estimator != NULL)
+  {
+    _rtt_estimator->timed_out(_ccf);
+  }
+
+  _peer_sender->send_cb(_attempt, ER_DIAMETER_UNABLE_TO_DELIVER, 0, "");
 }
 
 // Handles the Accounting-Control-Answer from the CCF, parsing out the data the SessionManager needs.
@@ -50,24 +56,37 @@ void RalfTransaction::on_response(Diameter::Message& rsp)
   std::string session_id = "<value not found in Diameter message>";
 
   rsp.result_code(result_code);
+
+  if ((_rtt_estimator != NULL) &&
+      (result_code != ER_DIAMETER_UNABLE_TO_DELIVER))
+  {
+    // Don't count failures to route the ACR, which don't reach the CCF.
+    _rtt_estimator->sample(_ccf, _rtt_estimator->now_us() - _start_us);
+  }
   rsp.get_str_from_avp(_dict->SESSION_ID, session_id);
 
   // This isn't a mandatory AVP. If it's missing, the interim interval is
   // set to 0.
   rsp.get_i32_from_avp(_dict->ACCT_INTERIM_INTERVAL, interim_interval);
 
-  if (result_code == 2001)
+  if (_cancelled)
+  {
+    // Another CCF answered first.  The message may already have been freed,
+    // so just let the sender know we're done.
+    TRC_DEBUG("Ignoring answer to cancelled ACR (result %d)", result_code);
+  }
+  else if (result_code == 2001)
   {
-    SAS::Event succeeded(_msg->trail, SASEvent::BILLING_REQUEST_SUCCEEDED, 0);
+    SAS::Event succeeded(trail(), SASEvent::BILLING_REQUEST_SUCCEEDED, 0);
     succeeded.add_var_param(session_id);
     SAS::report_event(succeeded);
   }
   else
   {
-    SAS::Event rejected(_msg->trail, SASEvent::BILLING_REQUEST_REJECTED, 0);
+    SAS::Event rejected(trail(), SASEvent::BILLING_REQUEST_REJECTED, 0);
     rejected.add_var_param(session_id);
     SAS::report_event(rejected);
   }
 
-  _peer_sender->send_cb(result_code, interim_interval, session_id);
+  _peer_sender->send_cb(_attempt, result_code, interim_interval, session_id);
 }
@@ -34,22 +34,256 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "rf.h"
 #include "log.h"
 
 namespace Rf {
 
-Dictionary::Dictionary() :
+const size_t Dictionary::DEFAULT_MAX_UNKNOWN_AVPS;
+
+Dictionary::Dictionary(LastValueCache* stats_aggregator,
+                       size_t max_unknown_avps) :
   RF("Diameter Base Accounting"),
   TGPP("3GPP"),
   ACCOUNTING_REQUEST("Accounting-Request"),
-  ACCOUNTING_RESPONSE("Accounting-Answer")
+  ACCOUNTING_RESPONSE("Accounting-Answer"),
+  DESTINATION_HOST_AVP("Destination-Host"),
+  DESTINATION_REALM_AVP("Destination-Realm"),
+  ACCOUNTING_RECORD_NUMBER_AVP("Accounting-Record-Number"),
+  _max_unknown_avps(max_unknown_avps),
+  _unknown_avps(0),
+  _ignored_stat(NULL),
+  _ignored_changed(false)
+{
+  pthread_rwlock_init(&_avps_lock, NULL);
+  _uncached_avp.avp = NULL;
+  _uncached_avp.ignored = 0;
+
+  if (stats_aggregator != NULL)
+  {
+    _ignored_stat = new Statistic("ralf_ignored_avps", stats_aggregator);
+  }
+}
+
+Dictionary::~Dictionary()
+{
+  for (std::unordered_map<std::string, CachedAVP*>::iterator it = _avps.begin();
+       it != _avps.end();
+       ++it)
+  {
+    delete it->second->avp;
+    delete it->second;
+  }
+  _avps.clear();
+
+  pthread_rwlock_destroy(&_avps_lock);
+  delete _ignored_stat; _ignored_stat = NULL;
+}
+
+Dictionary::CachedAVP* Dictionary::lookup(const std::string& name) const
+{
+  CachedAVP* cached = NULL;
+
+  pthread_rwlock_rdlock(&_avps_lock);
+  std::unordered_map<std::string, CachedAVP*>::const_iterator it = _avps.find(name);
+  if (it != _avps.end())
+  {
+    cached = it->second;
+  }
+  pthread_rwlock_unlock(&_avps_lock);
+
+  if (cached == NULL)
+  {
+    // Not seen this AVP before.  Search the dictionary outside the lock, then
+    // add the result to the cache unless another thread beat us to it, or
+    // there are already too many unknown names in it.
+    Diameter::Dictionary::AVP* avp = NULL;
+
+    try
+    {
+      avp = new Diameter::Dictionary::AVP(VENDORS, name);
+    }
+    catch (Diameter::Stack::Exception& e)
+    {
+      TRC_DEBUG("AVP %s not in dictionary", name.c_str());
+    }
+
+    pthread_rwlock_wrlock(&_avps_lock);
+    std::unordered_map<std::string, CachedAVP*>::const_iterator it = _avps.find(name);
+
+    if (it != _avps.end())
+    {
+      cached = it->second;
+    }
+    else if ((avp != NULL) || (_unknown_avps < _max_unknown_avps))
+    {
+      if (avp == NULL)
+      {
+        TRC_WARNING("AVP %s not recognised", name.c_str());
+        _unknown_avps++;
+      }
+
+      cached = new CachedAVP();
+      cached->avp = avp;
+      cached->ignored = 0;
+      _avps.insert(std::make_pair(name, cached));
+      avp = NULL;
+    }
+    else
+    {
+      cached = &_uncached_avp;
+    }
+    pthread_rwlock_unlock(&_avps_lock);
+
+    delete avp;
+  }
+
+  return cached;
+}
+
+const Diameter::Dictionary::AVP* Dictionary::lookup_avp(const std::string& name) const
 {
+  return lookup(name)->avp;
+}
+
+const Diameter::Dictionary::AVP& Dictionary::find_avp(const std::string& name) const
+{
+  const Diameter::Dictionary::AVP* avp = lookup_avp(name);
+
+  if (avp == NULL)
+  {
+    throw Diameter::Stack::Exception("fd_dict_search", ENOENT);
+  }
+
+  return *avp;
+}
+
+const Diameter::Dictionary::AVP* Dictionary::lookup_avp_or_ignore(const std::string& name) const
+{
+  CachedAVP* cached = lookup(name);
+
+  if (cached->avp == NULL)
+  {
+    TRC_DEBUG("AVP %s not recognised, ignoring", name.c_str());
+    cached->ignored++;
+    _ignored_changed = true;
+  }
+
+  return cached->avp;
+}
+
+uint64_t Dictionary::ignored_count(const std::string& name) const
+{
+  return lookup(name)->ignored;
+}
+
+// Report the names of the AVPs we've ignored, and how often.
+void Dictionary::report_ignored() const
+{
+  if ((!_ignored_changed.exchange(false)) || (_ignored_stat == NULL))
+  {
+    return;
+  }
+
+  std::vector<std::string> values;
+
+  if (_uncached_avp.ignored > 0)
+  {
+    values.push_back("(other)");
+    values.push_back(std::to_string(_uncached_avp.ignored));
+  }
+
+  pthread_rwlock_rdlock(&_avps_lock);
+  for (std::unordered_map<std::string, CachedAVP*>::const_iterator it = _avps.begin();
+       it != _avps.end();
+       ++it)
+  {
+    if (it->second->ignored > 0)
+    {
+      values.push_back(it->first);
+      values.push_back(std::to_string(it->second->ignored));
+    }
+  }
+  pthread_rwlock_unlock(&_avps_lock);
+
+  _ignored_stat->report_change(values);
+}
+
+// Add AVPs built from the members of a JSON object to a message or grouped AVP.
+// This is equivalent to Diameter::AVP::val_json for objects, but uses the
+// dictionary's cache of AVPs, including for the members of grouped AVPs.
+template <class T>
+static void add_json_avps(const Dictionary* dict,
+                          T& parent,
+                          const rapidjson::Value& contents);
+
+// Build an AVP from a JSON value.
+static Diameter::AVP& json_avp(const Dictionary* dict,
+                               const Diameter::Dictionary::AVP& avp_dict,
+                               Diameter::AVP& avp,
+                               const rapidjson::Value& value)
+{
+  if (value.GetType() == rapidjson::kObjectType)
+  {
+    add_json_avps(dict, avp, value);
+    return avp;
+  }
+  else
+  {
+    // Simple values don't involve any further dictionary lookups.
+    return avp.val_json(VENDORS, avp_dict, value);
+  }
+}
+
+template <class T>
+static void add_json_avps(const Dictionary* dict,
+                          T& parent,
+                          const rapidjson::Value& contents)
+{
+  for (rapidjson::Value::ConstMemberIterator it = contents.MemberBegin();
+       it != contents.MemberEnd();
+       ++it)
+  {
+    const Diameter::Dictionary::AVP* new_dict;
+
+    switch (it->value.GetType())
+    {
+    case rapidjson::kFalseType:
+    case rapidjson::kTrueType:
+    case rapidjson::kNullType:
+      TRC_ERROR("Invalid format (true/false) in JSON block, ignoring");
+      continue;
+    case rapidjson::kStringType:
+    case rapidjson::kNumberType:
+    case rapidjson::kObjectType:
+      new_dict = dict->lookup_avp_or_ignore(it->name.GetString());
+      if (new_dict != NULL)
+      {
+        Diameter::AVP avp(*new_dict);
+        parent.add(json_avp(dict, *new_dict, avp, it->value));
+      }
+      break;
+    case rapidjson::kArrayType:
+      new_dict = dict->lookup_avp_or_ignore(it->name.GetString());
+      if (new_dict != NULL)
+      {
+        for (rapidjson::Value::ConstValueIterator array_iter = it->value.Begin();
+             array_iter !=  it->value.End();
+             ++array_iter)
+        {
+          Diameter::AVP avp(*new_dict);
+          parent.add(json_avp(dict, *new_dict, avp, *array_iter));
+        }
+      }
+      break;
+    }
+  }
 }
 
-// Create an ACR message from a JSON descriptor.  Most AVPs are auto-created from the
-// contents parameter which should be a JSON object with keys named after AVPs.  For example
-// this object could be the "event" part of the original HTTP request received by Ralf.
 AccountingRequest::AccountingRequest(const Dictionary* dict,
                                      Diameter::Stack* diameter_stack,
                                      const std::string& session_id,
@@ -74,16 +308,13 @@ AccountingRequest::AccountingRequest(const Dictionary* dict,
   add_app_id(Dictionary::Application::ACCT, dict->RF);
 
   // Fill in contributed fields
-  Diameter::Dictionary::AVP dest_host_dict("Destination-Host");
-  Diameter::AVP dest_host_avp(dest_host_dict);
+  Diameter::AVP dest_host_avp(dict->DESTINATION_HOST_AVP);
   add(dest_host_avp.val_str(dest_host));
 
-  Diameter::Dictionary::AVP dest_realm_dict("Destination-Realm");
-  Diameter::AVP dest_realm_avp(dest_realm_dict);
+  Diameter::AVP dest_realm_avp(dict->DESTINATION_REALM_AVP);
   add(dest_realm_avp.val_str(dest_realm));
 
-  Diameter::Dictionary::AVP record_number_dict("Accounting-Record-Number");
-  Diameter::AVP record_number_avp(record_number_dict);
+  Diameter::AVP record_number_avp(dict->ACCOUNTING_RECORD_NUMBER_AVP);
   add(record_number_avp.val_i32(record_number));
 
   if (contents.GetType() != rapidjson::kObjectType)
@@ -93,49 +324,186 @@ AccountingRequest::AccountingRequest(const Dictionary* dict,
   }
 
   // Fill in the dynamic fields
-  for (rapidjson::Value::ConstMemberIterator it = contents.MemberBegin();
-       it != contents.MemberEnd();
-       ++it)
+  add_json_avps(dict, *this, contents);
+  dict->report_ignored();
+}
+
+AccountingRequest::~AccountingRequest()
+{
+}
+
+bool AccountingRequest::encode(std::string& encoded) const
+{
+  uint8_t* buffer;
+  size_t len;
+  int rc = fd_msg_bufferize(fd_msg(), &buffer, &len);
+
+  if (rc != 0)
   {
-    try
+    // LCOV_EXCL_START
+    TRC_WARNING("Failed to encode ACR: %d", rc);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  encoded.assign((const char*)buffer, len);
+  free(buffer);
+  return true;
+}
+
+// Offsets into the Diameter header, and the AVP header layout (RFC 6733).
+static const size_t HDR_LENGTH_OFFSET = 1;
+static const size_t HDR_FLAGS_OFFSET = 4;
+static const size_t HDR_HOP_BY_HOP_OFFSET = 12;
+static const size_t HDR_LEN = 20;
+static const size_t AVP_LENGTH_OFFSET = 5;
+static const size_t AVP_FLAGS_OFFSET = 4;
+static const size_t AVP_HDR_LEN = 8;
+static const uint32_t SESSION_ID_AVP_CODE = 263;
+static const uint32_t DESTINATION_HOST_AVP_CODE = 293;
+
+static uint32_t get_u24(const std::string& buf, size_t offset)
+{
+  return ((uint32_t)(uint8_t)buf[offset] << 16) |
+         ((uint32_t)(uint8_t)buf[offset + 1] << 8) |
+         (uint32_t)(uint8_t)buf[offset + 2];
+}
+
+static uint32_t get_u32(const std::string& buf, size_t offset)
+{
+  return ((uint32_t)(uint8_t)buf[offset] << 24) | get_u24(buf, offset + 1);
+}
+
+static void set_u24(std::string& buf, size_t offset, uint32_t value)
+{
+  buf[offset] = (char)((value >> 16) & 0xFF);
+  buf[offset + 1] = (char)((value >> 8) & 0xFF);
+  buf[offset + 2] = (char)(value & 0xFF);
+}
+
+// Find a top-level AVP with no vendor in an encoded request.  Sets offset to
+// the start of the AVP, and length to its length without padding.  Returns
+// false if there's no such AVP, or the encoding is invalid.
+static bool find_encoded_avp(const std::string& encoded,
+                             uint32_t avp_code,
+                             size_t& offset,
+                             size_t& length)
+{
+  if ((encoded.size() < HDR_LEN) ||
+      (get_u24(encoded, HDR_LENGTH_OFFSET) != encoded.size()))
+  {
+    return false;
+  }
+
+  offset = HDR_LEN;
+
+  while (offset + AVP_HDR_LEN <= encoded.size())
+  {
+    uint32_t code = get_u32(encoded, offset);
+    uint8_t flags = (uint8_t)encoded[offset + AVP_FLAGS_OFFSET];
+    length = get_u24(encoded, offset + AVP_LENGTH_OFFSET);
+    size_t padded_length = (length + 3) & ~(size_t)3;
+
+    if ((length < AVP_HDR_LEN) || (offset + padded_length > encoded.size()))
     {
-      switch (it->value.GetType())
-      {
-      case rapidjson::kFalseType:
-      case rapidjson::kTrueType:
-      case rapidjson::kNullType:
-        TRC_ERROR("Invalid format (true/false) in JSON block, ignoring");
-        continue;
-      case rapidjson::kStringType:
-      case rapidjson::kNumberType:
-      case rapidjson::kObjectType:
-        {
-          Diameter::Dictionary::AVP new_dict(VENDORS, it->name.GetString());
-          Diameter::AVP avp(new_dict);
-          add(avp.val_json(VENDORS, new_dict, it->value));
-        }
-        break;
-      case rapidjson::kArrayType:
-        for (rapidjson::Value::ConstValueIterator array_iter = it->value.Begin();
-             array_iter !=  it->value.End();
-             ++array_iter)
-        {
-          Diameter::Dictionary::AVP new_dict(VENDORS, it->name.GetString());
-          Diameter::AVP avp(new_dict);
-          add(avp.val_json(VENDORS, new_dict, *array_iter));
-        }
-        break;
-      }
+      return false;
     }
-    catch (Diameter::Stack::Exception& e)
+
+    if ((code == avp_code) && ((flags & AVP_FLAG_VENDOR) == 0))
     {
-      TRC_WARNING("AVP %s not recognised, ignoring", it->name.GetString());
+      return true;
     }
+
+    offset += padded_length;
   }
+
+  return false;
 }
 
-AccountingRequest::~AccountingRequest()
+bool AccountingRequest::retarget_encoded(const std::string& encoded,
+                                         const std::string& dest_host,
+                                         std::string& retargeted)
 {
+  size_t offset;
+  size_t length;
+
+  if (!find_encoded_avp(encoded, DESTINATION_HOST_AVP_CODE, offset, length))
+  {
+    return false;
+  }
+
+  size_t padded_length = (length + 3) & ~(size_t)3;
+  size_t new_length = AVP_HDR_LEN + dest_host.size();
+  size_t new_padded_length = (new_length + 3) & ~(size_t)3;
+
+  retargeted.reserve(encoded.size() - padded_length + new_padded_length);
+  retargeted.assign(encoded, 0, offset + AVP_HDR_LEN);
+  set_u24(retargeted, offset + AVP_LENGTH_OFFSET, new_length);
+  retargeted.append(dest_host);
+  retargeted.append(new_padded_length - new_length, '\0');
+  retargeted.append(encoded, offset + padded_length, std::string::npos);
+
+  set_u24(retargeted, HDR_LENGTH_OFFSET, retargeted.size());
+
+  // This may be a duplicate of a request that reached the failed CCF.
+  retargeted[HDR_FLAGS_OFFSET] |= CMD_FLAG_RETRANSMIT;
+
+  // Clear the hop-by-hop identifier.  freeDiameter allocates a new one
+  // for the hop to the new CCF when the request is sent.
+  retargeted.replace(HDR_HOP_BY_HOP_OFFSET, 4, 4, '\0');
+  return true;
+}
+
+bool AccountingRequest::encoded_session_id(const std::string& encoded,
+                                           std::string& session_id)
+{
+  size_t offset;
+  size_t length;
+
+  if (!find_encoded_avp(encoded, SESSION_ID_AVP_CODE, offset, length))
+  {
+    return false;
+  }
+
+  session_id.assign(encoded, offset + AVP_HDR_LEN, length - AVP_HDR_LEN);
+  return true;
+}
+
+Diameter::Message* AccountingRequest::retarget(const Dictionary* dict,
+                                               Diameter::Stack* diameter_stack,
+                                               const std::string& encoded,
+                                               const std::string& dest_host)
+{
+  std::string retargeted;
+
+  if (!retarget_encoded(encoded, dest_host, retargeted))
+  {
+    // LCOV_EXCL_START
+    TRC_WARNING("Failed to retarget encoded ACR");
+    return NULL;
+    // LCOV_EXCL_STOP
+  }
+
+  // freeDiameter takes ownership of the buffer if it parses it.
+  uint8_t* buffer = (uint8_t*)malloc(retargeted.size());
+  memcpy(buffer, retargeted.data(), retargeted.size());
+
+  // Only the message and AVP headers are parsed.  freeDiameter looks the
+  // AVPs it needs up in the dictionary when it routes the request, and the
+  // rest are sent as they were encoded.
+  struct msg* msg = NULL;
+  int rc = fd_msg_parse_buffer(&buffer, retargeted.size(), &msg);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_WARNING("Failed to parse encoded ACR: %d", rc);
+    free(buffer);
+    return NULL;
+    // LCOV_EXCL_STOP
+  }
+
+  return new Diameter::Message(dict, msg, diameter_stack);
 }
 
 AccountingResponse::AccountingResponse(const Dictionary* dict,
@@ -0,0 +1,202 @@
+/**
+ * @file rtt_estimator.cpp Estimates each CCF's round trip time, to set ACR timeouts.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include "rtt_estimator.hpp"
+#include "log.h"
+
+RttEstimator::RttEstimator(int min_timeout_ms,
+                           int max_timeout_ms,
+                           LastValueCache* stats_aggregator) :
+  _min_timeout_ms(min_timeout_ms),
+  _max_timeout_ms(max_timeout_ms),
+  _rtt_stat(NULL),
+  _reported(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  if (stats_aggregator != NULL)
+  {
+    _rtt_stat = new Statistic("ralf_ccf_rtt", stats_aggregator);
+  }
+}
+
+RttEstimator::~RttEstimator()
+{
+  pthread_mutex_destroy(&_lock);
+  delete _rtt_stat; _rtt_stat = NULL;
+}
+
+void RttEstimator::sample(const std::string& ccf, uint64_t rtt_us)
+{
+  pthread_mutex_lock(&_lock);
+  Estimate& estimate = _estimates[ccf];
+
+  if (estimate.srtt_us == 0)
+  {
+    // First sample.
+    estimate.srtt_us = rtt_us;
+    estimate.rttvar_us = rtt_us / 2;
+  }
+  else
+  {
+    uint64_t error_us = (rtt_us > estimate.srtt_us) ?
+                          rtt_us - estimate.srtt_us :
+                          estimate.srtt_us - rtt_us;
+    estimate.rttvar_us = (3 * estimate.rttvar_us + error_us) / 4;
+    estimate.srtt_us = (7 * estimate.srtt_us + rtt_us) / 8;
+  }
+
+  // An answer also ends any backoff.
+  update_timeout(estimate);
+
+  pthread_mutex_unlock(&_lock);
+
+  report();
+}
+
+void RttEstimator::update_timeout(Estimate& estimate)
+{
+  // Round up to the nearest millisecond.  The variance term is at least 1ms
+  // (the clock granularity in RFC 6298).
+  uint64_t var_us = 4 * estimate.rttvar_us;
+  if (var_us < 1000)
+  {
+    var_us = 1000;
+  }
+
+  uint64_t timeout_ms = (estimate.srtt_us + var_us + 999) / 1000;
+
+  if (timeout_ms < _min_timeout_ms)
+  {
+    timeout_ms = _min_timeout_ms;
+  }
+  else if (timeout_ms > _max_timeout_ms)
+  {
+    timeout_ms = _max_timeout_ms;
+  }
+
+  estimate.timeout_ms = timeout_ms;
+}
+
+void RttEstimator::timed_out(const std::string& ccf)
+{
+  pthread_mutex_lock(&_lock);
+  Estimate& estimate = _estimates[ccf];
+
+  if (estimate.timeout_ms != 0)
+  {
+    // Back off, in case the CCF has just slowed down.
+    estimate.timeout_ms = std::min(estimate.timeout_ms * 2, _max_timeout_ms);
+    TRC_DEBUG("ACR to %s timed out, timeout now %d ms",
+              ccf.c_str(), estimate.timeout_ms);
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  report();
+}
+
+unsigned int RttEstimator::timeout_ms(const std::string& ccf)
+{
+  pthread_mutex_lock(&_lock);
+  std::unordered_map<std::string, Estimate>::const_iterator it =
+    _estimates.find(ccf);
+  unsigned int timeout_ms = ((it != _estimates.end()) &&
+                             (it->second.timeout_ms != 0)) ?
+                              it->second.timeout_ms : _max_timeout_ms;
+  pthread_mutex_unlock(&_lock);
+
+  return timeout_ms;
+}
+
+uint64_t RttEstimator::srtt_us(const std::string& ccf)
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t srtt_us = _estimates[ccf].srtt_us;
+  pthread_mutex_unlock(&_lock);
+  return srtt_us;
+}
+
+uint64_t RttEstimator::rttvar_us(const std::string& ccf)
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t rttvar_us = _estimates[ccf].rttvar_us;
+  pthread_mutex_unlock(&_lock);
+  return rttvar_us;
+}
+
+void RttEstimator::report()
+{
+  if (_rtt_stat == NULL)
+  {
+    return;
+  }
+
+  time_t now = time(NULL);
+  time_t reported = _reported.load();
+
+  if ((now == reported) ||
+      (!_reported.compare_exchange_strong(reported, now)))
+  {
+    return;
+  }
+
+  std::vector<std::string> values;
+
+  pthread_mutex_lock(&_lock);
+  for (std::unordered_map<std::string, Estimate>::const_iterator it = _estimates.begin();
+       it != _estimates.end();
+       ++it)
+  {
+    values.push_back(it->first);
+    values.push_back(std::to_string(it->second.srtt_us));
+    values.push_back(std::to_string(it->second.rttvar_us));
+    values.push_back(std::to_string(it->second.timeout_ms));
+  }
+  pthread_mutex_unlock(&_lock);
+
+  _rtt_stat->report_change(values);
+}
+
+uint64_t RttEstimator::now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
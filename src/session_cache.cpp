@@ -0,0 +1,249 @@
+/**
+ * @file session_cache.cpp In-process cache of deserialized sessions.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "session_cache.hpp"
+#include "log.h"
+
+SessionCache::SessionCache(size_t max_bytes,
+                           unsigned int num_shards,
+                           LastValueCache* stats_aggregator) :
+  _hit_stat(NULL),
+  _miss_stat(NULL),
+  _eviction_stat(NULL)
+{
+  if (num_shards == 0)
+  {
+    num_shards = 1;
+  }
+
+  for (unsigned int ii = 0; ii < num_shards; ii++)
+  {
+    _shards.push_back(new Shard());
+  }
+
+  _max_shard_bytes = max_bytes / num_shards;
+
+  if (stats_aggregator != NULL)
+  {
+    _hit_stat = new StatisticCounter("ralf_session_cache_hits", stats_aggregator);
+    _miss_stat = new StatisticCounter("ralf_session_cache_misses", stats_aggregator);
+    _eviction_stat = new StatisticCounter("ralf_session_cache_evictions", stats_aggregator);
+  }
+}
+
+SessionCache::~SessionCache()
+{
+  for (std::vector<Shard*>::iterator it = _shards.begin();
+       it != _shards.end();
+       ++it)
+  {
+    delete *it;
+  }
+  _shards.clear();
+
+  delete _hit_stat; _hit_stat = NULL;
+  delete _miss_stat; _miss_stat = NULL;
+  delete _eviction_stat; _eviction_stat = NULL;
+}
+
+SessionStore::Session* SessionCache::get(const std::string& key,
+                                         uint64_t& cas,
+                                         bool require_cas)
+{
+  SessionStore::Session* session = NULL;
+  Shard* shard = shard_for(key);
+
+  pthread_mutex_lock(&shard->lock);
+
+  std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it =
+    shard->index.find(key);
+
+  if ((it != shard->index.end()) &&
+      (!require_cas || (it->second->cas != 0)))
+  {
+    // Move the entry to the front of the LRU list.
+    shard->lru.splice(shard->lru.begin(), shard->lru, it->second);
+    session = new SessionStore::Session(it->second->session);
+    cas = it->second->cas;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+
+  if (session != NULL)
+  {
+    TRC_DEBUG("Session cache hit for %s, CAS = %ld", key.c_str(), cas);
+    if (_hit_stat != NULL)
+    {
+      _hit_stat->increment();
+    }
+  }
+  else
+  {
+    TRC_DEBUG("Session cache miss for %s", key.c_str());
+    if (_miss_stat != NULL)
+    {
+      _miss_stat->increment();
+    }
+  }
+
+  return session;
+}
+
+void SessionCache::put(const std::string& key,
+                       const SessionStore::Session& session,
+                       uint64_t cas)
+{
+  size_t size = entry_size(key, session);
+  int evicted = 0;
+
+  if (size > _max_shard_bytes)
+  {
+    // This would never fit - make sure we don't hold an old copy.
+    invalidate(key);
+    return;
+  }
+
+  Shard* shard = shard_for(key);
+
+  pthread_mutex_lock(&shard->lock);
+
+  std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it =
+    shard->index.find(key);
+
+  if (it != shard->index.end())
+  {
+    shard->bytes -= it->second->size;
+    shard->lru.erase(it->second);
+    shard->index.erase(it);
+  }
+
+  // Make room by evicting the least recently used entries.
+  while ((shard->bytes + size > _max_shard_bytes) && (!shard->lru.empty()))
+  {
+    Entry& victim = shard->lru.back();
+    shard->bytes -= victim.size;
+    shard->index.erase(victim.key);
+    shard->lru.pop_back();
+    evicted++;
+  }
+
+  shard->lru.push_front(Entry());
+  Entry& entry = shard->lru.front();
+  entry.key = key;
+  entry.session = session;
+  entry.cas = cas;
+  entry.size = size;
+  shard->index[key] = shard->lru.begin();
+  shard->bytes += size;
+
+  pthread_mutex_unlock(&shard->lock);
+
+  if (_eviction_stat != NULL)
+  {
+    for (int ii = 0; ii < evicted; ii++)
+    {
+      _eviction_stat->increment();
+    }
+  }
+}
+
+void SessionCache::invalidate(const std::string& key)
+{
+  Shard* shard = shard_for(key);
+
+  pthread_mutex_lock(&shard->lock);
+
+  std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it =
+    shard->index.find(key);
+
+  if (it != shard->index.end())
+  {
+    shard->bytes -= it->second->size;
+    shard->lru.erase(it->second);
+    shard->index.erase(it);
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+}
+
+size_t SessionCache::size_bytes()
+{
+  size_t bytes = 0;
+
+  for (std::vector<Shard*>::iterator it = _shards.begin();
+       it != _shards.end();
+       ++it)
+  {
+    pthread_mutex_lock(&(*it)->lock);
+    bytes += (*it)->bytes;
+    pthread_mutex_unlock(&(*it)->lock);
+  }
+
+  return bytes;
+}
+
+SessionCache::Shard* SessionCache::shard_for(const std::string& key)
+{
+  return _shards[_hash(key) % _shards.size()];
+}
+
+// Estimate the memory used by an entry - the strings it holds plus the fixed
+// overheads of the entry, the list node and the index node.
+size_t SessionCache::entry_size(const std::string& key,
+                                const SessionStore::Session& session)
+{
+  size_t size = sizeof(Entry) + 64;
+
+  size += 2 * key.size();
+  size += session.session_id.size();
+  size += session.timer_id.size();
+
+  for (std::vector<std::string>::const_iterator it = session.ccf.begin();
+       it != session.ccf.end();
+       ++it)
+  {
+    size += sizeof(std::string) + it->size();
+  }
+
+  for (std::vector<std::string>::const_iterator it = session.ecf.begin();
+       it != session.ecf.end();
+       ++it)
+  {
+    size += sizeof(std::string) + it->size();
+  }
+
+  return size;
+}
@@ -36,6 +36,11 @@
 
 #include <string>
 #include <map>
+#include <functional>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
 
 #include "utils.h"
 #include "message.hpp"
@@ -46,6 +51,10 @@
 #include "sas.h"
 #include "ralfsasevent.h"
 #include "peer_message_sender_factory.hpp"
+#include "ccf_response_pool.hpp"
+#include "task_pool.hpp"
+#include "async_timer_client.hpp"
+#include "session_replicator.hpp"
 #include "rapidjson/document.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
@@ -53,151 +62,376 @@
 // Default value for the timer_id if a post to Chronos fails
 static const std::string NO_TIMER = "NO_TIMER";
 
-void SessionManager::handle(Message* msg)
+// Value for a message's timer_id while the START is still waiting for Chronos
+// to create the session's timer.  This is never stored or sent to Chronos -
+// the stored timer ID is NO_TIMER, with timer_pending_until set, so that
+// nodes that don't know about it treat the session as having no timer.
+static const std::string PENDING_TIMER = "PENDING_TIMER";
+
+// Whether a session's START is still waiting for its timer ID.  It's only
+// waited for until timer_pending_until, in case the START never fills it in
+// (for example because Ralf restarted).
+static bool timer_pending(SessionStore::Session* sess)
 {
-  SessionStore::Session* sess = NULL;
+  return ((sess->timer_id == NO_TIMER) &&
+          (sess->timer_pending_until > (uint32_t)time(NULL)));
+}
 
-  // This flag is used to add a session from a store in one site to another
-  // site that for some reason has lost it. When it's set the SessionStore will
-  // add the session to the store with a CAS of 0.
-  bool new_session = false;
+// A lookup of a session in the remote stores, shared between the thread
+// waiting for it and the tasks that query each store.  The first session
+// found is used, and any found later are ignored.  Whichever of them is
+// finished with the lookup last deletes it.
+class RemoteLookup
+{
+public:
+  RemoteLookup(size_t num_stores) :
+    _refs(num_stores + 1),
+    _outstanding(num_stores),
+    _finished(false),
+    _sess(NULL),
+    _store(0)
+  {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+  }
 
-  if (msg->record_type.isInterim() || msg->record_type.isStop())
+  // Records the result from one store.  Called once for each store.
+  void result(size_t store, SessionStore::Session* sess)
   {
-    // This relates to an existing session
-    sess = _local_store->get_session_data(msg->call_id,
-                                          msg->role,
-                                          msg->function,
-                                          msg->trail);
+    pthread_mutex_lock(&_lock);
+    _outstanding--;
 
-    if (sess == NULL)
+    if ((sess != NULL) && (_sess == NULL) && (!_finished))
     {
-      // Try the remote stores.
-      TRC_DEBUG("Session for %s not found in local store, trying remote stores",
-                msg->call_id.c_str());
-      new_session = true;
-      std::vector<SessionStore*>::iterator it = _remote_stores.begin();
+      _sess = sess;
+      _store = store;
+      sess = NULL;
+    }
 
-      while ((it != _remote_stores.end()) && (sess == NULL))
-      {
-        sess = (*it)->get_session_data(msg->call_id,
-                                       msg->role,
-                                       msg->function,
-                                       msg->trail);
-        ++it;
-      }
+    pthread_cond_signal(&_cond);
+    bool last = (--_refs == 0);
+    pthread_mutex_unlock(&_lock);
 
-      if (sess == NULL)
-      {
-        // No record of the session - ignore the request
-        TRC_INFO("Session for %s not found in database, ignoring message", msg->call_id.c_str());
-        delete msg; msg = NULL;
-        return;
-      }
+    delete sess; sess = NULL;
+
+    if (last)
+    {
+      delete this;
     }
+  }
 
-    // Increment the accounting record number before building new ACR.
-    sess->acct_record_number += 1;
+  // Waits for a session to be found, for all the stores to answer, or for
+  // the timeout.  Returns the session, if any, and the index of the store
+  // it came from.  Sets timed_out if any stores hadn't answered.
+  SessionStore::Session* wait(unsigned int timeout_ms,
+                              size_t& store,
+                              bool& timed_out)
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    uint64_t timeout_ns = (uint64_t)timeout_ms * 1000000;
+    deadline.tv_sec += (deadline.tv_nsec + timeout_ns) / 1000000000;
+    deadline.tv_nsec = (deadline.tv_nsec + timeout_ns) % 1000000000;
 
-    if (msg->record_type.isInterim())
+    pthread_mutex_lock(&_lock);
+
+    while ((_sess == NULL) && (_outstanding > 0))
     {
-      // Update the store with the incremented accounting record number.
-      Store::Status rc = _local_store->set_session_data(msg->call_id,
-                                                        msg->role,
-                                                        msg->function,
-                                                        sess,
-                                                        new_session,
-                                                        msg->trail);
-      if (rc == Store::Status::DATA_CONTENTION)
+      if (pthread_cond_timedwait(&_cond, &_lock, &deadline) == ETIMEDOUT)
       {
-        // Someone has written conflicting data since we read this, so start processing this message again
-        return this->handle(msg);  // LCOV_EXCL_LINE - no conflicts in UT
+        break;
       }
+    }
+
+    SessionStore::Session* sess = _sess;
+    _sess = NULL;
+    store = _store;
+    timed_out = (sess == NULL) && (_outstanding > 0);
+    _finished = true;
+    bool last = (--_refs == 0);
+    pthread_mutex_unlock(&_lock);
+
+    if (last)
+    {
+      delete this;
+    }
+
+    return sess;
+  }
+
+private:
+  ~RemoteLookup()
+  {
+    delete _sess; _sess = NULL;
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_lock);
+  }
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  size_t _refs;
+  size_t _outstanding;
+  bool _finished;
+  SessionStore::Session* _sess;
+  size_t _store;
+};
+
+SessionManager::SessionManager(SessionStore* local_store,
+                               std::vector<SessionStore*> remote_stores,
+                               Rf::Dictionary* dict,
+                               PeerMessageSenderFactory* factory,
+                               ChronosConnection* timer_conn,
+                               Diameter::Stack* diameter_stack,
+                               HealthChecker* hc,
+                               LastValueCache* stats_aggregator) :
+  _local_store(local_store),
+  _remote_stores(remote_stores),
+  _timer_conn(timer_conn),
+  _dict(dict),
+  _factory(factory),
+  _diameter_stack(diameter_stack),
+  _health_checker(hc),
+  _response_pool(NULL),
+  _task_pool(NULL),
+  _timer_client(NULL),
+  _lazy_timer_updates(false),
+  _timer_jitter(0),
+  _remote_lookup_timeout_ms(DEFAULT_REMOTE_LOOKUP_TIMEOUT_MS),
+  _contention_hit_stat(NULL),
+  _timer_updates_sent_stat(NULL),
+  _timer_updates_skipped_stat(NULL),
+  _local_hits_stat(NULL),
+  _remote_hits_stat(NULL),
+  _misses_stat(NULL),
+  _remote_timeouts_stat(NULL)
+{
+  if (stats_aggregator != NULL)
+  {
+    _contention_hit_stat = new StatisticCounter("ralf_session_contention_hit",
+                                                stats_aggregator);
+    _timer_updates_sent_stat = new StatisticCounter("ralf_timer_updates_sent",
+                                                    stats_aggregator);
+    _timer_updates_skipped_stat = new StatisticCounter("ralf_timer_updates_skipped",
+                                                       stats_aggregator);
+    _local_hits_stat = new StatisticCounter("ralf_session_local_hits",
+                                            stats_aggregator);
+    _remote_hits_stat = new StatisticCounter("ralf_session_remote_hits",
+                                             stats_aggregator);
+    _misses_stat = new StatisticCounter("ralf_session_misses",
+                                        stats_aggregator);
+    _remote_timeouts_stat = new StatisticCounter("ralf_session_remote_timeouts",
+                                                 stats_aggregator);
+  }
+}
+
+SessionManager::~SessionManager()
+{
+  delete _contention_hit_stat; _contention_hit_stat = NULL;
+  delete _timer_updates_sent_stat; _timer_updates_sent_stat = NULL;
+  delete _timer_updates_skipped_stat; _timer_updates_skipped_stat = NULL;
+  delete _local_hits_stat; _local_hits_stat = NULL;
+  delete _remote_hits_stat; _remote_hits_stat = NULL;
+  delete _misses_stat; _misses_stat = NULL;
+  delete _remote_timeouts_stat; _remote_timeouts_stat = NULL;
+}
 
-      std::vector<SessionStore*>::iterator remote_store = _remote_stores.begin();
+void SessionManager::handle(Message* msg)
+{
+  SessionStore::Session* sess = NULL;
 
-      while (remote_store != _remote_stores.end())
+  if (msg->record_type.isInterim() || msg->record_type.isStop())
+  {
+    // This relates to an existing session.  If someone writes conflicting data
+    // between us reading the session and writing it back, we go round again.
+    while (true)
+    {
+      // This flag is used to add a session from a store in one site to another
+      // site that for some reason has lost it. When it's set the SessionStore will
+      // add the session to the store with a CAS of 0.
+      bool new_session = false;
+
+      sess = _local_store->get_session_data(msg->call_id,
+                                            msg->role,
+                                            msg->function,
+                                            msg->trail);
+
+      if (sess == NULL)
       {
-        new_session = false;
+        // Try the remote stores.
+        TRC_DEBUG("Session for %s not found in local store, trying remote stores",
+                  msg->call_id.c_str());
+        new_session = true;
+        sess = find_remote_session(msg);
 
-        SessionStore::Session* remote_sess = (*remote_store)->get_session_data(msg->call_id,
-                                                                               msg->role,
-                                                                               msg->function,
-                                                                               msg->trail);
-        if (remote_sess == NULL)
+        if (sess == NULL)
         {
-          remote_sess = new SessionStore::Session();
-          *remote_sess = *sess;
-          new_session = true;
-        }
-        else
-        {
-          remote_sess->acct_record_number += 1;
-        }
+          // No record of the session - ignore the request
+          TRC_INFO("Session for %s not found in database, ignoring message", msg->call_id.c_str());
 
-        rc = (*remote_store)->set_session_data(msg->call_id,
-                                               msg->role,
-                                               msg->function,
-                                               remote_sess,
-                                               new_session,
-                                               msg->trail);
-        delete remote_sess; remote_sess = NULL;
-
-        // Move onto the next store unless we've got data contention, in which
-        // case we want to try this store. If a remote site is uncontactable we
-        // ignore it.
-        if (rc != Store::Status::DATA_CONTENTION)
-        {
-          ++remote_store;
+          if (_misses_stat != NULL)
+          {
+            _misses_stat->increment();
+          }
+
+          delete msg; msg = NULL;
+          return;
         }
       }
-    }
-    else if  (msg->record_type.isStop())
-    {
-      // Delete the session from the store and cancel the timer
-      Store::Status rc =_local_store->delete_session_data(msg->call_id,
+      else if (_local_hits_stat != NULL)
+      {
+        _local_hits_stat->increment();
+      }
+
+      // Increment the accounting record number before building new ACR.
+      sess->acct_record_number += 1;
+
+      if ((_lazy_timer_updates) &&
+          (msg->record_type.isInterim()) &&
+          (!msg->timer_interim))
+      {
+        // A request from Sprout refreshes the session.
+        uint32_t refresh_time = (msg->session_refresh_time != 0) ?
+                                  msg->session_refresh_time :
+                                  sess->session_refresh_time;
+        sess->session_expiry = (uint32_t)time(NULL) + refresh_time;
+      }
+
+      if (msg->record_type.isInterim())
+      {
+        // Update the store with the incremented accounting record number.
+        Store::Status rc = _local_store->set_session_data(msg->call_id,
                                                           msg->role,
                                                           msg->function,
                                                           sess,
+                                                          new_session,
                                                           msg->trail);
+        if (rc == Store::Status::DATA_CONTENTION)
+        {
+          // LCOV_EXCL_START - no conflicts in UT
+          contention_hit(msg->call_id);
+          delete sess; sess = NULL;
+          continue;
+          // LCOV_EXCL_STOP
+        }
 
-      if (rc == Store::Status::DATA_CONTENTION)
-      {
-        // Someone has written conflicting data since we read this, so start processing this message again
-        return this->handle(msg);  // LCOV_EXCL_LINE - no conflicts in UT
-      }
-
-      std::vector<SessionStore*>::iterator remote_store = _remote_stores.begin();
+        if (!_replicators.empty())
+        {
+          replicate(msg->call_id, msg->role, msg->function, sess, false, msg->trail);
+        }
+        else
+        {
+          std::vector<SessionStore*>::iterator remote_store = _remote_stores.begin();
 
-      while (remote_store != _remote_stores.end())
+          while (remote_store != _remote_stores.end())
+          {
+            new_session = false;
+
+            SessionStore::Session* remote_sess = (*remote_store)->get_session_data(msg->call_id,
+                                                                                   msg->role,
+                                                                                   msg->function,
+                                                                                   msg->trail);
+            if (remote_sess == NULL)
+            {
+              remote_sess = new SessionStore::Session();
+              *remote_sess = *sess;
+              new_session = true;
+            }
+            else
+            {
+              remote_sess->acct_record_number += 1;
+              remote_sess->session_expiry = sess->session_expiry;
+            }
+
+            rc = (*remote_store)->set_session_data(msg->call_id,
+                                                   msg->role,
+                                                   msg->function,
+                                                   remote_sess,
+                                                   new_session,
+                                                   msg->trail);
+            delete remote_sess; remote_sess = NULL;
+
+            // Move onto the next store unless we've got data contention, in which
+            // case we want to try this store. If a remote site is uncontactable we
+            // ignore it.
+            if (rc != Store::Status::DATA_CONTENTION)
+            {
+              ++remote_store;
+            }
+          }
+        }
+      }
+      else if  (msg->record_type.isStop())
       {
-        rc = (*remote_store)->delete_session_data(msg->call_id,
-                                                  msg->role,
-                                                  msg->function,
-                                                  msg->trail);
+        // Delete the session from the store and cancel the timer
+        Store::Status rc =_local_store->delete_session_data(msg->call_id,
+                                                            msg->role,
+                                                            msg->function,
+                                                            sess,
+                                                            msg->trail);
+
+        if (rc == Store::Status::DATA_CONTENTION)
+        {
+          // LCOV_EXCL_START - no conflicts in UT
+          contention_hit(msg->call_id);
+          delete sess; sess = NULL;
+          continue;
+          // LCOV_EXCL_STOP
+        }
 
-        // Move onto the next store unless we've got data contention, in which
-        // case we want to try this store. If a remote site is uncontactable we
-        // ignore it.
-        if (rc != Store::Status::DATA_CONTENTION)
+        if (!_replicators.empty())
         {
-          ++remote_store;
+          replicate_delete(msg->call_id, msg->role, msg->function, msg->trail);
         }
-      }
+        else
+        {
+          std::vector<SessionStore*>::iterator remote_store = _remote_stores.begin();
 
-      TRC_INFO("Received STOP for session %s, deleting session and timer using timer ID %s", msg->call_id.c_str(), sess->timer_id.c_str());
+          while (remote_store != _remote_stores.end())
+          {
+            rc = (*remote_store)->delete_session_data(msg->call_id,
+                                                      msg->role,
+                                                      msg->function,
+                                                      msg->trail);
+
+            // Move onto the next store unless we've got data contention, in which
+            // case we want to try this store. If a remote site is uncontactable we
+            // ignore it.
+            if (rc != Store::Status::DATA_CONTENTION)
+            {
+              ++remote_store;
+            }
+          }
+        }
 
-      if (sess->timer_id != "NO_TIMER")
-      {
-        _timer_conn->send_delete(sess->timer_id,
-                                 msg->trail);
+        TRC_INFO("Received STOP for session %s, deleting session and timer using timer ID %s", msg->call_id.c_str(), sess->timer_id.c_str());
+
+        // If the START's timer is still being created, it's deleted when
+        // the START finds the session has gone.
+        if (sess->timer_id != NO_TIMER)
+        {
+          if (_timer_client != NULL)
+          {
+            _timer_client->send_delete(sess->timer_id, msg->trail);
+          }
+          else
+          {
+            _timer_conn->send_delete(sess->timer_id,
+                                     msg->trail);
+          }
+        }
       }
+
+      break;
     }
 
     msg->accounting_record_number = sess->acct_record_number;
     msg->ccfs = sess->ccf;
     msg->session_id = sess->session_id;
-    msg->timer_id = sess->timer_id;
+    msg->timer_id = timer_pending(sess) ? PENDING_TIMER : sess->timer_id;
 
     if (msg->session_refresh_time == 0)
     {
@@ -206,6 +440,9 @@ void SessionManager::handle(Message* msg)
     }
 
     msg->interim_interval = sess->interim_interval;
+    msg->timer_interval = sess->timer_interval;
+    msg->timer_expiry = sess->timer_expiry;
+    msg->session_expiry = sess->session_expiry;
     delete sess; sess = NULL;
   }
   else
@@ -225,6 +462,126 @@ void SessionManager::handle(Message* msg)
   pm->send(msg, this, _dict, _diameter_stack);
 }
 
+// Looks up a session that isn't in the local store in the remote stores.  With
+// a task pool, all the remote stores are queried at once and the first
+// session found is used, as long as it's found within the timeout.  Without
+// one, they are queried one at a time.
+SessionStore::Session* SessionManager::find_remote_session(Message* msg)
+{
+  SessionStore::Session* sess = NULL;
+  size_t store = 0;
+
+  if ((_task_pool == NULL) || (_remote_stores.empty()))
+  {
+    for (size_t ii = 0; (ii < _remote_stores.size()) && (sess == NULL); ii++)
+    {
+      sess = _remote_stores[ii]->get_session_data(msg->call_id,
+                                                  msg->role,
+                                                  msg->function,
+                                                  msg->trail);
+      store = ii;
+    }
+  }
+  else
+  {
+    RemoteLookup* lookup = new RemoteLookup(_remote_stores.size());
+    std::string call_id = msg->call_id;
+    role_of_node_t role = msg->role;
+    node_functionality_t function = msg->function;
+    SAS::TrailId trail = msg->trail;
+
+    for (size_t ii = 0; ii < _remote_stores.size(); ii++)
+    {
+      SessionStore* remote_store = _remote_stores[ii];
+      std::function<void()> get = [lookup, ii, remote_store, call_id, role, function, trail]()
+      {
+        lookup->result(ii, remote_store->get_session_data(call_id,
+                                                          role,
+                                                          function,
+                                                          trail));
+      };
+
+      if (!_task_pool->add_task(get))
+      {
+        get();
+      }
+    }
+
+    bool timed_out = false;
+    sess = lookup->wait(_remote_lookup_timeout_ms, store, timed_out);
+    lookup = NULL;
+
+    if (timed_out)
+    {
+      TRC_INFO("Timed out looking up session for %s in remote stores",
+               msg->call_id.c_str());
+
+      if (_remote_timeouts_stat != NULL)
+      {
+        _remote_timeouts_stat->increment();
+      }
+    }
+  }
+
+  if (sess != NULL)
+  {
+    TRC_INFO("Session for %s found in remote store %d",
+             msg->call_id.c_str(), (int)store);
+
+    if (_remote_hits_stat != NULL)
+    {
+      _remote_hits_stat->increment();
+    }
+  }
+
+  return sess;
+}
+
+// Queues a session that has been written to the local store to be written
+// to each remote site.  new_session is set if the local write created it.
+void SessionManager::replicate(const std::string& call_id,
+                               role_of_node_t role,
+                               node_functionality_t function,
+                               SessionStore::Session* sess,
+                               bool new_session,
+                               SAS::TrailId trail)
+{
+  for (std::vector<SessionReplicator*>::iterator replicator = _replicators.begin();
+       replicator != _replicators.end();
+       ++replicator)
+  {
+    (*replicator)->replicate(call_id, role, function, sess, new_session, trail);
+  }
+}
+
+// Queues a session that has been deleted from the local store to be deleted
+// from each remote site.
+void SessionManager::replicate_delete(const std::string& call_id,
+                                      role_of_node_t role,
+                                      node_functionality_t function,
+                                      SAS::TrailId trail)
+{
+  for (std::vector<SessionReplicator*>::iterator replicator = _replicators.begin();
+       replicator != _replicators.end();
+       ++replicator)
+  {
+    (*replicator)->replicate_delete(call_id, role, function, trail);
+  }
+}
+
+// Someone else has written to the session between us reading and writing it.
+// When requests are processed in per-session order this can only be a
+// different node (or a timer pop racing with a request from Sprout).
+void SessionManager::contention_hit(const std::string& call_id)
+{
+  TRC_DEBUG("Data contention on session for %s, retrying", call_id.c_str());
+
+  if (_contention_hit_stat != NULL)
+  {
+    _contention_hit_stat->increment();
+  }
+}
+
 std::string SessionManager::create_opaque_data(Message* msg)
 {
   // Create the doc object so we can share the allocator during construction
@@ -304,6 +661,32 @@ void SessionManager::on_ccf_response(bool accepted,
                                      std::string session_id,
                                      int rc,
                                      Message* msg)
+{
+  if (_response_pool != NULL)
+  {
+    // Hand the answer to the response pool, so that the Diameter thread isn't
+    // held up by Chronos and the session stores.
+    CcfResponse response;
+    response.accepted = accepted;
+    response.interim_interval = interim_interval;
+    response.session_id = session_id;
+    response.rc = rc;
+    response.msg = msg;
+
+    if (_response_pool->add_response(response))
+    {
+      return;
+    }
+  }
+
+  process_ccf_response(accepted, interim_interval, session_id, rc, msg);
+}
+
+void SessionManager::process_ccf_response(bool accepted,
+                                          uint32_t interim_interval,
+                                          std::string session_id,
+                                          int rc,
+                                          Message* msg)
 {
   sas_log_ccf_response(accepted, session_id, msg);
 
@@ -322,53 +705,71 @@ void SessionManager::on_ccf_response(bool accepted,
         (msg->session_refresh_time > interim_interval))
     {
       // Interim message generated by Sprout, so update a timer to generate recurring INTERIMs
-      std::string timer_id = msg->timer_id;
-
-      send_chronos_update(timer_id,
-                          interim_interval,
-                          msg->session_refresh_time,
-                          "/call-id/"+Utils::url_escape(msg->call_id)+"?timer-interim=true",
-                          create_opaque_data(msg),
-                          msg->trail);
+      update_timer(msg, interim_interval);
 
       SAS::Event updated_timer(msg->trail, SASEvent::INTERIM_TIMER_RENEWED, 0);
       updated_timer.add_static_param(interim_interval);
       SAS::report_event(updated_timer);
-
-      // Update the timer_id if it has changed
-      if (timer_id != msg->timer_id)
-      {
-        update_timer_id(msg, timer_id);
-      }
+    }
+    else if ((_lazy_timer_updates) &&
+             (msg->record_type.isInterim()) &&
+             (msg->timer_interim))
+    {
+      // Timer pop.  If updates to the timer were skipped, it may need to be
+      // extended to the session's expiry.
+      update_timer(msg, interim_interval);
     }
     else if (msg->record_type.isStart())
     {
-      // New message from Sprout - create a new timer then insert the session into the store
+      // New message from Sprout - create a new timer and insert the session
+      // into the store.  If there's an asynchronous timer client, the session
+      // is written first and the timer ID filled in when Chronos answers.  If
+      // there's a task pool, the timer is created on it while we write the
+      // session, and the timer ID is filled in afterwards.  Otherwise the
+      // timer is created first so the session is only written once.
 
       // Set the timer id initially to NO_TIMER - this isn't included in the path of the POST
       std::string timer_id = NO_TIMER;
-      std::map<std::string, uint32_t> tags; tags["CALL"] = 1;
-
-      if (msg->session_refresh_time > interim_interval)
+      bool create_timer = (msg->session_refresh_time > interim_interval);
+      uint32_t timer_interval = jittered_interval(msg, interim_interval);
+      bool async = create_timer && (_timer_client != NULL);
+      bool concurrent = false;
+      sem_t timer_created;
+      sem_init(&timer_created, 0, 0);
+
+      std::function<void()> post = [&]()
       {
-         HTTPCode status = _timer_conn->send_post(timer_id,  // Chronos returns a timer ID which is filled in to this parameter
-                                                  interim_interval, // interval
-                                                  msg->session_refresh_time, // repeat-for
-                                                  "/call-id/"+Utils::url_escape(msg->call_id)+"?timer-interim=true",
-                                                  create_opaque_data(msg),
-                                                  msg->trail,
-                                                  tags);
-
-         if (status != HTTP_OK)
-         {
-           // LCOV_EXCL_START
-           TRC_ERROR("Chronos POST failed");
-           // LCOV_EXCL_STOP
-         }
+        std::map<std::string, uint32_t> tags; tags["CALL"] = 1;
+        HTTPCode status = _timer_conn->send_post(timer_id,  // Chronos returns a timer ID which is filled in to this parameter
+                                                 timer_interval, // interval
+                                                 msg->session_refresh_time, // repeat-for
+                                                 "/call-id/"+Utils::url_escape(msg->call_id)+"?timer-interim=true",
+                                                 create_opaque_data(msg),
+                                                 msg->trail,
+                                                 tags);
+
+        if (status != HTTP_OK)
+        {
+          // LCOV_EXCL_START
+          TRC_ERROR("Chronos POST failed");
+          // LCOV_EXCL_STOP
+        }
+
+        sem_post(&timer_created);
       };
 
+      if ((create_timer) && (!async))
+      {
+        concurrent = (_task_pool != NULL) && (_task_pool->add_task(post));
+
+        if (!concurrent)
+        {
+          post();
+        }
+      }
+
       SAS::Event new_timer(msg->trail, SASEvent::INTERIM_TIMER_CREATED, 0);
-      new_timer.add_static_param(interim_interval);
+      new_timer.add_static_param(timer_interval);
       SAS::report_event(new_timer);
 
       TRC_INFO("Writing session to store");
@@ -376,13 +777,24 @@ void SessionManager::on_ccf_response(bool accepted,
       sess->session_id = session_id;
       sess->interim_interval = interim_interval;
 
-      sess->timer_id = timer_id;
-      msg->timer_id = timer_id;
+      // Don't touch timer_id while the task pool might still be writing it.
+      // Later requests wait up to an interim interval for it to be filled in.
+      bool pending = (concurrent || async);
+      sess->timer_id = pending ? NO_TIMER : timer_id;
+      sess->timer_pending_until = pending ? (uint32_t)time(NULL) + interim_interval : 0;
+      msg->timer_id = pending ? PENDING_TIMER : timer_id;
 
       sess->ccf = msg->ccfs;
       sess->acct_record_number = msg->accounting_record_number;
       sess->session_refresh_time = msg->session_refresh_time;
 
+      if ((_lazy_timer_updates) && (create_timer))
+      {
+        sess->timer_interval = timer_interval;
+        sess->timer_expiry = (uint32_t)time(NULL) + msg->session_refresh_time;
+        sess->session_expiry = sess->timer_expiry;
+      }
+
       // Do this unconditionally - if it fails, this processing has already been done elsewhere
       _local_store->set_session_data(msg->call_id,
                                      msg->role,
@@ -391,19 +803,58 @@ void SessionManager::on_ccf_response(bool accepted,
                                      true,
                                      msg->trail);
 
-      for (std::vector<SessionStore*>::iterator remote_store = _remote_stores.begin();
-           remote_store != _remote_stores.end();
-           ++remote_store)
+      if (!_replicators.empty())
       {
-        (*remote_store)->set_session_data(msg->call_id,
-                                          msg->role,
-                                          msg->function,
-                                          sess,
-                                          true,
-                                          msg->trail);
+        replicate(msg->call_id, msg->role, msg->function, sess, true, msg->trail);
+      }
+      else
+      {
+        for (std::vector<SessionStore*>::iterator remote_store = _remote_stores.begin();
+             remote_store != _remote_stores.end();
+             ++remote_store)
+        {
+          (*remote_store)->set_session_data(msg->call_id,
+                                            msg->role,
+                                            msg->function,
+                                            sess,
+                                            true,
+                                            msg->trail);
+        }
       }
 
       delete sess; sess = NULL;
+
+      if (async)
+      {
+        std::string call_id = msg->call_id;
+        role_of_node_t role = msg->role;
+        node_functionality_t function = msg->function;
+        SAS::TrailId trail = msg->trail;
+        std::map<std::string, uint32_t> tags; tags["CALL"] = 1;
+
+        _timer_client->send_post(timer_interval,
+                                 msg->session_refresh_time,
+                                 "/call-id/"+Utils::url_escape(msg->call_id)+"?timer-interim=true",
+                                 create_opaque_data(msg),
+                                 msg->trail,
+                                 tags,
+                                 [this, call_id, role, function, trail](HTTPCode rc, const std::string& new_timer_id)
+                                 {
+                                   set_start_timer_id(call_id,
+                                                      role,
+                                                      function,
+                                                      trail,
+                                                      (rc == HTTP_OK) ? new_timer_id : NO_TIMER);
+                                 });
+      }
+      else if (concurrent)
+      {
+        sem_wait(&timer_created);
+        set_start_timer_id(msg->call_id, msg->role, msg->function, msg->trail, timer_id);
+        msg->timer_id = timer_id;
+      }
+
+      sem_destroy(&timer_created);
     }
 
     // Successful ACAs are an indication of healthy behaviour
@@ -424,14 +875,21 @@ void SessionManager::on_ccf_response(bool accepted,
                                           msg->function,
                                           msg->trail);
 
-        for (std::vector<SessionStore*>::iterator remote_store = _remote_stores.begin();
-             remote_store != _remote_stores.end();
-             ++remote_store)
+        if (!_replicators.empty())
         {
-          (*remote_store)->delete_session_data(msg->call_id,
-                                               msg->role,
-                                               msg->function,
-                                               msg->trail);
+          replicate_delete(msg->call_id, msg->role, msg->function, msg->trail);
+        }
+        else
+        {
+          for (std::vector<SessionStore*>::iterator remote_store = _remote_stores.begin();
+               remote_store != _remote_stores.end();
+               ++remote_store)
+          {
+            (*remote_store)->delete_session_data(msg->call_id,
+                                                 msg->role,
+                                                 msg->function,
+                                                 msg->trail);
+          }
         }
       }
       else if (!msg->timer_interim)
@@ -442,20 +900,7 @@ void SessionManager::on_ccf_response(bool accepted,
         if (msg->session_refresh_time > interim_interval)
         {
           TRC_INFO("Received INTERIM for session %s, updating timer using timer ID %s", msg->call_id.c_str(), msg->timer_id.c_str());
-
-          std::string timer_id = msg->timer_id;
-          send_chronos_update(timer_id,
-                              interim_interval,
-                              msg->session_refresh_time,
-                              "/call-id/"+Utils::url_escape(msg->call_id)+"?timer-interim=true",
-                              create_opaque_data(msg),
-                              msg->trail);
-
-          // Update the timer_id if it has changed
-          if (timer_id != msg->timer_id)
-          {
-            update_timer_id(msg, timer_id);
-          }
+          update_timer(msg, interim_interval);
         }
       }
     }
@@ -469,66 +914,368 @@ void SessionManager::on_ccf_response(bool accepted,
 // contention then this update will fail
 void SessionManager::update_timer_id(Message* msg, std::string timer_id)
 {
+  std::string old_timer_id = msg->timer_id;
+  msg->timer_id = timer_id;
+  update_timer_id(msg->call_id, msg->role, msg->function, msg->trail, old_timer_id, timer_id);
+}
+
+// Stores a session's timer ID, replacing old_timer_id.  If timer_expiry is
+// set, the timer's schedule is stored too.  If the session's timer has been
+// changed by another request in the meantime, it's left alone, and a new timer
+// that isn't stored anywhere is deleted.
+void SessionManager::update_timer_id(const std::string& call_id,
+                                     role_of_node_t role,
+                                     node_functionality_t function,
+                                     SAS::TrailId trail,
+                                     const std::string& old_timer_id,
+                                     const std::string& timer_id,
+                                     uint32_t timer_interval,
+                                     uint32_t timer_expiry)
+{
+  // With replicators, only the local store is written directly, and the
+  // result is replicated.
   std::vector<SessionStore*> stores = {_local_store};
-  stores.insert(stores.end(),
-                _remote_stores.begin(),
-                _remote_stores.end());
+
+  if (_replicators.empty())
+  {
+    stores.insert(stores.end(),
+                  _remote_stores.begin(),
+                  _remote_stores.end());
+  }
+  bool used = false;
 
   for (std::vector<SessionStore*>::iterator store = stores.begin();
        store != stores.end();
        ++store)
   {
-    SessionStore::Session* sess = (*store)->get_session_data(msg->call_id,
-                                                             msg->role,
-                                                             msg->function,
-                                                             msg->trail);
+    SessionStore::Session* sess = (*store)->get_session_data(call_id,
+                                                             role,
+                                                             function,
+                                                             trail);
+    if ((sess != NULL) &&
+        (sess->timer_id != old_timer_id) &&
+        (sess->timer_id != timer_id))
+    {
+      // LCOV_EXCL_START - no races in UT
+      TRC_INFO("Timer for %s changed from %s to %s while updating it, not storing timer %s",
+               call_id.c_str(), old_timer_id.c_str(), sess->timer_id.c_str(), timer_id.c_str());
+      delete sess; sess = NULL;
+      // LCOV_EXCL_STOP
+    }
+
     if (sess != NULL)
     {
       sess->timer_id = timer_id;
-      msg->timer_id = timer_id;
-
-      (*store)->set_session_data(msg->call_id,
-                                 msg->role,
-                                 msg->function,
-                                 sess,
-                                 false,
-                                 msg->trail);
+      sess->timer_pending_until = 0;
+      used = true;
+
+      if (timer_expiry != 0)
+      {
+        sess->timer_interval = timer_interval;
+        sess->timer_expiry = timer_expiry;
+      }
+
+      Store::Status rc = (*store)->set_session_data(call_id,
+                                                    role,
+                                                    function,
+                                                    sess,
+                                                    false,
+                                                    trail);
+
+      if ((rc == Store::Status::OK) && (*store == _local_store))
+      {
+        replicate(call_id, role, function, sess, false, trail);
+      }
     }
 
     delete sess; sess = NULL;
   }
+
+  if ((!used) && (timer_id != old_timer_id) && (timer_id != NO_TIMER))
+  {
+    // LCOV_EXCL_START - no races in UT
+    TRC_INFO("Session for %s changed while updating its timer, deleting timer %s",
+             call_id.c_str(), timer_id.c_str());
+    _timer_conn->send_delete(timer_id, trail);
+    // LCOV_EXCL_STOP
+  }
+}
+
+// Works out the interval for a session's timer.  With jitter, the timer pops
+// up to _timer_jitter percent of the interval early.  The amount is derived
+// from the session's identifiers, so it's the same every time the timer is
+// updated, on any node.  std::hash can differ between builds, so this uses
+// the session store's FNV-1a of the session key.
+uint32_t SessionManager::jittered_interval(Message* msg, uint32_t interim_interval)
+{
+  uint32_t max_jitter = (uint64_t)interim_interval * _timer_jitter / 100;
+
+  if (max_jitter == 0)
+  {
+    return interim_interval;
+  }
+
+  uint64_t hash = SessionStore::hash_body(
+                    SessionStore::create_key(msg->call_id, msg->role, msg->function));
+  return interim_interval - (hash % (max_jitter + 1));
+}
+
+// Updates the timer that generates a session's recurring INTERIMs, and stores
+// its new ID if Chronos changed it.  With an asynchronous timer client this
+// is done once Chronos answers.
+//
+// If timer updates are lazy, the timer is only updated if its interval has
+// changed or it's about to stop popping, and its new schedule is stored.
+void SessionManager::update_timer(Message* msg, uint32_t interim_interval)
+{
+  std::string callback_uri = "/call-id/"+Utils::url_escape(msg->call_id)+"?timer-interim=true";
+  uint32_t repeat_for = msg->session_refresh_time;
+  uint32_t now = (uint32_t)time(NULL);
+  interim_interval = jittered_interval(msg, interim_interval);
+
+  if (msg->timer_id == PENDING_TIMER)
+  {
+    // The START is still creating the session's timer, and will store its ID
+    // when Chronos answers.  Creating another timer here would leave one of
+    // them orphaned.
+    TRC_DEBUG("Timer for %s is still being created, not updating it",
+              msg->call_id.c_str());
+    return;
+  }
+
+  if (_lazy_timer_updates)
+  {
+    if (!timer_update_needed(msg, interim_interval, now))
+    {
+      TRC_DEBUG("Timer %s for %s is up to date, not updating it",
+                msg->timer_id.c_str(), msg->call_id.c_str());
+
+      if ((!msg->timer_interim) && (_timer_updates_skipped_stat != NULL))
+      {
+        _timer_updates_skipped_stat->increment();
+      }
+
+      return;
+    }
+
+    if (msg->timer_interim)
+    {
+      // Extend the timer to the session's expiry.
+      repeat_for = msg->session_expiry - now;
+    }
+  }
+
+  if (_timer_updates_sent_stat != NULL)
+  {
+    _timer_updates_sent_stat->increment();
+  }
+
+  // The schedule to store once the update succeeds, if updates are lazy.
+  uint32_t timer_expiry = _lazy_timer_updates ? now + repeat_for : 0;
+
+  if (_timer_client != NULL)
+  {
+    std::string old_timer_id = msg->timer_id;
+    std::string call_id = msg->call_id;
+    role_of_node_t role = msg->role;
+    node_functionality_t function = msg->function;
+    SAS::TrailId trail = msg->trail;
+    std::map<std::string, uint32_t> tags {{"CALL", 1}};
+
+    TimerRequest::Completion completion =
+      [this, old_timer_id, call_id, role, function, trail, interim_interval, timer_expiry]
+      (HTTPCode rc, const std::string& timer_id)
+      {
+        if ((rc == HTTP_OK) && (timer_expiry != 0))
+        {
+          update_timer_id(call_id, role, function, trail, old_timer_id, timer_id, interim_interval, timer_expiry);
+        }
+        else if ((!timer_id.empty()) && (timer_id != old_timer_id))
+        {
+          update_timer_id(call_id, role, function, trail, old_timer_id, timer_id);
+        }
+      };
+
+    if (old_timer_id == NO_TIMER)
+    {
+      // LCOV_EXCL_START
+      // The initial post to Chronos must have failed. Retry the post to get a new timer ID.
+      _timer_client->send_post(interim_interval,
+                               repeat_for,
+                               callback_uri,
+                               create_opaque_data(msg),
+                               trail,
+                               tags,
+                               completion);
+      // LCOV_EXCL_STOP
+    }
+    else
+    {
+      _timer_client->send_put(old_timer_id,
+                              interim_interval,
+                              repeat_for,
+                              callback_uri,
+                              create_opaque_data(msg),
+                              trail,
+                              tags,
+                              completion);
+    }
+
+    return;
+  }
+
+  std::string timer_id = msg->timer_id;
+  HTTPCode rc = send_chronos_update(timer_id,
+                                    interim_interval,
+                                    repeat_for,
+                                    callback_uri,
+                                    create_opaque_data(msg),
+                                    msg->trail);
+
+  if ((rc == HTTP_OK) && (timer_expiry != 0))
+  {
+    std::string old_timer_id = msg->timer_id;
+    msg->timer_id = timer_id;
+    update_timer_id(msg->call_id, msg->role, msg->function, msg->trail, old_timer_id, timer_id, interim_interval, timer_expiry);
+  }
+  else if (timer_id != msg->timer_id)
+  {
+    // Update the timer_id if it has changed
+    update_timer_id(msg, timer_id);
+  }
 }
 
-void SessionManager::send_chronos_update(std::string& timer_id,
+// Works out whether a lazily updated timer needs updating.
+bool SessionManager::timer_update_needed(Message* msg,
                                          uint32_t interim_interval,
-                                         uint32_t session_refresh_time,
-                                         const std::string& callback_uri,
-                                         const std::string& opaque_data,
-                                         SAS::TrailId trail)
+                                         uint32_t now)
+{
+  // The timer is about to stop popping if it has at most one pop left.
+  bool ending = (msg->timer_expiry < now + 2 * interim_interval);
+
+  if (msg->timer_interim)
+  {
+    // On a timer pop, the timer only needs extending if it's about to stop
+    // but the session has been refreshed since it was set.
+    return ((msg->timer_id != NO_TIMER) &&
+            (ending) &&
+            (msg->session_expiry > msg->timer_expiry) &&
+            (msg->session_expiry > now + interim_interval));
+  }
+
+  return ((msg->timer_id == NO_TIMER) ||
+          (msg->timer_interval != interim_interval) ||
+          (ending));
+}
+
+// Fills in the timer ID of a new session, which was written to the stores
+// with NO_TIMER and timer_pending_until while Chronos was creating its timer.
+// timer_id is NO_TIMER if the POST failed, so later requests retry it.  If the
+// session has been deleted in the meantime, or another request (perhaps one
+// that stopped waiting for this one) has already stored a timer for it, the
+// new timer isn't needed and is deleted.
+void SessionManager::set_start_timer_id(const std::string& call_id,
+                                        role_of_node_t role,
+                                        node_functionality_t function,
+                                        SAS::TrailId trail,
+                                        const std::string& timer_id)
+{
+  // With replicators, only the local store is written directly, and the
+  // result is replicated.
+  std::vector<SessionStore*> stores = {_local_store};
+
+  if (_replicators.empty())
+  {
+    stores.insert(stores.end(),
+                  _remote_stores.begin(),
+                  _remote_stores.end());
+  }
+  bool used = false;
+
+  for (std::vector<SessionStore*>::iterator store = stores.begin();
+       store != stores.end();
+       ++store)
+  {
+    while (true)
+    {
+      SessionStore::Session* sess = (*store)->get_session_data(call_id,
+                                                               role,
+                                                               function,
+                                                               trail);
+      if ((sess == NULL) || (sess->timer_id != NO_TIMER))
+      {
+        delete sess; sess = NULL;
+        break;
+      }
+
+      sess->timer_id = timer_id;
+      sess->timer_pending_until = 0;
+      Store::Status rc = (*store)->set_session_data(call_id,
+                                                    role,
+                                                    function,
+                                                    sess,
+                                                    false,
+                                                    trail);
+
+      if ((rc == Store::Status::OK) && (*store == _local_store))
+      {
+        replicate(call_id, role, function, sess, false, trail);
+      }
+
+      delete sess; sess = NULL;
+
+      if (rc == Store::Status::DATA_CONTENTION)
+      {
+        // LCOV_EXCL_START - no conflicts in UT
+        contention_hit(call_id);
+        continue;
+        // LCOV_EXCL_STOP
+      }
+
+      used = true;
+      break;
+    }
+  }
+
+  if ((!used) && (timer_id != NO_TIMER))
+  {
+    // LCOV_EXCL_START - no races in UT
+    TRC_INFO("Session for %s changed while creating its timer, deleting timer %s",
+             call_id.c_str(), timer_id.c_str());
+    _timer_conn->send_delete(timer_id, trail);
+    // LCOV_EXCL_STOP
+  }
+}
+
+HTTPCode SessionManager::send_chronos_update(std::string& timer_id,
+                                             uint32_t interim_interval,
+                                             uint32_t session_refresh_time,
+                                             const std::string& callback_uri,
+                                             const std::string& opaque_data,
+                                             SAS::TrailId trail)
 {
   std::map<std::string, uint32_t> tags {{"CALL", 1}};
 
   if (timer_id == NO_TIMER)
   {
-    // LCOV_EXCL_START
-    // The initial post to Chronos must have failed. Retry the post to get a new timer ID.
-    _timer_conn->send_post(timer_id,
-                           interim_interval,
-                           session_refresh_time,
-                           callback_uri,
-                           opaque_data,
-                           trail,
-                           tags);
-    // LCOV_EXCL_STOP
+    // The initial post to Chronos must have failed, or never stored its timer
+    // ID. Retry the post to get a new timer ID.
+    return _timer_conn->send_post(timer_id,
+                                  interim_interval,
+                                  session_refresh_time,
+                                  callback_uri,
+                                  opaque_data,
+                                  trail,
+                                  tags);
   }
   else
   {
-    _timer_conn->send_put(timer_id,
-                          interim_interval,
-                          session_refresh_time,
-                          callback_uri,
-                          opaque_data,
-                          trail,
-                          tags);
+    return _timer_conn->send_put(timer_id,
+                                 interim_interval,
+                                 session_refresh_time,
+                                 callback_uri,
+                                 opaque_data,
+                                 trail,
+                                 tags);
   }
 }
@@ -0,0 +1,505 @@
+/**
+ * @file session_replicator.cpp Asynchronous replication of sessions to a remote site
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#include "session_replicator.hpp"
+#include "log.h"
+
+const size_t SessionReplicator::MAX_BATCH;
+
+SessionReplicator::Stats::Stats(LastValueCache* stats_aggregator) :
+  depth(new StatisticAccumulator("ralf_replication_queue_depth",
+                                 stats_aggregator)),
+  lag_ms(new StatisticAccumulator("ralf_replication_lag_ms",
+                                  stats_aggregator)),
+  coalesced(new StatisticCounter("ralf_replication_coalesced",
+                                 stats_aggregator)),
+  dropped(new StatisticCounter("ralf_replication_dropped",
+                               stats_aggregator)),
+  failed(new StatisticCounter("ralf_replication_failed",
+                              stats_aggregator))
+{
+}
+
+SessionReplicator::Stats::~Stats()
+{
+  delete depth; depth = NULL;
+  delete lag_ms; lag_ms = NULL;
+  delete coalesced; coalesced = NULL;
+  delete dropped; dropped = NULL;
+  delete failed; failed = NULL;
+}
+
+SessionReplicator::SessionReplicator(SessionStore* store,
+                                     const std::string& site,
+                                     size_t max_queue,
+                                     uint64_t max_lag_ms,
+                                     Stats* stats,
+                                     unsigned int num_writers) :
+  _store(store),
+  _site(site),
+  _max_queue(max_queue),
+  _max_lag_ms(max_lag_ms),
+  _running(false),
+  _stats(stats),
+  _num_writers(num_writers),
+  _writers_running(false),
+  _batch(NULL),
+  _batch_next(0),
+  _batch_unfinished(0)
+{
+  pthread_mutex_init(&_lock, NULL);
+  pthread_cond_init(&_cond, NULL);
+  pthread_mutex_init(&_batch_lock, NULL);
+  pthread_cond_init(&_batch_cond, NULL);
+  pthread_cond_init(&_batch_done_cond, NULL);
+}
+
+SessionReplicator::~SessionReplicator()
+{
+  stop();
+
+  pthread_cond_destroy(&_batch_done_cond);
+  pthread_cond_destroy(&_batch_cond);
+  pthread_mutex_destroy(&_batch_lock);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+bool SessionReplicator::start()
+{
+  // The replicator's own thread writes changes too, so start one fewer
+  // writer threads than asked for.
+  _writers_running = true;
+
+  for (unsigned int ii = 1; ii < _num_writers; ii++)
+  {
+    pthread_t writer;
+    int rc = pthread_create(&writer, NULL, writer_thread_fn, this);
+
+    if (rc != 0)
+    {
+      // LCOV_EXCL_START
+      TRC_ERROR("Failed to start replication writer thread for site %s: %d",
+                _site.c_str(), rc);
+      stop();
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    _writers.push_back(writer);
+  }
+
+  _running = true;
+  int rc = pthread_create(&_thread, NULL, thread_fn, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start replication thread for site %s: %d",
+              _site.c_str(), rc);
+    _running = false;
+    stop();
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  return true;
+}
+
+void SessionReplicator::stop()
+{
+  pthread_mutex_lock(&_lock);
+  bool running = _running;
+  _running = false;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  if (running)
+  {
+    pthread_join(_thread, NULL);
+  }
+
+  // Write anything still queued.  Changes that are too old are still dropped,
+  // so this can't take much longer than the maximum lag.
+  while (write_batch() > 0)
+  {
+  }
+
+  pthread_mutex_lock(&_batch_lock);
+  _writers_running = false;
+  pthread_cond_broadcast(&_batch_cond);
+  pthread_mutex_unlock(&_batch_lock);
+
+  for (std::vector<pthread_t>::iterator writer = _writers.begin();
+       writer != _writers.end();
+       ++writer)
+  {
+    pthread_join(*writer, NULL);
+  }
+
+  _writers.clear();
+}
+
+void SessionReplicator::replicate(const std::string& call_id,
+                                  role_of_node_t role,
+                                  node_functionality_t function,
+                                  const SessionStore::Session* session,
+                                  bool new_session,
+                                  SAS::TrailId trail)
+{
+  Change change;
+  change.call_id = call_id;
+  change.role = role;
+  change.function = function;
+  change.write = true;
+  change.new_session = new_session;
+  change.session = *session;
+  change.trail = trail;
+  queue(change);
+}
+
+void SessionReplicator::replicate_delete(const std::string& call_id,
+                                         role_of_node_t role,
+                                         node_functionality_t function,
+                                         SAS::TrailId trail)
+{
+  Change change;
+  change.call_id = call_id;
+  change.role = role;
+  change.function = function;
+  change.write = false;
+  change.new_session = false;
+  change.trail = trail;
+  queue(change);
+}
+
+void SessionReplicator::queue(Change& change)
+{
+  std::string key = SessionStore::create_key(change.call_id,
+                                             change.role,
+                                             change.function);
+  change.queued_ms = now_ms();
+
+  pthread_mutex_lock(&_lock);
+  std::unordered_map<std::string, Change>::iterator queued = _changes.find(key);
+
+  if (queued != _changes.end())
+  {
+    // Replace the queued change, but keep the time it was queued so that a
+    // busy session can't hold its changes back indefinitely.  If the queued
+    // change created the session, so does this one as far as the remote site
+    // is concerned.
+    change.queued_ms = queued->second.queued_ms;
+    change.new_session = ((change.write) &&
+                          ((change.new_session) ||
+                           ((queued->second.write) && (queued->second.new_session))));
+    queued->second = change;
+    pthread_mutex_unlock(&_lock);
+
+    if (_stats != NULL)
+    {
+      _stats->coalesced->increment();
+    }
+
+    return;
+  }
+
+  if (_changes.size() >= _max_queue)
+  {
+    pthread_mutex_unlock(&_lock);
+
+    TRC_DEBUG("Replication queue for site %s is full, dropping change to %s",
+              _site.c_str(), key.c_str());
+
+    if (_stats != NULL)
+    {
+      _stats->dropped->increment();
+    }
+
+    return;
+  }
+
+  _changes[key] = change;
+  _order.push_back(key);
+  size_t depth = _order.size();
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  if (_stats != NULL)
+  {
+    _stats->depth->accumulate(depth);
+  }
+}
+
+size_t SessionReplicator::depth()
+{
+  pthread_mutex_lock(&_lock);
+  size_t depth = _order.size();
+  pthread_mutex_unlock(&_lock);
+  return depth;
+}
+
+size_t SessionReplicator::write_batch()
+{
+  std::vector<Change> batch;
+
+  pthread_mutex_lock(&_lock);
+
+  while ((!_order.empty()) && (batch.size() < MAX_BATCH))
+  {
+    std::unordered_map<std::string, Change>::iterator queued =
+                                                 _changes.find(_order.front());
+    batch.push_back(queued->second);
+    _changes.erase(queued);
+    _order.pop_front();
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  write_changes(batch);
+
+  return batch.size();
+}
+
+void SessionReplicator::write_changes(std::vector<Change>& batch)
+{
+  pthread_mutex_lock(&_batch_lock);
+  _batch = &batch;
+  _batch_next = 0;
+  _batch_unfinished = batch.size();
+  pthread_cond_broadcast(&_batch_cond);
+
+  // Write changes until there are none left for anyone to take, then wait
+  // for the writer threads to finish the ones they've taken.
+  while (_batch_next < batch.size())
+  {
+    const Change& change = batch[_batch_next++];
+    pthread_mutex_unlock(&_batch_lock);
+    write_one(change);
+    pthread_mutex_lock(&_batch_lock);
+    _batch_unfinished--;
+  }
+
+  while (_batch_unfinished > 0)
+  {
+    pthread_cond_wait(&_batch_done_cond, &_batch_lock);
+  }
+
+  _batch = NULL;
+  pthread_mutex_unlock(&_batch_lock);
+}
+
+void SessionReplicator::write_one(const Change& change)
+{
+  uint64_t lag_ms = now_ms() - change.queued_ms;
+
+  if (_stats != NULL)
+  {
+    _stats->lag_ms->accumulate(lag_ms);
+  }
+
+  if (lag_ms > _max_lag_ms)
+  {
+    TRC_DEBUG("Change to session for %s is %lums old, not replicating to site %s",
+              change.call_id.c_str(), lag_ms, _site.c_str());
+
+    if (_stats != NULL)
+    {
+      _stats->dropped->increment();
+    }
+
+    return;
+  }
+
+  Store::Status rc = write_change(change);
+
+  if ((rc != Store::Status::OK) && (rc != Store::Status::NOT_FOUND))
+  {
+    TRC_DEBUG("Failed to replicate session for %s to site %s: %d",
+              change.call_id.c_str(), _site.c_str(), rc);
+
+    if (_stats != NULL)
+    {
+      _stats->failed->increment();
+    }
+  }
+}
+
+Store::Status SessionReplicator::write_change(const Change& change)
+{
+  if (!change.write)
+  {
+    return _store->delete_session_data(change.call_id,
+                                       change.role,
+                                       change.function,
+                                       change.trail);
+  }
+
+  if (change.new_session)
+  {
+    // The session is probably new to the remote site too, so try adding it
+    // without reading it first.
+    SessionStore::Session* sess = new SessionStore::Session(change.session);
+    Store::Status rc = _store->set_session_data(change.call_id,
+                                                change.role,
+                                                change.function,
+                                                sess,
+                                                true,
+                                                change.trail);
+    delete sess; sess = NULL;
+
+    if (rc != Store::Status::DATA_CONTENTION)
+    {
+      return rc;
+    }
+  }
+
+  while (true)
+  {
+    bool new_session = false;
+    SessionStore::Session* sess = _store->get_session_data(change.call_id,
+                                                           change.role,
+                                                           change.function,
+                                                           change.trail);
+    if (sess == NULL)
+    {
+      sess = new SessionStore::Session(change.session);
+      new_session = true;
+    }
+    else
+    {
+      // The remote site may have sent ACRs for this session too, so never
+      // take its record number backwards.
+      uint32_t acct_record_number = std::max(sess->acct_record_number,
+                                             change.session.acct_record_number);
+      sess->session_id = change.session.session_id;
+      sess->ccf = change.session.ccf;
+      sess->ecf = change.session.ecf;
+      sess->acct_record_number = acct_record_number;
+      sess->timer_id = change.session.timer_id;
+      sess->session_refresh_time = change.session.session_refresh_time;
+      sess->interim_interval = change.session.interim_interval;
+      sess->timer_interval = change.session.timer_interval;
+      sess->timer_expiry = change.session.timer_expiry;
+      sess->session_expiry = change.session.session_expiry;
+    }
+
+    Store::Status rc = _store->set_session_data(change.call_id,
+                                                change.role,
+                                                change.function,
+                                                sess,
+                                                new_session,
+                                                change.trail);
+    delete sess; sess = NULL;
+
+    // Go round again if the session changed while we were writing it.
+    if (rc != Store::Status::DATA_CONTENTION)
+    {
+      return rc;
+    }
+  }
+}
+
+uint64_t SessionReplicator::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void* SessionReplicator::thread_fn(void* replicator)
+{
+  ((SessionReplicator*)replicator)->thread();
+  return NULL;
+}
+
+void* SessionReplicator::writer_thread_fn(void* replicator)
+{
+  ((SessionReplicator*)replicator)->writer_thread();
+  return NULL;
+}
+
+void SessionReplicator::writer_thread()
+{
+  pthread_mutex_lock(&_batch_lock);
+
+  while (_writers_running)
+  {
+    if ((_batch == NULL) || (_batch_next >= _batch->size()))
+    {
+      pthread_cond_wait(&_batch_cond, &_batch_lock);
+      continue;
+    }
+
+    // The batch isn't released until all its changes have been written, so
+    // the change stays valid while we write it.
+    const Change& change = (*_batch)[_batch_next++];
+    pthread_mutex_unlock(&_batch_lock);
+    write_one(change);
+    pthread_mutex_lock(&_batch_lock);
+
+    if (--_batch_unfinished == 0)
+    {
+      pthread_cond_signal(&_batch_done_cond);
+    }
+  }
+
+  pthread_mutex_unlock(&_batch_lock);
+}
+
+void SessionReplicator::thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (_running)
+  {
+    if (_order.empty())
+    {
+      pthread_cond_wait(&_cond, &_lock);
+      continue;
+    }
+
+    pthread_mutex_unlock(&_lock);
+    write_batch();
+    pthread_mutex_lock(&_lock);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
@@ -36,29 +36,47 @@
 
 #include <string>
 #include <sstream>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
 
 #include "session_store.h"
+#include "session_cache.hpp"
 #include "message.hpp"
 #include "log.h"
 #include "json_parse_utils.h"
 #include "ralfsasevent.h"
 
+const uint32_t SessionStore::SPLIT_LAYOUT_RECORD_NUMBER;
+
 SessionStore::SessionStore(Store *store,
                            SerializerDeserializer*& serializer,
-                           std::vector<SerializerDeserializer*>& deserializers) :
+                           std::vector<SerializerDeserializer*>& deserializers,
+                           SessionCache* cache,
+                           LastValueCache* stats_aggregator,
+                           bool split_record_number) :
   _store(store),
   _serializer(serializer),
-  _deserializers(deserializers)
+  _deserializers(deserializers),
+  _cache(split_record_number ? cache : NULL),
+  _split_record_number(split_record_number)
 {
   // We have taken ownership of the (de)serializers.
   serializer = NULL;
   deserializers.clear();
+
+  init_deserializers(stats_aggregator);
 }
 
-SessionStore::SessionStore(Store* store) : _store(store)
+SessionStore::SessionStore(Store* store) :
+  _store(store),
+  _cache(NULL),
+  _split_record_number(false)
 {
   _serializer = new JsonSerializerDeserializer();
   _deserializers.push_back(new JsonSerializerDeserializer());
+
+  init_deserializers(NULL);
 }
 
 SessionStore::~SessionStore()
@@ -71,6 +89,46 @@ SessionStore::~SessionStore()
   {
     delete *it; *it = NULL;
   }
+
+  for (int ii = 0; ii < NUM_FORMATS; ii++)
+  {
+    delete _format_read_stats[ii]; _format_read_stats[ii] = NULL;
+  }
+}
+
+// Work out which deserializer to use for each format.  If there's more than
+// one for a format, the first one wins.
+void SessionStore::init_deserializers(LastValueCache* stats_aggregator)
+{
+  static const char* const read_stat_names[NUM_FORMATS] = {
+    "ralf_session_reads_binary",
+    "ralf_session_reads_json",
+    "ralf_session_reads_compact",
+  };
+
+  for (int ii = 0; ii < NUM_FORMATS; ii++)
+  {
+    _format_deserializers[ii] = NULL;
+    _format_read_stats[ii] = NULL;
+
+    if (stats_aggregator != NULL)
+    {
+      _format_read_stats[ii] = new StatisticCounter(read_stat_names[ii],
+                                                    stats_aggregator);
+    }
+  }
+
+  for (std::vector<SerializerDeserializer*>::iterator it = _deserializers.begin();
+       it != _deserializers.end();
+       ++it)
+  {
+    Format format = (*it)->format();
+
+    if (_format_deserializers[format] == NULL)
+    {
+      _format_deserializers[format] = *it;
+    }
+  }
 }
 
 SessionStore::Session* SessionStore::get_session_data(const std::string& call_id,
@@ -80,10 +138,53 @@ SessionStore::Session* SessionStore::get_session_data(const std::string& call_id
 {
   std::string key = create_key(call_id, role, function);
   TRC_DEBUG("Retrieving session data for %s", key.c_str());
-  Session* session = NULL;
 
-  std::string data;
+  if (_split_record_number)
+  {
+    return get_split_session_data(call_id, key, trail);
+  }
+
   uint64_t cas;
+  Session* session = read_session(call_id, key, cas, trail);
+
+  if ((session != NULL) &&
+      (session->acct_record_number == SPLIT_LAYOUT_RECORD_NUMBER))
+  {
+    // The session was written in the split layout by a node that stores
+    // record numbers separately, so pick up its record number.
+    RecordNumber arn;
+    Store::Status status = read_record_number(key, arn, trail);
+
+    if ((status == Store::Status::OK) || (status == Store::Status::NOT_FOUND))
+    {
+      session = apply_record_number(session,
+                                    cas,
+                                    (status == Store::Status::OK) ? &arn : NULL);
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      delete session; session = NULL;
+      // LCOV_EXCL_STOP
+    }
+  }
+  else if (session != NULL)
+  {
+    session->_cas = cas;
+    session->_split_layout = false;
+  }
+
+  return session;
+}
+
+// Read and deserialize a session record from the store.
+SessionStore::Session* SessionStore::read_session(const std::string& call_id,
+                                                  const std::string& key,
+                                                  uint64_t& cas,
+                                                  SAS::TrailId trail)
+{
+  Session* session = NULL;
+  std::string data;
   Store::Status status = _store->get_data("session", key, data, cas, trail);
 
   if (status == Store::Status::OK && !data.empty())
@@ -92,11 +193,7 @@ SessionStore::Session* SessionStore::get_session_data(const std::string& call_id
     TRC_DEBUG("Retrieved record, CAS = %ld", cas);
     session = deserialize_session(data);
 
-    if (session != NULL)
-    {
-      session->_cas = cas;
-    }
-    else
+    if (session == NULL)
     {
       // Could not deserialize the record. Treat it as not found.
       TRC_INFO("Failed to deserialize record");
@@ -124,6 +221,14 @@ Store::Status SessionStore::set_session_data(const std::string& call_id,
   std::string key = create_key(call_id, role, function);
   TRC_DEBUG("Saving session data for %s, CAS = %ld", key.c_str(), session->_cas);
 
+  // Existing sessions are written back in the layout they were read from, so
+  // that nodes with and without split record numbers can share sessions.
+  if ((_split_record_number) ||
+      ((!new_session) && (session->_split_layout)))
+  {
+    return set_split_session_data(key, session, new_session, trail);
+  }
+
   std::string data = serialize_session(session);
 
   Store::Status status = _store->set_data("session",
@@ -146,14 +251,47 @@ Store::Status SessionStore::delete_session_data(const std::string& call_id,
   std::string key = create_key(call_id, role, function);
   TRC_DEBUG("Deleting session data for %s, CAS = %ld", key.c_str(), session->_cas);
 
-  Store::Status status = _store->set_data("session",
-                                          key,
-                                          "",
-                                          session->_cas,
-                                          0,
-                                          trail);
+  Store::Status status;
+
+  if (session->_split_layout)
+  {
+    // Clear the record number first - this is where writers contend.  The
+    // body can then be deleted unconditionally.
+    status = _store->set_data("session_arn", key, "", session->_cas, 0, trail);
+
+    if (status == Store::Status::OK)
+    {
+      status = _store->delete_data("session", key, trail);
+    }
+  }
+  else if (_split_record_number)
+  {
+    // The session is in the old layout, so the body holds the record number
+    // and is where writers contend.  Tidy up any record number record left
+    // over from an earlier session with the same key.
+    status = _store->set_data("session", key, "", session->_body_cas, 0, trail);
+
+    if ((status == Store::Status::OK) && (session->_cas != 0))
+    {
+      _store->delete_data("session_arn", key, trail);
+    }
+  }
+  else
+  {
+    status = _store->set_data("session",
+                              key,
+                              "",
+                              session->_cas,
+                              0,
+                              trail);
+  }
   TRC_DEBUG("Store returned %d", status);
 
+  if (_cache != NULL)
+  {
+    _cache->invalidate(key);
+  }
+
   return status;
 }
 
@@ -168,9 +306,329 @@ Store::Status SessionStore::delete_session_data(const std::string& call_id,
   Store::Status status = _store->delete_data("session", key, trail);
   TRC_DEBUG("Store returned %d", status);
 
+  // The session may have been written in the split layout even if we don't
+  // split record numbers ourselves.
+  Store::Status arn_status = _store->delete_data("session_arn", key, trail);
+
+  if ((_split_record_number) && (status == Store::Status::OK))
+  {
+    status = arn_status;
+  }
+
+  if (_cache != NULL)
+  {
+    _cache->invalidate(key);
+  }
+
+  return status;
+}
+
+//
+// Split record number layout.
+//
+// The accounting record number is kept in its own small record in the
+// "session_arn" table, and the rest of the session (the body) in the
+// "session" table.  The body rarely changes once the session has started,
+// so an INTERIM only needs to write the record number, and the body can be
+// served from the session cache.  Writers contend on the record number, so
+// it's written with CAS; the body is only rewritten when it changes, or when
+// it's getting close to expiry (the store can't extend a record's expiry
+// without rewriting it).
+//
+// The record number record holds the record number, the time the body
+// expires, a hash of the body and the session expiry time, e.g.
+// "12 1453120000 8811236437452317131 1453119700".  The session expiry time
+// moves on with every INTERIM, so it lives here rather than in the body.
+// Every write of the record number carries the hash of the body it goes
+// with, so a cached body is only used if its hash matches - if another node
+// has changed the body since we cached it, we read it again.
+//
+// Bodies are written with a record number of SPLIT_LAYOUT_RECORD_NUMBER,
+// which is how a session in the split layout is recognised.  Nodes that
+// don't split record numbers still read (and write back) sessions in the
+// split layout, so record numbers carry on during an upgrade, as long as
+// every node is running code that understands the split layout before
+// --split-record-number is turned on anywhere.  A body that still holds a
+// real record number is in the old layout - we use that record number and
+// rewrite both records on the next write, which migrates the session.
+//
+
+SessionStore::Session* SessionStore::get_split_session_data(const std::string& call_id,
+                                                            const std::string& key,
+                                                            SAS::TrailId trail)
+{
+  Session* session = NULL;
+  uint64_t body_cas = 0;
+  RecordNumber arn;
+  Store::Status status = read_record_number(key, arn, trail);
+
+  if ((status != Store::Status::OK) && (status != Store::Status::NOT_FOUND))
+  {
+    // LCOV_EXCL_START
+    return NULL;
+    // LCOV_EXCL_STOP
+  }
+
+  // The body isn't written with the CAS we read it with unless it changes, so
+  // a cached body with an unknown CAS will do, as long as it's still the body
+  // that goes with the record number.
+  if ((status == Store::Status::OK) && (arn.body_hash != 0) && (_cache != NULL))
+  {
+    session = _cache->get(key, body_cas, false);
+
+    if ((session != NULL) && (hash_body(serialize_body(session)) != arn.body_hash))
+    {
+      TRC_DEBUG("Cached body is out of date");
+      delete session; session = NULL;
+      _cache->invalidate(key);
+    }
+  }
+
+  if (session == NULL)
+  {
+    session = read_session(call_id, key, body_cas, trail);
+
+    if ((session != NULL) &&
+        (session->acct_record_number == SPLIT_LAYOUT_RECORD_NUMBER) &&
+        (_cache != NULL))
+    {
+      _cache->put(key, *session, body_cas);
+    }
+  }
+
+  if (session != NULL)
+  {
+    session = apply_record_number(session,
+                                  body_cas,
+                                  (status == Store::Status::OK) ? &arn : NULL);
+  }
+
+  return session;
+}
+
+// Read and parse a session's record number record.  Returns OK if it was
+// read, NOT_FOUND if there isn't one, or an error.
+Store::Status SessionStore::read_record_number(const std::string& key,
+                                               RecordNumber& arn,
+                                               SAS::TrailId trail)
+{
+  std::string data;
+  Store::Status status = _store->get_data("session_arn", key, data, arn.cas, trail);
+
+  if (status == Store::Status::OK && !data.empty())
+  {
+    unsigned long acct_record_number;
+    long body_expiry;
+    unsigned long body_hash = 0;
+    unsigned long session_expiry = 0;
+
+    // Records written before the body hash and session expiry were added only
+    // have some of the fields.
+    int fields = sscanf(data.c_str(),
+                        "%lu %ld %lu %lu",
+                        &acct_record_number,
+                        &body_expiry,
+                        &body_hash,
+                        &session_expiry);
+
+    if (fields >= 2)
+    {
+      TRC_DEBUG("Retrieved record number %lu, CAS = %ld", acct_record_number, arn.cas);
+      arn.acct_record_number = acct_record_number;
+      arn.body_expiry = body_expiry;
+      arn.body_hash = body_hash;
+      arn.has_session_expiry = (fields >= 4);
+      arn.session_expiry = session_expiry;
+    }
+    else
+    {
+      // LCOV_EXCL_START
+      TRC_INFO("Failed to parse record number %s", data.c_str());
+      status = Store::Status::ERROR;
+      // LCOV_EXCL_STOP
+    }
+  }
+  else if (status == Store::Status::NOT_FOUND || data.empty())
+  {
+    status = Store::Status::NOT_FOUND;
+  }
+  else
+  {
+    // LCOV_EXCL_START
+    TRC_INFO("Failed to read record number, status %d", status);
+    // LCOV_EXCL_STOP
+  }
+
+  return status;
+}
+
+// Fill in the record number of a session whose body has been read, given the
+// body's CAS and the session's record number record (or NULL if there isn't
+// one).  Returns the session, or NULL if it should be treated as not found.
+SessionStore::Session* SessionStore::apply_record_number(Session* session,
+                                                         uint64_t body_cas,
+                                                         const RecordNumber* arn)
+{
+  session->_body_cas = body_cas;
+  session->_body_data = serialize_body(session);
+  session->_body_expiry = 0;
+  session->_cas = (arn != NULL) ? arn->cas : 0;
+  session->_split_layout =
+    (session->acct_record_number == SPLIT_LAYOUT_RECORD_NUMBER);
+
+  if (!session->_split_layout)
+  {
+    // An old-style record - the record number is in the body.  Any record
+    // number record is left over from an earlier session with this key, and
+    // is overwritten when this one is migrated.
+    TRC_DEBUG("No separate record number, using %d from body",
+              session->acct_record_number);
+  }
+  else if (arn != NULL)
+  {
+    session->acct_record_number = arn->acct_record_number;
+    session->_body_expiry = arn->body_expiry;
+
+    if (arn->has_session_expiry)
+    {
+      session->session_expiry = arn->session_expiry;
+    }
+  }
+  else
+  {
+    // The record number hasn't been written yet (or has expired), so the
+    // session isn't usable.
+    TRC_DEBUG("No record number for session in the split layout");
+    delete session; session = NULL;
+  }
+
+  return session;
+}
+
+Store::Status SessionStore::set_split_session_data(const std::string& key,
+                                                   Session* session,
+                                                   bool new_session,
+                                                   SAS::TrailId trail)
+{
+  Store::Status status = Store::Status::OK;
+  int expiry = 2 * session->session_refresh_time;
+  time_t now = time(NULL);
+  time_t body_expiry = session->_body_expiry;
+  std::string body = serialize_body(session);
+
+  // Rewrite the body if it's changed, if it's in the old layout, or if it has
+  // less than half its lifetime left.
+  if ((new_session) ||
+      (!session->_split_layout) ||
+      (body != session->_body_data) ||
+      (now + (time_t)session->session_refresh_time >= body_expiry))
+  {
+    uint64_t body_cas = session->_body_cas;
+
+    if ((!new_session) && (body_cas == 0))
+    {
+      // The body came from the cache and we don't know its CAS.  Check that
+      // it hasn't changed since we read it, and get its CAS.
+      Session* stored = read_session("", key, body_cas, trail);
+
+      if ((stored == NULL) || (serialize_body(stored) != session->_body_data))
+      {
+        status = Store::Status::DATA_CONTENTION;
+      }
+
+      delete stored; stored = NULL;
+    }
+
+    if (status == Store::Status::OK)
+    {
+      status = _store->set_data("session",
+                                key,
+                                body,
+                                new_session ? 0 : body_cas,
+                                expiry,
+                                trail);
+      TRC_DEBUG("Store returned %d writing body", status);
+    }
+
+    if (status != Store::Status::OK)
+    {
+      if (_cache != NULL)
+      {
+        _cache->invalidate(key);
+      }
+
+      return status;
+    }
+
+    if (_cache != NULL)
+    {
+      Session cached = *session;
+      cached.acct_record_number = SPLIT_LAYOUT_RECORD_NUMBER;
+      _cache->put(key, cached, 0);
+    }
+
+    session->_body_cas = 0;
+    session->_body_data = body;
+    session->_split_layout = true;
+    body_expiry = now + expiry;
+  }
+
+  std::string data = std::to_string(session->acct_record_number) + " " +
+                     std::to_string((long)body_expiry) + " " +
+                     std::to_string(hash_body(session->_body_data)) + " " +
+                     std::to_string(session->session_expiry);
+  status = _store->set_data("session_arn",
+                            key,
+                            data,
+                            new_session ? 0 : session->_cas,
+                            expiry,
+                            trail);
+  TRC_DEBUG("Store returned %d writing record number", status);
+
+  if (status == Store::Status::OK)
+  {
+    session->_body_expiry = body_expiry;
+  }
+  else if (_cache != NULL)
+  {
+    // Someone else has written the session (or the write failed), so we
+    // can't be sure which body goes with the record number.
+    _cache->invalidate(key);
+  }
+
   return status;
 }
 
+// FNV-1a hash of a serialized body, used to check that a cached body is the
+// one that goes with a record number.
+uint64_t SessionStore::hash_body(const std::string& body)
+{
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (std::string::const_iterator it = body.begin(); it != body.end(); ++it)
+  {
+    hash ^= (uint8_t)*it;
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+// Serialize the body of a session - everything except the record number and
+// session expiry time.
+std::string SessionStore::serialize_body(Session* session)
+{
+  uint32_t acct_record_number = session->acct_record_number;
+  uint32_t session_expiry = session->session_expiry;
+  session->acct_record_number = SPLIT_LAYOUT_RECORD_NUMBER;
+  session->session_expiry = 0;
+  std::string body = serialize_session(session);
+  session->acct_record_number = acct_record_number;
+  session->session_expiry = session_expiry;
+
+  return body;
+}
+
 // Serialize a session to a string that can later be loaded by deserialize_session().
 std::string SessionStore::serialize_session(Session* session)
 {
@@ -180,30 +638,54 @@ std::string SessionStore::serialize_session(Session* session)
 // Deserialize a previously serialized session object.
 SessionStore::Session* SessionStore::deserialize_session(const std::string& data)
 {
-  Session* session = NULL;
+  Format format = detect_format(data);
+  SerializerDeserializer* deserializer = _format_deserializers[format];
 
-  for (std::vector<SerializerDeserializer*>::iterator it = _deserializers.begin();
-       it != _deserializers.end();
-       ++it)
+  if (_format_read_stats[format] != NULL)
   {
-    SerializerDeserializer* deserializer = *it;
+    _format_read_stats[format]->increment();
+  }
 
-    TRC_DEBUG("Try to deserialize record with '%s' deserializer",
-              deserializer->name().c_str());
-    session = deserializer->deserialize_session(data);
+  if (deserializer == NULL)
+  {
+    TRC_INFO("No deserializer for record format %d", format);
+    return NULL;
+  }
+
+  TRC_DEBUG("Deserialize record with '%s' deserializer",
+            deserializer->name().c_str());
+  Session* session = deserializer->deserialize_session(data);
 
-    if (session != NULL)
+  if (session != NULL)
+  {
+    TRC_DEBUG("Deserialization succeeded");
+  }
+  else
+  {
+    TRC_DEBUG("Deserialization failed");
+  }
+
+  return session;
+}
+
+// JSON records are objects, and compact records start with a magic byte.
+// Anything else must be the legacy binary format, which starts with the
+// session ID.
+SessionStore::Format SessionStore::detect_format(const std::string& data)
+{
+  if (!data.empty())
+  {
+    if (data[0] == '{')
     {
-      TRC_DEBUG("Deserialization succeeded");
-      break;
+      return FORMAT_JSON;
     }
-    else
+    else if ((uint8_t)data[0] == CompactSerializerDeserializer::MAGIC)
     {
-      TRC_DEBUG("Deserialization failed");
+      return FORMAT_COMPACT;
     }
   }
 
-  return session;
+  return FORMAT_BINARY;
 }
 
 std::string SessionStore::create_key(const std::string& call_id,
@@ -213,6 +695,17 @@ std::string SessionStore::create_key(const std::string& call_id,
   return call_id + std::to_string(role) + std::to_string(function);
 }
 
+// The timer state is only written if it's set, so that sessions are stored
+// exactly as before unless timer updates are lazy or a START is waiting for
+// its timer.
+static inline bool has_timer_state(SessionStore::Session* session)
+{
+  return ((session->timer_interval != 0) ||
+          (session->timer_expiry != 0) ||
+          (session->session_expiry != 0) ||
+          (session->timer_pending_until != 0));
+}
+
 
 //
 // (De)serializer for the binary SessionStore format.
@@ -243,6 +736,14 @@ std::string SessionStore::BinarySerializerDeserializer::
 
   oss.write((const char*)&session->interim_interval, sizeof(uint32_t));
 
+  if (has_timer_state(session))
+  {
+    oss.write((const char*)&session->timer_interval, sizeof(uint32_t));
+    oss.write((const char*)&session->timer_expiry, sizeof(uint32_t));
+    oss.write((const char*)&session->session_expiry, sizeof(uint32_t));
+    oss.write((const char*)&session->timer_pending_until, sizeof(uint32_t));
+  }
+
   return oss.str();
 }
 
@@ -291,6 +792,23 @@ if ((STREAM).eof())                                                            \
   iss.read((char*)&session->interim_interval, sizeof(uint32_t));
   // This could legitimately be the end of the stream.
 
+  // The timer state is only present if it's set.  Older records don't have
+  // the pending time.
+  uint32_t timer_state[4];
+  iss.read((char*)timer_state, sizeof(timer_state));
+
+  if (iss.gcount() >= (std::streamsize)(3 * sizeof(uint32_t)))
+  {
+    session->timer_interval = timer_state[0];
+    session->timer_expiry = timer_state[1];
+    session->session_expiry = timer_state[2];
+  }
+
+  if (iss.gcount() == sizeof(timer_state))
+  {
+    session->timer_pending_until = timer_state[3];
+  }
+
   return session;
 }
 
@@ -311,6 +829,10 @@ static const char* const JSON_ACCT_RECORD_NUM = "acct_record_num";
 static const char* const JSON_TIMER_ID = "timer_id";
 static const char* const JSON_REFRESH_TIME = "refresh_time";
 static const char* const JSON_INTERIM_INTERVAL = "interim_interval";
+static const char* const JSON_TIMER_INTERVAL = "timer_interval";
+static const char* const JSON_TIMER_EXPIRY = "timer_expiry";
+static const char* const JSON_SESSION_EXPIRY = "session_expiry";
+static const char* const JSON_TIMER_PENDING_UNTIL = "timer_pending_until";
 
 
 std::string SessionStore::JsonSerializerDeserializer::
@@ -339,6 +861,14 @@ std::string SessionStore::JsonSerializerDeserializer::
     writer.String(JSON_TIMER_ID); writer.String(session->timer_id.c_str());
     writer.String(JSON_REFRESH_TIME); writer.Int(session->session_refresh_time);
     writer.String(JSON_INTERIM_INTERVAL); writer.Int(session->interim_interval);
+
+    if (has_timer_state(session))
+    {
+      writer.String(JSON_TIMER_INTERVAL); writer.Uint(session->timer_interval);
+      writer.String(JSON_TIMER_EXPIRY); writer.Uint(session->timer_expiry);
+      writer.String(JSON_SESSION_EXPIRY); writer.Uint(session->session_expiry);
+      writer.String(JSON_TIMER_PENDING_UNTIL); writer.Uint(session->timer_pending_until);
+    }
   }
   writer.EndObject();
 
@@ -381,6 +911,19 @@ SessionStore::Session* SessionStore::JsonSerializerDeserializer::
     JSON_GET_STRING_MEMBER(doc, JSON_TIMER_ID, session->timer_id);
     JSON_GET_INT_MEMBER(doc, JSON_REFRESH_TIME, session->session_refresh_time);
     JSON_GET_INT_MEMBER(doc, JSON_INTERIM_INTERVAL, session->interim_interval);
+
+    // The timer state is only present if timer updates are lazy.
+    if (doc.HasMember(JSON_TIMER_INTERVAL))
+    {
+      JSON_GET_INT_MEMBER(doc, JSON_TIMER_INTERVAL, session->timer_interval);
+      JSON_GET_INT_MEMBER(doc, JSON_TIMER_EXPIRY, session->timer_expiry);
+      JSON_GET_INT_MEMBER(doc, JSON_SESSION_EXPIRY, session->session_expiry);
+    }
+
+    if (doc.HasMember(JSON_TIMER_PENDING_UNTIL))
+    {
+      JSON_GET_INT_MEMBER(doc, JSON_TIMER_PENDING_UNTIL, session->timer_pending_until);
+    }
   }
   catch(JsonFormatError& err)
   {
@@ -397,3 +940,230 @@ std::string SessionStore::JsonSerializerDeserializer::name()
 {
   return "JSON";
 }
+
+
+//
+// (De)serializer for the compact binary SessionStore format.
+//
+
+const uint8_t SessionStore::CompactSerializerDeserializer::MAGIC;
+const uint8_t SessionStore::CompactSerializerDeserializer::VERSION;
+
+// The number of bytes needed to encode a value as a varint.
+static inline size_t varint_size(uint64_t value)
+{
+  size_t size = 1;
+
+  while (value >= 0x80)
+  {
+    value >>= 7;
+    size++;
+  }
+
+  return size;
+}
+
+static inline char* write_varint(char* pos, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    *pos++ = (char)((value & 0x7F) | 0x80);
+    value >>= 7;
+  }
+
+  *pos++ = (char)value;
+  return pos;
+}
+
+static inline char* write_string(char* pos, const std::string& value)
+{
+  pos = write_varint(pos, value.size());
+  memcpy(pos, value.data(), value.size());
+  return pos + value.size();
+}
+
+// Read a varint of at most max_bits bits.  Returns false if the data is
+// truncated or the value is too large.
+static inline bool read_varint(const char*& pos,
+                               const char* end,
+                               uint32_t max_bits,
+                               uint64_t& value)
+{
+  value = 0;
+
+  for (uint32_t shift = 0; shift < max_bits; shift += 7)
+  {
+    if (pos >= end)
+    {
+      return false;
+    }
+
+    uint8_t byte = (uint8_t)*pos++;
+    value |= (uint64_t)(byte & 0x7F) << shift;
+
+    if ((byte & 0x80) == 0)
+    {
+      return ((max_bits >= 64) || ((value >> max_bits) == 0));
+    }
+  }
+
+  return false;
+}
+
+static inline bool read_uint32(const char*& pos,
+                               const char* end,
+                               uint32_t& value)
+{
+  uint64_t value64;
+
+  if (!read_varint(pos, end, 32, value64))
+  {
+    return false;
+  }
+
+  value = (uint32_t)value64;
+  return true;
+}
+
+static inline bool read_string(const char*& pos,
+                               const char* end,
+                               std::string& value)
+{
+  uint64_t len;
+
+  if ((!read_varint(pos, end, 32, len)) || (len > (uint64_t)(end - pos)))
+  {
+    return false;
+  }
+
+  value.assign(pos, len);
+  pos += len;
+  return true;
+}
+
+
+std::string SessionStore::CompactSerializerDeserializer::
+  serialize_session(Session *session)
+{
+  // Work out the exact size of the record so we only allocate once.
+  size_t size = 2;
+  size += varint_size(session->session_id.size()) + session->session_id.size();
+  size += varint_size(session->ccf.size());
+
+  for (std::vector<std::string>::const_iterator ccf = session->ccf.begin();
+       ccf != session->ccf.end();
+       ++ccf)
+  {
+    size += varint_size(ccf->size()) + ccf->size();
+  }
+
+  size += varint_size(session->acct_record_number);
+  size += varint_size(session->timer_id.size()) + session->timer_id.size();
+  size += varint_size(session->session_refresh_time);
+  size += varint_size(session->interim_interval);
+
+  bool timer_state = has_timer_state(session);
+  if (timer_state)
+  {
+    size += varint_size(session->timer_interval);
+    size += varint_size(session->timer_expiry);
+    size += varint_size(session->session_expiry);
+    size += varint_size(session->timer_pending_until);
+  }
+
+  std::string data(size, '\0');
+  char* pos = &data[0];
+
+  *pos++ = (char)MAGIC;
+  *pos++ = (char)VERSION;
+  pos = write_string(pos, session->session_id);
+  pos = write_varint(pos, session->ccf.size());
+
+  for (std::vector<std::string>::const_iterator ccf = session->ccf.begin();
+       ccf != session->ccf.end();
+       ++ccf)
+  {
+    pos = write_string(pos, *ccf);
+  }
+
+  pos = write_varint(pos, session->acct_record_number);
+  pos = write_string(pos, session->timer_id);
+  pos = write_varint(pos, session->session_refresh_time);
+  pos = write_varint(pos, session->interim_interval);
+
+  if (timer_state)
+  {
+    pos = write_varint(pos, session->timer_interval);
+    pos = write_varint(pos, session->timer_expiry);
+    pos = write_varint(pos, session->session_expiry);
+    pos = write_varint(pos, session->timer_pending_until);
+  }
+
+  return data;
+}
+
+
+SessionStore::Session* SessionStore::CompactSerializerDeserializer::
+  deserialize_session(const std::string& data)
+{
+  const char* pos = data.data();
+  const char* end = pos + data.size();
+
+  if ((data.size() < 2) ||
+      ((uint8_t)pos[0] != MAGIC) ||
+      ((uint8_t)pos[1] != VERSION))
+  {
+    TRC_DEBUG("Record is not in the compact format");
+    return NULL;
+  }
+
+  pos += 2;
+
+  Session* session = new Session();
+  uint64_t num_ccf;
+  bool ok = read_string(pos, end, session->session_id) &&
+            read_varint(pos, end, 32, num_ccf);
+
+  for (uint64_t ii = 0; ok && (ii < num_ccf); ii++)
+  {
+    std::string ccf;
+    ok = read_string(pos, end, ccf);
+    session->ccf.push_back(ccf);
+  }
+
+  ok = ok &&
+       read_uint32(pos, end, session->acct_record_number) &&
+       read_string(pos, end, session->timer_id) &&
+       read_uint32(pos, end, session->session_refresh_time) &&
+       read_uint32(pos, end, session->interim_interval);
+
+  // The timer state is only present if it's set.  Older records don't have
+  // the pending time.
+  if ((ok) && (pos != end))
+  {
+    ok = read_uint32(pos, end, session->timer_interval) &&
+         read_uint32(pos, end, session->timer_expiry) &&
+         read_uint32(pos, end, session->session_expiry);
+  }
+
+  if ((ok) && (pos != end))
+  {
+    ok = read_uint32(pos, end, session->timer_pending_until);
+  }
+
+  ok = ok && (pos == end);
+
+  if (!ok)
+  {
+    TRC_INFO("Failed to deserialize compact record (%zu bytes)", data.size());
+    delete session; session = NULL;
+  }
+
+  return session;
+}
+
+
+std::string SessionStore::CompactSerializerDeserializer::name()
+{
+  return "compact";
+}
@@ -0,0 +1,941 @@
+/**
+ * @file timer_wheel.cpp In-process timer service for interim timers
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+#include "timer_wheel.hpp"
+#include "log.h"
+
+TimerWheel::TimerWheel(PopCallback pop_callback,
+                       Store* store,
+                       const std::string& node_id,
+                       LastValueCache* stats_aggregator) :
+  ChronosConnection("", "", NULL, NULL),
+  _pop_callback(pop_callback),
+  _store(store),
+  _node_id(node_id),
+  _running(false),
+  _tick(0),
+  _id_base(0),
+  _next_id(0),
+  _index(NUM_INDEX_SHARDS),
+  _timers_stat(NULL),
+  _pops_stat(NULL)
+{
+  memset(_slots, 0, sizeof(_slots));
+
+  pthread_mutex_init(&_lock, NULL);
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_cond_init(&_flush_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  if (stats_aggregator != NULL)
+  {
+    _timers_stat = new StatisticAccumulator("ralf_timer_wheel_timers",
+                                            stats_aggregator);
+    _pops_stat = new StatisticCounter("ralf_timer_wheel_pops",
+                                      stats_aggregator);
+  }
+}
+
+TimerWheel::~TimerWheel()
+{
+  stop();
+
+  for (std::unordered_map<std::string, Timer*>::iterator it = _timers.begin();
+       it != _timers.end();
+       ++it)
+  {
+    delete it->second;
+  }
+  _timers.clear();
+
+  pthread_cond_destroy(&_flush_cond);
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+
+  delete _timers_stat; _timers_stat = NULL;
+  delete _pops_stat; _pops_stat = NULL;
+}
+
+bool TimerWheel::start()
+{
+  recover();
+
+  _running = true;
+  int rc = pthread_create(&_flush_thread, NULL, flush_thread_fn, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start timer flush thread: %d", rc);
+    _running = false;
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  rc = pthread_create(&_thread, NULL, thread_fn, this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start timer wheel thread: %d", rc);
+    pthread_mutex_lock(&_lock);
+    _running = false;
+    pthread_cond_signal(&_flush_cond);
+    pthread_mutex_unlock(&_lock);
+    pthread_join(_flush_thread, NULL);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  return true;
+}
+
+void TimerWheel::stop()
+{
+  pthread_mutex_lock(&_lock);
+  bool running = _running;
+  _running = false;
+  pthread_cond_signal(&_cond);
+  pthread_cond_signal(&_flush_cond);
+  pthread_mutex_unlock(&_lock);
+
+  if (running)
+  {
+    pthread_join(_thread, NULL);
+    pthread_join(_flush_thread, NULL);
+
+    // Write out any changes made since the last flush.
+    flush();
+  }
+}
+
+HTTPCode TimerWheel::send_post(std::string& post_identity,
+                               uint32_t timer_interval,
+                               uint32_t repeat_for,
+                               const std::string& callback_uri,
+                               const std::string& opaque_data,
+                               SAS::TrailId trail,
+                               const std::map<std::string, uint32_t>& tags)
+{
+  pthread_mutex_lock(&_lock);
+  post_identity = new_id();
+  pthread_mutex_unlock(&_lock);
+
+  return send_put(post_identity,
+                  timer_interval,
+                  repeat_for,
+                  callback_uri,
+                  opaque_data,
+                  trail,
+                  tags);
+}
+
+HTTPCode TimerWheel::send_put(std::string& put_identity,
+                              uint32_t timer_interval,
+                              uint32_t repeat_for,
+                              const std::string& callback_uri,
+                              const std::string& opaque_data,
+                              SAS::TrailId trail,
+                              const std::map<std::string, uint32_t>& tags)
+{
+  // As in Chronos, the timer pops at least once, even if repeat_for is
+  // shorter than the interval.
+  uint64_t now = now_ms();
+  uint64_t interval_ms = (uint64_t)timer_interval * 1000;
+  uint64_t end_ms = now + std::max(interval_ms, (uint64_t)repeat_for * 1000);
+
+  TRC_DEBUG("Arm timer %s to pop every %ums for %ums",
+            put_identity.c_str(), timer_interval * 1000, repeat_for * 1000);
+
+  pthread_mutex_lock(&_lock);
+  arm(put_identity, interval_ms, now + interval_ms, end_ms, callback_uri, opaque_data);
+  mark_dirty(put_identity);
+  pthread_mutex_unlock(&_lock);
+
+  return HTTP_OK;
+}
+
+HTTPCode TimerWheel::send_delete(const std::string& delete_identity,
+                                 SAS::TrailId trail)
+{
+  HTTPCode rc = HTTP_NOT_FOUND;
+
+  pthread_mutex_lock(&_lock);
+  std::unordered_map<std::string, Timer*>::iterator it =
+                                                 _timers.find(delete_identity);
+
+  if (it != _timers.end())
+  {
+    TRC_DEBUG("Cancel timer %s", delete_identity.c_str());
+    Timer* timer = it->second;
+    unlink(timer);
+    _timers.erase(it);
+
+    int index_shard = shard(delete_identity);
+    _index[index_shard].erase(delete_identity);
+    _dirty_shards.insert(index_shard);
+    mark_dirty(delete_identity);
+
+    delete timer; timer = NULL;
+    rc = HTTP_OK;
+  }
+
+  pthread_mutex_unlock(&_lock);
+  return rc;
+}
+
+size_t TimerWheel::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _timers.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+void TimerWheel::advance(uint64_t now_ms)
+{
+  std::vector<std::pair<std::string, std::string>> popped;
+
+  pthread_mutex_lock(&_lock);
+  init_tick();
+
+  while (_tick * TICK_MS <= now_ms)
+  {
+    // When the lowest level wraps, move the timers in the next slot of the
+    // level above down, and so on up the levels.
+    int index = _tick & (SLOTS - 1);
+
+    if (index == 0)
+    {
+      for (int level = 1; level < LEVELS; level++)
+      {
+        int slot = (_tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+        cascade(level, slot);
+
+        if (slot != 0)
+        {
+          break;
+        }
+      }
+    }
+
+    uint64_t tick = _tick++;
+    Timer* timer = _slots[0][index];
+    _slots[0][index] = NULL;
+
+    while (timer != NULL)
+    {
+      Timer* next = timer->next;
+      timer->prev = NULL;
+      timer->next = NULL;
+
+      if ((timer->next_pop_ms + TICK_MS - 1) / TICK_MS > tick)
+      {
+        // The timer was too far in the future to fit in the wheel when it
+        // was armed, so it isn't due yet.
+        insert(timer);
+      }
+      else
+      {
+        popped.push_back(std::make_pair(timer->callback_uri, timer->opaque_data));
+        timer->next_pop_ms += timer->interval_ms;
+
+        if ((timer->interval_ms == 0) || (timer->next_pop_ms > timer->end_ms))
+        {
+          // That was the last pop.  The timer's record in the store is left
+          // to expire.
+          TRC_DEBUG("Timer %s has finished", timer->id.c_str());
+          int index_shard = shard(timer->id);
+          _index[index_shard].erase(timer->id);
+          _dirty_shards.insert(index_shard);
+          _timers.erase(timer->id);
+          delete timer;
+        }
+        else
+        {
+          insert(timer);
+        }
+      }
+
+      timer = next;
+    }
+  }
+
+  size_t num_timers = _timers.size();
+  pthread_mutex_unlock(&_lock);
+
+  if ((!popped.empty()) && (_timers_stat != NULL))
+  {
+    _timers_stat->accumulate(num_timers);
+  }
+
+  // Offer any pops that were refused last time first, so pops are passed on
+  // in order.
+  if (!_refused.empty())
+  {
+    popped.insert(popped.begin(), _refused.begin(), _refused.end());
+    _refused.clear();
+  }
+
+  // Don't hold the lock while calling back, as the callback is likely to
+  // update the timer.
+  for (size_t ii = 0; ii < popped.size(); ii++)
+  {
+    if (!_pop_callback(popped[ii].first, popped[ii].second))
+    {
+      TRC_DEBUG("Timer pops refused, offering them again on the next tick");
+      _refused.assign(popped.begin() + ii, popped.end());
+      break;
+    }
+
+    if (_pops_stat != NULL)
+    {
+      _pops_stat->increment();
+    }
+  }
+}
+
+void TimerWheel::flush()
+{
+  if (_store == NULL)
+  {
+    return;
+  }
+
+  // Convert monotonic times to wall clock times for the store.
+  uint64_t now = now_ms();
+  uint64_t wall = wall_ms();
+
+  // Build the records with the lock held, but write them without it.  An
+  // empty record means the timer or index shard should be deleted.
+  std::vector<std::pair<std::string, std::string>> timers;
+  std::vector<int> expiries;
+  std::vector<std::pair<int, std::string>> shards;
+  std::vector<std::string> shard_keys;
+  std::vector<int> shard_expiries;
+
+  pthread_mutex_lock(&_lock);
+
+  for (std::unordered_set<std::string>::iterator it = _dirty_timers.begin();
+       it != _dirty_timers.end();
+       ++it)
+  {
+    std::unordered_map<std::string, Timer*>::iterator timer = _timers.find(*it);
+
+    if (timer != _timers.end())
+    {
+      Timer* t = timer->second;
+      timers.push_back(std::make_pair(*it,
+                                      make_record(t->interval_ms,
+                                                  t->first_pop_ms - now + wall,
+                                                  t->end_ms - now + wall,
+                                                  t->callback_uri,
+                                                  t->opaque_data)));
+      expiries.push_back((t->end_ms > now) ? (t->end_ms - now) / 1000 + 1 : 1);
+    }
+    else
+    {
+      timers.push_back(std::make_pair(*it, std::string()));
+      expiries.push_back(0);
+    }
+  }
+
+  for (std::unordered_set<int>::iterator it = _dirty_shards.begin();
+       it != _dirty_shards.end();
+       ++it)
+  {
+    // The shard expires with the last of its timers.
+    std::string ids;
+    uint64_t end_ms = now;
+
+    for (std::unordered_set<std::string>::iterator id = _index[*it].begin();
+         id != _index[*it].end();
+         ++id)
+    {
+      // Every timer in the index should be armed, but don't create an entry
+      // for one that isn't.
+      std::unordered_map<std::string, Timer*>::iterator timer = _timers.find(*id);
+
+      if (timer != _timers.end())
+      {
+        ids.append(*id).push_back('\n');
+        end_ms = std::max(end_ms, timer->second->end_ms);
+      }
+    }
+
+    shards.push_back(std::make_pair(*it, ids));
+    shard_keys.push_back(ids.empty() ? std::string() : new_id());
+    shard_expiries.push_back((end_ms - now) / 1000 + 1);
+  }
+
+  _dirty_timers.clear();
+  _dirty_shards.clear();
+  pthread_mutex_unlock(&_lock);
+
+  for (size_t ii = 0; ii < timers.size(); ii++)
+  {
+    if (timers[ii].second.empty())
+    {
+      _store->delete_data("timer", timers[ii].first, 0);
+    }
+    else if (!write("timer", timers[ii].first, timers[ii].second, expiries[ii]))
+    {
+      TRC_WARNING("Failed to write timer %s to the store", timers[ii].first.c_str());
+    }
+  }
+
+  for (size_t ii = 0; ii < shards.size(); ii++)
+  {
+    if (!write_index(shards[ii].first,
+                     shard_keys[ii],
+                     shards[ii].second,
+                     shard_expiries[ii]))
+    {
+      TRC_WARNING("Failed to write timer index %s to the store",
+                  index_key(shards[ii].first).c_str());
+    }
+  }
+}
+
+void TimerWheel::recover()
+{
+  if (_store == NULL)
+  {
+    return;
+  }
+
+  uint64_t now = now_ms();
+  uint64_t wall = wall_ms();
+  int recovered = 0;
+
+  for (int index_shard = 0; index_shard < NUM_INDEX_SHARDS; index_shard++)
+  {
+    std::string ids_key;
+    std::string ids;
+    uint64_t cas;
+
+    if ((_store->get_data("timer_index", index_key(index_shard), ids_key, cas, 0) !=
+         Store::Status::OK))
+    {
+      continue;
+    }
+
+    if ((_store->get_data("timer_index_ids", ids_key, ids, cas, 0) !=
+         Store::Status::OK))
+    {
+      // The shard's IDs have gone, so its timers can't be found.  Make sure
+      // the shard is rewritten.
+      TRC_WARNING("Timer index %s is missing its timer IDs",
+                  index_key(index_shard).c_str());
+      pthread_mutex_lock(&_lock);
+      _dirty_shards.insert(index_shard);
+      pthread_mutex_unlock(&_lock);
+      continue;
+    }
+
+    size_t start = 0;
+    size_t end;
+
+    while ((end = ids.find('\n', start)) != std::string::npos)
+    {
+      std::string id = ids.substr(start, end - start);
+      start = end + 1;
+
+      std::string record;
+      uint64_t interval_ms;
+      uint64_t first_pop_ms;
+      uint64_t end_ms;
+      std::string callback_uri;
+      std::string opaque_data;
+
+      if ((_store->get_data("timer", id, record, cas, 0) != Store::Status::OK) ||
+          (!parse_record(record,
+                         interval_ms,
+                         first_pop_ms,
+                         end_ms,
+                         callback_uri,
+                         opaque_data)))
+      {
+        // The timer has finished or was cancelled.  Make sure the index is
+        // rewritten without it.
+        pthread_mutex_lock(&_lock);
+        _dirty_shards.insert(index_shard);
+        pthread_mutex_unlock(&_lock);
+        continue;
+      }
+
+      // Skip any pops that were due while we were down.
+      uint64_t next_pop_ms = first_pop_ms;
+
+      if ((next_pop_ms <= wall) && (interval_ms > 0))
+      {
+        next_pop_ms += ((wall - next_pop_ms) / interval_ms + 1) * interval_ms;
+      }
+
+      pthread_mutex_lock(&_lock);
+
+      if ((next_pop_ms > wall) && (next_pop_ms <= end_ms))
+      {
+        arm(id,
+            interval_ms,
+            next_pop_ms - wall + now,
+            end_ms - wall + now,
+            callback_uri,
+            opaque_data);
+        recovered++;
+      }
+      else
+      {
+        _dirty_shards.insert(index_shard);
+      }
+
+      pthread_mutex_unlock(&_lock);
+    }
+  }
+
+  TRC_STATUS("Recovered %d timers from the store", recovered);
+}
+
+// The version of the timer record format.  Bump this if the format changes.
+static const uint8_t TIMER_RECORD_VERSION = 1;
+
+// Records are written with varints (as in the compact session format), so
+// they're the same whatever the byte order of the node that wrote them.
+static void write_varint(std::string& record, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    record.push_back((char)((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+
+  record.push_back((char)value);
+}
+
+// Returns false if the data is truncated or the value is too large.
+static bool read_varint(const std::string& record,
+                        size_t& offset,
+                        uint64_t& value)
+{
+  value = 0;
+
+  for (uint32_t shift = 0; shift < 64; shift += 7)
+  {
+    if (offset >= record.size())
+    {
+      return false;
+    }
+
+    uint8_t byte = (uint8_t)record[offset++];
+    value |= (uint64_t)(byte & 0x7F) << shift;
+
+    if ((byte & 0x80) == 0)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+std::string TimerWheel::make_record(uint64_t interval_ms,
+                                    uint64_t first_pop_ms,
+                                    uint64_t end_ms,
+                                    const std::string& callback_uri,
+                                    const std::string& opaque_data)
+{
+  // A record is a version byte, then the interval, first pop time and end
+  // time, then the callback URI (as a length and the URI), then the opaque
+  // data.  The numbers are all varints.
+  std::string record;
+  record.reserve(1 + 3 * 10 + 5 + callback_uri.size() + opaque_data.size());
+  record.push_back((char)TIMER_RECORD_VERSION);
+  write_varint(record, interval_ms);
+  write_varint(record, first_pop_ms);
+  write_varint(record, end_ms);
+  write_varint(record, callback_uri.size());
+  record.append(callback_uri);
+  record.append(opaque_data);
+  return record;
+}
+
+bool TimerWheel::parse_record(const std::string& record,
+                              uint64_t& interval_ms,
+                              uint64_t& first_pop_ms,
+                              uint64_t& end_ms,
+                              std::string& callback_uri,
+                              std::string& opaque_data)
+{
+  size_t offset = 1;
+  uint64_t len;
+
+  if ((record.empty()) ||
+      ((uint8_t)record[0] != TIMER_RECORD_VERSION) ||
+      (!read_varint(record, offset, interval_ms)) ||
+      (!read_varint(record, offset, first_pop_ms)) ||
+      (!read_varint(record, offset, end_ms)) ||
+      (!read_varint(record, offset, len)) ||
+      (len > record.size() - offset))
+  {
+    return false;
+  }
+
+  callback_uri = record.substr(offset, len);
+  opaque_data = record.substr(offset + len);
+  return true;
+}
+
+uint64_t TimerWheel::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t TimerWheel::wall_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void* TimerWheel::thread_fn(void* wheel)
+{
+  ((TimerWheel*)wheel)->thread();
+  return NULL;
+}
+
+void TimerWheel::thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (_running)
+  {
+    pthread_mutex_unlock(&_lock);
+    advance(now_ms());
+    pthread_mutex_lock(&_lock);
+
+    if (_running)
+    {
+      // Wait for the next tick.
+      uint64_t deadline = _tick * TICK_MS;
+      struct timespec ts;
+      ts.tv_sec = deadline / 1000;
+      ts.tv_nsec = (deadline % 1000) * 1000000;
+      pthread_cond_timedwait(&_cond, &_lock, &ts);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void* TimerWheel::flush_thread_fn(void* wheel)
+{
+  ((TimerWheel*)wheel)->flush_thread();
+  return NULL;
+}
+
+void TimerWheel::flush_thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (_running)
+  {
+    pthread_mutex_unlock(&_lock);
+    flush();
+    pthread_mutex_lock(&_lock);
+
+    if (_running)
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      ts.tv_nsec += FLUSH_INTERVAL_MS * 1000000;
+      ts.tv_sec += ts.tv_nsec / 1000000000;
+      ts.tv_nsec %= 1000000000;
+      pthread_cond_timedwait(&_flush_cond, &_lock, &ts);
+    }
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void TimerWheel::arm(const std::string& id,
+                     uint64_t interval_ms,
+                     uint64_t first_pop_ms,
+                     uint64_t end_ms,
+                     const std::string& callback_uri,
+                     const std::string& opaque_data)
+{
+  init_tick();
+
+  Timer* timer;
+  std::unordered_map<std::string, Timer*>::iterator it = _timers.find(id);
+
+  if (it != _timers.end())
+  {
+    timer = it->second;
+    unlink(timer);
+  }
+  else
+  {
+    timer = new Timer();
+    timer->id = id;
+    _timers[id] = timer;
+
+    int index_shard = shard(id);
+    _index[index_shard].insert(id);
+    _dirty_shards.insert(index_shard);
+  }
+
+  timer->callback_uri = callback_uri;
+  timer->opaque_data = opaque_data;
+  timer->interval_ms = interval_ms;
+  timer->first_pop_ms = first_pop_ms;
+  timer->next_pop_ms = first_pop_ms;
+  timer->end_ms = end_ms;
+  insert(timer);
+}
+
+void TimerWheel::insert(Timer* timer)
+{
+  uint64_t due = (timer->next_pop_ms + TICK_MS - 1) / TICK_MS;
+
+  if (due < _tick)
+  {
+    due = _tick;
+  }
+
+  // Find the lowest level that the timer fits in.  If it doesn't fit in the
+  // wheel at all, put it in the furthest slot, and it'll be moved on again
+  // when that slot comes round.
+  uint64_t delta = due - _tick;
+  int level = 0;
+
+  while ((level < LEVELS - 1) && (delta >> (SLOT_BITS * (level + 1)) != 0))
+  {
+    level++;
+  }
+
+  if (delta >> (SLOT_BITS * LEVELS) != 0)
+  {
+    due = _tick + (1ull << (SLOT_BITS * LEVELS)) - 1;
+  }
+
+  int slot = (due >> (SLOT_BITS * level)) & (SLOTS - 1);
+
+  timer->level = level;
+  timer->slot = slot;
+  timer->prev = NULL;
+  timer->next = _slots[level][slot];
+
+  if (timer->next != NULL)
+  {
+    timer->next->prev = timer;
+  }
+
+  _slots[level][slot] = timer;
+}
+
+void TimerWheel::unlink(Timer* timer)
+{
+  if (timer->prev != NULL)
+  {
+    timer->prev->next = timer->next;
+  }
+  else
+  {
+    _slots[timer->level][timer->slot] = timer->next;
+  }
+
+  if (timer->next != NULL)
+  {
+    timer->next->prev = timer->prev;
+  }
+
+  timer->prev = NULL;
+  timer->next = NULL;
+}
+
+void TimerWheel::cascade(int level, int slot)
+{
+  Timer* timer = _slots[level][slot];
+  _slots[level][slot] = NULL;
+
+  while (timer != NULL)
+  {
+    Timer* next = timer->next;
+    insert(timer);
+    timer = next;
+  }
+}
+
+void TimerWheel::mark_dirty(const std::string& id)
+{
+  if (_store != NULL)
+  {
+    _dirty_timers.insert(id);
+  }
+}
+
+bool TimerWheel::write(const std::string& table,
+                       const std::string& key,
+                       const std::string& data,
+                       int expiry,
+                       std::string* old_data)
+{
+  // Writing with a CAS of 0 only succeeds if there's no record yet, so read
+  // the current CAS first.  Only this node writes these records, so there's
+  // only contention if the record expires in between.
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    std::string current;
+    uint64_t cas = 0;
+    Store::Status status = _store->get_data(table, key, current, cas, 0);
+
+    if (status == Store::Status::NOT_FOUND)
+    {
+      cas = 0;
+      current.clear();
+    }
+    else if (status != Store::Status::OK)
+    {
+      return false;
+    }
+
+    status = _store->set_data(table, key, data, cas, expiry, 0);
+
+    if (status == Store::Status::OK)
+    {
+      if (old_data != NULL)
+      {
+        *old_data = current;
+      }
+
+      return true;
+    }
+    else if (status != Store::Status::DATA_CONTENTION)
+    {
+      return false;
+    }
+  }
+
+  return false;
+}
+
+bool TimerWheel::write_index(int shard,
+                             const std::string& ids_key,
+                             const std::string& ids,
+                             int expiry)
+{
+  // The store doesn't tell us the CAS of the records we write, so the
+  // shard's record has to be read before it's overwritten.  It only holds the
+  // key of the record with the IDs, so that read is cheap however many timers
+  // the shard has.  The IDs themselves are written to a new record, which
+  // never needs a CAS.
+  std::string key = index_key(shard);
+  std::string old_ids_key;
+
+  if (ids.empty())
+  {
+    uint64_t cas;
+
+    if (_store->get_data("timer_index", key, old_ids_key, cas, 0) ==
+        Store::Status::OK)
+    {
+      _store->delete_data("timer_index", key, 0);
+      _store->delete_data("timer_index_ids", old_ids_key, 0);
+    }
+
+    return true;
+  }
+
+  if (_store->set_data("timer_index_ids", ids_key, ids, 0, expiry, 0) !=
+      Store::Status::OK)
+  {
+    return false;
+  }
+
+  if (!write("timer_index", key, ids_key, expiry, &old_ids_key))
+  {
+    _store->delete_data("timer_index_ids", ids_key, 0);
+    return false;
+  }
+
+  if (!old_ids_key.empty())
+  {
+    _store->delete_data("timer_index_ids", old_ids_key, 0);
+  }
+
+  return true;
+}
+
+void TimerWheel::init_tick()
+{
+  if (_tick == 0)
+  {
+    _tick = now_ms() / TICK_MS;
+  }
+}
+
+std::string TimerWheel::new_id()
+{
+  if (_id_base == 0)
+  {
+    _id_base = wall_ms();
+  }
+
+  char buf[64];
+  snprintf(buf, sizeof(buf), "-%" PRIx64 "-%" PRIx64, _id_base, _next_id++);
+  return _node_id + buf;
+}
+
+int TimerWheel::shard(const std::string& id) const
+{
+  return _hash(id) % NUM_INDEX_SHARDS;
+}
+
+std::string TimerWheel::index_key(int shard) const
+{
+  return _node_id + ":" + std::to_string(shard);
+}
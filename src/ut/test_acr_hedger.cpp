@@ -0,0 +1,130 @@
+/**
+ * @file test_acr_hedger.cpp UTs for the ACR hedger.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "acr_hedger.hpp"
+
+// An AcrHedger whose clock is controlled by the test.
+class TestAcrHedger : public AcrHedger
+{
+public:
+  TestAcrHedger(int percentile, int budget_percent) :
+    AcrHedger(percentile, budget_percent),
+    time_ms(1000)
+  {}
+
+  uint64_t time_ms;
+
+  uint64_t now_ms() { return time_ms; }
+};
+
+class AcrHedgerTest : public ::testing::Test
+{
+public:
+  AcrHedgerTest() : _hedger(90, 10) {}
+
+  // Record 90% of ACRs answered in 10ms, and 10% in 500ms.
+  void record_samples(int count)
+  {
+    for (int ii = 0; ii < count; ii++)
+    {
+      _hedger.record_latency((ii % 10 == 9) ? 500 : 10);
+    }
+  }
+
+  TestAcrHedger _hedger;
+};
+
+TEST_F(AcrHedgerTest, NoHedgeWithoutEnoughSamples)
+{
+  record_samples(AcrHedger::MIN_SAMPLES - 1);
+  EXPECT_EQ(0u, _hedger.acr_sent());
+}
+
+TEST_F(AcrHedgerTest, ThresholdTracksPercentile)
+{
+  record_samples(AcrHedger::MIN_SAMPLES);
+
+  // The 90th percentile is in the 10-15ms bucket.
+  EXPECT_EQ(15u, _hedger.acr_sent());
+
+  // If latency gets worse, so does the threshold.
+  for (uint64_t ii = 0; ii < AcrHedger::DECAY_SAMPLES; ii++)
+  {
+    _hedger.record_latency(100);
+  }
+
+  EXPECT_EQ(105u, _hedger.acr_sent());
+}
+
+TEST_F(AcrHedgerTest, BudgetLimitsHedges)
+{
+  // With a 10% budget, there's no budget to hedge until 10 ACRs are sent.
+  for (int ii = 0; ii < 9; ii++)
+  {
+    _hedger.acr_sent();
+  }
+  EXPECT_FALSE(_hedger.take_budget());
+
+  _hedger.acr_sent();
+  EXPECT_TRUE(_hedger.take_budget());
+  EXPECT_FALSE(_hedger.take_budget());
+
+  // Budget can only be saved up for a limited number of hedges.
+  for (int ii = 0; ii < 1000; ii++)
+  {
+    _hedger.acr_sent();
+  }
+
+  int hedges = 0;
+  while (_hedger.take_budget())
+  {
+    hedges++;
+  }
+  EXPECT_EQ(10, hedges);
+}
+
+TEST_F(AcrHedgerTest, CancelScheduledHedge)
+{
+  PeerMessageSender* sender = (PeerMessageSender*)0x1234;
+
+  EXPECT_FALSE(_hedger.cancel(sender));
+  _hedger.schedule(sender, 15);
+  EXPECT_TRUE(_hedger.cancel(sender));
+  EXPECT_FALSE(_hedger.cancel(sender));
+}
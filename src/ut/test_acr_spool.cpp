@@ -0,0 +1,364 @@
+/**
+ * @file test_acr_spool.cpp UTs for the ACR spool.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "acr_spool.hpp"
+
+// A spool that records what it delivers, rather than sending it.
+class TestSpool : public AcrSpool
+{
+public:
+  TestSpool(const std::string& dir, uint64_t max_bytes, size_t segment_size) :
+    AcrSpool(dir, max_bytes, 1000, NULL, segment_size),
+    deliverable(true)
+  {}
+
+  std::vector<std::string> delivered;
+  bool deliverable;
+
+protected:
+  void deliver(const std::string& record, const DeliveryCallback& done)
+  {
+    if (deliverable)
+    {
+      delivered.push_back(record);
+    }
+    done(deliverable);
+  }
+};
+
+// A spool that keeps the records it's asked to deliver, so the test can
+// finish delivering them in any order.
+class AsyncTestSpool : public AcrSpool
+{
+public:
+  AsyncTestSpool(const std::string& dir) :
+    AcrSpool(dir, 1024 * 1024, 1000, NULL, 4096)
+  {}
+
+  std::vector<std::string> records;
+  std::vector<DeliveryCallback> callbacks;
+
+protected:
+  void deliver(const std::string& record, const DeliveryCallback& done)
+  {
+    records.push_back(record);
+    callbacks.push_back(done);
+  }
+
+  // Records of the form "key:data" are ordered by key.
+  std::string record_key(const std::string& record) const
+  {
+    size_t colon = record.find(':');
+    return (colon != std::string::npos) ? record.substr(0, colon) : "";
+  }
+};
+
+class AcrSpoolTest : public ::testing::Test
+{
+public:
+  AcrSpoolTest()
+  {
+    char dir[] = "/tmp/ralf_spool_XXXXXX";
+    _dir = mkdtemp(dir);
+  }
+
+  virtual ~AcrSpoolTest()
+  {
+    DIR* dir = opendir(_dir.c_str());
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+      unlink((_dir + "/" + entry->d_name).c_str());
+    }
+    closedir(dir);
+    rmdir(_dir.c_str());
+  }
+
+  int num_segment_files()
+  {
+    int count = 0;
+    DIR* dir = opendir(_dir.c_str());
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+      if (entry->d_name[0] != '.')
+      {
+        count++;
+      }
+    }
+    closedir(dir);
+    return count;
+  }
+
+  std::string _dir;
+};
+
+TEST_F(AcrSpoolTest, ReplaysInOrder)
+{
+  TestSpool spool(_dir, 1024 * 1024, 4096);
+  ASSERT_TRUE(spool.recover());
+
+  EXPECT_FALSE(spool.replay_one());
+  EXPECT_TRUE(spool.append("first"));
+  EXPECT_TRUE(spool.append("second"));
+  EXPECT_EQ(2u, spool.depth());
+
+  // Records that can't be delivered stay in the spool.
+  spool.deliverable = false;
+  EXPECT_FALSE(spool.replay_one());
+  EXPECT_EQ(2u, spool.depth());
+
+  spool.deliverable = true;
+  EXPECT_TRUE(spool.replay_one());
+  EXPECT_TRUE(spool.replay_one());
+  EXPECT_FALSE(spool.replay_one());
+  EXPECT_EQ(0u, spool.depth());
+
+  std::vector<std::string> expected = {"first", "second"};
+  EXPECT_EQ(expected, spool.delivered);
+}
+
+TEST_F(AcrSpoolTest, SurvivesRestart)
+{
+  {
+    TestSpool spool(_dir, 1024 * 1024, 4096);
+    ASSERT_TRUE(spool.recover());
+
+    for (int ii = 0; ii < 100; ii++)
+    {
+      EXPECT_TRUE(spool.append("record " + std::to_string(ii)));
+    }
+
+    // Deliver the first few before "restarting".
+    for (int ii = 0; ii < 10; ii++)
+    {
+      EXPECT_TRUE(spool.replay_one());
+    }
+    spool.flush();
+  }
+
+  TestSpool spool(_dir, 1024 * 1024, 4096);
+  ASSERT_TRUE(spool.recover());
+  EXPECT_EQ(90u, spool.depth());
+
+  while (spool.replay_one())
+  {
+  }
+
+  ASSERT_EQ(90u, spool.delivered.size());
+  EXPECT_EQ("record 10", spool.delivered.front());
+  EXPECT_EQ("record 99", spool.delivered.back());
+
+  // New records follow on from the recovered ones.
+  EXPECT_TRUE(spool.append("new"));
+  EXPECT_TRUE(spool.replay_one());
+  EXPECT_EQ("new", spool.delivered.back());
+}
+
+TEST_F(AcrSpoolTest, ReusesDeliveredSegments)
+{
+  TestSpool spool(_dir, 1024 * 1024, 4096);
+  ASSERT_TRUE(spool.recover());
+  std::string record(1200, 'x');
+
+  // Each segment holds 3 of these records.  Fill and deliver lots of
+  // segments - the files should be reused rather than piling up.
+  for (int ii = 0; ii < 30; ii++)
+  {
+    EXPECT_TRUE(spool.append(record));
+    EXPECT_TRUE(spool.replay_one());
+  }
+
+  EXPECT_EQ(30u, spool.delivered.size());
+  EXPECT_LE(num_segment_files(), 4);
+}
+
+TEST_F(AcrSpoolTest, FullSpool)
+{
+  // Room for two segments of 3 records.
+  TestSpool spool(_dir, 8192, 4096);
+  ASSERT_TRUE(spool.recover());
+  std::string record(1200, 'x');
+
+  for (int ii = 0; ii < 6; ii++)
+  {
+    EXPECT_TRUE(spool.append(record));
+  }
+  EXPECT_FALSE(spool.append(record));
+
+  // Records that are too big for a segment are rejected.
+  EXPECT_FALSE(spool.append(std::string(5000, 'x')));
+
+  // Delivering a segment makes room for more.
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_TRUE(spool.replay_one());
+  }
+  EXPECT_TRUE(spool.replay_one());
+  EXPECT_TRUE(spool.append(record));
+}
+
+TEST_F(AcrSpoolTest, DeliversSeveralAtOnce)
+{
+  {
+    AsyncTestSpool spool(_dir);
+    ASSERT_TRUE(spool.recover());
+
+    for (size_t ii = 0; ii < AcrSpool::MAX_IN_FLIGHT + 1; ii++)
+    {
+      EXPECT_TRUE(spool.append("record " + std::to_string(ii)));
+    }
+
+    // Only MAX_IN_FLIGHT records are delivered at once.
+    for (size_t ii = 0; ii < AcrSpool::MAX_IN_FLIGHT; ii++)
+    {
+      EXPECT_TRUE(spool.replay_one());
+    }
+    EXPECT_FALSE(spool.replay_one());
+    ASSERT_EQ(AcrSpool::MAX_IN_FLIGHT, spool.records.size());
+    EXPECT_EQ("record 0", spool.records[0]);
+
+    // A record delivered ahead of an earlier one isn't counted as delivered
+    // until the earlier one is.
+    spool.callbacks[1](true);
+    spool.callbacks[2](true);
+    EXPECT_EQ(AcrSpool::MAX_IN_FLIGHT + 1, spool.depth());
+    spool.callbacks[0](true);
+    EXPECT_EQ(AcrSpool::MAX_IN_FLIGHT - 2, spool.depth());
+
+    // A record that fails is retried before any new ones.
+    spool.callbacks[3](false);
+    EXPECT_TRUE(spool.replay_one());
+    EXPECT_EQ("record 3", spool.records.back());
+    EXPECT_TRUE(spool.replay_one());
+    EXPECT_EQ("record " + std::to_string(AcrSpool::MAX_IN_FLIGHT), spool.records.back());
+
+    // Finish the deliveries the spool is waiting for, except record 3.
+    for (size_t ii = 4; ii < spool.callbacks.size(); ii++)
+    {
+      if (spool.records[ii] != "record 3")
+      {
+        spool.callbacks[ii](true);
+      }
+    }
+    spool.flush();
+  }
+
+  // After a restart, replay starts from the record that wasn't delivered.
+  TestSpool spool(_dir, 1024 * 1024, 4096);
+  ASSERT_TRUE(spool.recover());
+  EXPECT_EQ(AcrSpool::MAX_IN_FLIGHT - 2, spool.depth());
+  EXPECT_TRUE(spool.replay_one());
+  EXPECT_EQ("record 3", spool.delivered.front());
+}
+
+TEST_F(AcrSpoolTest, DeliversOneRecordPerKeyAtOnce)
+{
+  AsyncTestSpool spool(_dir);
+  ASSERT_TRUE(spool.recover());
+  EXPECT_TRUE(spool.append("a:first"));
+  EXPECT_TRUE(spool.append("b:first"));
+  EXPECT_TRUE(spool.append("a:second"));
+  EXPECT_TRUE(spool.append("b:second"));
+
+  // A record isn't sent while an earlier one with the same key is being
+  // delivered.
+  EXPECT_TRUE(spool.replay_one());
+  EXPECT_TRUE(spool.replay_one());
+  EXPECT_FALSE(spool.replay_one());
+  ASSERT_EQ(2u, spool.records.size());
+
+  // Or while the earlier one is waiting to be retried.
+  spool.callbacks[0](false);
+  EXPECT_TRUE(spool.replay_one());
+  EXPECT_EQ("a:first", spool.records.back());
+  EXPECT_FALSE(spool.replay_one());
+
+  // Once it's delivered, the next record with its key is sent, even though
+  // a record with another key is still being delivered.
+  spool.callbacks[2](true);
+  EXPECT_TRUE(spool.replay_one());
+  EXPECT_EQ("a:second", spool.records.back());
+  EXPECT_FALSE(spool.replay_one());
+
+  spool.callbacks[1](true);
+  EXPECT_TRUE(spool.replay_one());
+  EXPECT_EQ("b:second", spool.records.back());
+
+  spool.callbacks[3](true);
+  spool.callbacks[4](true);
+  EXPECT_EQ(0u, spool.depth());
+}
+
+TEST_F(AcrSpoolTest, ThreadsDeliverRecords)
+{
+  TestSpool spool(_dir, 1024 * 1024, 4096);
+  ASSERT_TRUE(spool.start());
+  EXPECT_TRUE(spool.append("record"));
+
+  for (int ii = 0; (ii < 100) && (spool.depth() > 0); ii++)
+  {
+    usleep(10000);
+  }
+
+  EXPECT_EQ(0u, spool.depth());
+  spool.stop();
+}
+
+TEST(RfAcrSpoolTest, RecordEncoding)
+{
+  std::vector<std::string> ccfs = {"ccf1.example.com", "ccf2.example.com"};
+  std::string record = RfAcrSpool::make_record(ccfs, "acr bytes");
+
+  std::vector<std::string> parsed_ccfs;
+  std::string parsed_acr;
+  EXPECT_TRUE(RfAcrSpool::parse_record(record, parsed_ccfs, parsed_acr));
+  EXPECT_EQ(ccfs, parsed_ccfs);
+  EXPECT_EQ("acr bytes", parsed_acr);
+
+  // Truncated records are rejected.
+  EXPECT_FALSE(RfAcrSpool::parse_record(record.substr(0, 10), parsed_ccfs, parsed_acr));
+  EXPECT_FALSE(RfAcrSpool::parse_record("", parsed_ccfs, parsed_acr));
+}
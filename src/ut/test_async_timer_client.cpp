@@ -0,0 +1,183 @@
+/**
+ * @file test_async_timer_client.cpp UT for AsyncTimerClient
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "async_timer_client.hpp"
+
+// Timer client that records the requests it would have sent to Chronos, and
+// answers them all successfully.
+class RecordingTimerClient : public AsyncTimerClient
+{
+public:
+  RecordingTimerClient(unsigned int num_threads, size_t max_queue) :
+    AsyncTimerClient(NULL, num_threads, max_queue, NULL, NULL)
+  {
+    pthread_mutex_init(&_sent_lock, NULL);
+  }
+
+  virtual ~RecordingTimerClient()
+  {
+    pthread_mutex_destroy(&_sent_lock);
+  }
+
+  std::vector<std::string> sent()
+  {
+    pthread_mutex_lock(&_sent_lock);
+    std::vector<std::string> sent = _sent;
+    pthread_mutex_unlock(&_sent_lock);
+    return sent;
+  }
+
+protected:
+  void send(TimerRequest* req)
+  {
+    std::string method = (req->method == TimerRequest::POST) ? "POST" :
+                         (req->method == TimerRequest::PUT) ? "PUT" : "DELETE";
+    std::string timer_id = (req->method == TimerRequest::POST) ? "NEW_TIMER" :
+                                                                  req->timer_id;
+
+    pthread_mutex_lock(&_sent_lock);
+    _sent.push_back(method + " " + timer_id);
+    pthread_mutex_unlock(&_sent_lock);
+
+    if (req->completion)
+    {
+      req->completion(HTTP_OK, timer_id);
+    }
+  }
+
+private:
+  pthread_mutex_t _sent_lock;
+  std::vector<std::string> _sent;
+};
+
+TEST(AsyncTimerClientTest, PostCompletes)
+{
+  RecordingTimerClient client(2, 16);
+  ASSERT_TRUE(client.start());
+
+  HTTPCode rc = 0;
+  std::string timer_id;
+  client.send_post(100, 300, "/call-id/a", "{}", 0, {{"CALL", 1}},
+                   [&](HTTPCode c, const std::string& id) { rc = c; timer_id = id; });
+
+  client.stop();
+  client.join();
+
+  EXPECT_EQ(HTTP_OK, rc);
+  EXPECT_EQ("NEW_TIMER", timer_id);
+}
+
+TEST(AsyncTimerClientTest, DeleteSupersedesQueuedPut)
+{
+  // Queue the requests before starting the client, so the PUTs are still
+  // queued when the DELETE arrives.
+  RecordingTimerClient client(1, 16);
+  bool completed = false;
+
+  client.send_put("TIMER_A", 100, 300, "/call-id/a", "{}", 0, {},
+                  [&](HTTPCode c, const std::string& id) { completed = true; });
+  client.send_delete("TIMER_A", 0);
+  client.send_put("TIMER_B", 100, 300, "/call-id/b", "{}", 0, {}, nullptr);
+
+  ASSERT_TRUE(client.start());
+  client.stop();
+  client.join();
+
+  std::vector<std::string> sent = client.sent();
+  EXPECT_THAT(sent, ::testing::UnorderedElementsAre("DELETE TIMER_A",
+                                                    "PUT TIMER_B"));
+  EXPECT_FALSE(completed);
+}
+
+TEST(AsyncTimerClientTest, SendsInlineWhenFull)
+{
+  // Don't start the client, so nothing is taken off the queue.
+  RecordingTimerClient client(1, 2);
+
+  client.send_put("TIMER_A", 100, 300, "/call-id/a", "{}", 0, {}, nullptr);
+  client.send_put("TIMER_B", 100, 300, "/call-id/b", "{}", 0, {}, nullptr);
+  EXPECT_TRUE(client.sent().empty());
+
+  client.send_put("TIMER_C", 100, 300, "/call-id/c", "{}", 0, {}, nullptr);
+  EXPECT_THAT(client.sent(), ::testing::ElementsAre("PUT TIMER_C"));
+
+  ASSERT_TRUE(client.start());
+  client.stop();
+  client.join();
+
+  EXPECT_THAT(client.sent(), ::testing::ElementsAre("PUT TIMER_C",
+                                                    "PUT TIMER_A",
+                                                    "PUT TIMER_B"));
+}
+
+static void* send_delete_a(void* client)
+{
+  ((RecordingTimerClient*)client)->send_delete("TIMER_A", 0);
+  return NULL;
+}
+
+TEST(AsyncTimerClientTest, FullQueueDoesNotReorderTimer)
+{
+  // Don't start the client yet, so nothing is taken off the queue.
+  RecordingTimerClient client(1, 2);
+
+  client.send_put("TIMER_A", 100, 300, "/call-id/a", "{}", 0, {}, nullptr);
+  client.send_put("TIMER_B", 100, 300, "/call-id/b", "{}", 0, {}, nullptr);
+
+  // A DELETE for a timer with a PUT queued waits for room in the queue,
+  // rather than being sent ahead of the PUT.
+  pthread_t thread;
+  pthread_create(&thread, NULL, send_delete_a, &client);
+  usleep(10000);
+  EXPECT_TRUE(client.sent().empty());
+
+  ASSERT_TRUE(client.start());
+  pthread_join(thread, NULL);
+  client.stop();
+  client.join();
+
+  // The queued PUT is superseded by the DELETE.
+  EXPECT_THAT(client.sent(), ::testing::ElementsAre("PUT TIMER_B",
+                                                    "DELETE TIMER_A"));
+}
@@ -0,0 +1,243 @@
+/**
+ * @file test_billing_worker_pool.cpp UT for the billing worker pool
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <unistd.h>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "localstore.h"
+#include "session_store.h"
+#include "session_manager.hpp"
+#include "billing_worker_pool.hpp"
+#include "handlers.hpp"
+
+static const SAS::TrailId FAKE_TRAIL_ID = 0;
+
+// An INTERIM for a session that isn't in the store, which the session manager
+// just drops.
+static Message* interim(const std::string& call_id,
+                        role_of_node_t role = ORIGINATING)
+{
+  return new Message(call_id, role, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID);
+}
+
+// A billing pool whose requests all hit an exception part way through.
+class FailingBillingWorkerPool : public BillingWorkerPool
+{
+public:
+  FailingBillingWorkerPool(SessionManager* sess_mgr) :
+    BillingWorkerPool(sess_mgr, 1, 16, NULL, NULL, true)
+  {}
+
+protected:
+  void process_work(Message*& msg)
+  {
+    // Stand in for the exception handler recovering from an exception in the
+    // session manager, which has already deleted the message.
+    begin_request(msg);
+    delete msg; msg = NULL;
+    process_work_failed(msg);
+  }
+};
+
+class BillingWorkerPoolTest : public ::testing::Test
+{
+public:
+  BillingWorkerPoolTest()
+  {
+    _memstore = new LocalStore();
+    _store = new SessionStore(_memstore);
+    _mgr = new SessionManager(_store, {}, NULL, NULL, NULL, NULL, NULL);
+  }
+
+  virtual ~BillingWorkerPoolTest()
+  {
+    delete _mgr; _mgr = NULL;
+    delete _store; _store = NULL;
+    delete _memstore; _memstore = NULL;
+  }
+
+  // Processes anything left on a stopped pool's queue.
+  void drain(BillingWorkerPool& pool)
+  {
+    ASSERT_TRUE(pool.start());
+    pool.stop();
+    pool.join();
+  }
+
+  LocalStore* _memstore;
+  SessionStore* _store;
+  SessionManager* _mgr;
+};
+
+TEST_F(BillingWorkerPoolTest, ProcessesAllMessages)
+{
+  BillingWorkerPool pool(_mgr, 4, 1024, NULL, NULL);
+  ASSERT_TRUE(pool.start());
+
+  for (int ii = 0; ii < 100; ii++)
+  {
+    Message* msg = interim("CALL_ID_" + std::to_string(ii));
+    while (!pool.add_message(msg))
+    {
+      usleep(100);
+    }
+  }
+
+  pool.stop();
+  pool.join();
+
+  EXPECT_EQ(0u, pool.queue_depth());
+  EXPECT_EQ(0u, pool.contention_avoided());
+}
+
+TEST_F(BillingWorkerPoolTest, OrderedModeCountsContentionAvoided)
+{
+  // Don't start the pool, so the messages stay queued.
+  BillingWorkerPool pool(_mgr, 4, 1024, NULL, NULL, true);
+  EXPECT_EQ(4u, pool.num_lanes());
+
+  // The second message for a session is queued behind the first.
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE")));
+  EXPECT_EQ(0u, pool.contention_avoided());
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE")));
+  EXPECT_EQ(1u, pool.contention_avoided());
+
+  // Messages for other sessions, or for the same call in another role, are
+  // not.
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_TWO")));
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE", TERMINATING)));
+  EXPECT_EQ(1u, pool.contention_avoided());
+
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE")));
+  EXPECT_EQ(2u, pool.contention_avoided());
+  EXPECT_EQ(5u, pool.queue_depth());
+
+  // Once they've all been processed, nothing is pending.
+  drain(pool);
+  EXPECT_EQ(0u, pool.queue_depth());
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE")));
+  EXPECT_EQ(2u, pool.contention_avoided());
+
+  drain(pool);
+}
+
+TEST_F(BillingWorkerPoolTest, UnorderedModeDoesntCountContention)
+{
+  BillingWorkerPool pool(_mgr, 4, 1024, NULL, NULL);
+  EXPECT_EQ(1u, pool.num_lanes());
+
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE")));
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE")));
+  EXPECT_EQ(0u, pool.contention_avoided());
+
+  drain(pool);
+}
+
+TEST_F(BillingWorkerPoolTest, RejectsMessagesWhenFull)
+{
+  // Don't start the pool, so nothing is taken off the queue.
+  BillingWorkerPool pool(_mgr, 1, 2, NULL, NULL);
+
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE")));
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_TWO")));
+
+  // The caller keeps a message that can't be queued.
+  Message* msg = interim("CALL_ID_THREE");
+  EXPECT_FALSE(pool.add_message(msg));
+  EXPECT_EQ(2u, pool.queue_depth());
+  delete msg; msg = NULL;
+
+  drain(pool);
+}
+
+TEST_F(BillingWorkerPoolTest, RejectedMessagesArentPending)
+{
+  BillingWorkerPool pool(_mgr, 1, 2, NULL, NULL, true);
+
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE")));
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE")));
+  EXPECT_EQ(1u, pool.contention_avoided());
+
+  Message* msg = interim("CALL_ID_ONE");
+  EXPECT_FALSE(pool.add_message(msg));
+  delete msg; msg = NULL;
+
+  // Once the queued messages have been processed, the rejected one isn't
+  // counted as still pending, so the next message for the session isn't
+  // queued behind anything.
+  drain(pool);
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE")));
+  EXPECT_EQ(1u, pool.contention_avoided());
+
+  drain(pool);
+}
+
+TEST_F(BillingWorkerPoolTest, FailedMessagesArentPending)
+{
+  FailingBillingWorkerPool pool(_mgr);
+
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE")));
+  drain(pool);
+
+  // The message that hit an exception was released, so the next message for
+  // the session isn't queued behind it.
+  EXPECT_TRUE(pool.add_message(interim("CALL_ID_ONE")));
+  EXPECT_EQ(0u, pool.contention_avoided());
+
+  drain(pool);
+}
+
+TEST_F(BillingWorkerPoolTest, HandleMessageFallsBackWhenFull)
+{
+  BillingWorkerPool pool(_mgr, 1, 2, NULL, NULL);
+  BillingHandlerConfig cfg = {_mgr, &pool, NULL};
+
+  EXPECT_TRUE(BillingTask::handle_message(&cfg, interim("CALL_ID_ONE")));
+  EXPECT_TRUE(BillingTask::handle_message(&cfg, interim("CALL_ID_TWO")));
+
+  // The pool is full, so the caller keeps the message.
+  Message* msg = interim("CALL_ID_THREE");
+  EXPECT_FALSE(BillingTask::handle_message(&cfg, msg));
+  delete msg; msg = NULL;
+
+  // Without a pool, the message is handled straight away.
+  cfg.pool = NULL;
+  EXPECT_TRUE(BillingTask::handle_message(&cfg, interim("CALL_ID_FOUR")));
+
+  drain(pool);
+}
@@ -0,0 +1,167 @@
+/**
+ * @file test_ccf_health.cpp UTs for the CCF health tracker.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "ccf_health.hpp"
+
+// A CcfHealthTracker whose clock is controlled by the test.
+class TestCcfHealthTracker : public CcfHealthTracker
+{
+public:
+  TestCcfHealthTracker(int failure_threshold, int probe_interval_ms) :
+    CcfHealthTracker(failure_threshold, probe_interval_ms),
+    time_ms(1000)
+  {}
+
+  uint64_t time_ms;
+
+protected:
+  uint64_t now_ms() { return time_ms; }
+};
+
+class CcfHealthTest : public ::testing::Test
+{
+public:
+  CcfHealthTest() : _health(2, 5000), _ccfs({"ccf1", "ccf2"}) {}
+
+  TestCcfHealthTracker _health;
+  std::vector<std::string> _ccfs;
+  const std::vector<std::string> PRIMARY_FIRST = {"ccf1", "ccf2"};
+  const std::vector<std::string> BACKUP_FIRST = {"ccf2", "ccf1"};
+};
+
+TEST_F(CcfHealthTest, HealthyOrder)
+{
+  EXPECT_EQ(PRIMARY_FIRST, _health.order(_ccfs));
+  _health.success("ccf1");
+  EXPECT_EQ(PRIMARY_FIRST, _health.order(_ccfs));
+  EXPECT_EQ(CcfHealthTracker::CLOSED, _health.state("ccf1"));
+}
+
+TEST_F(CcfHealthTest, OpensAfterConsecutiveFailures)
+{
+  _health.failure("ccf1");
+  _health.success("ccf1");
+  _health.failure("ccf1");
+  EXPECT_EQ(CcfHealthTracker::CLOSED, _health.state("ccf1"));
+  EXPECT_EQ(PRIMARY_FIRST, _health.order(_ccfs));
+
+  _health.failure("ccf1");
+  EXPECT_EQ(CcfHealthTracker::OPEN, _health.state("ccf1"));
+
+  // The failing CCF is tried last.
+  EXPECT_EQ(BACKUP_FIRST, _health.order(_ccfs));
+}
+
+TEST_F(CcfHealthTest, ProbeRecovers)
+{
+  _health.failure("ccf1");
+  _health.failure("ccf1");
+  EXPECT_EQ(BACKUP_FIRST, _health.order(_ccfs));
+
+  // After the probe interval, one ACR probes the CCF, and the rest skip it
+  // until we know the outcome.
+  _health.time_ms += 5000;
+  EXPECT_EQ(PRIMARY_FIRST, _health.order(_ccfs));
+  EXPECT_EQ(CcfHealthTracker::HALF_OPEN, _health.state("ccf1"));
+  EXPECT_EQ(BACKUP_FIRST, _health.order(_ccfs));
+
+  _health.success("ccf1");
+  EXPECT_EQ(CcfHealthTracker::CLOSED, _health.state("ccf1"));
+  EXPECT_EQ(PRIMARY_FIRST, _health.order(_ccfs));
+}
+
+TEST_F(CcfHealthTest, FailedProbeReopens)
+{
+  _health.failure("ccf1");
+  _health.failure("ccf1");
+
+  _health.time_ms += 5000;
+  EXPECT_EQ(PRIMARY_FIRST, _health.order(_ccfs));
+  _health.failure("ccf1");
+  EXPECT_EQ(CcfHealthTracker::OPEN, _health.state("ccf1"));
+
+  _health.time_ms += 4999;
+  EXPECT_EQ(BACKUP_FIRST, _health.order(_ccfs));
+  _health.time_ms += 1;
+  EXPECT_EQ(PRIMARY_FIRST, _health.order(_ccfs));
+}
+
+TEST_F(CcfHealthTest, LostProbeRetried)
+{
+  std::vector<std::string> ccfs = {"ccf1", "ccf2", "ccf3"};
+  const std::vector<std::string> BACKUP_SKIPPED = {"ccf1", "ccf3", "ccf2"};
+
+  _health.failure("ccf2");
+  _health.failure("ccf2");
+  EXPECT_EQ(BACKUP_SKIPPED, _health.order(ccfs));
+
+  // The next ACR probes ccf2, but the primary answers it, so we never hear
+  // how the probe went.
+  _health.time_ms += 5000;
+  EXPECT_EQ(ccfs, _health.order(ccfs));
+  _health.success("ccf1");
+  EXPECT_EQ(CcfHealthTracker::HALF_OPEN, _health.state("ccf2"));
+
+  _health.time_ms += 4999;
+  EXPECT_EQ(BACKUP_SKIPPED, _health.order(ccfs));
+
+  // Once the probe interval has passed, another ACR probes ccf2.
+  _health.time_ms += 1;
+  EXPECT_EQ(ccfs, _health.order(ccfs));
+  EXPECT_EQ(CcfHealthTracker::HALF_OPEN, _health.state("ccf2"));
+  EXPECT_EQ(BACKUP_SKIPPED, _health.order(ccfs));
+
+  _health.success("ccf2");
+  EXPECT_EQ(CcfHealthTracker::CLOSED, _health.state("ccf2"));
+  EXPECT_EQ(ccfs, _health.order(ccfs));
+}
+
+TEST_F(CcfHealthTest, AllFailing)
+{
+  _health.failure("ccf1");
+  _health.failure("ccf1");
+  _health.failure("ccf2");
+  _health.failure("ccf2");
+
+  // All CCFs are still tried, in their original order.
+  EXPECT_EQ(PRIMARY_FIRST, _health.order(_ccfs));
+}
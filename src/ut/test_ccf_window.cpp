@@ -0,0 +1,135 @@
+/**
+ * @file test_ccf_window.cpp UTs for the CCF window.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "ccf_window.hpp"
+#include "peer_message_sender.hpp"
+
+using ::testing::Return;
+
+class MockWindowSender : public PeerMessageSender
+{
+public:
+  MockWindowSender() : PeerMessageSender(0, "billing.example.com") {}
+
+  MOCK_METHOD2(window_open, bool(unsigned int attempt, bool admitted));
+};
+
+class CcfWindowTest : public ::testing::Test
+{
+public:
+  CcfWindowTest() {}
+  MockWindowSender _sender1;
+  MockWindowSender _sender2;
+  MockWindowSender _sender3;
+};
+
+TEST_F(CcfWindowTest, QueuesBeyondWindow)
+{
+  CcfWindow window(1, 1, CcfWindow::FAILOVER);
+
+  EXPECT_EQ(CcfWindow::SEND, window.acquire("ccf1", &_sender1, 0));
+  EXPECT_EQ(CcfWindow::QUEUED, window.acquire("ccf1", &_sender2, 0));
+  EXPECT_EQ(1, window.in_flight("ccf1"));
+  EXPECT_EQ(1u, window.queue_depth("ccf1"));
+
+  // Other CCFs have their own window.
+  EXPECT_EQ(CcfWindow::SEND, window.acquire("ccf2", &_sender3, 1));
+
+  // When the first ACR is answered, the queued one is sent.
+  EXPECT_CALL(_sender2, window_open(0, true)).WillOnce(Return(true));
+  window.release("ccf1");
+  EXPECT_EQ(1, window.in_flight("ccf1"));
+  EXPECT_EQ(0u, window.queue_depth("ccf1"));
+
+  window.release("ccf1");
+  EXPECT_EQ(0, window.in_flight("ccf1"));
+}
+
+TEST_F(CcfWindowTest, UnusedSpaceIsPassedOn)
+{
+  CcfWindow window(1, 2, CcfWindow::FAILOVER);
+
+  EXPECT_EQ(CcfWindow::SEND, window.acquire("ccf1", &_sender1, 0));
+  EXPECT_EQ(CcfWindow::QUEUED, window.acquire("ccf1", &_sender2, 0));
+  EXPECT_EQ(CcfWindow::QUEUED, window.acquire("ccf1", &_sender3, 1));
+
+  // The first queued sender doesn't need the space any more, so it goes to
+  // the second.
+  EXPECT_CALL(_sender2, window_open(0, true)).WillOnce(Return(false));
+  EXPECT_CALL(_sender3, window_open(1, true)).WillOnce(Return(true));
+  window.release("ccf1");
+  EXPECT_EQ(1, window.in_flight("ccf1"));
+}
+
+TEST_F(CcfWindowTest, FullQueue)
+{
+  CcfWindow window(1, 1, CcfWindow::DROP);
+
+  EXPECT_EQ(CcfWindow::SEND, window.acquire("ccf1", &_sender1, 0));
+  EXPECT_EQ(CcfWindow::QUEUED, window.acquire("ccf1", &_sender2, 0));
+  EXPECT_EQ(CcfWindow::FULL, window.acquire("ccf1", &_sender3, 0));
+  EXPECT_EQ(1u, window.queue_depth("ccf1"));
+}
+
+TEST_F(CcfWindowTest, ShedOldest)
+{
+  CcfWindow window(1, 1, CcfWindow::SHED);
+
+  EXPECT_EQ(CcfWindow::SEND, window.acquire("ccf1", &_sender1, 0));
+  EXPECT_EQ(CcfWindow::QUEUED, window.acquire("ccf1", &_sender2, 0));
+
+  // The oldest queued ACR is shed to make room for the new one.
+  EXPECT_CALL(_sender2, window_open(0, false)).WillOnce(Return(false));
+  EXPECT_EQ(CcfWindow::QUEUED, window.acquire("ccf1", &_sender3, 0));
+
+  EXPECT_CALL(_sender3, window_open(0, true)).WillOnce(Return(true));
+  window.release("ccf1");
+}
+
+TEST_F(CcfWindowTest, ParsePolicy)
+{
+  CcfWindow::OverflowPolicy policy;
+  EXPECT_TRUE(CcfWindow::parse_policy("failover", policy));
+  EXPECT_EQ(CcfWindow::FAILOVER, policy);
+  EXPECT_TRUE(CcfWindow::parse_policy("drop", policy));
+  EXPECT_EQ(CcfWindow::DROP, policy);
+  EXPECT_TRUE(CcfWindow::parse_policy("shed", policy));
+  EXPECT_EQ(CcfWindow::SHED, policy);
+  EXPECT_FALSE(CcfWindow::parse_policy("queue", policy));
+}
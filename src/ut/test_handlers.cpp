@@ -34,6 +34,8 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <time.h>
+
 #include "handlers.hpp"
 #include "message.hpp"
 #include "gmock/gmock.h"
@@ -171,3 +173,165 @@ TEST_F(HandlerTest, NoNodeFunctionalityTest)
   ASSERT_EQ(NULL, msg);
   delete msg; msg = NULL;
 };
+
+TEST_F(HandlerTest, BodyConsumedTest)
+{
+  // The body is parsed in-situ, so parse_body takes its contents.
+  std::string body = "{\"peers\": {\"ccf\": [\"ec2-54-197-167-141.compute-1.amazonaws.com\"]}, \"event\": {\"Accounting-Record-Type\": 2, \"Acct-Interim-Interval\": 300, \"Service-Information\": {\"IMS-Information\": {\"Role-Of-Node\": 1, \"Node-Functionality\": 0}}}}";
+  Message* msg = NULL;
+  long rc = BillingTask::parse_body("abcd", false, body, &msg, FAKE_TRAIL_ID);
+  ASSERT_NE((Message*)NULL, msg);
+  EXPECT_EQ(rc, 200);
+  EXPECT_TRUE(body.empty());
+  EXPECT_TRUE(msg->record_type.isStart());
+  EXPECT_EQ(msg->role, TERMINATING);
+  EXPECT_EQ(msg->ccfs[0], "ec2-54-197-167-141.compute-1.amazonaws.com");
+
+  // The strings in the document must still be valid.
+  rapidjson::Value& event = msg->received_json->FindMember("event")->value;
+  EXPECT_EQ(300, event["Acct-Interim-Interval"].GetInt());
+  delete msg; msg = NULL;
+};
+
+// The body the session manager gives Chronos for interim timers.
+static const std::string TIMER_INTERIM_BODY = "{\"event\":{\"Service-Information\":{\"IMS-Information\":{\"Role-Of-Node\":1,\"Node-Functionality\":6}},\"Accounting-Record-Type\":3}}";
+
+TEST_F(HandlerTest, TimerInterimFastPathTest)
+{
+  Message* msg = NULL;
+  ASSERT_TRUE(BillingTask::parse_timer_interim("abcd", TIMER_INTERIM_BODY, &msg, FAKE_TRAIL_ID));
+  ASSERT_NE((Message*)NULL, msg);
+  EXPECT_EQ("abcd", msg->call_id);
+  EXPECT_TRUE(msg->record_type.isInterim());
+  EXPECT_EQ(TERMINATING, msg->role);
+  EXPECT_EQ(AS, msg->function);
+  EXPECT_EQ(0u, msg->session_refresh_time);
+  EXPECT_TRUE(msg->timer_interim);
+
+  // The document matches the one parse_body would have built.
+  std::string body = TIMER_INTERIM_BODY;
+  Message* parsed_msg = NULL;
+  ASSERT_EQ(200, BillingTask::parse_body("abcd", true, body, &parsed_msg, FAKE_TRAIL_ID));
+  EXPECT_TRUE(*msg->received_json == *parsed_msg->received_json);
+
+  delete msg; msg = NULL;
+  delete parsed_msg; parsed_msg = NULL;
+};
+
+TEST_F(HandlerTest, TimerInterimFastPathFallbackTest)
+{
+  // Anything other than the exact template is left for parse_body.
+  std::vector<std::string> bodies = {
+    "",
+    "{\"event\": {\"Service-Information\": {\"IMS-Information\": {\"Role-Of-Node\": 1, \"Node-Functionality\": 6}}, \"Accounting-Record-Type\": 3}}",
+    "{\"event\":{\"Service-Information\":{\"IMS-Information\":{\"Role-Of-Node\":-1,\"Node-Functionality\":6}},\"Accounting-Record-Type\":3}}",
+    "{\"event\":{\"Service-Information\":{\"IMS-Information\":{\"Role-Of-Node\":1,\"Node-Functionality\":}},\"Accounting-Record-Type\":3}}",
+    "{\"event\":{\"Service-Information\":{\"IMS-Information\":{\"Role-Of-Node\":1,\"Node-Functionality\":6}},\"Accounting-Record-Type\":4}}",
+    TIMER_INTERIM_BODY + " ",
+    TIMER_INTERIM_BODY.substr(0, TIMER_INTERIM_BODY.size() - 1)};
+
+  for (size_t ii = 0; ii < bodies.size(); ii++)
+  {
+    Message* msg = NULL;
+    EXPECT_FALSE(BillingTask::parse_timer_interim("abcd", bodies[ii], &msg, FAKE_TRAIL_ID)) << bodies[ii];
+    EXPECT_EQ(NULL, msg);
+  }
+};
+
+// rapidjson base allocator that counts the heap allocations made through it.
+class CountingAllocator
+{
+public:
+  static const bool kNeedFree = true;
+  void* Malloc(size_t size) { allocs++; return rapidjson::CrtAllocator().Malloc(size); }
+  void* Realloc(void* ptr, size_t old_size, size_t new_size)
+  {
+    allocs++;
+    return rapidjson::CrtAllocator().Realloc(ptr, old_size, new_size);
+  }
+  static void Free(void* ptr) { rapidjson::CrtAllocator::Free(ptr); }
+
+  static uint64_t allocs;
+};
+uint64_t CountingAllocator::allocs = 0;
+
+typedef rapidjson::MemoryPoolAllocator<CountingAllocator> CountingPool;
+typedef rapidjson::GenericDocument<rapidjson::UTF8<>, CountingPool, CountingAllocator> CountingDocument;
+
+// Compares the rapidjson allocations per request made by the old body parsing
+// (copy the body, then Parse<0> into a heap-allocated document) and the
+// in-situ parsing done by ReceivedBody.  Not run by default - use
+// --gtest_also_run_disabled_tests.
+TEST_F(HandlerTest, DISABLED_ParseBodyAllocationBenchmark)
+{
+  const std::string body = "{\"peers\":{\"ccf\":[\"cdf.example.com\"]},\"event\":{\"Accounting-Record-Type\":1,\"Acct-Interim-Interval\":600,\"Event-Timestamp\":1444118158,\"Service-Information\":{\"IMS-Information\":{\"Event-Type\":{\"SIP-Method\":\"INVITE\"},\"Role-Of-Node\":1,\"Node-Functionality\":2,\"User-Session-Id\":\"084972d9749c214876eb0ba4700ab1fa\",\"Calling-Party-Address\":[\"sip:6515550098@example.com\"],\"Called-Party-Address\":\"sip:6515550026@example.com\",\"Time-Stamps\":{\"SIP-Request-Timestamp\":1444118158,\"SIP-Request-Timestamp-Fraction\":92},\"Inter-Operator-Identifier\":[{\"Originating-IOI\":\"example.com\"}],\"IMS-Charging-Identifier\":\"084972d9749c214876eb0ba4700ab1fa\",\"Server-Capabilities\":{\"Mandatory-Capability\":[],\"Optional-Capability\":[],\"Server-Name\":[\"sip:sprout.example.com\"]},\"From-Address\":\"<sip:6515550098@example.com>;tag=d8d2645dea83f80087c5a4b8167e59e1\"}}}}";
+  const int iterations = 100000;
+  struct timespec start;
+  struct timespec end;
+
+  // Old behaviour.
+  CountingAllocator::allocs = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int ii = 0; ii < iterations; ii++)
+  {
+    std::string bodys = body;
+    CountingDocument* doc = new CountingDocument();
+    doc->Parse<0>(bodys.c_str());
+    ASSERT_TRUE(doc->IsObject());
+    delete doc;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Parse<0>:     %.2f allocs/request, %ld ns/request\n",
+         (double)CountingAllocator::allocs / iterations,
+         ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / iterations);
+
+  // In-situ parsing into a pool with an inline first chunk.
+  CountingAllocator::allocs = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int ii = 0; ii < iterations; ii++)
+  {
+    std::string bodys = body;
+    alignas(8) char chunk[ReceivedBody::INLINE_CHUNK_SIZE];
+    CountingPool pool(chunk, sizeof(chunk));
+    CountingDocument doc(&pool);
+    doc.ParseInsitu<0>(&bodys[0]);
+    ASSERT_TRUE(doc.IsObject());
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("ParseInsitu:  %.2f allocs/request, %ld ns/request\n",
+         (double)CountingAllocator::allocs / iterations,
+         ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / iterations);
+}
+
+// Compares the cost of building a timer-interim Message with parse_body and
+// with parse_timer_interim.  Not run by default - use
+// --gtest_also_run_disabled_tests.
+TEST_F(HandlerTest, DISABLED_TimerInterimBenchmark)
+{
+  const int iterations = 100000;
+  struct timespec start;
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int ii = 0; ii < iterations; ii++)
+  {
+    std::string body = TIMER_INTERIM_BODY;
+    Message* msg = NULL;
+    BillingTask::parse_body("abcd", true, body, &msg, FAKE_TRAIL_ID);
+    delete msg;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("parse_body:          %ld ns/request\n",
+         ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / iterations);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int ii = 0; ii < iterations; ii++)
+  {
+    Message* msg = NULL;
+    BillingTask::parse_timer_interim("abcd", TIMER_INTERIM_BODY, &msg, FAKE_TRAIL_ID);
+    delete msg;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("parse_timer_interim: %ld ns/request\n",
+         ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / iterations);
+}
@@ -0,0 +1,177 @@
+/**
+ * @file test_interim_pacer.cpp UT for the timer-interim pacer
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "interim_pacer.hpp"
+
+static const SAS::TrailId FAKE_TRAIL_ID = 0;
+
+// Pacer whose clock is controlled by the test, and which records the messages
+// it releases.  Messages are refused while refuse is set.
+class TestInterimPacer : public InterimPacer
+{
+public:
+  TestInterimPacer(int rate, size_t max_queue) :
+    InterimPacer([this](Message* msg)
+                 {
+                   if (refuse)
+                   {
+                     return false;
+                   }
+
+                   released.push_back(msg);
+                   delete msg;
+                   return true;
+                 },
+                 rate,
+                 max_queue),
+    refuse(false),
+    now(1000000)
+  {}
+
+  // Release anything still queued while released still exists.
+  virtual ~TestInterimPacer() { stop(); }
+
+  // Returns how many messages were refused because the queue was full.
+  int add_messages(int count)
+  {
+    int refused = 0;
+
+    for (int ii = 0; ii < count; ii++)
+    {
+      Message* msg = new Message("CALL_ID", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID, true);
+
+      if (!add(msg))
+      {
+        delete msg;
+        refused++;
+      }
+    }
+
+    return refused;
+  }
+
+  std::vector<Message*> released;
+  bool refuse;
+  uint64_t now;
+
+protected:
+  uint64_t now_ms() { return now; }
+};
+
+TEST(InterimPacerTest, ReleasesAtRate)
+{
+  // 100 a second, in bursts of up to 10.
+  TestInterimPacer pacer(100, 1000);
+  pacer.add_messages(50);
+  EXPECT_EQ(50u, pacer.depth());
+
+  pacer.release(pacer.now);
+  EXPECT_EQ(10u, pacer.released.size());
+
+  // Another token every 10ms.
+  EXPECT_EQ(11u, pacer.release(pacer.now));
+  pacer.now += 50;
+  pacer.release(pacer.now);
+  EXPECT_EQ(15u, pacer.released.size());
+
+  // Tokens don't build up beyond the burst size.
+  pacer.now += 10000;
+  pacer.release(pacer.now);
+  EXPECT_EQ(25u, pacer.released.size());
+
+  for (int ii = 0; ii < 25; ii++)
+  {
+    pacer.now += 10;
+    pacer.release(pacer.now);
+  }
+  EXPECT_EQ(50u, pacer.released.size());
+  EXPECT_EQ(0u, pacer.depth());
+}
+
+TEST(InterimPacerTest, RefusesWhenFull)
+{
+  TestInterimPacer pacer(1, 2);
+  EXPECT_EQ(1, pacer.add_messages(3));
+  EXPECT_EQ(0u, pacer.released.size());
+  EXPECT_EQ(2u, pacer.depth());
+}
+
+TEST(InterimPacerTest, RefusedReleaseOfferedAgain)
+{
+  TestInterimPacer pacer(100, 1000);
+  pacer.add_messages(5);
+
+  // The first message is refused, so nothing is released and it waits before
+  // offering it again.
+  pacer.refuse = true;
+  EXPECT_EQ(InterimPacer::RETRY_MS, pacer.release(pacer.now));
+  EXPECT_EQ(5u, pacer.depth());
+
+  // Not offered again too soon.
+  pacer.refuse = false;
+  pacer.now += 1;
+  EXPECT_EQ(InterimPacer::RETRY_MS - 1, pacer.release(pacer.now));
+  EXPECT_EQ(5u, pacer.depth());
+
+  // The refused tokens were given back, so they can all be released.
+  pacer.now += InterimPacer::RETRY_MS;
+  pacer.release(pacer.now);
+  EXPECT_EQ(5u, pacer.released.size());
+  EXPECT_EQ(0u, pacer.depth());
+}
+
+TEST(InterimPacerTest, StopReleasesQueued)
+{
+  TestInterimPacer pacer(1, 100);
+  pacer.add_messages(5);
+  pacer.stop();
+  EXPECT_EQ(5u, pacer.released.size());
+  EXPECT_EQ(0u, pacer.depth());
+}
+
+TEST(InterimPacerTest, PacesOnThread)
+{
+  TestInterimPacer pacer(1000, 100);
+  ASSERT_TRUE(pacer.start());
+  pacer.add_messages(5);
+  pacer.stop();
+  EXPECT_EQ(5u, pacer.released.size());
+}
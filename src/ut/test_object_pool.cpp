@@ -0,0 +1,149 @@
+/**
+ * @file test_object_pool.cpp UTs for the object pool.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "object_pool.hpp"
+
+struct PooledObject
+{
+  PooledObject() : value(0) {}
+  uint64_t value;
+  char padding[64];
+
+  POOLED_ALLOCATION(PooledObject)
+};
+
+struct BiggerPooledObject : public PooledObject
+{
+  char more_padding[64];
+};
+
+TEST(ObjectPoolTest, ReusesMemory)
+{
+  uint64_t live = ObjectPool<PooledObject>::live();
+
+  PooledObject* obj = new PooledObject();
+  EXPECT_EQ(live + 1, ObjectPool<PooledObject>::live());
+  void* first = obj;
+  delete obj; obj = NULL;
+  EXPECT_EQ(live, ObjectPool<PooledObject>::live());
+
+  // The next object gets the same memory.
+  obj = new PooledObject();
+  EXPECT_EQ(first, (void*)obj);
+  EXPECT_EQ(0u, obj->value);
+  delete obj; obj = NULL;
+}
+
+TEST(ObjectPoolTest, SubclassesBypassPool)
+{
+  uint64_t live = ObjectPool<PooledObject>::live();
+  PooledObject* obj = new BiggerPooledObject();
+  EXPECT_EQ(live, ObjectPool<PooledObject>::live());
+  delete (BiggerPooledObject*)obj; obj = NULL;
+}
+
+TEST(ObjectPoolTest, ThreadCacheIsBounded)
+{
+  std::vector<PooledObject*> objs;
+
+  for (int ii = 0; ii < 1000; ii++)
+  {
+    objs.push_back(new PooledObject());
+  }
+
+  for (size_t ii = 0; ii < objs.size(); ii++)
+  {
+    delete objs[ii];
+  }
+
+  EXPECT_LE(ObjectPool<PooledObject>::cached(),
+            ObjectPool<PooledObject>::MAX_CACHED);
+}
+
+static void* free_objects(void* arg)
+{
+  std::vector<PooledObject*>* objs = (std::vector<PooledObject*>*)arg;
+
+  for (size_t ii = 0; ii < objs->size(); ii++)
+  {
+    delete (*objs)[ii];
+  }
+
+  return NULL;
+}
+
+TEST(ObjectPoolTest, FreedOnAnotherThread)
+{
+  std::vector<PooledObject*> objs;
+  uint64_t live = ObjectPool<PooledObject>::live();
+
+  for (int ii = 0; ii < 200; ii++)
+  {
+    objs.push_back(new PooledObject());
+  }
+
+  // Free the objects on another thread.  They end up on the shared list when
+  // it exits, so can be used by this thread.
+  pthread_t thread;
+  pthread_create(&thread, NULL, free_objects, &objs);
+  pthread_join(thread, NULL);
+  EXPECT_EQ(live, ObjectPool<PooledObject>::live());
+
+  std::vector<PooledObject*> reused;
+  for (int ii = 0; ii < 200; ii++)
+  {
+    reused.push_back(new PooledObject());
+  }
+
+  int matches = 0;
+  for (size_t ii = 0; ii < reused.size(); ii++)
+  {
+    if (std::find(objs.begin(), objs.end(), reused[ii]) != objs.end())
+    {
+      matches++;
+    }
+    delete reused[ii];
+  }
+
+  EXPECT_GT(matches, 0);
+}
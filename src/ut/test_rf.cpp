@@ -35,6 +35,7 @@
  */
 
 #include <stdexcept>
+#include <time.h>
 
 #include "rf.h"
 #include "ralf_transaction.hpp"
@@ -121,6 +122,268 @@ TEST_F(RfTest, CreateMessageTest)
   delete body_doc;
 };
 
+TEST_F(RfTest, CreateMessageGroupedAVPsTest)
+{
+  std::string body = "{\"event\": {\"Accounting-Record-Type\": 2, \"Service-Information\": {\"IMS-Information\": {\"Role-Of-Node\": 1, \"Node-Functionality\": 2, \"Calling-Party-Address\": [\"sip:1@example.com\", \"sip:2@example.com\"]}}}}";
+  rapidjson::Document body_doc;
+  body_doc.Parse<0>(body.c_str());
+  ASSERT_TRUE(body_doc.IsObject());
+
+  // Build the message twice, so the second time uses cached dictionary
+  // entries.
+  for (int ii = 0; ii < 2; ii++)
+  {
+    Rf::AccountingRequest acr(_dict,
+                              _real_stack,
+                              "session-id",
+                              "host.example.com",
+                              "realm.example.com",
+                              3u,
+                              body_doc["event"]);
+    Diameter::Message msg = launder_message(acr);
+
+    Diameter::AVP::iterator service_info =
+      msg.begin(_dict->find_avp("Service-Information"));
+    ASSERT_TRUE(service_info != msg.end());
+
+    Diameter::AVP::iterator ims_info =
+      service_info->begin(_dict->find_avp("IMS-Information"));
+    ASSERT_TRUE(ims_info != service_info->end());
+
+    int count = 0;
+    for (Diameter::AVP::iterator calling =
+           ims_info->begin(_dict->find_avp("Calling-Party-Address"));
+         calling != ims_info->end();
+         ++calling)
+    {
+      count++;
+    }
+    EXPECT_EQ(2, count);
+  }
+};
+
+TEST_F(RfTest, RetargetMessageTest)
+{
+  std::string body = "{\"Accounting-Record-Type\": 2, \"Acct-Interim-Interval\": 300}";
+  rapidjson::Document body_doc;
+  body_doc.Parse<0>(body.c_str());
+  ASSERT_TRUE(body_doc.IsObject());
+
+  Rf::AccountingRequest acr(_dict,
+                            _real_stack,
+                            "session-id",
+                            "host1.example.com",
+                            "realm.example.com",
+                            3u,
+                            body_doc);
+  std::string encoded;
+  ASSERT_TRUE(acr.encode(encoded));
+
+  Diameter::Message* retargeted =
+    Rf::AccountingRequest::retarget(_dict, _real_stack, encoded, "host2.example.com");
+  ASSERT_TRUE(retargeted != NULL);
+  Diameter::Message msg = launder_message(*retargeted);
+
+  Diameter::AVP::iterator dest_host = msg.begin(_dict->DESTINATION_HOST_AVP);
+  ASSERT_TRUE(dest_host != msg.end());
+  EXPECT_EQ("host2.example.com", dest_host->val_str());
+
+  Diameter::AVP::iterator dest_realm = msg.begin(_dict->DESTINATION_REALM_AVP);
+  ASSERT_TRUE(dest_realm != msg.end());
+  EXPECT_EQ("realm.example.com", dest_realm->val_str());
+
+  EXPECT_TRUE(msg.begin(_dict->find_avp("Acct-Interim-Interval")) != msg.end());
+
+  delete retargeted;
+};
+
+TEST_F(RfTest, RetargetKeepsSessionTest)
+{
+  std::string body = "{\"Accounting-Record-Type\": 2, \"Acct-Interim-Interval\": 300}";
+  rapidjson::Document body_doc;
+  body_doc.Parse<0>(body.c_str());
+  ASSERT_TRUE(body_doc.IsObject());
+
+  // No Session-Id, so the ACR is given a new one.  The retargeted ACR must
+  // keep it.
+  Rf::AccountingRequest acr(_dict,
+                            _real_stack,
+                            "",
+                            "host1.example.com",
+                            "realm.example.com",
+                            1u,
+                            body_doc);
+  Diameter::AVP::iterator session_id = acr.begin(_dict->find_avp("Session-Id"));
+  ASSERT_TRUE(session_id != acr.end());
+  std::string encoded;
+  ASSERT_TRUE(acr.encode(encoded));
+
+  std::string encoded_session_id;
+  ASSERT_TRUE(Rf::AccountingRequest::encoded_session_id(encoded, encoded_session_id));
+  EXPECT_EQ(session_id->val_str(), encoded_session_id);
+
+  // Retarget to a host with a longer name, which changes the AVP's padding.
+  Diameter::Message* retargeted =
+    Rf::AccountingRequest::retarget(_dict, _real_stack, encoded, "backup-host.example.com");
+  ASSERT_TRUE(retargeted != NULL);
+  Diameter::Message msg = launder_message(*retargeted);
+
+  Diameter::AVP::iterator new_session_id = msg.begin(_dict->find_avp("Session-Id"));
+  ASSERT_TRUE(new_session_id != msg.end());
+  EXPECT_EQ(session_id->val_str(), new_session_id->val_str());
+
+  Diameter::AVP::iterator dest_host = msg.begin(_dict->DESTINATION_HOST_AVP);
+  ASSERT_TRUE(dest_host != msg.end());
+  EXPECT_EQ("backup-host.example.com", dest_host->val_str());
+
+  Diameter::AVP::iterator dest_realm = msg.begin(_dict->DESTINATION_REALM_AVP);
+  ASSERT_TRUE(dest_realm != msg.end());
+  EXPECT_EQ("realm.example.com", dest_realm->val_str());
+
+  struct msg_hdr* hdr;
+  fd_msg_hdr(msg.fd_msg(), &hdr);
+  EXPECT_TRUE(hdr->msg_flags & CMD_FLAG_RETRANSMIT);
+  EXPECT_EQ(0u, hdr->msg_hbhid);
+
+  delete retargeted;
+};
+
+TEST_F(RfTest, RetargetInvalidEncodingTest)
+{
+  std::string retargeted;
+  EXPECT_FALSE(Rf::AccountingRequest::retarget_encoded("", "host.example.com", retargeted));
+  EXPECT_FALSE(Rf::AccountingRequest::retarget_encoded(std::string(24, '\x01'), "host.example.com", retargeted));
+
+  std::string session_id;
+  EXPECT_FALSE(Rf::AccountingRequest::encoded_session_id("", session_id));
+};
+
+TEST_F(RfTest, UnknownAVPTest)
+{
+  EXPECT_TRUE(_dict->lookup_avp("Accounting-Record-Type") != NULL);
+  EXPECT_EQ(NULL, _dict->lookup_avp("Not-An-AVP"));
+  EXPECT_EQ(NULL, _dict->lookup_avp("Not-An-AVP"));
+  EXPECT_THROW(_dict->find_avp("Not-An-AVP"), Diameter::Stack::Exception);
+
+  // Unknown AVPs, including those in grouped AVPs, are left out of the
+  // message and counted.
+  std::string body = "{\"Accounting-Record-Type\": 2, \"Not-An-AVP\": 1, \"Service-Information\": {\"Not-An-AVP\": \"x\", \"Also-Not-An-AVP\": [1, 2]}}";
+  rapidjson::Document body_doc;
+  body_doc.Parse<0>(body.c_str());
+  ASSERT_TRUE(body_doc.IsObject());
+
+  Rf::AccountingRequest acr(_dict,
+                            _real_stack,
+                            "session-id",
+                            "host.example.com",
+                            "realm.example.com",
+                            3u,
+                            body_doc);
+  Diameter::Message msg = launder_message(acr);
+  EXPECT_TRUE(msg.begin(_dict->find_avp("Service-Information")) != msg.end());
+
+  EXPECT_EQ(2u, _dict->ignored_count("Not-An-AVP"));
+  EXPECT_EQ(1u, _dict->ignored_count("Also-Not-An-AVP"));
+  EXPECT_EQ(0u, _dict->ignored_count("Accounting-Record-Type"));
+};
+
+TEST_F(RfTest, UnknownAVPCacheLimitTest)
+{
+  // Only the first two unknown names are cached.  The rest share a count.
+  Rf::Dictionary* dict = new Rf::Dictionary(NULL, 2);
+  EXPECT_EQ(NULL, dict->lookup_avp_or_ignore("Unknown-1"));
+  EXPECT_EQ(NULL, dict->lookup_avp_or_ignore("Unknown-2"));
+  EXPECT_EQ(NULL, dict->lookup_avp_or_ignore("Unknown-3"));
+  EXPECT_EQ(NULL, dict->lookup_avp_or_ignore("Unknown-4"));
+  EXPECT_EQ(NULL, dict->lookup_avp_or_ignore("Unknown-1"));
+
+  EXPECT_EQ(2u, dict->ignored_count("Unknown-1"));
+  EXPECT_EQ(1u, dict->ignored_count("Unknown-2"));
+  EXPECT_EQ(2u, dict->ignored_count("Unknown-3"));
+  EXPECT_EQ(2u, dict->ignored_count("Unknown-5"));
+
+  // Known AVPs are still cached.
+  EXPECT_TRUE(dict->lookup_avp_or_ignore("Accounting-Record-Type") != NULL);
+  EXPECT_EQ(0u, dict->ignored_count("Accounting-Record-Type"));
+
+  // Nothing to report to without a stats aggregator.
+  dict->report_ignored();
+
+  delete dict;
+};
+
+// Compares the cost of building an ACR with a dictionary search for every AVP
+// against using the cached dictionary entries.  Run with
+// --gtest_also_run_disabled_tests.
+TEST_F(RfTest, DISABLED_CreateMessageBenchmark)
+{
+  std::string body = "{\"Accounting-Record-Type\":1,\"Acct-Interim-Interval\":600,\"Event-Timestamp\":1444118158,\"Service-Information\":{\"IMS-Information\":{\"Event-Type\":{\"SIP-Method\":\"INVITE\"},\"Role-Of-Node\":1,\"Node-Functionality\":2,\"User-Session-Id\":\"084972d9749c214876eb0ba4700ab1fa\",\"Calling-Party-Address\":[\"sip:6515550098@example.com\"],\"Called-Party-Address\":\"sip:6515550026@example.com\",\"Time-Stamps\":{\"SIP-Request-Timestamp\":1444118158,\"SIP-Request-Timestamp-Fraction\":92},\"Inter-Operator-Identifier\":[{\"Originating-IOI\":\"example.com\"}],\"IMS-Charging-Identifier\":\"084972d9749c214876eb0ba4700ab1fa\",\"Server-Capabilities\":{\"Server-Name\":[\"sip:sprout.example.com\"]},\"From-Address\":\"<sip:6515550098@example.com>;tag=d8d2645dea83f80087c5a4b8167e59e1\"}}}";
+  rapidjson::Document contents;
+  contents.Parse<0>(body.c_str());
+  ASSERT_TRUE(contents.IsObject());
+  const int iterations = 10000;
+  struct timespec start;
+  struct timespec end;
+
+  // Old behaviour - search the dictionary for every AVP.
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int ii = 0; ii < iterations; ii++)
+  {
+    Diameter::Message acr(_dict, _dict->ACCOUNTING_REQUEST, _real_stack);
+    acr.add_session_id("session-id");
+    Diameter::Dictionary::AVP dest_host_dict("Destination-Host");
+    Diameter::AVP dest_host_avp(dest_host_dict);
+    acr.add(dest_host_avp.val_str("host.example.com"));
+    Diameter::Dictionary::AVP dest_realm_dict("Destination-Realm");
+    Diameter::AVP dest_realm_avp(dest_realm_dict);
+    acr.add(dest_realm_avp.val_str("realm.example.com"));
+    Diameter::Dictionary::AVP record_number_dict("Accounting-Record-Number");
+    Diameter::AVP record_number_avp(record_number_dict);
+    acr.add(record_number_avp.val_i32(1));
+
+    for (rapidjson::Value::ConstMemberIterator it = contents.MemberBegin();
+         it != contents.MemberEnd();
+         ++it)
+    {
+      if (it->value.IsArray())
+      {
+        for (rapidjson::Value::ConstValueIterator array_iter = it->value.Begin();
+             array_iter != it->value.End();
+             ++array_iter)
+        {
+          Diameter::Dictionary::AVP new_dict(Rf::VENDORS, it->name.GetString());
+          Diameter::AVP avp(new_dict);
+          acr.add(avp.val_json(Rf::VENDORS, new_dict, *array_iter));
+        }
+      }
+      else
+      {
+        Diameter::Dictionary::AVP new_dict(Rf::VENDORS, it->name.GetString());
+        Diameter::AVP avp(new_dict);
+        acr.add(avp.val_json(Rf::VENDORS, new_dict, it->value));
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Uncached dictionary: %ld ns/ACR\n",
+         ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / iterations);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int ii = 0; ii < iterations; ii++)
+  {
+    Rf::AccountingRequest acr(_dict,
+                              _real_stack,
+                              "session-id",
+                              "host.example.com",
+                              "realm.example.com",
+                              1u,
+                              contents);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Cached dictionary:   %ld ns/ACR\n",
+         ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / iterations);
+};
+
 TEST_F(RfTest, DISABLED_SuccessTransactionTest)
 {
   Diameter::Stack* diameter_stack = Diameter::Stack::get_instance();
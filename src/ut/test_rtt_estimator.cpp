@@ -0,0 +1,110 @@
+/**
+ * @file test_rtt_estimator.cpp UTs for the CCF round trip time estimator.
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "rtt_estimator.hpp"
+
+class RttEstimatorTest : public ::testing::Test
+{
+public:
+  RttEstimatorTest() : _rtt(20, 2000) {}
+
+  RttEstimator _rtt;
+};
+
+TEST_F(RttEstimatorTest, MaxTimeoutWithoutSamples)
+{
+  EXPECT_EQ(2000u, _rtt.timeout_ms("ccf1"));
+
+  // Timeouts don't change this.
+  _rtt.timed_out("ccf1");
+  EXPECT_EQ(2000u, _rtt.timeout_ms("ccf1"));
+}
+
+TEST_F(RttEstimatorTest, FirstSample)
+{
+  _rtt.sample("ccf1", 10000);
+  EXPECT_EQ(10000u, _rtt.srtt_us("ccf1"));
+  EXPECT_EQ(5000u, _rtt.rttvar_us("ccf1"));
+
+  // 10ms + 4 * 5ms.
+  EXPECT_EQ(30u, _rtt.timeout_ms("ccf1"));
+
+  // Other CCFs are unaffected.
+  EXPECT_EQ(2000u, _rtt.timeout_ms("ccf2"));
+}
+
+TEST_F(RttEstimatorTest, SteadyRttConverges)
+{
+  for (int ii = 0; ii < 100; ii++)
+  {
+    _rtt.sample("ccf1", 4000);
+  }
+
+  EXPECT_EQ(4000u, _rtt.srtt_us("ccf1"));
+  EXPECT_EQ(0u, _rtt.rttvar_us("ccf1"));
+
+  // 4ms + 1ms is below the minimum.
+  EXPECT_EQ(20u, _rtt.timeout_ms("ccf1"));
+}
+
+TEST_F(RttEstimatorTest, SmoothsSamples)
+{
+  _rtt.sample("ccf1", 80000);
+  _rtt.sample("ccf1", 160000);
+
+  // srtt = 7/8 * 80ms + 1/8 * 160ms, rttvar = 3/4 * 40ms + 1/4 * 80ms.
+  EXPECT_EQ(90000u, _rtt.srtt_us("ccf1"));
+  EXPECT_EQ(50000u, _rtt.rttvar_us("ccf1"));
+  EXPECT_EQ(290u, _rtt.timeout_ms("ccf1"));
+}
+
+TEST_F(RttEstimatorTest, TimeoutsBackOff)
+{
+  _rtt.sample("ccf1", 200000);
+  EXPECT_EQ(600u, _rtt.timeout_ms("ccf1"));
+
+  _rtt.timed_out("ccf1");
+  EXPECT_EQ(1200u, _rtt.timeout_ms("ccf1"));
+  _rtt.timed_out("ccf1");
+  EXPECT_EQ(2000u, _rtt.timeout_ms("ccf1"));
+
+  // An answer ends the backoff.
+  _rtt.sample("ccf1", 200000);
+  EXPECT_EQ(500u, _rtt.timeout_ms("ccf1"));
+}
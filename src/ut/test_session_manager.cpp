@@ -34,10 +34,14 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <unistd.h>
+#include <atomic>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
 #include "localstore.h"
+#include "mock_store.h"
 #include "session_store.h"
 #include "session_manager.hpp"
 #include "mock_chronos_connection.h"
@@ -45,6 +49,13 @@
 
 #include "peer_message_sender.hpp"
 #include "peer_message_sender_factory.hpp"
+#include "ccf_response_pool.hpp"
+#include "task_pool.hpp"
+#include "async_timer_client.hpp"
+#include "session_replicator.hpp"
+
+using ::testing::_;
+using ::testing::InvokeWithoutArgs;
 
 const SAS::TrailId FAKE_TRAIL_ID = 0;
 const std::string BILLING_REALM = "billing.example.com";
@@ -179,6 +190,423 @@ TEST_F(SessionManagerTest, SimpleTest)
   delete memstore;
 }
 
+// Checks that CCF answers handed to the response pool are processed on its
+// threads.
+TEST_F(SessionManagerTest, ResponsePoolTest)
+{
+  LocalStore* memstore = new LocalStore();
+  SessionStore* store = new SessionStore(memstore);
+  DummyPeerMessageSenderFactory* factory = new DummyPeerMessageSenderFactory(BILLING_REALM);
+  MockChronosConnection* fake_chronos = new MockChronosConnection("http://localhost:1234");
+  fake_chronos->accept_all_requests();
+  HealthChecker* hc = new HealthChecker();
+  SessionManager* mgr = new SessionManager(store, {}, _dict, factory, fake_chronos, _diameter_stack, hc);
+  CcfResponsePool* pool = new CcfResponsePool(mgr, 2, 100, NULL, NULL);
+  ASSERT_TRUE(pool->start());
+  mgr->set_response_pool(pool);
+  SessionStore::Session* sess = NULL;
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+
+  // The START's answer is queued to the pool.  Wait for the pool to drain
+  // before checking the session was stored.
+  mgr->handle(start_msg);
+  pool->stop();
+  pool->join();
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(1u, sess->acct_record_number);
+  delete sess;
+  sess = NULL;
+
+  delete pool;
+  delete mgr;
+  delete factory;
+  delete hc;
+  delete fake_chronos;
+  delete store;
+  delete memstore;
+}
+
+// Checks that a CCF answer is processed straight away if the response pool's
+// queue is full.
+TEST_F(SessionManagerTest, ResponsePoolOverflowTest)
+{
+  LocalStore* memstore = new LocalStore();
+  SessionStore* store = new SessionStore(memstore);
+  DummyPeerMessageSenderFactory* factory = new DummyPeerMessageSenderFactory(BILLING_REALM);
+  MockChronosConnection* fake_chronos = new MockChronosConnection("http://localhost:1234");
+  fake_chronos->accept_all_requests();
+  HealthChecker* hc = new HealthChecker();
+  SessionManager* mgr = new SessionManager(store, {}, _dict, factory, fake_chronos, _diameter_stack, hc);
+
+  // Don't start the pool, so its queue, which has room for two answers,
+  // fills up.
+  CcfResponsePool* pool = new CcfResponsePool(mgr, 1, 2, NULL, NULL);
+  mgr->set_response_pool(pool);
+  SessionStore::Session* sess = NULL;
+
+  std::string call_ids[] = {"CALL_ID_ONE", "CALL_ID_TWO", "CALL_ID_THREE"};
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    Message* start_msg = new Message(call_ids[ii], ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+    start_msg->ccfs.push_back("10.0.0.1");
+    mgr->handle(start_msg);
+  }
+
+  // The first two answers are queued, and the third is processed inline.
+  EXPECT_EQ(2u, pool->queue_depth());
+  EXPECT_EQ(1u, pool->overflows());
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  EXPECT_EQ(NULL, sess);
+  sess = store->get_session_data("CALL_ID_THREE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(1u, sess->acct_record_number);
+  delete sess; sess = NULL;
+
+  // The queued answers are processed once the pool runs.
+  ASSERT_TRUE(pool->start());
+  pool->stop();
+  pool->join();
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  delete sess; sess = NULL;
+
+  delete pool;
+  delete mgr;
+  delete factory;
+  delete hc;
+  delete fake_chronos;
+  delete store;
+  delete memstore;
+}
+
+// Checks that a START's timer is created on the task pool, and its ID filled
+// in once the session has been written.
+TEST_F(SessionManagerTest, TaskPoolTest)
+{
+  LocalStore* memstore = new LocalStore();
+  SessionStore* store = new SessionStore(memstore);
+  DummyPeerMessageSenderFactory* factory = new DummyPeerMessageSenderFactory(BILLING_REALM);
+  MockChronosConnection* fake_chronos = new MockChronosConnection("http://localhost:1234");
+  fake_chronos->accept_all_requests();
+  HealthChecker* hc = new HealthChecker();
+  SessionManager* mgr = new SessionManager(store, {}, _dict, factory, fake_chronos, _diameter_stack, hc);
+  TaskPool* pool = new TaskPool(1, 100, NULL, NULL);
+  ASSERT_TRUE(pool->start());
+  mgr->set_task_pool(pool);
+  SessionStore::Session* sess = NULL;
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+
+  // START should put a session in the store, with the timer ID from Chronos.
+  mgr->handle(start_msg);
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(1u, sess->acct_record_number);
+  EXPECT_EQ("TIMER_ID", sess->timer_id);
+  delete sess;
+  sess = NULL;
+
+  pool->stop();
+  pool->join();
+
+  delete pool;
+  delete mgr;
+  delete factory;
+  delete hc;
+  delete fake_chronos;
+  delete store;
+  delete memstore;
+}
+
+// Checks that a START's timer ID is stored once the asynchronous timer client
+// has created the timer.
+TEST_F(SessionManagerTest, TimerClientTest)
+{
+  LocalStore* memstore = new LocalStore();
+  SessionStore* store = new SessionStore(memstore);
+  DummyPeerMessageSenderFactory* factory = new DummyPeerMessageSenderFactory(BILLING_REALM);
+  MockChronosConnection* fake_chronos = new MockChronosConnection("http://localhost:1234");
+  fake_chronos->accept_all_requests();
+  HealthChecker* hc = new HealthChecker();
+  SessionManager* mgr = new SessionManager(store, {}, _dict, factory, fake_chronos, _diameter_stack, hc);
+  AsyncTimerClient* client = new AsyncTimerClient(fake_chronos, 1, 100, NULL, NULL);
+  ASSERT_TRUE(client->start());
+  mgr->set_timer_client(client);
+  SessionStore::Session* sess = NULL;
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+
+  // START should put a session in the store.  Wait for the POST to Chronos
+  // before checking its timer ID.
+  mgr->handle(start_msg);
+  client->stop();
+  client->join();
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(1u, sess->acct_record_number);
+  EXPECT_EQ("TIMER_ID", sess->timer_id);
+  delete sess;
+  sess = NULL;
+
+  delete client;
+  delete mgr;
+  delete factory;
+  delete hc;
+  delete fake_chronos;
+  delete store;
+  delete memstore;
+}
+
+// Checks that an INTERIM arriving before the START's timer ID has been stored
+// doesn't create a second timer, and doesn't stop the START's timer ID being
+// stored.
+TEST_F(SessionManagerTest, InterimBeforeTimerIDTest)
+{
+  LocalStore* memstore = new LocalStore();
+  SessionStore* store = new SessionStore(memstore);
+  DummyPeerMessageSenderFactory* factory = new DummyPeerMessageSenderFactory(BILLING_REALM);
+  MockChronosConnection* fake_chronos = new MockChronosConnection("http://localhost:1234");
+  fake_chronos->accept_all_requests();
+  HealthChecker* hc = new HealthChecker();
+  SessionManager* mgr = new SessionManager(store, {}, _dict, factory, fake_chronos, _diameter_stack, hc);
+  AsyncTimerClient* client = new AsyncTimerClient(fake_chronos, 1, 100, NULL, NULL);
+  mgr->set_timer_client(client);
+  SessionStore::Session* sess = NULL;
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+  Message* interim_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 300, FAKE_TRAIL_ID);
+
+  // Only the START's timer should be created, and the INTERIM shouldn't try
+  // to update it.
+  EXPECT_CALL(*fake_chronos, send_post(_, _, _, _, _, _, _)).Times(1);
+  EXPECT_CALL(*fake_chronos, send_put(_, _, _, _, _, _, _)).Times(0);
+
+  // The timer client isn't started yet, so the START's POST stays queued
+  // while the INTERIM is handled.
+  mgr->handle(start_msg);
+  mgr->handle(interim_msg);
+
+  // Until then, the session is stored without a timer, and with when to stop
+  // waiting for it.
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ("NO_TIMER", sess->timer_id);
+  EXPECT_LT((uint32_t)time(NULL), sess->timer_pending_until);
+  delete sess;
+  sess = NULL;
+
+  ASSERT_TRUE(client->start());
+  client->stop();
+  client->join();
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(2u, sess->acct_record_number);
+  EXPECT_EQ("TIMER_ID", sess->timer_id);
+  EXPECT_EQ(0u, sess->timer_pending_until);
+  delete sess;
+  sess = NULL;
+
+  delete client;
+  delete mgr;
+  delete factory;
+  delete hc;
+  delete fake_chronos;
+  delete store;
+  delete memstore;
+}
+
+// Checks that if a START never stored its timer ID (for example because Ralf
+// restarted), a later INTERIM stops waiting for it and creates a new timer.
+TEST_F(SessionManagerTest, StalePendingTimerTest)
+{
+  LocalStore* memstore = new LocalStore();
+  SessionStore* store = new SessionStore(memstore);
+  DummyPeerMessageSenderFactory* factory = new DummyPeerMessageSenderFactory(BILLING_REALM);
+  MockChronosConnection* fake_chronos = new MockChronosConnection("http://localhost:1234");
+  fake_chronos->accept_all_requests();
+  HealthChecker* hc = new HealthChecker();
+  SessionManager* mgr = new SessionManager(store, {}, _dict, factory, fake_chronos, _diameter_stack, hc);
+  SessionStore::Session* sess = new SessionStore::Session();
+
+  sess->session_id = "test_session_id";
+  sess->ccf.push_back("10.0.0.1");
+  sess->acct_record_number = 1;
+  sess->timer_id = "NO_TIMER";
+  sess->session_refresh_time = 300;
+  sess->interim_interval = 100;
+  sess->timer_pending_until = (uint32_t)time(NULL) - 1;
+  store->set_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL_ID);
+  delete sess;
+  sess = NULL;
+
+  Message* interim_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID);
+
+  EXPECT_CALL(*fake_chronos, send_post(_, _, _, _, _, _, _)).Times(1);
+  EXPECT_CALL(*fake_chronos, send_put(_, _, _, _, _, _, _)).Times(0);
+
+  mgr->handle(interim_msg);
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(2u, sess->acct_record_number);
+  EXPECT_EQ("TIMER_ID", sess->timer_id);
+  EXPECT_EQ(0u, sess->timer_pending_until);
+  delete sess;
+  sess = NULL;
+
+  delete mgr;
+  delete factory;
+  delete hc;
+  delete fake_chronos;
+  delete store;
+  delete memstore;
+}
+
+// Checks that lazy timer updates only update the timer when its interval
+// changes or it's about to stop popping.
+TEST_F(SessionManagerTest, LazyTimerUpdateTest)
+{
+  LocalStore* memstore = new LocalStore();
+  SessionStore* store = new SessionStore(memstore);
+  DummyPeerMessageSenderFactory* factory = new DummyPeerMessageSenderFactory(BILLING_REALM);
+  MockChronosConnection* fake_chronos = new MockChronosConnection("http://localhost:1234");
+  fake_chronos->accept_all_requests();
+  HealthChecker* hc = new HealthChecker();
+  SessionManager* mgr = new SessionManager(store, {}, _dict, factory, fake_chronos, _diameter_stack, hc);
+  mgr->set_lazy_timer_updates(true);
+  SessionStore::Session* sess = NULL;
+  uint32_t now = (uint32_t)time(NULL);
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+  Message* interim_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID);
+  Message* changed_interim_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID);
+  Message* timer_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID, true);
+
+  // START should store the timer's schedule.
+  mgr->handle(start_msg);
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ("TIMER_ID", sess->timer_id);
+  EXPECT_EQ(100u, sess->timer_interval);
+  EXPECT_LE(now + 300, sess->timer_expiry);
+  EXPECT_EQ(sess->timer_expiry, sess->session_expiry);
+
+  // An INTERIM from Sprout that doesn't change the interval only refreshes
+  // the session, while the timer has plenty of pops left.
+  sess->timer_expiry = now + 250;
+  store->set_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL_ID);
+  delete sess; sess = NULL;
+
+  mgr->handle(interim_msg);
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(now + 250, sess->timer_expiry);
+  EXPECT_LE(now + 300, sess->session_expiry);
+
+  // If the interval has changed, the timer is updated.
+  sess->timer_interval = 50;
+  store->set_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL_ID);
+  delete sess; sess = NULL;
+
+  mgr->handle(changed_interim_msg);
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(100u, sess->timer_interval);
+  EXPECT_LE(now + 300, sess->timer_expiry);
+
+  // A timer pop when the timer is about to stop extends it to the session's
+  // expiry.
+  sess->timer_expiry = now + 150;
+  sess->session_expiry = now + 400;
+  store->set_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL_ID);
+  delete sess; sess = NULL;
+
+  mgr->handle(timer_msg);
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(now + 400, sess->timer_expiry);
+  delete sess; sess = NULL;
+
+  delete mgr;
+  delete factory;
+  delete hc;
+  delete fake_chronos;
+  delete store;
+  delete memstore;
+}
+
+TEST_F(SessionManagerTest, TimerJitterTest)
+{
+  LocalStore* memstore = new LocalStore();
+  SessionStore* store = new SessionStore(memstore);
+  DummyPeerMessageSenderFactory* factory = new DummyPeerMessageSenderFactory(BILLING_REALM);
+  MockChronosConnection* fake_chronos = new MockChronosConnection("http://localhost:1234");
+  fake_chronos->accept_all_requests();
+  HealthChecker* hc = new HealthChecker();
+  SessionManager* mgr = new SessionManager(store, {}, _dict, factory, fake_chronos, _diameter_stack, hc);
+  mgr->set_lazy_timer_updates(true);
+  mgr->set_timer_jitter(20);
+  SessionStore::Session* sess = NULL;
+  uint32_t now = (uint32_t)time(NULL);
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+  Message* interim_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID);
+
+  // The timer pops up to 20% of the CCF's interval early.
+  mgr->handle(start_msg);
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(100u, sess->interim_interval);
+  EXPECT_LE(80u, sess->timer_interval);
+  EXPECT_GE(100u, sess->timer_interval);
+
+  // The jitter comes from a fixed hash of the session key, so every node
+  // works out the same interval whatever it was built with.
+  EXPECT_EQ(99u, sess->timer_interval);
+  uint32_t timer_interval = sess->timer_interval;
+
+  // The jitter is the same every time, so an INTERIM from Sprout doesn't
+  // look like it changes the interval, and the timer isn't updated.
+  sess->timer_expiry = now + 250;
+  store->set_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL_ID);
+  delete sess; sess = NULL;
+
+  mgr->handle(interim_msg);
+
+  sess = store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(timer_interval, sess->timer_interval);
+  EXPECT_EQ(now + 250, sess->timer_expiry);
+  delete sess; sess = NULL;
+
+  delete mgr;
+  delete factory;
+  delete hc;
+  delete fake_chronos;
+  delete store;
+  delete memstore;
+}
+
 TEST_F(SessionManagerTest, TimerIDTest)
 {
   LocalStore* memstore = new LocalStore();
@@ -738,6 +1166,59 @@ TEST_F(SessionManagerGRTest, SimpleTest)
   ASSERT_EQ(NULL, sess);
 }
 
+// With replicators, the remote stores are written when the replicators write
+// their queued changes rather than while each request is processed.
+TEST_F(SessionManagerGRTest, ReplicatorsTest)
+{
+  SessionReplicator* replicator1 = new SessionReplicator(_remote_store1, "site1", 100, 10000);
+  SessionReplicator* replicator2 = new SessionReplicator(_remote_store2, "site2", 100, 10000);
+  _mgr->set_replicators({replicator1, replicator2});
+  SessionStore::Session* sess = NULL;
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+  Message* interim_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID);
+  Message* stop_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(4), 0, FAKE_TRAIL_ID);
+
+  // The START and INTERIM are only written to the local store at first, and
+  // then both are written to the remote stores together.
+  _mgr->handle(start_msg);
+  _mgr->handle(interim_msg);
+
+  sess = _remote_store1->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_EQ(NULL, sess);
+  EXPECT_EQ(1u, replicator1->depth());
+  EXPECT_EQ(1u, replicator2->depth());
+
+  replicator1->write_batch();
+  replicator2->write_batch();
+
+  sess = _remote_store1->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(2u, sess->acct_record_number);
+  delete sess; sess = NULL;
+
+  sess = _remote_store2->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(2u, sess->acct_record_number);
+  delete sess; sess = NULL;
+
+  // STOP is replicated too.
+  _mgr->handle(stop_msg);
+  replicator1->write_batch();
+  replicator2->write_batch();
+
+  sess = _remote_store1->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_EQ(NULL, sess);
+
+  sess = _remote_store2->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_EQ(NULL, sess);
+
+  _mgr->set_replicators({});
+  delete replicator1; replicator1 = NULL;
+  delete replicator2; replicator2 = NULL;
+}
+
 TEST_F(SessionManagerGRTest, InterimUnknownTest)
 {
   DummyUnknownErrorPeerMessageSenderFactory* fail_factory = new DummyUnknownErrorPeerMessageSenderFactory(BILLING_REALM);
@@ -832,3 +1313,79 @@ TEST_F(SessionManagerGRTest, EmptyLocalTest)
   EXPECT_EQ(2u, sess->acct_record_number);
   delete sess; sess = NULL;
 }
+
+// With a task pool, the remote stores are queried in parallel, and the session
+// is used from whichever has it.
+TEST_F(SessionManagerGRTest, ParallelLookupTest)
+{
+  TaskPool* pool = new TaskPool(2, 100, NULL, NULL);
+  ASSERT_TRUE(pool->start());
+  _mgr->set_task_pool(pool);
+  SessionStore::Session* sess = NULL;
+
+  Message* start_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(2), 300, FAKE_TRAIL_ID);
+  start_msg->ccfs.push_back("10.0.0.1");
+  Message* interim_msg = new Message("CALL_ID_ONE", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 0, FAKE_TRAIL_ID);
+
+  // START should put a session in all the stores.
+  _mgr->handle(start_msg);
+
+  // Leave the session in the second remote store only.
+  _local_store->delete_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  _remote_store1->delete_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+
+  // INTERIM should find it, and put it back in the local store.
+  _mgr->handle(interim_msg);
+
+  sess = _local_store->get_session_data("CALL_ID_ONE", ORIGINATING, SCSCF, FAKE_TRAIL_ID);
+  ASSERT_NE((SessionStore::Session*)NULL, sess);
+  EXPECT_EQ(2u, sess->acct_record_number);
+  delete sess; sess = NULL;
+
+  _mgr->set_task_pool(NULL);
+  pool->stop();
+  pool->join();
+  delete pool; pool = NULL;
+}
+
+// A remote store that doesn't answer within the timeout is ignored.
+TEST_F(SessionManagerGRTest, ParallelLookupTimeoutTest)
+{
+  MockStore slow_memstore;
+  SessionStore* slow_store = new SessionStore(&slow_memstore);
+  std::atomic<bool> answered(false);
+  EXPECT_CALL(slow_memstore, get_data(_, _, _, _, _))
+    .WillRepeatedly(InvokeWithoutArgs([&answered]()
+                                      {
+                                        usleep(200000);
+                                        answered = true;
+                                        return Store::NOT_FOUND;
+                                      }));
+
+  SessionManager* mgr = new SessionManager(_local_store,
+                                           {slow_store},
+                                           _dict,
+                                           _factory,
+                                           _fake_chronos,
+                                           _diameter_stack,
+                                           _hc);
+  TaskPool* pool = new TaskPool(1, 100, NULL, NULL);
+  ASSERT_TRUE(pool->start());
+  mgr->set_task_pool(pool);
+  mgr->set_remote_lookup_timeout(10);
+
+  // The INTERIM is for an unknown session, so is ignored without waiting for
+  // the slow store.
+  Message* interim_msg = new Message("CALL_ID_TWO", ORIGINATING, SCSCF, NULL, Rf::AccountingRecordType(3), 300, FAKE_TRAIL_ID);
+  mgr->handle(interim_msg);
+  EXPECT_FALSE(answered);
+
+  // Its answer is ignored when it does arrive.
+  pool->stop();
+  pool->join();
+  EXPECT_TRUE(answered);
+
+  delete pool; pool = NULL;
+  delete mgr; mgr = NULL;
+  delete slow_store; slow_store = NULL;
+}
@@ -0,0 +1,299 @@
+/**
+ * @file test_session_replicator.cpp UT for session replication
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "localstore.h"
+#include "session_replicator.hpp"
+
+static const SAS::TrailId FAKE_TRAIL = 0;
+
+// Local store that counts reads.
+class CountingStore : public LocalStore
+{
+public:
+  CountingStore() : reads(0) {}
+
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail = 0)
+  {
+    reads++;
+    return LocalStore::get_data(table, key, data, cas, trail);
+  }
+
+  int reads;
+};
+
+// Replicator whose clock is controlled by the test.
+class TestSessionReplicator : public SessionReplicator
+{
+public:
+  TestSessionReplicator(SessionStore* store, size_t max_queue, uint64_t max_lag_ms) :
+    SessionReplicator(store, "remote", max_queue, max_lag_ms),
+    now(1000000)
+  {}
+
+  uint64_t now;
+
+protected:
+  uint64_t now_ms() { return now; }
+};
+
+class SessionReplicatorTest : public ::testing::Test
+{
+public:
+  SessionReplicatorTest()
+  {
+    _memstore = new CountingStore();
+
+    SessionStore::SerializerDeserializer* serializer =
+      new SessionStore::CompactSerializerDeserializer();
+    std::vector<SessionStore::SerializerDeserializer*> deserializers = {
+      new SessionStore::CompactSerializerDeserializer()
+    };
+
+    _store = new SessionStore(_memstore, serializer, deserializers);
+  }
+
+  virtual ~SessionReplicatorTest()
+  {
+    delete _store; _store = NULL;
+    delete _memstore; _memstore = NULL;
+  }
+
+  SessionStore::Session* make_session(uint32_t acct_record_number)
+  {
+    SessionStore::Session* sess = new SessionStore::Session();
+    sess->session_id = "session_id";
+    sess->ccf.push_back("ccf1");
+    sess->acct_record_number = acct_record_number;
+    sess->timer_id = "timer_id";
+    sess->session_refresh_time = 300;
+    sess->interim_interval = 100;
+    return sess;
+  }
+
+  CountingStore* _memstore;
+  SessionStore* _store;
+};
+
+TEST_F(SessionReplicatorTest, WritesNewSession)
+{
+  TestSessionReplicator replicator(_store, 100, 1000);
+  SessionStore::Session* sess = make_session(1);
+  replicator.replicate("call-1", ORIGINATING, SCSCF, sess, true, FAKE_TRAIL);
+  delete sess; sess = NULL;
+
+  // Nothing is written until the batch is.
+  EXPECT_EQ(1u, replicator.depth());
+  EXPECT_EQ(NULL, _store->get_session_data("call-1", ORIGINATING, SCSCF, FAKE_TRAIL));
+
+  // A new session is written without being read first.
+  _memstore->reads = 0;
+  EXPECT_EQ(1u, replicator.write_batch());
+  EXPECT_EQ(0u, replicator.depth());
+  EXPECT_EQ(0, _memstore->reads);
+
+  sess = _store->get_session_data("call-1", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(sess != NULL);
+  EXPECT_EQ("session_id", sess->session_id);
+  EXPECT_EQ(1u, sess->acct_record_number);
+  EXPECT_EQ("timer_id", sess->timer_id);
+  delete sess; sess = NULL;
+}
+
+TEST_F(SessionReplicatorTest, CoalescesChanges)
+{
+  TestSessionReplicator replicator(_store, 100, 1000);
+
+  for (uint32_t ii = 1; ii <= 5; ii++)
+  {
+    SessionStore::Session* sess = make_session(ii);
+    replicator.replicate("call-1", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL);
+    delete sess; sess = NULL;
+  }
+
+  // A different role or function is a different session.
+  SessionStore::Session* sess = make_session(1);
+  replicator.replicate("call-1", TERMINATING, SCSCF, sess, false, FAKE_TRAIL);
+  delete sess; sess = NULL;
+
+  EXPECT_EQ(2u, replicator.depth());
+  EXPECT_EQ(2u, replicator.write_batch());
+
+  sess = _store->get_session_data("call-1", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(sess != NULL);
+  EXPECT_EQ(5u, sess->acct_record_number);
+  delete sess; sess = NULL;
+
+  // A delete replaces a queued write.
+  sess = make_session(6);
+  replicator.replicate("call-1", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL);
+  delete sess; sess = NULL;
+  replicator.replicate_delete("call-1", ORIGINATING, SCSCF, FAKE_TRAIL);
+  EXPECT_EQ(1u, replicator.write_batch());
+  EXPECT_EQ(NULL, _store->get_session_data("call-1", ORIGINATING, SCSCF, FAKE_TRAIL));
+}
+
+TEST_F(SessionReplicatorTest, KeepsHigherRecordNumber)
+{
+  // The remote site has moved on further than this one.
+  SessionStore::Session* sess = make_session(10);
+  _store->set_session_data("call-1", ORIGINATING, SCSCF, sess, true, FAKE_TRAIL);
+  delete sess; sess = NULL;
+
+  TestSessionReplicator replicator(_store, 100, 1000);
+  sess = make_session(4);
+  sess->timer_id = "new_timer_id";
+  replicator.replicate("call-1", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL);
+  delete sess; sess = NULL;
+  replicator.write_batch();
+
+  sess = _store->get_session_data("call-1", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(sess != NULL);
+  EXPECT_EQ(10u, sess->acct_record_number);
+  EXPECT_EQ("new_timer_id", sess->timer_id);
+  delete sess; sess = NULL;
+}
+
+TEST_F(SessionReplicatorTest, NewSessionMergedIfAlreadyThere)
+{
+  // The remote site has already created the session.
+  SessionStore::Session* sess = make_session(10);
+  _store->set_session_data("call-1", ORIGINATING, SCSCF, sess, true, FAKE_TRAIL);
+  delete sess; sess = NULL;
+
+  // Adding the session fails, so it's read and merged instead.
+  TestSessionReplicator replicator(_store, 100, 1000);
+  sess = make_session(1);
+  sess->timer_id = "new_timer_id";
+  replicator.replicate("call-1", ORIGINATING, SCSCF, sess, true, FAKE_TRAIL);
+  delete sess; sess = NULL;
+  replicator.write_batch();
+
+  sess = _store->get_session_data("call-1", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(sess != NULL);
+  EXPECT_EQ(10u, sess->acct_record_number);
+  EXPECT_EQ("new_timer_id", sess->timer_id);
+  delete sess; sess = NULL;
+}
+
+TEST_F(SessionReplicatorTest, BoundsLag)
+{
+  TestSessionReplicator replicator(_store, 2, 1000);
+  SessionStore::Session* sess = make_session(1);
+  replicator.replicate("call-1", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL);
+  replicator.replicate("call-2", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL);
+
+  // The queue is full, so changes to new sessions are dropped, but changes to
+  // queued sessions aren't.
+  replicator.replicate("call-3", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL);
+  replicator.replicate("call-2", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL);
+  EXPECT_EQ(2u, replicator.depth());
+
+  // Changes that have been queued for too long are dropped.
+  replicator.now += 1001;
+  replicator.replicate("call-2", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL);
+  delete sess; sess = NULL;
+  EXPECT_EQ(2u, replicator.write_batch());
+
+  EXPECT_EQ(NULL, _store->get_session_data("call-1", ORIGINATING, SCSCF, FAKE_TRAIL));
+  EXPECT_EQ(NULL, _store->get_session_data("call-2", ORIGINATING, SCSCF, FAKE_TRAIL));
+  EXPECT_EQ(NULL, _store->get_session_data("call-3", ORIGINATING, SCSCF, FAKE_TRAIL));
+}
+
+TEST_F(SessionReplicatorTest, WritesInBatches)
+{
+  TestSessionReplicator replicator(_store, 1000, 1000);
+  SessionStore::Session* sess = make_session(1);
+
+  for (int ii = 0; ii < 150; ii++)
+  {
+    replicator.replicate("call-" + std::to_string(ii), ORIGINATING, SCSCF, sess, false, FAKE_TRAIL);
+  }
+
+  delete sess; sess = NULL;
+
+  EXPECT_EQ(SessionReplicator::MAX_BATCH, replicator.write_batch());
+  EXPECT_EQ(50u, replicator.write_batch());
+  EXPECT_EQ(0u, replicator.write_batch());
+}
+
+TEST_F(SessionReplicatorTest, WritersShareBatches)
+{
+  SessionReplicator replicator(_store, "remote", 1000, 10000, NULL, 4);
+  replicator.start();
+
+  SessionStore::Session* sess = make_session(1);
+
+  for (int ii = 0; ii < 150; ii++)
+  {
+    replicator.replicate("call-" + std::to_string(ii), ORIGINATING, SCSCF, sess, true, FAKE_TRAIL);
+  }
+
+  delete sess; sess = NULL;
+  replicator.stop();
+  EXPECT_EQ(0u, replicator.depth());
+
+  for (int ii = 0; ii < 150; ii++)
+  {
+    sess = _store->get_session_data("call-" + std::to_string(ii), ORIGINATING, SCSCF, FAKE_TRAIL);
+    ASSERT_TRUE(sess != NULL);
+    delete sess; sess = NULL;
+  }
+}
+
+TEST_F(SessionReplicatorTest, ThreadWritesQueued)
+{
+  SessionReplicator replicator(_store, "remote", 100, 10000);
+  replicator.start();
+
+  SessionStore::Session* sess = make_session(1);
+  replicator.replicate("call-1", ORIGINATING, SCSCF, sess, false, FAKE_TRAIL);
+  delete sess; sess = NULL;
+
+  // Anything still queued is written when the replicator stops.
+  replicator.stop();
+  EXPECT_EQ(0u, replicator.depth());
+
+  sess = _store->get_session_data("call-1", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(sess != NULL);
+  delete sess; sess = NULL;
+}
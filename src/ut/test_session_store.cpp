@@ -34,18 +34,24 @@
  * as those licenses appear in the file LICENSE-OPENSSL.
  */
 
+#include <time.h>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 
 #include "localstore.h"
 #include "session_store.h"
+#include "session_cache.hpp"
 
 #include "mock_store.h"
 
 using ::testing::_;
+using ::testing::ByRef;
 using ::testing::DoAll;
 using ::testing::Return;
+using ::testing::SaveArg;
 using ::testing::SetArgReferee;
+using ::testing::StartsWith;
 
 static const SAS::TrailId FAKE_TRAIL = 0;
 
@@ -56,7 +62,8 @@ static const SAS::TrailId FAKE_TRAIL = 0;
 /// The types of (de)serializer that we want to test.
 typedef ::testing::Types<
   SessionStore::BinarySerializerDeserializer,
-  SessionStore::JsonSerializerDeserializer
+  SessionStore::JsonSerializerDeserializer,
+  SessionStore::CompactSerializerDeserializer
 > SerializerDeserializerTypes;
 
 /// Fixture for BasicSessionStoreTest.  This uses a single SessionStore,
@@ -121,6 +128,38 @@ TYPED_TEST(BasicSessionStoreTest, SimpleTest)
 }
 
 
+TYPED_TEST(BasicSessionStoreTest, TimerStateTest)
+{
+  SessionStore::Session* session = new SessionStore::Session();
+  session->session_id = "session_id";
+  session->ccf.push_back("ccf1");
+  session->acct_record_number = 2;
+  session->timer_id = "timer_id";
+  session->session_refresh_time = 5 * 60;
+  session->interim_interval = 100;
+  session->timer_interval = 100;
+  session->timer_expiry = 1500000300;
+  session->session_expiry = 1500000400;
+  session->timer_pending_until = 1500000500;
+
+  // Save the session in the store
+  Store::Status rc = this->_store->set_session_data("call_id", ORIGINATING, SCSCF, session, false, FAKE_TRAIL);
+  EXPECT_EQ(Store::Status::OK, rc);
+  delete session; session = NULL;
+
+  // Retrieve the session again, with its timer state.
+  session = this->_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  EXPECT_EQ(100u, session->interim_interval);
+  EXPECT_EQ(100u, session->timer_interval);
+  EXPECT_EQ(1500000300u, session->timer_expiry);
+  EXPECT_EQ(1500000400u, session->session_expiry);
+  EXPECT_EQ(1500000500u, session->timer_pending_until);
+
+  delete session; session = NULL;
+}
+
+
 TYPED_TEST(BasicSessionStoreTest, DeletionTest)
 {
   SessionStore::Session* session = new SessionStore::Session();
@@ -173,6 +212,7 @@ public:
       SessionStore::SerializerDeserializer* serializer =
         new SessionStore::JsonSerializerDeserializer();
       std::vector<SessionStore::SerializerDeserializer*> deserializers = {
+        new SessionStore::CompactSerializerDeserializer(),
         new SessionStore::JsonSerializerDeserializer(),
         new SessionStore::BinarySerializerDeserializer(),
       };
@@ -305,3 +345,612 @@ TEST_F(SessionStoreCorruptDataTest, SemanticallyInvalidJson)
   session = this->_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
   ASSERT_TRUE(session == NULL);
 }
+
+
+TEST(CompactSerializerDeserializerTest, Encoding)
+{
+  SessionStore::CompactSerializerDeserializer compact;
+  SessionStore::Session session;
+  session.session_id = "id";
+  session.ccf.push_back("c");
+  session.acct_record_number = 300;
+  session.timer_id = "";
+  session.session_refresh_time = 600;
+  session.interim_interval = 0;
+
+  // Magic, version, "id", one CCF "c", 300, "", 600, 0.
+  const char expected[] = "\xC5\x03" "\x02id" "\x01" "\x01" "c"
+                          "\xAC\x02" "\x00" "\xD8\x04" "\x00";
+  EXPECT_EQ(std::string(expected, sizeof(expected) - 1),
+            compact.serialize_session(&session));
+}
+
+
+TEST(CompactSerializerDeserializerTest, RejectsCorruptData)
+{
+  SessionStore::CompactSerializerDeserializer compact;
+  SessionStore::Session session;
+  session.session_id = "session_id";
+  session.ccf.push_back("ccf1");
+  session.acct_record_number = 2;
+  session.timer_id = "timer_id";
+  session.session_refresh_time = 5 * 60;
+  session.interim_interval = 0;
+
+  std::string data = compact.serialize_session(&session);
+
+  // Every truncation of the record is rejected.
+  for (size_t len = 0; len < data.size(); len++)
+  {
+    EXPECT_EQ(NULL, compact.deserialize_session(data.substr(0, len)));
+  }
+
+  // As are trailing bytes, and records from the other formats.
+  EXPECT_EQ(NULL, compact.deserialize_session(data + "x"));
+  EXPECT_EQ(NULL, compact.deserialize_session(
+    SessionStore::JsonSerializerDeserializer().serialize_session(&session)));
+  EXPECT_EQ(NULL, compact.deserialize_session(
+    SessionStore::BinarySerializerDeserializer().serialize_session(&session)));
+
+  SessionStore::Session* result = compact.deserialize_session(data);
+  ASSERT_TRUE(result != NULL);
+  EXPECT_EQ("session_id", result->session_id);
+  delete result;
+}
+
+
+// Compares the size and speed of the session formats.  Run with
+// --gtest_also_run_disabled_tests.
+TEST(SessionFormatTest, DISABLED_SerializationBenchmark)
+{
+  SessionStore::Session session;
+  session.session_id = "084972d9749c214876eb0ba4700ab1fa@10.0.0.1";
+  session.ccf.push_back("ccf1.example.com");
+  session.ccf.push_back("ccf2.example.com");
+  session.acct_record_number = 12;
+  session.timer_id = "e8ac0d1c3a3b4bbfa85e7d2f5f8bd8ae-0-1";
+  session.session_refresh_time = 600;
+  session.interim_interval = 300;
+
+  SessionStore::SerializerDeserializer* formats[] = {
+    new SessionStore::BinarySerializerDeserializer(),
+    new SessionStore::JsonSerializerDeserializer(),
+    new SessionStore::CompactSerializerDeserializer(),
+  };
+  const int iterations = 1000000;
+
+  for (size_t ii = 0; ii < sizeof(formats) / sizeof(formats[0]); ii++)
+  {
+    SessionStore::SerializerDeserializer* format = formats[ii];
+    std::string data;
+    struct timespec start;
+    struct timespec mid;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int jj = 0; jj < iterations; jj++)
+    {
+      data = format->serialize_session(&session);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &mid);
+    for (int jj = 0; jj < iterations; jj++)
+    {
+      delete format->deserialize_session(data);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%-8s %3zu bytes, serialize %ld ns, deserialize %ld ns\n",
+           format->name().c_str(),
+           data.size(),
+           ((mid.tv_sec - start.tv_sec) * 1000000000L + (mid.tv_nsec - start.tv_nsec)) / iterations,
+           ((end.tv_sec - mid.tv_sec) * 1000000000L + (end.tv_nsec - mid.tv_nsec)) / iterations);
+
+    delete format;
+  }
+}
+
+
+/// A (de)serializer that records the data it's asked to deserialize.
+class RecordingDeserializer : public SessionStore::SerializerDeserializer
+{
+public:
+  RecordingDeserializer(SessionStore::Format format, std::vector<std::string>& seen) :
+    _format(format), _seen(seen)
+  {}
+
+  std::string serialize_session(SessionStore::Session* data) { return ""; }
+
+  SessionStore::Session* deserialize_session(const std::string& data)
+  {
+    _seen.push_back(name() + ":" + data.substr(0, 1));
+    return NULL;
+  }
+
+  std::string name() { return std::to_string(_format); }
+  SessionStore::Format format() { return _format; }
+
+private:
+  SessionStore::Format _format;
+  std::vector<std::string>& _seen;
+};
+
+
+TEST(SessionStoreFormatTest, DeserializerChosenByFirstByte)
+{
+  MockStore memstore;
+  std::vector<std::string> seen;
+
+  SessionStore::SerializerDeserializer* serializer =
+    new SessionStore::JsonSerializerDeserializer();
+  std::vector<SessionStore::SerializerDeserializer*> deserializers = {
+    new RecordingDeserializer(SessionStore::FORMAT_JSON, seen),
+    new RecordingDeserializer(SessionStore::FORMAT_BINARY, seen),
+    new RecordingDeserializer(SessionStore::FORMAT_COMPACT, seen),
+  };
+  SessionStore store(&memstore, serializer, deserializers);
+
+  EXPECT_CALL(memstore, get_data(_, _, _, _, _))
+    .WillOnce(DoAll(SetArgReferee<2>(std::string("sid")),
+                    SetArgReferee<3>(1), // CAS
+                    Return(Store::OK)))
+    .WillOnce(DoAll(SetArgReferee<2>(std::string("{}")),
+                    SetArgReferee<3>(1), // CAS
+                    Return(Store::OK)))
+    .WillOnce(DoAll(SetArgReferee<2>(std::string("\xC5\x03")),
+                    SetArgReferee<3>(1), // CAS
+                    Return(Store::OK)));
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    EXPECT_EQ(NULL, store.get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL));
+  }
+
+  // Each record was only offered to the deserializer for its format.
+  std::vector<std::string> expected = {
+    std::to_string(SessionStore::FORMAT_BINARY) + ":s",
+    std::to_string(SessionStore::FORMAT_JSON) + ":{",
+    std::to_string(SessionStore::FORMAT_COMPACT) + ":\xC5",
+  };
+  EXPECT_EQ(expected, seen);
+}
+
+
+TEST(SessionStoreFormatTest, NoDeserializerForFormat)
+{
+  MockStore memstore;
+  std::vector<std::string> seen;
+
+  SessionStore::SerializerDeserializer* serializer =
+    new SessionStore::JsonSerializerDeserializer();
+  std::vector<SessionStore::SerializerDeserializer*> deserializers = {
+    new RecordingDeserializer(SessionStore::FORMAT_JSON, seen),
+  };
+  SessionStore store(&memstore, serializer, deserializers);
+
+  // A binary record isn't offered to the JSON deserializer.
+  EXPECT_CALL(memstore, get_data(_, _, _, _, _))
+    .WillOnce(DoAll(SetArgReferee<2>(std::string("sid")),
+                    SetArgReferee<3>(1), // CAS
+                    Return(Store::OK)));
+
+  EXPECT_EQ(NULL, store.get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL));
+  EXPECT_TRUE(seen.empty());
+}
+
+
+/// Fixture for testing a SessionStore that stores accounting record numbers
+/// separately from the rest of the session.  This also creates a store using
+/// the old layout, and a split store with a session cache, all sharing the
+/// same underlying store.
+class SplitSessionStoreTest : public ::testing::Test
+{
+public:
+  void SetUp()
+  {
+    _memstore = new LocalStore();
+    _cache = new SessionCache(1024 * 1024);
+
+    {
+      SessionStore::SerializerDeserializer* serializer =
+        new SessionStore::JsonSerializerDeserializer();
+      std::vector<SessionStore::SerializerDeserializer*> deserializers = {
+        new SessionStore::JsonSerializerDeserializer(),
+      };
+      _split_store = new SessionStore(_memstore, serializer, deserializers, NULL, NULL, true);
+    }
+
+    {
+      SessionStore::SerializerDeserializer* serializer =
+        new SessionStore::JsonSerializerDeserializer();
+      std::vector<SessionStore::SerializerDeserializer*> deserializers = {
+        new SessionStore::JsonSerializerDeserializer(),
+      };
+      _cached_store = new SessionStore(_memstore, serializer, deserializers, _cache, NULL, true);
+    }
+
+    _old_store = new SessionStore(_memstore);
+  }
+
+  void TearDown()
+  {
+    delete _old_store; _old_store = NULL;
+    delete _cached_store; _cached_store = NULL;
+    delete _split_store; _split_store = NULL;
+    delete _cache; _cache = NULL;
+    delete _memstore; _memstore = NULL;
+  }
+
+  SessionStore::Session* new_session()
+  {
+    SessionStore::Session* session = new SessionStore::Session();
+    session->session_id = "session_id";
+    session->ccf.push_back("ccf1");
+    session->acct_record_number = 1;
+    session->timer_id = "timer_id";
+    session->session_refresh_time = 5 * 60;
+    session->interim_interval = 0;
+    return session;
+  }
+
+  LocalStore* _memstore;
+  SessionCache* _cache;
+  SessionStore* _split_store;
+  SessionStore* _cached_store;
+  SessionStore* _old_store;
+};
+
+
+TEST_F(SplitSessionStoreTest, RecordNumberUpdates)
+{
+  SessionStore::Session* session = new_session();
+  Store::Status rc = _split_store->set_session_data("call_id", ORIGINATING, SCSCF, session, true, FAKE_TRAIL);
+  EXPECT_EQ(Store::Status::OK, rc);
+  delete session; session = NULL;
+
+  for (uint32_t ii = 1; ii < 5; ii++)
+  {
+    session = _split_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+    ASSERT_TRUE(session != NULL);
+    EXPECT_EQ(ii, session->acct_record_number);
+    EXPECT_EQ("timer_id", session->timer_id);
+
+    EXPECT_EQ(ii - 1, session->session_expiry);
+
+    session->acct_record_number += 1;
+    session->session_expiry = ii;
+    rc = _split_store->set_session_data("call_id", ORIGINATING, SCSCF, session, false, FAKE_TRAIL);
+    EXPECT_EQ(Store::Status::OK, rc);
+    delete session; session = NULL;
+  }
+
+  // Changes to the rest of the session are still written.
+  session = _split_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  session->timer_id = "new_timer_id";
+  rc = _split_store->set_session_data("call_id", ORIGINATING, SCSCF, session, false, FAKE_TRAIL);
+  EXPECT_EQ(Store::Status::OK, rc);
+  delete session; session = NULL;
+
+  session = _split_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  EXPECT_EQ(5u, session->acct_record_number);
+  EXPECT_EQ("new_timer_id", session->timer_id);
+  delete session; session = NULL;
+
+  _split_store->delete_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  session = _split_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  EXPECT_EQ(NULL, session);
+}
+
+
+TEST_F(SplitSessionStoreTest, ContentionOnRecordNumber)
+{
+  SessionStore::Session* session = new_session();
+  _split_store->set_session_data("call_id", ORIGINATING, SCSCF, session, true, FAKE_TRAIL);
+  delete session; session = NULL;
+
+  SessionStore::Session* session1 = _split_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  SessionStore::Session* session2 = _split_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session1 != NULL);
+  ASSERT_TRUE(session2 != NULL);
+
+  session1->acct_record_number += 1;
+  EXPECT_EQ(Store::Status::OK,
+            _split_store->set_session_data("call_id", ORIGINATING, SCSCF, session1, false, FAKE_TRAIL));
+
+  session2->acct_record_number += 1;
+  EXPECT_EQ(Store::Status::DATA_CONTENTION,
+            _split_store->set_session_data("call_id", ORIGINATING, SCSCF, session2, false, FAKE_TRAIL));
+
+  delete session1; session1 = NULL;
+  delete session2; session2 = NULL;
+}
+
+
+TEST_F(SplitSessionStoreTest, MigratesOldRecords)
+{
+  // Write a session in the old layout.
+  SessionStore::Session* session = new_session();
+  session->acct_record_number = 7;
+  _old_store->set_session_data("call_id", ORIGINATING, SCSCF, session, true, FAKE_TRAIL);
+  delete session; session = NULL;
+
+  // The split store picks up the record number from the old record.
+  session = _split_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  EXPECT_EQ(7u, session->acct_record_number);
+
+  session->acct_record_number += 1;
+  EXPECT_EQ(Store::Status::OK,
+            _split_store->set_session_data("call_id", ORIGINATING, SCSCF, session, false, FAKE_TRAIL));
+  delete session; session = NULL;
+
+  session = _split_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  EXPECT_EQ(8u, session->acct_record_number);
+  EXPECT_EQ("session_id", session->session_id);
+  delete session; session = NULL;
+
+  // The session record itself no longer holds the record number, but a store
+  // that doesn't split record numbers still finds it.
+  std::string data;
+  uint64_t cas;
+  _memstore->get_data("session", SessionStore::create_key("call_id", ORIGINATING, SCSCF), data, cas, FAKE_TRAIL);
+  session = SessionStore::JsonSerializerDeserializer().deserialize_session(data);
+  ASSERT_TRUE(session != NULL);
+  EXPECT_EQ(SessionStore::SPLIT_LAYOUT_RECORD_NUMBER, session->acct_record_number);
+  delete session; session = NULL;
+
+  session = _old_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  EXPECT_EQ(8u, session->acct_record_number);
+  delete session; session = NULL;
+}
+
+
+TEST_F(SplitSessionStoreTest, OldLayoutStoreKeepsSplitLayout)
+{
+  SessionStore::Session* session = new_session();
+  _split_store->set_session_data("call_id", ORIGINATING, SCSCF, session, true, FAKE_TRAIL);
+  delete session; session = NULL;
+
+  // A store that doesn't split record numbers can update the session...
+  session = _old_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  EXPECT_EQ(1u, session->acct_record_number);
+  session->acct_record_number += 1;
+  EXPECT_EQ(Store::Status::OK,
+            _old_store->set_session_data("call_id", ORIGINATING, SCSCF, session, false, FAKE_TRAIL));
+  delete session; session = NULL;
+
+  // ...and the split store sees the new record number.
+  session = _split_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  EXPECT_EQ(2u, session->acct_record_number);
+  delete session; session = NULL;
+
+  // Both stores can delete it.
+  session = _old_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  EXPECT_EQ(Store::Status::OK,
+            _old_store->delete_session_data("call_id", ORIGINATING, SCSCF, session, FAKE_TRAIL));
+  delete session; session = NULL;
+
+  EXPECT_EQ(NULL, _split_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL));
+  EXPECT_EQ(NULL, _old_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL));
+}
+
+
+TEST_F(SplitSessionStoreTest, CachedBodyCheckedAgainstRecordNumber)
+{
+  SessionStore::Session* session = new_session();
+  _cached_store->set_session_data("call_id", ORIGINATING, SCSCF, session, true, FAKE_TRAIL);
+  delete session; session = NULL;
+
+  // Another node changes the body.
+  session = _split_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  session->timer_id = "new_timer_id";
+  session->acct_record_number += 1;
+  EXPECT_EQ(Store::Status::OK,
+            _split_store->set_session_data("call_id", ORIGINATING, SCSCF, session, false, FAKE_TRAIL));
+  delete session; session = NULL;
+
+  // The cached body no longer matches the record number, so isn't used.
+  session = _cached_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  EXPECT_EQ(2u, session->acct_record_number);
+  EXPECT_EQ("new_timer_id", session->timer_id);
+  delete session; session = NULL;
+}
+
+
+TEST_F(SplitSessionStoreTest, ContentionInvalidatesCache)
+{
+  SessionStore::Session* session = new_session();
+  _cached_store->set_session_data("call_id", ORIGINATING, SCSCF, session, true, FAKE_TRAIL);
+  delete session; session = NULL;
+
+  SessionStore::Session* session1 = _cached_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  SessionStore::Session* session2 = _split_store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session1 != NULL);
+  ASSERT_TRUE(session2 != NULL);
+  EXPECT_NE(0u, _cache->size_bytes());
+
+  session2->acct_record_number += 1;
+  EXPECT_EQ(Store::Status::OK,
+            _split_store->set_session_data("call_id", ORIGINATING, SCSCF, session2, false, FAKE_TRAIL));
+
+  // Losing the race on the record number throws away the cached body.
+  session1->acct_record_number += 1;
+  EXPECT_EQ(Store::Status::DATA_CONTENTION,
+            _cached_store->set_session_data("call_id", ORIGINATING, SCSCF, session1, false, FAKE_TRAIL));
+  EXPECT_EQ(0u, _cache->size_bytes());
+
+  delete session1; session1 = NULL;
+  delete session2; session2 = NULL;
+}
+
+
+TEST(SplitSessionStoreMockTest, InterimOnlyWritesRecordNumber)
+{
+  MockStore memstore;
+  SessionCache cache(1024 * 1024);
+  SessionStore::SerializerDeserializer* serializer =
+    new SessionStore::JsonSerializerDeserializer();
+  std::vector<SessionStore::SerializerDeserializer*> deserializers = {
+    new SessionStore::JsonSerializerDeserializer(),
+  };
+  SessionStore store(&memstore, serializer, deserializers, &cache, NULL, true);
+
+  SessionStore::Session body;
+  body.session_id = "session_id";
+  body.acct_record_number = SessionStore::SPLIT_LAYOUT_RECORD_NUMBER;
+  body.session_refresh_time = 5 * 60;
+  body.interim_interval = 0;
+  std::string body_data =
+    SessionStore::JsonSerializerDeserializer().serialize_session(&body);
+  std::string expiry = std::to_string((long)time(NULL) + 10000);
+  std::string arn_data;
+
+  // The body is only read once - the first record number record doesn't have
+  // a body hash, but after that it comes from the cache.
+  EXPECT_CALL(memstore, get_data("session", _, _, _, _))
+    .WillOnce(DoAll(SetArgReferee<2>(body_data),
+                    SetArgReferee<3>(1), // CAS
+                    Return(Store::OK)));
+  EXPECT_CALL(memstore, get_data("session_arn", _, _, _, _))
+    .WillOnce(DoAll(SetArgReferee<2>("5 " + expiry),
+                    SetArgReferee<3>(7), // CAS
+                    Return(Store::OK)))
+    .WillOnce(DoAll(SetArgReferee<2>(ByRef(arn_data)),
+                    SetArgReferee<3>(8), // CAS
+                    Return(Store::OK)));
+
+  EXPECT_CALL(memstore, set_data("session", _, _, _, _, _)).Times(0);
+  EXPECT_CALL(memstore, set_data("session_arn", _, StartsWith("6 " + expiry + " "), 7, _, _))
+    .WillOnce(DoAll(SaveArg<2>(&arn_data), Return(Store::OK)));
+  EXPECT_CALL(memstore, set_data("session_arn", _, StartsWith("7 " + expiry + " "), 8, _, _))
+    .WillOnce(Return(Store::OK));
+
+  // Each INTERIM moves the session expiry on, but that doesn't need the body
+  // to be rewritten.
+  for (int ii = 0; ii < 2; ii++)
+  {
+    SessionStore::Session* session =
+      store.get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+    ASSERT_TRUE(session != NULL);
+    session->acct_record_number += 1;
+    session->session_expiry = time(NULL) + 300 + ii;
+    EXPECT_EQ(Store::Status::OK,
+              store.set_session_data("call_id", ORIGINATING, SCSCF, session, false, FAKE_TRAIL));
+    delete session; session = NULL;
+  }
+}
+
+
+/// Fixture for testing a SessionStore that has an in-process session cache.
+class SessionStoreCacheTest : public ::testing::Test
+{
+public:
+  void SetUp()
+  {
+    _memstore = new MockStore();
+    _cache = new SessionCache(1024 * 1024);
+
+    SessionStore::SerializerDeserializer* serializer =
+      new SessionStore::JsonSerializerDeserializer();
+    std::vector<SessionStore::SerializerDeserializer*> deserializers = {
+      new SessionStore::JsonSerializerDeserializer(),
+    };
+    _store = new SessionStore(_memstore, serializer, deserializers, _cache);
+
+    SessionStore::Session session;
+    session.session_id = "session_id";
+    session.ccf.push_back("ccf1");
+    session.acct_record_number = 2;
+    session.timer_id = "timer_id";
+    session.session_refresh_time = 5 * 60;
+    session.interim_interval = 0;
+    _data = SessionStore::JsonSerializerDeserializer().serialize_session(&session);
+  }
+
+  void TearDown()
+  {
+    delete _store; _store = NULL;
+    delete _cache; _cache = NULL;
+    delete _memstore; _memstore = NULL;
+  }
+
+  MockStore* _memstore;
+  SessionCache* _cache;
+  SessionStore* _store;
+  std::string _data;
+};
+
+
+TEST_F(SessionStoreCacheTest, WholeRecordsAreNotCached)
+{
+  SessionStore::Session* session;
+
+  // Without a separate record number, a cached session could never be
+  // written back (we don't learn the CAS of our own writes), so every read
+  // goes to the store.
+  EXPECT_CALL(*_memstore, get_data(_, _, _, _, _))
+    .Times(2)
+    .WillRepeatedly(DoAll(SetArgReferee<2>(_data),
+                          SetArgReferee<3>(1), // CAS
+                          Return(Store::OK)));
+
+  session = _store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  delete session; session = NULL;
+
+  session = _store->get_session_data("call_id", ORIGINATING, SCSCF, FAKE_TRAIL);
+  ASSERT_TRUE(session != NULL);
+  EXPECT_EQ(2u, session->acct_record_number);
+
+  EXPECT_CALL(*_memstore, set_data(_, _, _, 1, _, _))
+    .WillOnce(Return(Store::OK));
+  _store->set_session_data("call_id", ORIGINATING, SCSCF, session, false, FAKE_TRAIL);
+  delete session; session = NULL;
+
+  EXPECT_EQ(0u, _cache->size_bytes());
+}
+
+
+TEST(SessionCacheTest, EvictsLeastRecentlyUsed)
+{
+  SessionStore::Session session;
+  session.session_id = "session_id";
+  uint64_t cas;
+
+  // Use a single shard with room for roughly two sessions.
+  SessionCache cache(1024, 1);
+  cache.put("key1", session, 1);
+  cache.put("key2", session, 2);
+
+  size_t two_entries = cache.size_bytes();
+  SessionCache small_cache(two_entries, 1);
+  small_cache.put("key1", session, 1);
+  small_cache.put("key2", session, 2);
+
+  // Touch key1 so that key2 is the least recently used entry.
+  delete small_cache.get("key1", cas);
+  small_cache.put("key3", session, 3);
+
+  SessionStore::Session* cached = small_cache.get("key1", cas);
+  EXPECT_TRUE(cached != NULL);
+  EXPECT_EQ(1u, cas);
+  delete cached;
+
+  cached = small_cache.get("key2", cas);
+  EXPECT_TRUE(cached == NULL);
+
+  cached = small_cache.get("key3", cas);
+  EXPECT_TRUE(cached != NULL);
+  EXPECT_EQ(3u, cas);
+  delete cached;
+
+  EXPECT_LE(small_cache.size_bytes(), two_entries);
+}
@@ -0,0 +1,369 @@
+/**
+ * @file test_timer_wheel.cpp UT for the in-process timer wheel
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "timer_wheel.hpp"
+#include "localstore.h"
+
+// Timer wheel whose clocks are controlled by the test, and which records the
+// timers that pop.  Pops are refused while accept is false.
+class TestTimerWheel : public TimerWheel
+{
+public:
+  TestTimerWheel(Store* store = NULL) :
+    TimerWheel([this](const std::string& uri, const std::string& body)
+               {
+                 if (!accept)
+                 {
+                   return false;
+                 }
+
+                 popped.push_back(uri);
+                 return true;
+               },
+               store,
+               "ralf1"),
+    accept(true),
+    mono(1000000),
+    wall(1500000000000)
+  {}
+
+  // Moves both clocks on, and pops the timers that are due.
+  void run_for(uint64_t ms)
+  {
+    mono += ms;
+    wall += ms;
+    advance(mono);
+  }
+
+  std::vector<std::string> popped;
+  bool accept;
+  uint64_t mono;
+  uint64_t wall;
+
+protected:
+  uint64_t now_ms() { return mono; }
+  uint64_t wall_ms() { return wall; }
+};
+
+TEST(TimerWheelTest, PopsEveryInterval)
+{
+  TestTimerWheel wheel;
+  std::string id;
+  EXPECT_EQ(HTTP_OK, wheel.send_post(id, 10, 30, "/call-id/a", "{}", 0, {}));
+  EXPECT_FALSE(id.empty());
+  EXPECT_EQ(1u, wheel.size());
+
+  wheel.run_for(9990);
+  EXPECT_EQ(0u, wheel.popped.size());
+
+  wheel.run_for(10);
+  ASSERT_EQ(1u, wheel.popped.size());
+  EXPECT_EQ("/call-id/a", wheel.popped[0]);
+
+  // The timer pops twice more, then finishes.
+  wheel.run_for(20000);
+  EXPECT_EQ(3u, wheel.popped.size());
+  EXPECT_EQ(0u, wheel.size());
+
+  wheel.run_for(60000);
+  EXPECT_EQ(3u, wheel.popped.size());
+}
+
+TEST(TimerWheelTest, PopsOnceIfRepeatForIsShort)
+{
+  TestTimerWheel wheel;
+  std::string id;
+  wheel.send_post(id, 10, 5, "/call-id/a", "{}", 0, {});
+
+  wheel.run_for(60000);
+  EXPECT_EQ(1u, wheel.popped.size());
+  EXPECT_EQ(0u, wheel.size());
+}
+
+TEST(TimerWheelTest, PutRearmsFromNow)
+{
+  TestTimerWheel wheel;
+  std::string id;
+  wheel.send_post(id, 10, 100, "/call-id/a", "{}", 0, {});
+
+  wheel.run_for(5000);
+  std::string put_id = id;
+  EXPECT_EQ(HTTP_OK, wheel.send_put(put_id, 10, 100, "/call-id/b", "{}", 0, {}));
+  EXPECT_EQ(id, put_id);
+  EXPECT_EQ(1u, wheel.size());
+
+  wheel.run_for(9000);
+  EXPECT_EQ(0u, wheel.popped.size());
+
+  wheel.run_for(1000);
+  ASSERT_EQ(1u, wheel.popped.size());
+  EXPECT_EQ("/call-id/b", wheel.popped[0]);
+}
+
+TEST(TimerWheelTest, PutCreatesTimer)
+{
+  TestTimerWheel wheel;
+  std::string id = "TIMER_ID";
+  EXPECT_EQ(HTTP_OK, wheel.send_put(id, 10, 10, "/call-id/a", "{}", 0, {}));
+  EXPECT_EQ("TIMER_ID", id);
+
+  wheel.run_for(10000);
+  EXPECT_EQ(1u, wheel.popped.size());
+}
+
+TEST(TimerWheelTest, DeleteCancels)
+{
+  TestTimerWheel wheel;
+  std::string id_a;
+  std::string id_b;
+  wheel.send_post(id_a, 10, 100, "/call-id/a", "{}", 0, {});
+  wheel.send_post(id_b, 10, 100, "/call-id/b", "{}", 0, {});
+  EXPECT_NE(id_a, id_b);
+
+  EXPECT_EQ(HTTP_OK, wheel.send_delete(id_a, 0));
+  EXPECT_EQ(HTTP_NOT_FOUND, wheel.send_delete(id_a, 0));
+  EXPECT_EQ(1u, wheel.size());
+
+  wheel.run_for(10000);
+  ASSERT_EQ(1u, wheel.popped.size());
+  EXPECT_EQ("/call-id/b", wheel.popped[0]);
+}
+
+TEST(TimerWheelTest, LongTimersCascade)
+{
+  // Timers on each level of the wheel.
+  TestTimerWheel wheel;
+  std::string id;
+  wheel.send_post(id, 1, 1, "/call-id/1s", "{}", 0, {});
+  wheel.send_post(id, 300, 300, "/call-id/5m", "{}", 0, {});
+  wheel.send_post(id, 86400, 86400, "/call-id/1d", "{}", 0, {});
+  wheel.send_post(id, 259200, 259200, "/call-id/3d", "{}", 0, {});
+
+  wheel.run_for(1000);
+  EXPECT_EQ(1u, wheel.popped.size());
+  wheel.run_for(298990);
+  EXPECT_EQ(1u, wheel.popped.size());
+  wheel.run_for(10);
+  EXPECT_EQ(2u, wheel.popped.size());
+  wheel.run_for(86100000 - 10);
+  EXPECT_EQ(2u, wheel.popped.size());
+  wheel.run_for(10);
+  EXPECT_EQ(3u, wheel.popped.size());
+  wheel.run_for(172800000 - 10);
+  EXPECT_EQ(3u, wheel.popped.size());
+  wheel.run_for(10);
+  ASSERT_EQ(4u, wheel.popped.size());
+  EXPECT_EQ("/call-id/3d", wheel.popped[3]);
+}
+
+TEST(TimerWheelTest, TimersSurviveRestart)
+{
+  LocalStore store;
+  std::string id;
+
+  {
+    TestTimerWheel wheel(&store);
+    wheel.send_post(id, 10, 100, "/call-id/a", "{\"a\":1}", 0, {});
+    std::string cancelled;
+    wheel.send_post(cancelled, 10, 100, "/call-id/b", "{}", 0, {});
+    wheel.send_delete(cancelled, 0);
+    wheel.run_for(10000);
+    wheel.flush();
+  }
+
+  // Restart 25s later, in the middle of the timer's third interval.
+  TestTimerWheel wheel(&store);
+  wheel.mono = 5000000;
+  wheel.wall = 1500000000000 + 35000;
+  wheel.recover();
+  EXPECT_EQ(1u, wheel.size());
+
+  // The pops at 20s and 30s are skipped, and the timer carries on from 40s.
+  wheel.run_for(4990);
+  EXPECT_EQ(0u, wheel.popped.size());
+  wheel.run_for(10);
+  ASSERT_EQ(1u, wheel.popped.size());
+  EXPECT_EQ("/call-id/a", wheel.popped[0]);
+
+  // It can still be cancelled by its ID.
+  EXPECT_EQ(HTTP_OK, wheel.send_delete(id, 0));
+  wheel.flush();
+
+  TestTimerWheel restarted(&store);
+  restarted.recover();
+  EXPECT_EQ(0u, restarted.size());
+}
+
+TEST(TimerWheelTest, RefusedPopsOfferedAgain)
+{
+  TestTimerWheel wheel;
+  std::string id;
+  wheel.send_post(id, 10, 100, "/call-id/a", "{}", 0, {});
+  wheel.send_post(id, 20, 100, "/call-id/b", "{}", 0, {});
+
+  // The first pop is refused, so is offered again on each tick until it's
+  // taken, ahead of the next pop.
+  wheel.accept = false;
+  wheel.run_for(10000);
+  wheel.run_for(10000);
+  EXPECT_EQ(0u, wheel.popped.size());
+
+  wheel.accept = true;
+  wheel.run_for(10);
+  ASSERT_EQ(3u, wheel.popped.size());
+  EXPECT_EQ("/call-id/a", wheel.popped[0]);
+  EXPECT_EQ(2, std::count(wheel.popped.begin(), wheel.popped.end(), "/call-id/a"));
+  EXPECT_EQ(1, std::count(wheel.popped.begin(), wheel.popped.end(), "/call-id/b"));
+}
+
+// Store that records the keys read from it.
+class ReadRecordingStore : public LocalStore
+{
+public:
+  Store::Status get_data(const std::string& table,
+                         const std::string& key,
+                         std::string& data,
+                         uint64_t& cas,
+                         SAS::TrailId trail = 0)
+  {
+    reads.push_back(table);
+    return LocalStore::get_data(table, key, data, cas, trail);
+  }
+
+  std::vector<std::string> reads;
+};
+
+TEST(TimerWheelTest, FlushDoesNotReadTimerIDs)
+{
+  ReadRecordingStore store;
+  std::vector<std::string> ids(100);
+
+  {
+    TestTimerWheel wheel(&store);
+
+    for (size_t ii = 0; ii < ids.size(); ii++)
+    {
+      wheel.send_post(ids[ii], 10, 100, "/call-id/a", "{}", 0, {});
+    }
+    wheel.flush();
+
+    // Rewriting the index only reads the small records that point at each
+    // shard's timer IDs.
+    wheel.send_delete(ids[0], 0);
+    store.reads.clear();
+    wheel.flush();
+    EXPECT_EQ(0, std::count(store.reads.begin(), store.reads.end(), "timer_index_ids"));
+    EXPECT_EQ(1, std::count(store.reads.begin(), store.reads.end(), "timer_index"));
+  }
+
+  TestTimerWheel restarted(&store);
+  restarted.recover();
+  EXPECT_EQ(ids.size() - 1, restarted.size());
+}
+
+TEST(TimerWheelTest, ParseRecord)
+{
+  std::string record = TimerWheel::make_record(10000, 20000, 30000, "/call-id/a", "{}");
+  uint64_t interval_ms;
+  uint64_t first_pop_ms;
+  uint64_t end_ms;
+  std::string uri;
+  std::string body;
+
+  ASSERT_TRUE(TimerWheel::parse_record(record, interval_ms, first_pop_ms, end_ms, uri, body));
+  EXPECT_EQ(10000u, interval_ms);
+  EXPECT_EQ(20000u, first_pop_ms);
+  EXPECT_EQ(30000u, end_ms);
+  EXPECT_EQ("/call-id/a", uri);
+  EXPECT_EQ("{}", body);
+
+  // Truncated records, and records in another format, are rejected.
+  EXPECT_FALSE(TimerWheel::parse_record("", interval_ms, first_pop_ms, end_ms, uri, body));
+  EXPECT_FALSE(TimerWheel::parse_record(record.substr(0, 5), interval_ms, first_pop_ms, end_ms, uri, body));
+  EXPECT_FALSE(TimerWheel::parse_record(record.substr(0, 15), interval_ms, first_pop_ms, end_ms, uri, body));
+  record[0] = 2;
+  EXPECT_FALSE(TimerWheel::parse_record(record, interval_ms, first_pop_ms, end_ms, uri, body));
+
+  // The numbers are varints, so the record doesn't depend on the byte order
+  // of the node that wrote it.
+  EXPECT_EQ(std::string("\x01\xac\x02\x01\x02\x01/x", 8),
+            TimerWheel::make_record(300, 1, 2, "/", "x"));
+}
+
+// Measures the cost of arming, re-arming and popping a million timers.  With
+// Chronos each of these is an HTTP request (and each pop another back to
+// Ralf), which costs in the order of 100us of CPU between the two processes.
+TEST(TimerWheelTest, DISABLED_MillionTimersBenchmark)
+{
+  const int timers = 1000000;
+  TestTimerWheel wheel;
+  std::vector<std::string> ids(timers);
+  struct timespec start;
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int ii = 0; ii < timers; ii++)
+  {
+    wheel.send_post(ids[ii], 600 + ii % 300, 3600, "/call-id/a?timer-interim=true", "{}", 0, {});
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Arm:   %ld ns/timer\n",
+         ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / timers);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int ii = 0; ii < timers; ii++)
+  {
+    wheel.send_put(ids[ii], 600 + ii % 300, 3600, "/call-id/a?timer-interim=true", "{}", 0, {});
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Rearm: %ld ns/timer\n",
+         ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / timers);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  wheel.run_for(900000);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  ASSERT_EQ((size_t)timers, wheel.popped.size());
+  printf("Pop:   %ld ns/timer\n",
+         ((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec)) / timers);
+}
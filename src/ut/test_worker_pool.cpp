@@ -0,0 +1,208 @@
+/**
+ * @file test_worker_pool.cpp
+ *
+ * Project Clearwater - IMS in the Cloud
+ * Copyright (C) 2016  Metaswitch Networks Ltd
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version, along with the "Special Exception" for use of
+ * the program along with SSL, set forth below. This program is distributed
+ * in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details. You should have received a copy of the GNU General Public
+ * License along with this program.  If not, see
+ * <http://www.gnu.org/licenses/>.
+ *
+ * The author can be reached by email at clearwater@metaswitch.com or by
+ * post at Metaswitch Networks Ltd, 100 Church St, Enfield EN2 6BQ, UK
+ *
+ * Special Exception
+ * Metaswitch Networks Ltd  grants you permission to copy, modify,
+ * propagate, and distribute a work formed by combining OpenSSL with The
+ * Software, or a work derivative of such a combination, even if such
+ * copying, modification, propagation, or distribution would otherwise
+ * violate the terms of the GPL. You must comply with the GPL in all
+ * respects for all of the code used other than OpenSSL.
+ * "OpenSSL" means OpenSSL toolkit software distributed by the OpenSSL
+ * Project and licensed under the OpenSSL Licenses, or a work based on such
+ * software and licensed under the OpenSSL Licenses.
+ * "OpenSSL Licenses" means the OpenSSL License and Original SSLeay License
+ * under which the OpenSSL Project distributes the OpenSSL toolkit software,
+ * as those licenses appear in the file LICENSE-OPENSSL.
+ */
+
+#include <atomic>
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "bounded_queue.hpp"
+#include "worker_pool.hpp"
+
+TEST(BoundedQueueTest, FifoOrder)
+{
+  BoundedQueue<int> queue(4);
+  EXPECT_EQ(4u, queue.capacity());
+
+  for (int ii = 0; ii < 4; ii++)
+  {
+    EXPECT_TRUE(queue.push(ii));
+  }
+  EXPECT_EQ(4u, queue.size());
+
+  for (int ii = 0; ii < 4; ii++)
+  {
+    int item = -1;
+    EXPECT_TRUE(queue.pop(item));
+    EXPECT_EQ(ii, item);
+  }
+
+  int item;
+  EXPECT_FALSE(queue.pop(item));
+}
+
+TEST(BoundedQueueTest, RejectsWhenFull)
+{
+  BoundedQueue<int> queue(3);
+
+  // The capacity is rounded up to a power of two.
+  EXPECT_EQ(4u, queue.capacity());
+
+  for (int ii = 0; ii < 4; ii++)
+  {
+    EXPECT_TRUE(queue.push(ii));
+  }
+
+  int extra = 99;
+  EXPECT_FALSE(queue.push(extra));
+  EXPECT_EQ(99, extra);
+
+  // Popping frees up a slot again (on the next lap of the ring).
+  int item;
+  EXPECT_TRUE(queue.pop(item));
+  EXPECT_TRUE(queue.push(extra));
+}
+
+// Worker pool that totals the work it has been given.
+class SummingPool : public WorkerPool<int>
+{
+public:
+  SummingPool(unsigned int num_threads, size_t max_queue) :
+    WorkerPool<int>(num_threads, max_queue, NULL, NULL, NULL, "test"),
+    total(0),
+    processed(0)
+  {}
+
+  std::atomic<long> total;
+  std::atomic<int> processed;
+
+protected:
+  void process_work(int& work)
+  {
+    total += work;
+    processed++;
+  }
+};
+
+TEST(WorkerPoolTest, ProcessesAllWork)
+{
+  SummingPool pool(4, 1024);
+  ASSERT_TRUE(pool.start());
+
+  long expected = 0;
+  for (int ii = 1; ii <= 1000; ii++)
+  {
+    int work = ii;
+    while (!pool.add_work(work))
+    {
+      usleep(100);
+    }
+    expected += ii;
+  }
+
+  pool.stop();
+  pool.join();
+
+  EXPECT_EQ(1000, pool.processed);
+  EXPECT_EQ(expected, pool.total);
+}
+
+TEST(WorkerPoolTest, RejectsWorkWhenFull)
+{
+  // Don't start the pool, so nothing is taken off the queue.
+  SummingPool pool(1, 2);
+
+  int work = 1;
+  EXPECT_TRUE(pool.add_work(work));
+  EXPECT_TRUE(pool.add_work(work));
+  EXPECT_FALSE(pool.add_work(work));
+  EXPECT_EQ(2u, pool.queue_depth());
+}
+
+// Worker pool that records the order in which it saw work for each key.
+class OrderRecordingPool : public WorkerPool<std::pair<int, int> >
+{
+public:
+  OrderRecordingPool(unsigned int num_threads, size_t max_queue) :
+    WorkerPool<std::pair<int, int> >(num_threads, max_queue, NULL, NULL, NULL, "test", true)
+  {
+    pthread_mutex_init(&_lock, NULL);
+  }
+
+  ~OrderRecordingPool()
+  {
+    pthread_mutex_destroy(&_lock);
+  }
+
+  std::map<int, std::vector<int> > seen;
+
+protected:
+  void process_work(std::pair<int, int>& work)
+  {
+    pthread_mutex_lock(&_lock);
+    seen[work.first].push_back(work.second);
+    pthread_mutex_unlock(&_lock);
+  }
+
+private:
+  pthread_mutex_t _lock;
+};
+
+TEST(WorkerPoolTest, OrderedModeKeepsPerKeyOrder)
+{
+  OrderRecordingPool pool(4, 4096);
+  EXPECT_EQ(4u, pool.num_lanes());
+  ASSERT_TRUE(pool.start());
+
+  for (int seq = 0; seq < 200; seq++)
+  {
+    for (int key = 0; key < 10; key++)
+    {
+      std::pair<int, int> work(key, seq);
+      while (!pool.add_work(work, key))
+      {
+        usleep(100);
+      }
+    }
+  }
+
+  pool.stop();
+  pool.join();
+
+  ASSERT_EQ(10u, pool.seen.size());
+  for (int key = 0; key < 10; key++)
+  {
+    ASSERT_EQ(200u, pool.seen[key].size());
+    for (int seq = 0; seq < 200; seq++)
+    {
+      EXPECT_EQ(seq, pool.seen[key][seq]);
+    }
+  }
+}